@@ -17,12 +17,25 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "qemu/atomic.h"
+#include "trace.h"
+#ifdef CONFIG_EPOLL_CREATE1
+#include <sys/epoll.h>
+#endif
+
+/* Initial busy-wait time once aio_poll() starts polling, and the default
+ * factor by which it grows.
+ */
+#define AIO_POLL_START_NS       4000
+#define AIO_POLL_DEFAULT_GROW   2
 
 struct AioHandler
 {
     GPollFD pfd;
     IOHandler *io_read;
     IOHandler *io_write;
+    AioPollFn *io_poll;
+    bool poll_ready;
     int deleted;
     void *opaque;
     QLIST_ENTRY(AioHandler) node;
@@ -41,6 +54,158 @@ static AioHandler *find_aio_handler(AioContext *ctx, int fd)
     return NULL;
 }
 
+#ifdef CONFIG_EPOLL_CREATE1
+
+/* The fd number threshold to switch to epoll */
+#define EPOLL_ENABLE_THRESHOLD 64
+
+/* Go back to ppoll() for good, e.g. because the kernel refused a file
+ * descriptor.  The epoll file descriptor is closed by aio_context_destroy().
+ */
+static void aio_epoll_disable(AioContext *ctx)
+{
+    ctx->epoll_available = false;
+    ctx->epoll_enabled = false;
+}
+
+static inline int epoll_events_from_pfd(int pfd_events)
+{
+    return (pfd_events & G_IO_IN ? EPOLLIN : 0) |
+           (pfd_events & G_IO_OUT ? EPOLLOUT : 0) |
+           (pfd_events & G_IO_HUP ? EPOLLHUP : 0) |
+           (pfd_events & G_IO_ERR ? EPOLLERR : 0);
+}
+
+static bool aio_epoll_try_enable(AioContext *ctx)
+{
+    AioHandler *node;
+    struct epoll_event event;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        int r;
+        if (node->deleted || !node->pfd.events) {
+            continue;
+        }
+        event.events = epoll_events_from_pfd(node->pfd.events);
+        event.data.ptr = node;
+        r = epoll_ctl(ctx->epollfd, EPOLL_CTL_ADD, node->pfd.fd, &event);
+        if (r) {
+            return false;
+        }
+    }
+    ctx->epoll_enabled = true;
+    return true;
+}
+
+static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
+{
+    struct epoll_event event;
+    int r;
+
+    if (!ctx->epoll_enabled) {
+        return;
+    }
+    if (!node->pfd.events) {
+        /* The file descriptor may already be closed, in which case the
+         * kernel has dropped it from the epoll set on its own.
+         */
+        epoll_ctl(ctx->epollfd, EPOLL_CTL_DEL, node->pfd.fd, &event);
+        return;
+    }
+
+    event.data.ptr = node;
+    event.events = epoll_events_from_pfd(node->pfd.events);
+    r = epoll_ctl(ctx->epollfd, is_new ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+                  node->pfd.fd, &event);
+    if (r) {
+        aio_epoll_disable(ctx);
+    }
+}
+
+static int aio_epoll(AioContext *ctx, GPollFD *pfds,
+                     unsigned npfd, int64_t timeout)
+{
+    AioHandler *node;
+    int i, ret = 0;
+    struct epoll_event events[128];
+
+    assert(npfd == 1);
+    assert(pfds[0].fd == ctx->epollfd);
+
+    /* epoll_wait() only has millisecond resolution, so sleep in ppoll()
+     * on the epoll file descriptor and then fetch the events.
+     */
+    if (timeout > 0) {
+        ret = qemu_poll_ns(pfds, npfd, timeout);
+    }
+    if (timeout <= 0 || ret > 0) {
+        ret = epoll_wait(ctx->epollfd, events, ARRAY_SIZE(events),
+                         timeout < 0 ? -1 : 0);
+        if (ret <= 0) {
+            goto out;
+        }
+        for (i = 0; i < ret; i++) {
+            int ev = events[i].events;
+            node = events[i].data.ptr;
+            node->pfd.revents = (ev & EPOLLIN ? G_IO_IN : 0) |
+                (ev & EPOLLOUT ? G_IO_OUT : 0) |
+                (ev & EPOLLHUP ? G_IO_HUP : 0) |
+                (ev & EPOLLERR ? G_IO_ERR : 0);
+        }
+    }
+out:
+    return ret;
+}
+
+static bool aio_epoll_check_poll(AioContext *ctx, GPollFD *pfds,
+                                 unsigned npfd, int64_t timeout)
+{
+    if (!ctx->epoll_available) {
+        return false;
+    }
+    if (ctx->epoll_enabled) {
+        return true;
+    }
+    if (npfd >= EPOLL_ENABLE_THRESHOLD) {
+        if (aio_epoll_try_enable(ctx)) {
+            return true;
+        } else {
+            aio_epoll_disable(ctx);
+        }
+    }
+    return false;
+}
+
+static inline bool aio_epoll_enabled(AioContext *ctx)
+{
+    return ctx->epoll_enabled;
+}
+
+#else
+
+static inline bool aio_epoll_enabled(AioContext *ctx)
+{
+    return false;
+}
+
+static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
+{
+}
+
+static int aio_epoll(AioContext *ctx, GPollFD *pfds,
+                     unsigned npfd, int64_t timeout)
+{
+    abort();
+}
+
+static bool aio_epoll_check_poll(AioContext *ctx, GPollFD *pfds,
+                                 unsigned npfd, int64_t timeout)
+{
+    return false;
+}
+
+#endif
+
 void aio_set_fd_handler(AioContext *ctx,
                         int fd,
                         IOHandler *io_read,
@@ -48,26 +213,34 @@ void aio_set_fd_handler(AioContext *ctx,
                         void *opaque)
 {
     AioHandler *node;
+    bool is_new = false;
+    bool deleted = false;
 
     node = find_aio_handler(ctx, fd);
 
     /* Are we deleting the fd handler? */
     if (!io_read && !io_write) {
-        if (node) {
-            g_source_remove_poll(&ctx->source, &node->pfd);
-
-            /* If the lock is held, just mark the node as deleted */
-            if (ctx->walking_handlers) {
-                node->deleted = 1;
-                node->pfd.revents = 0;
-            } else {
-                /* Otherwise, delete it for real.  We can't just mark it as
-                 * deleted because deleted nodes are only cleaned up after
-                 * releasing the walking_handlers lock.
-                 */
-                QLIST_REMOVE(node, node);
-                g_free(node);
-            }
+        if (node == NULL) {
+            return;
+        }
+
+        g_source_remove_poll(&ctx->source, &node->pfd);
+        if (!node->io_poll) {
+            ctx->poll_disable_cnt--;
+        }
+        node->pfd.events = 0;
+
+        /* If the lock is held, just mark the node as deleted */
+        if (ctx->walking_handlers) {
+            node->deleted = 1;
+            node->pfd.revents = 0;
+        } else {
+            /* Otherwise, delete it for real.  We can't just mark it as
+             * deleted because deleted nodes are only cleaned up after
+             * releasing the walking_handlers lock.
+             */
+            QLIST_REMOVE(node, node);
+            deleted = true;
         }
     } else {
         if (node == NULL) {
@@ -77,8 +250,14 @@ void aio_set_fd_handler(AioContext *ctx,
             QLIST_INSERT_HEAD(&ctx->aio_handlers, node, node);
 
             g_source_add_poll(&ctx->source, &node->pfd);
+            ctx->poll_disable_cnt++;
+            is_new = true;
         }
         /* Update handler with latest information */
+        if (node->opaque != opaque && node->io_poll) {
+            node->io_poll = NULL;
+            ctx->poll_disable_cnt++;
+        }
         node->io_read = io_read;
         node->io_write = io_write;
         node->opaque = opaque;
@@ -87,7 +266,11 @@ void aio_set_fd_handler(AioContext *ctx,
         node->pfd.events |= (io_write ? G_IO_OUT | G_IO_ERR : 0);
     }
 
+    aio_epoll_update(ctx, node, is_new);
     aio_notify(ctx);
+    if (deleted) {
+        g_free(node);
+    }
 }
 
 void aio_set_event_notifier(AioContext *ctx,
@@ -98,6 +281,40 @@ void aio_set_event_notifier(AioContext *ctx,
                        (IOHandler *)io_read, NULL, notifier);
 }
 
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll)
+{
+    AioHandler *node;
+
+    node = find_aio_handler(ctx, event_notifier_get_fd(notifier));
+    if (node == NULL) {
+        return;
+    }
+
+    if (!node->io_poll != !io_poll) {
+        ctx->poll_disable_cnt += io_poll ? -1 : 1;
+    }
+    node->io_poll = io_poll;
+}
+
+void aio_context_setup(AioContext *ctx)
+{
+#ifdef CONFIG_EPOLL_CREATE1
+    ctx->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    ctx->epoll_available = ctx->epollfd != -1;
+#endif
+}
+
+void aio_context_destroy(AioContext *ctx)
+{
+#ifdef CONFIG_EPOLL_CREATE1
+    if (ctx->epollfd != -1) {
+        close(ctx->epollfd);
+    }
+#endif
+}
+
 bool aio_prepare(AioContext *ctx)
 {
     return false;
@@ -230,18 +447,93 @@ static void add_pollfd(AioHandler *node)
     npfd++;
 }
 
+/* Call the poll callbacks of all handlers, flagging those that have work
+ * to do.  Return true if any did.
+ */
+static bool run_poll_handlers_once(AioContext *ctx)
+{
+    bool progress = false;
+    AioHandler *node;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->io_poll &&
+            node->io_poll(node->opaque)) {
+            node->poll_ready = true;
+            progress = true;
+        }
+    }
+    return progress;
+}
+
+/* Busy-wait for up to @max_ns nanoseconds, until a handler or aio_notify()
+ * has something to report.  Return true if polling found work.
+ */
+static bool run_poll_handlers(AioContext *ctx, int64_t max_ns)
+{
+    int64_t end_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + max_ns;
+    bool progress;
+
+    do {
+        progress = run_poll_handlers_once(ctx);
+    } while (!progress &&
+             qemu_clock_get_ns(QEMU_CLOCK_REALTIME) < end_time);
+
+    trace_run_poll_handlers(ctx, max_ns, progress);
+    return progress;
+}
+
+/* Adjust the polling time after aio_poll() waited for @block_ns
+ * nanoseconds, either busy-waiting or blocked in the kernel.
+ */
+static void adjust_poll_time(AioContext *ctx, int64_t block_ns)
+{
+    int64_t old = ctx->poll_ns;
+
+    if (block_ns <= ctx->poll_ns) {
+        /* Polling was long enough to catch the event */
+        return;
+    } else if (block_ns > ctx->poll_max_ns) {
+        /* An event this late cannot be caught by polling, back off */
+        if (ctx->poll_shrink) {
+            ctx->poll_ns /= ctx->poll_shrink;
+        } else {
+            ctx->poll_ns = 0;
+        }
+    } else if (ctx->poll_ns < ctx->poll_max_ns) {
+        /* Polling a little longer would have avoided blocking */
+        if (ctx->poll_ns == 0) {
+            ctx->poll_ns = AIO_POLL_START_NS;
+        } else {
+            ctx->poll_ns *= ctx->poll_grow ? ctx->poll_grow :
+                            AIO_POLL_DEFAULT_GROW;
+        }
+        ctx->poll_ns = MIN(ctx->poll_ns, ctx->poll_max_ns);
+    }
+
+    if (ctx->poll_ns != old) {
+        trace_poll_adjust(ctx, old, ctx->poll_ns, block_ns);
+    }
+}
+
 bool aio_poll(AioContext *ctx, bool blocking)
 {
     AioHandler *node;
     bool was_dispatching;
     int i, ret;
     bool progress;
+    bool poll_progress = false;
     int64_t timeout;
+    int64_t start = 0;
 
     aio_context_acquire(ctx);
     was_dispatching = ctx->dispatching;
     progress = false;
 
+    /* Only notifications that come after this point are relevant to the
+     * polling phase below; earlier ones will be seen by aio_compute_timeout().
+     */
+    atomic_set(&ctx->notified, false);
+
     /* aio_notify can avoid the expensive event_notifier_set if
      * everything (file descriptors, bottom halves, timers) will
      * be re-evaluated before the next blocking poll().  This is
@@ -258,30 +550,75 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     assert(npfd == 0);
 
-    /* fill pollfds */
-    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
-        if (!node->deleted && node->pfd.events) {
-            add_pollfd(node);
+    /* fill pollfds; with epoll, the kernel keeps track of them */
+    if (!aio_epoll_enabled(ctx)) {
+        QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+            if (!node->deleted && node->pfd.events) {
+                add_pollfd(node);
+            }
         }
     }
 
     timeout = blocking ? aio_compute_timeout(ctx) : 0;
 
+    /* Busy-wait for a while before going to sleep; if a handler becomes
+     * ready, just check the file descriptors without blocking.
+     */
+    if (timeout && ctx->poll_max_ns && !ctx->poll_disable_cnt) {
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        if (ctx->poll_ns) {
+            if (run_poll_handlers(ctx, timeout < 0 ? ctx->poll_ns :
+                                       MIN(ctx->poll_ns, timeout))) {
+                poll_progress = true;
+                timeout = 0;
+            } else if (timeout > 0) {
+                timeout -= qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+                timeout = MAX(timeout, 0);
+            }
+        }
+    }
+
     /* wait until next event */
     if (timeout) {
         aio_context_release(ctx);
     }
-    ret = qemu_poll_ns((GPollFD *)pollfds, npfd, timeout);
+    if (aio_epoll_check_poll(ctx, pollfds, npfd, timeout)) {
+        AioHandler epoll_handler;
+
+#ifdef CONFIG_EPOLL_CREATE1
+        epoll_handler.pfd.fd = ctx->epollfd;
+#endif
+        epoll_handler.pfd.events = G_IO_IN | G_IO_OUT | G_IO_HUP | G_IO_ERR;
+        npfd = 0;
+        add_pollfd(&epoll_handler);
+        ret = aio_epoll(ctx, pollfds, npfd, timeout);
+    } else {
+        ret = qemu_poll_ns(pollfds, npfd, timeout);
+    }
     if (timeout) {
         aio_context_acquire(ctx);
     }
 
-    /* if we have any readable fds, dispatch event */
-    if (ret > 0) {
+    if (start) {
+        adjust_poll_time(ctx, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
+    }
+
+    /* if we have any readable fds, dispatch event; with epoll, revents
+     * were already filled in by aio_epoll()
+     */
+    if (ret > 0 && !aio_epoll_enabled(ctx)) {
         for (i = 0; i < npfd; i++) {
             nodes[i]->pfd.revents = pollfds[i].revents;
         }
     }
+    if (poll_progress) {
+        QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+            if (node->poll_ready) {
+                node->pfd.revents |= G_IO_IN;
+                node->poll_ready = false;
+            }
+        }
+    }
 
     npfd = 0;
     ctx->walking_handlers--;
@@ -144,6 +144,21 @@ void aio_set_event_notifier(AioContext *ctx,
     aio_notify(ctx);
 }
 
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *e,
+                                 AioPollFn *io_poll)
+{
+    /* Busy polling is not implemented, aio_poll() always blocks */
+}
+
+void aio_context_setup(AioContext *ctx)
+{
+}
+
+void aio_context_destroy(AioContext *ctx)
+{
+}
+
 bool aio_prepare(AioContext *ctx)
 {
     static struct timeval tv0;
@@ -58,6 +58,8 @@
  * A BdrvDirtyBitmap can be in three possible states:
  * (1) successor is NULL and disabled is false: full r/w mode
  * (2) successor is NULL and disabled is true: read only mode ("disabled")
+ *     A disabled bitmap does not track guest writes, but its owner may still
+ *     set and reset bits explicitly.
  * (3) successor is set: frozen mode.
  *     A frozen bitmap cannot be renamed, deleted, anonymized, cleared, set,
  *     or enabled. A frozen bitmap can only abdicate() or reclaim().
@@ -68,6 +70,8 @@ struct BdrvDirtyBitmap {
     char *name;                 /* Optional non-empty unique ID */
     int64_t size;               /* Size of the bitmap (Number of sectors) */
     bool disabled;              /* Bitmap is read-only */
+    bool persistent;            /* Bitmap is stored in the image on close */
+    HBitmap *meta;              /* Chunks of bitmap changed since last reset */
     QLIST_ENTRY(BdrvDirtyBitmap) list;
 };
 
@@ -89,6 +93,7 @@ static int bdrv_open_inherit(BlockDriverState **pbs, const char *filename,
                              BlockDriver *drv, Error **errp);
 
 static void bdrv_dirty_bitmap_truncate(BlockDriverState *bs);
+static void bdrv_release_persistent_dirty_bitmaps(BlockDriverState *bs);
 /* If non-zero, use only whitelisted block drivers */
 static int use_bdrv_whitelist;
 
@@ -259,6 +264,7 @@ BlockDriverState *bdrv_new(void)
         QLIST_INIT(&bs->op_blockers[i]);
     }
     bdrv_iostatus_disable(bs);
+    block_acct_init(&bs->stats, true, true);
     notifier_list_init(&bs->close_notifiers);
     notifier_with_return_list_init(&bs->before_write_notifiers);
     qemu_co_queue_init(&bs->throttled_reqs[0]);
@@ -680,6 +686,30 @@ int bdrv_parse_cache_flags(const char *mode, int *flags)
     return 0;
 }
 
+/**
+ * Set open flags for a given AIO mode
+ *
+ * Return 0 on success, -1 if the AIO mode was invalid.
+ */
+int bdrv_parse_aio(const char *mode, int *flags)
+{
+    *flags &= ~(BDRV_O_NATIVE_AIO | BDRV_O_IO_URING);
+
+    if (!strcmp(mode, "native")) {
+        *flags |= BDRV_O_NATIVE_AIO;
+#ifdef CONFIG_LINUX_IO_URING
+    } else if (!strcmp(mode, "io_uring")) {
+        *flags |= BDRV_O_IO_URING;
+#endif
+    } else if (!strcmp(mode, "threads")) {
+        /* this is the default */
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
 /*
  * Returns the flags that a temporary snapshot should get, based on the
  * originally requested flags (the originally requested image will have flags
@@ -954,6 +984,7 @@ static int bdrv_open_common(BlockDriverState *bs, BlockDriverState *file,
     return 0;
 
 free_and_fail:
+    bdrv_release_persistent_dirty_bitmaps(bs);
     bs->file = NULL;
     g_free(bs->opaque);
     bs->opaque = NULL;
@@ -1863,6 +1894,8 @@ void bdrv_close(BlockDriverState *bs)
             bdrv_unref(backing_hd);
         }
         bs->drv->bdrv_close(bs);
+        /* The driver has written persistent bitmaps back to the image */
+        bdrv_release_persistent_dirty_bitmaps(bs);
         g_free(bs->opaque);
         bs->opaque = NULL;
         bs->drv = NULL;
@@ -1950,9 +1983,15 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
     /* dev info */
     bs_dest->guest_block_size   = bs_src->guest_block_size;
     bs_dest->copy_on_read       = bs_src->copy_on_read;
+    bs_dest->cor_background     = bs_src->cor_background;
+    bs_dest->cor_prefetch       = bs_src->cor_prefetch;
 
     bs_dest->enable_write_cache = bs_src->enable_write_cache;
 
+    /* request merging */
+    bs_dest->merge_requests     = bs_src->merge_requests;
+    bs_dest->merge_window_ns    = bs_src->merge_window_ns;
+
     /* i/o throttled req */
     bs_dest->throttle_state     = bs_src->throttle_state,
     bs_dest->io_limits_enabled  = bs_src->io_limits_enabled;
@@ -1975,6 +2014,14 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
     bs_dest->iostatus_enabled   = bs_src->iostatus_enabled;
     bs_dest->iostatus           = bs_src->iostatus;
 
+    /* statistics configuration */
+    bs_dest->stats.account_invalid = bs_src->stats.account_invalid;
+    bs_dest->stats.account_failed  = bs_src->stats.account_failed;
+    bs_dest->stats.intervals       = bs_src->stats.intervals;
+    memcpy(bs_dest->stats.latency_histogram,
+           bs_src->stats.latency_histogram,
+           sizeof(bs_dest->stats.latency_histogram));
+
     /* dirty bitmap */
     bs_dest->dirty_bitmaps      = bs_src->dirty_bitmaps;
 
@@ -2131,6 +2178,7 @@ static void bdrv_delete(BlockDriverState *bs)
     /* remove from list, if necessary */
     bdrv_make_anon(bs);
 
+    block_acct_cleanup(&bs->stats);
     g_free(bs);
 }
 
@@ -3126,10 +3174,10 @@ void bdrv_invalidate_cache(BlockDriverState *bs, Error **errp)
         return;
     }
 
-    if (!(bs->open_flags & BDRV_O_INCOMING)) {
+    if (!(bs->open_flags & (BDRV_O_INCOMING | BDRV_O_INACTIVE))) {
         return;
     }
-    bs->open_flags &= ~BDRV_O_INCOMING;
+    bs->open_flags &= ~(BDRV_O_INCOMING | BDRV_O_INACTIVE);
 
     if (bs->drv->bdrv_invalidate_cache) {
         bs->drv->bdrv_invalidate_cache(bs, &local_err);
@@ -3166,6 +3214,54 @@ void bdrv_invalidate_cache_all(Error **errp)
     }
 }
 
+static int bdrv_inactivate(BlockDriverState *bs)
+{
+    int ret;
+
+    if (!bs->drv || (bs->open_flags & BDRV_O_INACTIVE)) {
+        return 0;
+    }
+
+    ret = bdrv_flush(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (bs->drv->bdrv_inactivate) {
+        ret = bs->drv->bdrv_inactivate(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    bs->open_flags |= BDRV_O_INACTIVE;
+    return 0;
+}
+
+/*
+ * Called on the migration source once the destination has everything it
+ * needs to take over the images.  Until bdrv_invalidate_cache_all() is
+ * called, nothing may be written to them any more.
+ */
+int bdrv_inactivate_all(void)
+{
+    BlockDriverState *bs;
+    int ret;
+
+    QTAILQ_FOREACH(bs, &bdrv_states, device_list) {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
+        aio_context_acquire(aio_context);
+        ret = bdrv_inactivate(bs);
+        aio_context_release(aio_context);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
 /**************************************************************/
 /* removable device support */
 
@@ -3404,6 +3500,9 @@ static void bdrv_dirty_bitmap_truncate(BlockDriverState *bs)
     QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
         assert(!bdrv_dirty_bitmap_frozen(bitmap));
         hbitmap_truncate(bitmap->bitmap, size);
+        if (bitmap->meta) {
+            hbitmap_truncate(bitmap->meta, size);
+        }
         bitmap->size = size;
     }
 }
@@ -3416,6 +3515,9 @@ void bdrv_release_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
             assert(!bdrv_dirty_bitmap_frozen(bm));
             QLIST_REMOVE(bitmap, list);
             hbitmap_free(bitmap->bitmap);
+            if (bitmap->meta) {
+                hbitmap_free(bitmap->meta);
+            }
             g_free(bitmap->name);
             g_free(bitmap);
             return;
@@ -3423,6 +3525,17 @@ void bdrv_release_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
     }
 }
 
+static void bdrv_release_persistent_dirty_bitmaps(BlockDriverState *bs)
+{
+    BdrvDirtyBitmap *bm, *next;
+
+    QLIST_FOREACH_SAFE(bm, &bs->dirty_bitmaps, list, next) {
+        if (bm->persistent) {
+            bdrv_release_dirty_bitmap(bs, bm);
+        }
+    }
+}
+
 void bdrv_disable_dirty_bitmap(BdrvDirtyBitmap *bitmap)
 {
     assert(!bdrv_dirty_bitmap_frozen(bitmap));
@@ -3449,6 +3562,7 @@ BlockDirtyInfoList *bdrv_query_dirty_bitmaps(BlockDriverState *bs)
         info->has_name = !!bm->name;
         info->name = g_strdup(bm->name);
         info->status = bdrv_dirty_bitmap_status(bm);
+        info->persistent = bm->persistent;
         entry->value = info;
         *plist = entry;
         plist = &entry->next;
@@ -3496,24 +3610,35 @@ void bdrv_dirty_iter_init(BdrvDirtyBitmap *bitmap, HBitmapIter *hbi)
     hbitmap_iter_init(hbi, bitmap->bitmap, 0);
 }
 
+static void bdrv_dirty_bitmap_mark_meta(BdrvDirtyBitmap *bitmap,
+                                        int64_t cur_sector, int64_t nr_sectors)
+{
+    if (bitmap->meta && nr_sectors) {
+        hbitmap_set(bitmap->meta, cur_sector, nr_sectors);
+    }
+}
+
 void bdrv_set_dirty_bitmap(BdrvDirtyBitmap *bitmap,
                            int64_t cur_sector, int nr_sectors)
 {
-    assert(bdrv_dirty_bitmap_enabled(bitmap));
+    assert(!bdrv_dirty_bitmap_frozen(bitmap));
     hbitmap_set(bitmap->bitmap, cur_sector, nr_sectors);
+    bdrv_dirty_bitmap_mark_meta(bitmap, cur_sector, nr_sectors);
 }
 
 void bdrv_reset_dirty_bitmap(BdrvDirtyBitmap *bitmap,
                              int64_t cur_sector, int nr_sectors)
 {
-    assert(bdrv_dirty_bitmap_enabled(bitmap));
+    assert(!bdrv_dirty_bitmap_frozen(bitmap));
     hbitmap_reset(bitmap->bitmap, cur_sector, nr_sectors);
+    bdrv_dirty_bitmap_mark_meta(bitmap, cur_sector, nr_sectors);
 }
 
 void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap)
 {
     assert(bdrv_dirty_bitmap_enabled(bitmap));
     hbitmap_reset_all(bitmap->bitmap);
+    bdrv_dirty_bitmap_mark_meta(bitmap, 0, bitmap->size);
 }
 
 void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector,
@@ -3525,6 +3650,7 @@ void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector,
             continue;
         }
         hbitmap_set(bitmap->bitmap, cur_sector, nr_sectors);
+        bdrv_dirty_bitmap_mark_meta(bitmap, cur_sector, nr_sectors);
     }
 }
 
@@ -3537,6 +3663,7 @@ void bdrv_reset_dirty(BlockDriverState *bs, int64_t cur_sector,
             continue;
         }
         hbitmap_reset(bitmap->bitmap, cur_sector, nr_sectors);
+        bdrv_dirty_bitmap_mark_meta(bitmap, cur_sector, nr_sectors);
     }
 }
 
@@ -3554,6 +3681,158 @@ int64_t bdrv_get_dirty_count(BdrvDirtyBitmap *bitmap)
     return hbitmap_count(bitmap->bitmap);
 }
 
+BdrvDirtyBitmap *bdrv_dirty_bitmap_next(BlockDriverState *bs,
+                                        BdrvDirtyBitmap *bitmap)
+{
+    return bitmap == NULL ? QLIST_FIRST(&bs->dirty_bitmaps) :
+                            QLIST_NEXT(bitmap, list);
+}
+
+const char *bdrv_dirty_bitmap_name(const BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->name;
+}
+
+int64_t bdrv_dirty_bitmap_size(const BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->size;
+}
+
+bool bdrv_dirty_bitmap_get_persistence(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->persistent;
+}
+
+/**
+ * Mark a named bitmap to be written to the image when the BDS is closed.
+ * Persistent bitmaps are owned by the image: they are released together
+ * with the BDS instead of outliving it.
+ */
+void bdrv_dirty_bitmap_set_persistence(BdrvDirtyBitmap *bitmap,
+                                       bool persistent)
+{
+    assert(!persistent || bitmap->name);
+    bitmap->persistent = persistent;
+}
+
+bool bdrv_can_store_dirty_bitmap(BlockDriverState *bs, const char *name,
+                                 uint32_t granularity, Error **errp)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv) {
+        error_setg(errp, "Can't store persistent bitmaps to %s",
+                   bdrv_get_device_or_node_name(bs));
+        return false;
+    }
+
+    if (!drv->bdrv_can_store_dirty_bitmap) {
+        error_setg(errp, "Format '%s' does not support persistent bitmaps",
+                   drv->format_name);
+        return false;
+    }
+
+    return drv->bdrv_can_store_dirty_bitmap(bs, name, granularity, errp);
+}
+
+/**
+ * Return true if no bit is set in [@sector, @sector + @nr_sectors).
+ */
+bool bdrv_dirty_bitmap_range_empty(BdrvDirtyBitmap *bitmap,
+                                   int64_t sector, int64_t nr_sectors)
+{
+    HBitmapIter hbi;
+    int64_t next;
+
+    if (sector >= bitmap->size) {
+        return true;
+    }
+    hbitmap_iter_init(&hbi, bitmap->bitmap, sector);
+    next = hbitmap_iter_next(&hbi);
+
+    return next < 0 || next >= sector + nr_sectors;
+}
+
+uint64_t bdrv_dirty_bitmap_serialization_size(const BdrvDirtyBitmap *bitmap,
+                                              uint64_t start, uint64_t count)
+{
+    return hbitmap_serialization_size(bitmap->bitmap, start, count);
+}
+
+uint64_t bdrv_dirty_bitmap_serialization_align(const BdrvDirtyBitmap *bitmap)
+{
+    return hbitmap_serialization_granularity(bitmap->bitmap);
+}
+
+void bdrv_dirty_bitmap_serialize_part(const BdrvDirtyBitmap *bitmap,
+                                      uint8_t *buf, uint64_t start,
+                                      uint64_t count)
+{
+    hbitmap_serialize_part(bitmap->bitmap, buf, start, count);
+}
+
+void bdrv_dirty_bitmap_deserialize_part(BdrvDirtyBitmap *bitmap,
+                                        uint8_t *buf, uint64_t start,
+                                        uint64_t count, bool finish)
+{
+    hbitmap_deserialize_part(bitmap->bitmap, buf, start, count, finish);
+}
+
+void bdrv_dirty_bitmap_deserialize_zeroes(BdrvDirtyBitmap *bitmap,
+                                          uint64_t start, uint64_t count,
+                                          bool finish)
+{
+    hbitmap_deserialize_zeroes(bitmap->bitmap, start, count, finish);
+}
+
+void bdrv_dirty_bitmap_deserialize_finish(BdrvDirtyBitmap *bitmap)
+{
+    hbitmap_deserialize_finish(bitmap->bitmap);
+}
+
+/**
+ * Start tracking which chunks of @bitmap change.  Any set or reset of
+ * bits in @bitmap marks the @chunk_sectors sized chunks that contain them
+ * in the meta bitmap, so that e.g. migration can resend only the parts
+ * of a bitmap that changed since they were last sent.
+ */
+void bdrv_create_meta_dirty_bitmap(BdrvDirtyBitmap *bitmap,
+                                   int64_t chunk_sectors)
+{
+    assert(!bitmap->meta);
+    assert(is_power_of_2(chunk_sectors));
+    bitmap->meta = hbitmap_alloc(bitmap->size, ctz64(chunk_sectors));
+}
+
+bool bdrv_dirty_bitmap_has_meta(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->meta;
+}
+
+void bdrv_release_meta_dirty_bitmap(BdrvDirtyBitmap *bitmap)
+{
+    assert(bitmap->meta);
+    hbitmap_free(bitmap->meta);
+    bitmap->meta = NULL;
+}
+
+void bdrv_dirty_bitmap_meta_iter_init(BdrvDirtyBitmap *bitmap,
+                                      HBitmapIter *hbi)
+{
+    hbitmap_iter_init(hbi, bitmap->meta, 0);
+}
+
+void bdrv_dirty_bitmap_meta_reset(BdrvDirtyBitmap *bitmap,
+                                  int64_t sector, int64_t nr_sectors)
+{
+    hbitmap_reset(bitmap->meta, sector, nr_sectors);
+}
+
+int64_t bdrv_dirty_bitmap_meta_count(BdrvDirtyBitmap *bitmap)
+{
+    return hbitmap_count(bitmap->meta);
+}
+
 /* Get a reference to bs */
 void bdrv_ref(BlockDriverState *bs)
 {
@@ -46,6 +46,8 @@ typedef struct BackupBlockJob {
     BlockdevOnError on_target_error;
     CoRwlock flush_rwlock;
     uint64_t sectors_read;
+    /* bytes written to the target as zeroes instead of being copied */
+    int64_t bytes_skipped;
     HBitmap *bitmap;
     QLIST_HEAD(, CowRequest) inflight_reqs;
 } BackupBlockJob;
@@ -98,7 +100,9 @@ static int coroutine_fn backup_do_cow(BlockDriverState *bs,
     void *bounce_buffer = NULL;
     int ret = 0;
     int64_t start, end;
-    int n;
+    int64_t status;
+    int n, pnum;
+    bool zero;
 
     qemu_co_rwlock_rdlock(&job->flush_rwlock);
 
@@ -122,27 +126,41 @@ static int coroutine_fn backup_do_cow(BlockDriverState *bs,
                 job->common.len / BDRV_SECTOR_SIZE -
                 start * BACKUP_SECTORS_PER_CLUSTER);
 
-        if (!bounce_buffer) {
-            bounce_buffer = qemu_blockalign(bs, BACKUP_CLUSTER_SIZE);
-        }
-        iov.iov_base = bounce_buffer;
-        iov.iov_len = n * BDRV_SECTOR_SIZE;
-        qemu_iovec_init_external(&bounce_qiov, &iov, 1);
+        /* Clusters that are known to read as zeroes need not be read at all;
+         * errors are not fatal here, the read below will report them.
+         */
+        status = bdrv_get_block_status(bs, start * BACKUP_SECTORS_PER_CLUSTER,
+                                       n, &pnum);
+        zero = status >= 0 && (status & BDRV_BLOCK_ZERO) && pnum >= n;
 
-        ret = bdrv_co_readv(bs, start * BACKUP_SECTORS_PER_CLUSTER, n,
-                            &bounce_qiov);
-        if (ret < 0) {
-            trace_backup_do_cow_read_fail(job, start, ret);
-            if (error_is_read) {
-                *error_is_read = true;
+        if (!zero) {
+            if (!bounce_buffer) {
+                bounce_buffer = qemu_blockalign(bs, BACKUP_CLUSTER_SIZE);
             }
-            goto out;
+            iov.iov_base = bounce_buffer;
+            iov.iov_len = n * BDRV_SECTOR_SIZE;
+            qemu_iovec_init_external(&bounce_qiov, &iov, 1);
+
+            ret = bdrv_co_readv(bs, start * BACKUP_SECTORS_PER_CLUSTER, n,
+                                &bounce_qiov);
+            if (ret < 0) {
+                trace_backup_do_cow_read_fail(job, start, ret);
+                if (error_is_read) {
+                    *error_is_read = true;
+                }
+                goto out;
+            }
+            zero = buffer_is_zero(iov.iov_base, iov.iov_len);
         }
 
-        if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
+        if (zero) {
+            trace_backup_do_cow_zero(job, start);
             ret = bdrv_co_write_zeroes(job->target,
                                        start * BACKUP_SECTORS_PER_CLUSTER,
                                        n, BDRV_REQ_MAY_UNMAP);
+            if (ret >= 0) {
+                job->bytes_skipped += n * BDRV_SECTOR_SIZE;
+            }
         } else {
             ret = bdrv_co_writev(job->target,
                                  start * BACKUP_SECTORS_PER_CLUSTER, n,
@@ -211,11 +229,20 @@ static void backup_iostatus_reset(BlockJob *job)
     bdrv_iostatus_reset(s->target);
 }
 
+static void backup_query(BlockJob *job, BlockJobInfo *info)
+{
+    BackupBlockJob *s = container_of(job, BackupBlockJob, common);
+
+    info->has_skipped = true;
+    info->skipped = s->bytes_skipped;
+}
+
 static const BlockJobDriver backup_job_driver = {
     .instance_size  = sizeof(BackupBlockJob),
     .job_type       = BLOCK_JOB_TYPE_BACKUP,
     .set_speed      = backup_set_speed,
     .iostatus_reset = backup_iostatus_reset,
+    .query          = backup_query,
 };
 
 static BlockErrorAction backup_error_action(BackupBlockJob *job,
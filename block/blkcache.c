@@ -0,0 +1,868 @@
+/*
+ * Block cache filter
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "block/block_int.h"
+#include "block/coroutine.h"
+#include "qemu/timer.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qstring.h"
+
+/* The cache is split in blocks of block-size bytes, which are managed with
+ * the Adaptive Replacement Cache algorithm (Megiddo and Modha, FAST '03).
+ *
+ * T1 holds the blocks that were accessed once recently, T2 the blocks that
+ * were accessed at least twice.  B1 and B2 are "ghost" lists that only
+ * remember the index of the blocks recently evicted from T1 and T2.  A hit in
+ * a ghost list adapts p, the target size of T1, to the workload; this makes
+ * the cache resistant to sequential scans while still favouring recently
+ * used data.
+ *
+ * Only blocks in T1 and T2 own a buffer.  Blocks that are dirty or used by a
+ * request are never evicted; if no block can be evicted, requests bypass the
+ * cache.
+ */
+enum {
+    BLKCACHE_T1,
+    BLKCACHE_T2,
+    BLKCACHE_B1,
+    BLKCACHE_B2,
+    BLKCACHE_LIST_MAX,
+};
+
+typedef struct BlkcacheEntry BlkcacheEntry;
+struct BlkcacheEntry {
+    int64_t index;
+    int list;
+    uint8_t *data;      /* NULL for ghost entries */
+    bool valid;         /* data has been read or completely written */
+    bool dirty;         /* data must be written back to the image */
+    uint64_t dirty_seq; /* when the block became dirty */
+    int users;          /* requests that hold a reference */
+    CoMutex lock;       /* serialises filling, updating and writing back */
+    QTAILQ_ENTRY(BlkcacheEntry) next;       /* most recently used first */
+    QTAILQ_ENTRY(BlkcacheEntry) dirty_next; /* least recently dirtied first */
+};
+
+typedef struct BDRVBlkcacheState {
+    BlockDriverState *bs;
+    GHashTable *entries;
+    QTAILQ_HEAD(BlkcacheList, BlkcacheEntry) lists[BLKCACHE_LIST_MAX];
+    int list_len[BLKCACHE_LIST_MAX];
+    int nb_blocks;
+    int p;
+
+    int block_size;
+    int64_t length;
+    bool writeback;
+    uint64_t dirty_limit;
+    int64_t flush_interval;
+
+    /* Write back */
+    QTAILQ_HEAD(, BlkcacheEntry) dirty;
+    uint64_t dirty_bytes;
+    uint64_t dirty_seq;
+    CoQueue dirty_queue;
+    Coroutine *flusher;
+    QEMUTimer *flush_timer;
+    int writeback_in_flight;
+    int writeback_error;
+
+    /* Statistics */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;
+} BDRVBlkcacheState;
+
+/* Valid blkcache filenames look like blkcache:path/to/image */
+static void blkcache_parse_filename(const char *filename, QDict *options,
+                                    Error **errp)
+{
+    /* Without the prefix, all options have to be present in the QDict */
+    strstart(filename, "blkcache:", &filename);
+
+    /* TODO Allow multi-level nesting and set image.filename here */
+    qdict_put(options, "x-image", qstring_from_str(filename));
+}
+
+static QemuOptsList runtime_opts = {
+    .name = "blkcache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = "x-image",
+            .type = QEMU_OPT_STRING,
+            .help = "[internal use only, will be removed]",
+        },
+        {
+            .name = "cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum size of the cached data",
+        },
+        {
+            .name = "block-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of a cache block",
+        },
+        {
+            .name = "writeback",
+            .type = QEMU_OPT_BOOL,
+            .help = "Buffer writes in the cache",
+        },
+        {
+            .name = "dirty-limit",
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum size of the data that is not yet written back",
+        },
+        {
+            .name = "flush-interval",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Time after which dirty data is written back (in ms)",
+        },
+        {
+            .name = "direct",
+            .type = QEMU_OPT_BOOL,
+            .help = "Bypass the host page cache for the image",
+        },
+        { /* end of list */ }
+    },
+};
+
+#define BLKCACHE_DEFAULT_CACHE_SIZE     (64 * 1024 * 1024)
+#define BLKCACHE_DEFAULT_BLOCK_SIZE     (64 * 1024)
+#define BLKCACHE_MAX_BLOCK_SIZE         (4 * 1024 * 1024)
+#define BLKCACHE_DEFAULT_FLUSH_INTERVAL 1000
+
+/* The cache takes the role of the host page cache */
+static int blkcache_inherited_flags(int parent_flags)
+{
+    return child_file.inherit_flags(parent_flags) | BDRV_O_NOCACHE;
+}
+
+static const BdrvChildRole child_blkcache_direct = {
+    .inherit_flags = blkcache_inherited_flags,
+};
+
+static int blkcache_block_len(BDRVBlkcacheState *s, BlkcacheEntry *e)
+{
+    return MIN(s->block_size, s->length - e->index * s->block_size);
+}
+
+static void blkcache_list_move(BDRVBlkcacheState *s, BlkcacheEntry *e,
+                               int list)
+{
+    QTAILQ_REMOVE(&s->lists[e->list], e, next);
+    s->list_len[e->list]--;
+    e->list = list;
+    QTAILQ_INSERT_HEAD(&s->lists[list], e, next);
+    s->list_len[list]++;
+}
+
+static void blkcache_entry_free(BDRVBlkcacheState *s, BlkcacheEntry *e)
+{
+    QTAILQ_REMOVE(&s->lists[e->list], e, next);
+    s->list_len[e->list]--;
+    g_hash_table_remove(s->entries, &e->index);
+    qemu_vfree(e->data);
+    g_free(e);
+}
+
+/* Drop all the blocks that are neither dirty nor in use */
+static void blkcache_drop_clean(BDRVBlkcacheState *s)
+{
+    BlkcacheEntry *e, *next;
+    int i;
+
+    for (i = 0; i < BLKCACHE_LIST_MAX; i++) {
+        QTAILQ_FOREACH_SAFE(e, &s->lists[i], next, next) {
+            if (!e->dirty && !e->users) {
+                blkcache_entry_free(s, e);
+            }
+        }
+    }
+    s->p = 0;
+}
+
+static BlkcacheEntry *blkcache_find_victim(BDRVBlkcacheState *s, int list)
+{
+    BlkcacheEntry *e;
+
+    QTAILQ_FOREACH_REVERSE(e, &s->lists[list], BlkcacheList, next) {
+        if (!e->dirty && !e->users) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/* Evict a block from T1 or T2 as in the REPLACE routine of ARC, and return
+ * its buffer for reuse.  Returns NULL if all resident blocks are busy.
+ */
+static uint8_t *blkcache_replace(BDRVBlkcacheState *s, bool in_b2)
+{
+    BlkcacheEntry *victim;
+    int t1 = s->list_len[BLKCACHE_T1];
+    uint8_t *data;
+
+    if (t1 && ((in_b2 && t1 == s->p) || t1 > s->p)) {
+        victim = blkcache_find_victim(s, BLKCACHE_T1);
+        if (!victim) {
+            victim = blkcache_find_victim(s, BLKCACHE_T2);
+        }
+    } else {
+        victim = blkcache_find_victim(s, BLKCACHE_T2);
+        if (!victim) {
+            victim = blkcache_find_victim(s, BLKCACHE_T1);
+        }
+    }
+    if (!victim) {
+        return NULL;
+    }
+
+    data = victim->data;
+    victim->data = NULL;
+    victim->valid = false;
+    blkcache_list_move(s, victim, victim->list == BLKCACHE_T1 ? BLKCACHE_B1
+                                                              : BLKCACHE_B2);
+    s->evictions++;
+    return data;
+}
+
+/* Look up the block at @index and make it resident.  The caller must drop
+ * the reference with e->users-- when it is done.  Returns NULL if the block
+ * cannot be cached.
+ */
+static BlkcacheEntry *blkcache_get(BDRVBlkcacheState *s, int64_t index)
+{
+    BlkcacheEntry *e = g_hash_table_lookup(s->entries, &index);
+    int *len = s->list_len;
+    int c = s->nb_blocks;
+    uint8_t *data;
+
+    if (e && e->data) {
+        blkcache_list_move(s, e, BLKCACHE_T2);
+        e->users++;
+        return e;
+    }
+
+    /* A ghost hit tells which list should have been larger */
+    if (e && e->list == BLKCACHE_B1) {
+        s->p = MIN(c, s->p + MAX(len[BLKCACHE_B2] / len[BLKCACHE_B1], 1));
+    } else if (e) {
+        s->p = MAX(0, s->p - MAX(len[BLKCACHE_B1] / len[BLKCACHE_B2], 1));
+    }
+
+    if (len[BLKCACHE_T1] + len[BLKCACHE_T2] >= c) {
+        data = blkcache_replace(s, e && e->list == BLKCACHE_B2);
+    } else {
+        data = qemu_try_blockalign(s->bs->file, s->block_size);
+    }
+    if (!data) {
+        return NULL;
+    }
+
+    if (e) {
+        blkcache_list_move(s, e, BLKCACHE_T2);
+    } else {
+        e = g_new0(BlkcacheEntry, 1);
+        e->index = index;
+        e->list = BLKCACHE_T1;
+        qemu_co_mutex_init(&e->lock);
+        QTAILQ_INSERT_HEAD(&s->lists[BLKCACHE_T1], e, next);
+        len[BLKCACHE_T1]++;
+        g_hash_table_insert(s->entries, &e->index, e);
+    }
+    e->data = data;
+    e->users++;
+
+    /* Forget the oldest ghosts; ARC keeps |T1| + |B1| <= c and the total
+     * number of entries <= 2c */
+    while (len[BLKCACHE_T1] + len[BLKCACHE_B1] > c && len[BLKCACHE_B1]) {
+        blkcache_entry_free(s, QTAILQ_LAST(&s->lists[BLKCACHE_B1],
+                                           BlkcacheList));
+    }
+    while (len[BLKCACHE_T1] + len[BLKCACHE_T2] + len[BLKCACHE_B1] +
+           len[BLKCACHE_B2] > 2 * c && len[BLKCACHE_B2]) {
+        blkcache_entry_free(s, QTAILQ_LAST(&s->lists[BLKCACHE_B2],
+                                           BlkcacheList));
+    }
+
+    return e;
+}
+
+/* Perform I/O on the image for the part of @qiov at @qiov_offset */
+static int coroutine_fn blkcache_co_rw_image(BlockDriverState *bs,
+                                             int64_t offset, int bytes,
+                                             QEMUIOVector *qiov,
+                                             size_t qiov_offset, bool is_write)
+{
+    QEMUIOVector local_qiov;
+    int ret;
+
+    qemu_iovec_init(&local_qiov, qiov->niov);
+    qemu_iovec_concat(&local_qiov, qiov, qiov_offset, bytes);
+
+    if (is_write) {
+        ret = bdrv_co_writev(bs->file, offset >> BDRV_SECTOR_BITS,
+                             bytes >> BDRV_SECTOR_BITS, &local_qiov);
+    } else {
+        ret = bdrv_co_readv(bs->file, offset >> BDRV_SECTOR_BITS,
+                            bytes >> BDRV_SECTOR_BITS, &local_qiov);
+    }
+
+    qemu_iovec_destroy(&local_qiov);
+    return ret;
+}
+
+static int coroutine_fn blkcache_co_fill(BlockDriverState *bs,
+                                         BlkcacheEntry *e)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    QEMUIOVector qiov;
+    struct iovec iov = {
+        .iov_base   = e->data,
+        .iov_len    = blkcache_block_len(s, e),
+    };
+    int ret;
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    ret = bdrv_co_readv(bs->file,
+                        e->index * (s->block_size >> BDRV_SECTOR_BITS),
+                        iov.iov_len >> BDRV_SECTOR_BITS, &qiov);
+    if (ret < 0) {
+        return ret;
+    }
+
+    e->valid = true;
+    return 0;
+}
+
+/* A block that is written again keeps its place in the dirty list and its
+ * sequence number, so that the list stays sorted by dirty_seq and a flush
+ * writes back every block that was dirty when it started.
+ */
+static void blkcache_mark_dirty(BDRVBlkcacheState *s, BlkcacheEntry *e)
+{
+    if (e->dirty) {
+        return;
+    }
+
+    e->dirty = true;
+    e->dirty_seq = ++s->dirty_seq;
+    QTAILQ_INSERT_TAIL(&s->dirty, e, dirty_next);
+    s->dirty_bytes += s->block_size;
+
+    if (s->flush_interval && !timer_pending(s->flush_timer)) {
+        timer_mod(s->flush_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                                  s->flush_interval);
+    }
+}
+
+/* Write the oldest dirty block back to the image */
+static int coroutine_fn blkcache_co_writeback(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheEntry *e = QTAILQ_FIRST(&s->dirty);
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret;
+
+    QTAILQ_REMOVE(&s->dirty, e, dirty_next);
+    e->users++;
+    s->writeback_in_flight++;
+
+    /* Writes to the block wait until it is on the disk; they find it still
+     * dirty and do not queue it again */
+    qemu_co_mutex_lock(&e->lock);
+
+    iov.iov_base = e->data;
+    iov.iov_len = blkcache_block_len(s, e);
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    ret = bdrv_co_writev(bs->file,
+                         e->index * (s->block_size >> BDRV_SECTOR_BITS),
+                         iov.iov_len >> BDRV_SECTOR_BITS, &qiov);
+    if (ret < 0) {
+        BlkcacheEntry *pos;
+
+        /* Put it back in order; another writeback may have failed as well */
+        s->writeback_error = ret;
+        QTAILQ_FOREACH(pos, &s->dirty, dirty_next) {
+            if (pos->dirty_seq > e->dirty_seq) {
+                break;
+            }
+        }
+        if (pos) {
+            QTAILQ_INSERT_BEFORE(pos, e, dirty_next);
+        } else {
+            QTAILQ_INSERT_TAIL(&s->dirty, e, dirty_next);
+        }
+    } else {
+        e->dirty = false;
+        s->dirty_bytes -= s->block_size;
+        s->writebacks++;
+    }
+
+    qemu_co_mutex_unlock(&e->lock);
+    e->users--;
+    s->writeback_in_flight--;
+    qemu_co_queue_restart_all(&s->dirty_queue);
+
+    return ret;
+}
+
+static void coroutine_fn blkcache_co_flusher(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVBlkcacheState *s = bs->opaque;
+
+    while (!QTAILQ_EMPTY(&s->dirty) && !s->writeback_error) {
+        blkcache_co_writeback(bs);
+    }
+
+    s->flusher = NULL;
+    qemu_co_queue_restart_all(&s->dirty_queue);
+}
+
+/* Start writing back dirty blocks.  After a write error, the flusher stays
+ * stopped until the next flush request reports the error.
+ */
+static void blkcache_kick_flusher(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+
+    if (!s->flusher && !s->writeback_error && !QTAILQ_EMPTY(&s->dirty)) {
+        s->flusher = qemu_coroutine_create(blkcache_co_flusher);
+        qemu_coroutine_enter(s->flusher, bs);
+    }
+}
+
+static void blkcache_flush_timer_cb(void *opaque)
+{
+    blkcache_kick_flusher(opaque);
+}
+
+static int blkcache_open(BlockDriverState *bs, QDict *options, int flags,
+                         Error **errp)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    uint64_t cache_size, block_size;
+    int64_t length;
+    int i;
+    int ret;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    cache_size = qemu_opt_get_size(opts, "cache-size",
+                                   BLKCACHE_DEFAULT_CACHE_SIZE);
+    block_size = qemu_opt_get_size(opts, "block-size",
+                                   BLKCACHE_DEFAULT_BLOCK_SIZE);
+    if (block_size < BDRV_SECTOR_SIZE || block_size > BLKCACHE_MAX_BLOCK_SIZE ||
+        (block_size & (block_size - 1))) {
+        error_setg(errp, "block-size must be a power of two between 512 "
+                   "and %d", BLKCACHE_MAX_BLOCK_SIZE);
+        ret = -EINVAL;
+        goto out;
+    }
+    if (cache_size < block_size || cache_size / block_size > INT_MAX / 2) {
+        error_setg(errp, "Invalid cache-size");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    s->bs = bs;
+    s->block_size = block_size;
+    s->nb_blocks = cache_size / block_size;
+    s->writeback = qemu_opt_get_bool(opts, "writeback", false);
+    s->dirty_limit = qemu_opt_get_size(opts, "dirty-limit", cache_size / 2);
+    if (s->dirty_limit < block_size || s->dirty_limit > cache_size) {
+        error_setg(errp, "dirty-limit must be between block-size and "
+                   "cache-size");
+        ret = -EINVAL;
+        goto out;
+    }
+    s->flush_interval = qemu_opt_get_number(opts, "flush-interval",
+                                            BLKCACHE_DEFAULT_FLUSH_INTERVAL);
+    if (s->flush_interval < 0) {
+        error_setg(errp, "flush-interval must not be negative");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    /* Open the image */
+    assert(bs->file == NULL);
+    ret = bdrv_open_image(&bs->file, qemu_opt_get(opts, "x-image"), options,
+                          "image", bs,
+                          qemu_opt_get_bool(opts, "direct", true)
+                          ? &child_blkcache_direct : &child_file,
+                          false, &local_err);
+    if (ret < 0) {
+        error_propagate(errp, local_err);
+        goto out;
+    }
+
+    length = bdrv_getlength(bs->file);
+    if (length < 0) {
+        error_setg_errno(errp, -length, "Could not get the image size");
+        ret = length;
+        goto fail_unref;
+    }
+    s->length = QEMU_ALIGN_UP(length, BDRV_SECTOR_SIZE);
+
+    s->entries = g_hash_table_new(g_int64_hash, g_int64_equal);
+    for (i = 0; i < BLKCACHE_LIST_MAX; i++) {
+        QTAILQ_INIT(&s->lists[i]);
+    }
+    QTAILQ_INIT(&s->dirty);
+    qemu_co_queue_init(&s->dirty_queue);
+    s->flush_timer = aio_timer_new(bdrv_get_aio_context(bs),
+                                   QEMU_CLOCK_REALTIME, SCALE_MS,
+                                   blkcache_flush_timer_cb, bs);
+
+    ret = 0;
+    goto out;
+
+fail_unref:
+    bdrv_unref(bs->file);
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void blkcache_close(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheEntry *e, *next;
+    int i;
+
+    /* bdrv_close() has flushed the cache; if that failed, the data is lost */
+    assert(!s->flusher);
+    for (i = 0; i < BLKCACHE_LIST_MAX; i++) {
+        QTAILQ_FOREACH_SAFE(e, &s->lists[i], next, next) {
+            blkcache_entry_free(s, e);
+        }
+    }
+    g_hash_table_destroy(s->entries);
+
+    timer_del(s->flush_timer);
+    timer_free(s->flush_timer);
+}
+
+static int64_t blkcache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file);
+}
+
+static int blkcache_truncate(BlockDriverState *bs, int64_t offset)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int64_t length;
+    int ret;
+
+    ret = bdrv_flush(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* The last block may change size */
+    blkcache_drop_clean(s);
+
+    ret = bdrv_truncate(bs->file, offset);
+    length = bdrv_getlength(bs->file);
+    if (length >= 0) {
+        s->length = QEMU_ALIGN_UP(length, BDRV_SECTOR_SIZE);
+    }
+    return ret;
+}
+
+static int coroutine_fn blkcache_co_readv(BlockDriverState *bs,
+                                          int64_t sector_num, int nb_sectors,
+                                          QEMUIOVector *qiov)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int64_t offset = sector_num << BDRV_SECTOR_BITS;
+    size_t bytes = (size_t)nb_sectors << BDRV_SECTOR_BITS;
+    size_t pos;
+    int n;
+    int ret = 0;
+
+    for (pos = 0; pos < bytes; pos += n) {
+        int64_t index = (offset + pos) / s->block_size;
+        int skip = (offset + pos) % s->block_size;
+        BlkcacheEntry *e;
+
+        n = MIN(s->block_size - skip, bytes - pos);
+        e = blkcache_get(s, index);
+        if (!e) {
+            s->misses++;
+            ret = blkcache_co_rw_image(bs, offset + pos, n, qiov, pos, false);
+        } else {
+            qemu_co_mutex_lock(&e->lock);
+            if (e->valid) {
+                s->hits++;
+            } else {
+                s->misses++;
+                ret = blkcache_co_fill(bs, e);
+            }
+            if (ret >= 0) {
+                qemu_iovec_from_buf(qiov, pos, e->data + skip, n);
+            }
+            qemu_co_mutex_unlock(&e->lock);
+            e->users--;
+        }
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/* Bring resident blocks up to date after @bytes at @offset were written
+ * to the image from @qiov, starting at @qiov_offset
+ */
+static void coroutine_fn blkcache_co_update(BlockDriverState *bs,
+                                            int64_t offset, size_t bytes,
+                                            QEMUIOVector *qiov,
+                                            size_t qiov_offset, bool valid)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    size_t pos;
+    int n;
+
+    for (pos = 0; pos < bytes; pos += n) {
+        int64_t index = (offset + pos) / s->block_size;
+        int skip = (offset + pos) % s->block_size;
+        BlkcacheEntry *e = g_hash_table_lookup(s->entries, &index);
+
+        n = MIN(s->block_size - skip, bytes - pos);
+        if (!e || !e->data) {
+            continue;
+        }
+
+        e->users++;
+        qemu_co_mutex_lock(&e->lock);
+        if (!valid) {
+            e->valid = false;
+        } else if (e->valid) {
+            qemu_iovec_to_buf(qiov, qiov_offset + pos, e->data + skip, n);
+        }
+        qemu_co_mutex_unlock(&e->lock);
+        e->users--;
+    }
+}
+
+static int coroutine_fn blkcache_co_writev(BlockDriverState *bs,
+                                           int64_t sector_num, int nb_sectors,
+                                           QEMUIOVector *qiov)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int64_t offset = sector_num << BDRV_SECTOR_BITS;
+    size_t bytes = (size_t)nb_sectors << BDRV_SECTOR_BITS;
+    size_t pos;
+    int n;
+    int ret = 0;
+
+    if (!s->writeback) {
+        ret = bdrv_co_writev(bs->file, sector_num, nb_sectors, qiov);
+        blkcache_co_update(bs, offset, bytes, qiov, 0, ret >= 0);
+        return ret;
+    }
+
+    for (pos = 0; pos < bytes; pos += n) {
+        int64_t index = (offset + pos) / s->block_size;
+        int skip = (offset + pos) % s->block_size;
+        BlkcacheEntry *e;
+
+        n = MIN(s->block_size - skip, bytes - pos);
+
+        while (s->dirty_bytes >= s->dirty_limit) {
+            if (s->writeback_error) {
+                return s->writeback_error;
+            }
+            blkcache_kick_flusher(bs);
+            qemu_co_queue_wait(&s->dirty_queue);
+        }
+
+        e = blkcache_get(s, index);
+        if (!e) {
+            /* A read may have cached the block in the meantime */
+            ret = blkcache_co_rw_image(bs, offset + pos, n, qiov, pos, true);
+            blkcache_co_update(bs, offset + pos, n, qiov, pos, ret >= 0);
+        } else {
+            qemu_co_mutex_lock(&e->lock);
+            if (!e->valid && (skip || n < blkcache_block_len(s, e))) {
+                ret = blkcache_co_fill(bs, e);
+            }
+            if (ret >= 0) {
+                qemu_iovec_to_buf(qiov, pos, e->data + skip, n);
+                e->valid = true;
+                blkcache_mark_dirty(s, e);
+            }
+            qemu_co_mutex_unlock(&e->lock);
+            e->users--;
+        }
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (s->dirty_bytes >= s->dirty_limit / 2) {
+        blkcache_kick_flusher(bs);
+    }
+
+    return 0;
+}
+
+/* Write back the blocks that were dirty when the flush was requested, even
+ * if they have been written again since; the block layer flushes the image
+ * afterwards.
+ */
+static int coroutine_fn blkcache_co_flush(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    uint64_t seq = s->dirty_seq;
+    BlkcacheEntry *e;
+    int ret;
+
+    for (;;) {
+        e = QTAILQ_FIRST(&s->dirty);
+        if (e && e->dirty_seq <= seq) {
+            ret = blkcache_co_writeback(bs);
+            if (ret < 0) {
+                return ret;
+            }
+        } else if (s->writeback_in_flight) {
+            qemu_co_queue_wait(&s->dirty_queue);
+        } else {
+            break;
+        }
+    }
+
+    /* Everything has been retried successfully, restart the flusher */
+    s->writeback_error = 0;
+    blkcache_kick_flusher(bs);
+    return 0;
+}
+
+static void blkcache_invalidate_cache(BlockDriverState *bs, Error **errp)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    Error *local_err = NULL;
+    int64_t length;
+
+    /* The image may have been changed by someone else */
+    blkcache_drop_clean(s);
+
+    bdrv_invalidate_cache(bs->file, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    length = bdrv_getlength(bs->file);
+    if (length < 0) {
+        error_setg_errno(errp, -length, "Could not get the image size");
+        return;
+    }
+    s->length = QEMU_ALIGN_UP(length, BDRV_SECTOR_SIZE);
+}
+
+static ImageInfoSpecific *blkcache_get_specific_info(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    ImageInfoSpecific *spec_info = g_new(ImageInfoSpecific, 1);
+    uint64_t accesses = s->hits + s->misses;
+
+    *spec_info = (ImageInfoSpecific){
+        .kind  = IMAGE_INFO_SPECIFIC_KIND_BLKCACHE,
+        {
+            .blkcache = g_new(ImageInfoSpecificBlkcache, 1),
+        },
+    };
+    *spec_info->blkcache = (ImageInfoSpecificBlkcache){
+        .cache_size     = (int64_t)s->nb_blocks * s->block_size,
+        .block_size     = s->block_size,
+        .writeback      = s->writeback,
+        .cached_bytes   = (int64_t)(s->list_len[BLKCACHE_T1] +
+                                    s->list_len[BLKCACHE_T2]) * s->block_size,
+        .dirty_bytes    = s->dirty_bytes,
+        .hits           = s->hits,
+        .misses         = s->misses,
+        .hit_rate       = accesses ? (double)s->hits / accesses : 0,
+        .evictions      = s->evictions,
+        .writebacks     = s->writebacks,
+    };
+
+    return spec_info;
+}
+
+static void blkcache_detach_aio_context(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+
+    timer_del(s->flush_timer);
+    timer_free(s->flush_timer);
+    s->flush_timer = NULL;
+}
+
+static void blkcache_attach_aio_context(BlockDriverState *bs,
+                                        AioContext *new_context)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+
+    s->flush_timer = aio_timer_new(new_context, QEMU_CLOCK_REALTIME, SCALE_MS,
+                                   blkcache_flush_timer_cb, bs);
+    if (s->flush_interval && !QTAILQ_EMPTY(&s->dirty)) {
+        timer_mod(s->flush_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                                  s->flush_interval);
+    }
+}
+
+static bool blkcache_recurse_is_first_non_filter(BlockDriverState *bs,
+                                                 BlockDriverState *candidate)
+{
+    return bdrv_recurse_is_first_non_filter(bs->file, candidate);
+}
+
+static BlockDriver bdrv_blkcache = {
+    .format_name                      = "blkcache",
+    .protocol_name                    = "blkcache",
+    .instance_size                    = sizeof(BDRVBlkcacheState),
+
+    .bdrv_parse_filename              = blkcache_parse_filename,
+    .bdrv_file_open                   = blkcache_open,
+    .bdrv_close                       = blkcache_close,
+    .bdrv_getlength                   = blkcache_getlength,
+    .bdrv_truncate                    = blkcache_truncate,
+    .bdrv_invalidate_cache            = blkcache_invalidate_cache,
+    .bdrv_get_specific_info           = blkcache_get_specific_info,
+
+    .bdrv_co_readv                    = blkcache_co_readv,
+    .bdrv_co_writev                   = blkcache_co_writev,
+    .bdrv_co_flush_to_os              = blkcache_co_flush,
+
+    .bdrv_attach_aio_context          = blkcache_attach_aio_context,
+    .bdrv_detach_aio_context          = blkcache_detach_aio_context,
+
+    .is_filter                        = true,
+    .bdrv_recurse_is_first_non_filter = blkcache_recurse_is_first_non_filter,
+};
+
+static void bdrv_blkcache_init(void)
+{
+    bdrv_register(&bdrv_blkcache);
+}
+
+block_init(bdrv_blkcache_init);
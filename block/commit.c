@@ -25,6 +25,9 @@ enum {
      * contiguous regions of the image is efficient.
      */
     COMMIT_BUFFER_SIZE = 512 * 1024, /* in bytes */
+
+    /* Number of buffers that are copied in parallel */
+    COMMIT_MAX_IN_FLIGHT = 8,
 };
 
 #define SLICE_TIME 100000000ULL /* ns */
@@ -39,21 +42,44 @@ typedef struct CommitBlockJob {
     int base_flags;
     int orig_overlay_flags;
     char *backing_file_str;
+
+    int in_flight;
+    bool waiting_for_io;
+    int ret;            /* error that ends the job */
 } CommitBlockJob;
 
+typedef struct CommitOp {
+    CommitBlockJob *s;
+    int64_t sector_num;
+    int nb_sectors;
+} CommitOp;
+
 static int coroutine_fn commit_populate(BlockDriverState *bs,
                                         BlockDriverState *base,
                                         int64_t sector_num, int nb_sectors,
                                         void *buf)
 {
+    struct iovec iov = {
+        .iov_base = buf,
+        .iov_len  = nb_sectors * BDRV_SECTOR_SIZE,
+    };
+    QEMUIOVector qiov;
     int ret = 0;
 
-    ret = bdrv_read(bs, sector_num, buf, nb_sectors);
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    ret = bdrv_co_readv(bs, sector_num, nb_sectors, &qiov);
     if (ret) {
         return ret;
     }
 
-    ret = bdrv_write(base, sector_num, buf, nb_sectors);
+    /* Zeroed ranges can be written efficiently, or even left sparse */
+    if (buffer_is_zero(buf, iov.iov_len)) {
+        trace_commit_write_zeroes(base, sector_num, nb_sectors);
+        ret = bdrv_co_write_zeroes(base, sector_num, nb_sectors, 0);
+    } else {
+        ret = bdrv_co_writev(base, sector_num, nb_sectors, &qiov);
+    }
     if (ret) {
         return ret;
     }
@@ -61,6 +87,77 @@ static int coroutine_fn commit_populate(BlockDriverState *bs,
     return 0;
 }
 
+static void coroutine_fn commit_co_populate(void *opaque)
+{
+    CommitOp *op = opaque;
+    CommitBlockJob *s = op->s;
+    void *buf;
+    int ret;
+
+    buf = qemu_try_blockalign(s->top, op->nb_sectors * BDRV_SECTOR_SIZE);
+    if (buf == NULL) {
+        ret = -ENOMEM;
+    } else {
+        ret = commit_populate(s->top, s->base, op->sector_num,
+                              op->nb_sectors, buf);
+        qemu_vfree(buf);
+    }
+
+    /* Unlike streaming, commit does not pause on errors: as before the
+     * copies were parallelised, "stop" and "enospc" end the job like
+     * "report", and failed ranges are not retried.
+     */
+    if (ret < 0 &&
+        (s->on_error == BLOCKDEV_ON_ERROR_STOP ||
+         s->on_error == BLOCKDEV_ON_ERROR_REPORT ||
+         (s->on_error == BLOCKDEV_ON_ERROR_ENOSPC && ret == -ENOSPC))) {
+        if (s->ret == 0) {
+            s->ret = ret;
+        }
+    } else {
+        /* Publish progress */
+        s->common.offset += op->nb_sectors * BDRV_SECTOR_SIZE;
+    }
+
+    s->in_flight--;
+    g_free(op);
+
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+static void coroutine_fn commit_wait_for_io(CommitBlockJob *s)
+{
+    assert(!s->waiting_for_io);
+    s->waiting_for_io = true;
+    qemu_coroutine_yield();
+    s->waiting_for_io = false;
+}
+
+/* Start copying a range in the background, once a slot is free */
+static void coroutine_fn commit_submit(CommitBlockJob *s, int64_t sector_num,
+                                       int nb_sectors)
+{
+    CommitOp *op;
+    Coroutine *co;
+
+    while (s->in_flight >= COMMIT_MAX_IN_FLIGHT) {
+        commit_wait_for_io(s);
+    }
+
+    op = g_new0(CommitOp, 1);
+    *op = (CommitOp) {
+        .s          = s,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+    };
+
+    s->in_flight++;
+    co = qemu_coroutine_create(commit_co_populate);
+    qemu_coroutine_enter(co, op);
+}
+
 typedef struct {
     int ret;
 } CommitCompleteData;
@@ -104,8 +201,6 @@ static void coroutine_fn commit_run(void *opaque)
     int64_t sector_num, end;
     int ret = 0;
     int n = 0;
-    void *buf = NULL;
-    int bytes_written = 0;
     int64_t base_len;
 
     ret = s->common.len = bdrv_getlength(top);
@@ -128,7 +223,6 @@ static void coroutine_fn commit_run(void *opaque)
     }
 
     end = s->common.len >> BDRV_SECTOR_BITS;
-    buf = qemu_blockalign(top, COMMIT_BUFFER_SIZE);
 
     for (sector_num = 0; sector_num < end; sector_num += n) {
         uint64_t delay_ns = 0;
@@ -139,14 +233,21 @@ wait:
          * with no pending I/O here so that bdrv_drain_all() returns.
          */
         block_job_sleep_ns(&s->common, QEMU_CLOCK_REALTIME, delay_ns);
-        if (block_job_is_cancelled(&s->common)) {
+        if (block_job_is_cancelled(&s->common) || s->ret < 0) {
             break;
         }
-        /* Copy if allocated above the base */
+        /* Copy if allocated above the base.  Look at large ranges so that
+         * unallocated areas are skipped in one go; only the copies are split
+         * into buffers.
+         */
         ret = bdrv_is_allocated_above(top, base, sector_num,
-                                      COMMIT_BUFFER_SIZE / BDRV_SECTOR_SIZE,
+                                      MIN(end - sector_num,
+                                          BDRV_REQUEST_MAX_SECTORS),
                                       &n);
         copy = (ret == 1);
+        if (copy) {
+            n = MIN(n, COMMIT_BUFFER_SIZE / BDRV_SECTOR_SIZE);
+        }
         trace_commit_one_iteration(s, sector_num, n, ret);
         if (copy) {
             if (s->common.speed) {
@@ -155,8 +256,8 @@ wait:
                     goto wait;
                 }
             }
-            ret = commit_populate(top, base, sector_num, n, buf);
-            bytes_written += n * BDRV_SECTOR_SIZE;
+            commit_submit(s, sector_num, n);
+            continue;
         }
         if (ret < 0) {
             if (s->on_error == BLOCKDEV_ON_ERROR_STOP ||
@@ -175,7 +276,12 @@ wait:
     ret = 0;
 
 out:
-    qemu_vfree(buf);
+    while (s->in_flight > 0) {
+        commit_wait_for_io(s);
+    }
+    if (ret == 0) {
+        ret = s->ret;
+    }
 
     data = g_malloc(sizeof(*data));
     data->ret = ret;
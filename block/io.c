@@ -224,6 +224,16 @@ static bool bdrv_requests_pending(BlockDriverState *bs)
     if (!qemu_co_queue_empty(&bs->throttled_reqs[1])) {
         return true;
     }
+    if (bs->merge_batch) {
+        return true;
+    }
+    if (bs->cor_in_flight) {
+        return true;
+    }
+    if (bs->drv && bs->drv->bdrv_requests_pending &&
+        bs->drv->bdrv_requests_pending(bs)) {
+        return true;
+    }
     if (bs->file && bdrv_requests_pending(bs->file)) {
         return true;
     }
@@ -323,6 +333,29 @@ void bdrv_drain_all(void)
     g_slist_free(aio_ctxs);
 }
 
+/*
+ * The overlap ranges of tracked requests are also kept in an interval tree,
+ * so that wait_serialising_requests() does not have to walk all the requests
+ * in flight.  Empty ranges never overlap and are not indexed.
+ */
+static void tracked_request_index(BdrvTrackedRequest *req)
+{
+    if (req->overlap_bytes) {
+        req->overlap_node.start = req->overlap_offset;
+        req->overlap_node.last = req->overlap_offset + req->overlap_bytes - 1;
+        interval_tree_insert(&req->overlap_node,
+                             &req->bs->tracked_requests_tree);
+    }
+}
+
+static void tracked_request_unindex(BdrvTrackedRequest *req)
+{
+    if (req->overlap_bytes) {
+        interval_tree_remove(&req->overlap_node,
+                             &req->bs->tracked_requests_tree);
+    }
+}
+
 /**
  * Remove an active request from the tracked requests list
  *
@@ -334,6 +367,7 @@ static void tracked_request_end(BdrvTrackedRequest *req)
         req->bs->serialising_in_flight--;
     }
 
+    tracked_request_unindex(req);
     QLIST_REMOVE(req, list);
     qemu_co_queue_restart_all(&req->wait_queue);
 }
@@ -360,9 +394,10 @@ static void tracked_request_begin(BdrvTrackedRequest *req,
     qemu_co_queue_init(&req->wait_queue);
 
     QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
+    tracked_request_index(req);
 }
 
-static void mark_request_serialising(BdrvTrackedRequest *req, uint64_t align)
+void bdrv_mark_request_serialising(BdrvTrackedRequest *req, uint64_t align)
 {
     int64_t overlap_offset = req->offset & ~(align - 1);
     unsigned int overlap_bytes = ROUND_UP(req->offset + req->bytes, align)
@@ -373,8 +408,15 @@ static void mark_request_serialising(BdrvTrackedRequest *req, uint64_t align)
         req->serialising = true;
     }
 
-    req->overlap_offset = MIN(req->overlap_offset, overlap_offset);
-    req->overlap_bytes = MAX(req->overlap_bytes, overlap_bytes);
+    overlap_offset = MIN(req->overlap_offset, overlap_offset);
+    overlap_bytes = MAX(req->overlap_bytes, overlap_bytes);
+    if (overlap_offset != req->overlap_offset ||
+        overlap_bytes != req->overlap_bytes) {
+        tracked_request_unindex(req);
+        req->overlap_offset = overlap_offset;
+        req->overlap_bytes = overlap_bytes;
+        tracked_request_index(req);
+    }
 }
 
 /**
@@ -411,57 +453,48 @@ static int bdrv_get_cluster_size(BlockDriverState *bs)
     }
 }
 
-static bool tracked_request_overlaps(BdrvTrackedRequest *req,
-                                     int64_t offset, unsigned int bytes)
-{
-    /*        aaaa   bbbb */
-    if (offset >= req->overlap_offset + req->overlap_bytes) {
-        return false;
-    }
-    /* bbbb   aaaa        */
-    if (req->overlap_offset >= offset + bytes) {
-        return false;
-    }
-    return true;
-}
-
 static bool coroutine_fn wait_serialising_requests(BdrvTrackedRequest *self)
 {
     BlockDriverState *bs = self->bs;
     BdrvTrackedRequest *req;
+    IntervalTreeNode *node;
+    uint64_t start, last;
     bool retry;
     bool waited = false;
 
-    if (!bs->serialising_in_flight) {
+    if (!bs->serialising_in_flight || !self->overlap_bytes) {
         return false;
     }
 
     do {
         retry = false;
-        QLIST_FOREACH(req, &bs->tracked_requests, list) {
+        /* The range may have been widened while we were waiting */
+        start = self->overlap_offset;
+        last = self->overlap_offset + self->overlap_bytes - 1;
+        for (node = interval_tree_iter_first(&bs->tracked_requests_tree,
+                                             start, last);
+             node; node = interval_tree_iter_next(node, start, last)) {
+            req = container_of(node, BdrvTrackedRequest, overlap_node);
             if (req == self || (!req->serialising && !self->serialising)) {
                 continue;
             }
-            if (tracked_request_overlaps(req, self->overlap_offset,
-                                         self->overlap_bytes))
-            {
-                /* Hitting this means there was a reentrant request, for
-                 * example, a block driver issuing nested requests.  This must
-                 * never happen since it means deadlock.
-                 */
-                assert(qemu_coroutine_self() != req->co);
-
-                /* If the request is already (indirectly) waiting for us, or
-                 * will wait for us as soon as it wakes up, then just go on
-                 * (instead of producing a deadlock in the former case). */
-                if (!req->waiting_for) {
-                    self->waiting_for = req;
-                    qemu_co_queue_wait(&req->wait_queue);
-                    self->waiting_for = NULL;
-                    retry = true;
-                    waited = true;
-                    break;
-                }
+
+            /* Hitting this means there was a reentrant request, for
+             * example, a block driver issuing nested requests.  This must
+             * never happen since it means deadlock.
+             */
+            assert(qemu_coroutine_self() != req->co);
+
+            /* If the request is already (indirectly) waiting for us, or
+             * will wait for us as soon as it wakes up, then just go on
+             * (instead of producing a deadlock in the former case). */
+            if (!req->waiting_for) {
+                self->waiting_for = req;
+                qemu_co_queue_wait(&req->wait_queue);
+                self->waiting_for = NULL;
+                retry = true;
+                waited = true;
+                break;
             }
         }
     } while (retry);
@@ -744,6 +777,29 @@ int bdrv_pwrite_sync(BlockDriverState *bs, int64_t offset,
     return 0;
 }
 
+/* Write data that was read from the backing file into the image */
+static int coroutine_fn bdrv_co_do_cor_write(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, void *buf)
+{
+    BlockDriver *drv = bs->drv;
+    QEMUIOVector qiov;
+    struct iovec iov = {
+        .iov_base   = buf,
+        .iov_len    = nb_sectors * BDRV_SECTOR_SIZE,
+    };
+
+    if (drv->bdrv_co_write_zeroes && buffer_is_zero(buf, iov.iov_len)) {
+        return bdrv_co_do_write_zeroes(bs, sector_num, nb_sectors, 0);
+    }
+
+    /* This does not change the data on the disk, it is not necessary
+     * to flush even in cache=writethrough mode.
+     */
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    return drv->bdrv_co_writev(bs, sector_num, nb_sectors, &qiov);
+}
+
+/* If @qiov is NULL, only copy the clusters without returning the data */
 static int coroutine_fn bdrv_co_do_copy_on_readv(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
 {
@@ -786,18 +842,8 @@ static int coroutine_fn bdrv_co_do_copy_on_readv(BlockDriverState *bs,
         goto err;
     }
 
-    if (drv->bdrv_co_write_zeroes &&
-        buffer_is_zero(bounce_buffer, iov.iov_len)) {
-        ret = bdrv_co_do_write_zeroes(bs, cluster_sector_num,
-                                      cluster_nb_sectors, 0);
-    } else {
-        /* This does not change the data on the disk, it is not necessary
-         * to flush even in cache=writethrough mode.
-         */
-        ret = drv->bdrv_co_writev(bs, cluster_sector_num, cluster_nb_sectors,
-                                  &bounce_qiov);
-    }
-
+    ret = bdrv_co_do_cor_write(bs, cluster_sector_num, cluster_nb_sectors,
+                               bounce_buffer);
     if (ret < 0) {
         /* It might be okay to ignore write errors for guest requests.  If this
          * is a deliberate copy-on-read then we don't want to ignore the error.
@@ -806,15 +852,195 @@ static int coroutine_fn bdrv_co_do_copy_on_readv(BlockDriverState *bs,
         goto err;
     }
 
-    skip_bytes = (sector_num - cluster_sector_num) * BDRV_SECTOR_SIZE;
-    qemu_iovec_from_buf(qiov, 0, bounce_buffer + skip_bytes,
-                        nb_sectors * BDRV_SECTOR_SIZE);
+    if (qiov) {
+        skip_bytes = (sector_num - cluster_sector_num) * BDRV_SECTOR_SIZE;
+        qemu_iovec_from_buf(qiov, 0, bounce_buffer + skip_bytes,
+                            nb_sectors * BDRV_SECTOR_SIZE);
+    }
 
 err:
     qemu_vfree(bounce_buffer);
     return ret;
 }
 
+/*
+ * Background copy-on-read
+ *
+ * The guest read is served from a cluster-aligned bounce buffer like with
+ * synchronous copy-on-read, but completes as soon as the data is available.
+ * The buffer is then handed to a coroutine that writes it to the image,
+ * together with some prefetched clusters if the guest reads sequentially.
+ */
+typedef struct BdrvCorPopulate {
+    BlockDriverState *bs;
+    QEMUBH *bh;
+    int64_t sector_num;
+    int nb_sectors;
+    void *buf;
+    int prefetch_nb_sectors;
+} BdrvCorPopulate;
+
+/* Beyond this, reads just go to the backing file without copying */
+#define BDRV_COR_MAX_IN_FLIGHT      16
+
+/* Prefetched clusters are copied in chunks of this size */
+#define BDRV_COR_PREFETCH_SECTORS   2048
+
+/* Copy the unallocated parts of a range from the backing file into the image.
+ * If @buf is not NULL, it already contains the data of the whole range.
+ */
+static int coroutine_fn bdrv_co_cor_populate(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, void *buf)
+{
+    int64_t start = sector_num;
+    int pnum;
+    int ret;
+
+    while (nb_sectors > 0) {
+        ret = bdrv_is_allocated(bs, sector_num,
+                                MIN(nb_sectors, BDRV_COR_PREFETCH_SECTORS),
+                                &pnum);
+        if (ret < 0) {
+            return ret;
+        }
+        if (pnum == 0) {
+            break;
+        }
+
+        if (!ret) {
+            if (buf) {
+                ret = bdrv_co_do_cor_write(bs, sector_num, pnum,
+                    buf + (sector_num - start) * BDRV_SECTOR_SIZE);
+            } else {
+                ret = bdrv_co_do_copy_on_readv(bs, sector_num, pnum, NULL);
+            }
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        sector_num += pnum;
+        nb_sectors -= pnum;
+    }
+
+    return 0;
+}
+
+static void coroutine_fn bdrv_co_cor_populate_entry(void *opaque)
+{
+    BdrvCorPopulate *p = opaque;
+    BlockDriverState *bs = p->bs;
+    BdrvTrackedRequest req;
+    int nb_sectors = p->nb_sectors + p->prefetch_nb_sectors;
+    int ret;
+
+    /* As for synchronous copy-on-read, no guest write may slip in between
+     * checking the allocation status and writing the clusters.  The guest
+     * read that produced the data has already completed, so this only waits
+     * for other requests that touch the same clusters.
+     */
+    tracked_request_begin(&req, bs, p->sector_num << BDRV_SECTOR_BITS,
+                          nb_sectors << BDRV_SECTOR_BITS, false);
+    bdrv_mark_request_serialising(&req, bdrv_get_cluster_size(bs));
+    wait_serialising_requests(&req);
+
+    ret = bdrv_co_cor_populate(bs, p->sector_num, p->nb_sectors, p->buf);
+    if (ret >= 0 && p->prefetch_nb_sectors) {
+        ret = bdrv_co_cor_populate(bs, p->sector_num + p->nb_sectors,
+                                   p->prefetch_nb_sectors, NULL);
+    }
+
+    /* The guest already has its data, so errors only mean that the clusters
+     * will be read from the backing file again next time */
+    trace_bdrv_co_cor_populate_done(bs, p->sector_num, nb_sectors, ret);
+
+    tracked_request_end(&req);
+    bs->cor_in_flight--;
+    qemu_vfree(p->buf);
+    g_free(p);
+}
+
+static void bdrv_cor_populate_bh(void *opaque)
+{
+    BdrvCorPopulate *p = opaque;
+    Coroutine *co;
+
+    qemu_bh_delete(p->bh);
+    co = qemu_coroutine_create(bdrv_co_cor_populate_entry);
+    qemu_coroutine_enter(co, p);
+}
+
+static int coroutine_fn bdrv_co_cor_background_readv(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    BlockDriver *drv = bs->drv;
+    BdrvCorPopulate *p;
+    void *bounce_buffer;
+    struct iovec iov;
+    QEMUIOVector bounce_qiov;
+    int64_t cluster_sector_num;
+    int cluster_nb_sectors;
+    int64_t total_sectors, end;
+    bool sequential;
+    int ret;
+
+    sequential = sector_num == bs->cor_next_sector;
+    bs->cor_next_sector = sector_num + nb_sectors;
+
+    bdrv_round_to_clusters(bs, sector_num, nb_sectors,
+                           &cluster_sector_num, &cluster_nb_sectors);
+
+    trace_bdrv_co_do_copy_on_readv(bs, sector_num, nb_sectors,
+                                   cluster_sector_num, cluster_nb_sectors);
+
+    iov.iov_len = cluster_nb_sectors * BDRV_SECTOR_SIZE;
+    iov.iov_base = bounce_buffer = qemu_try_blockalign(bs, iov.iov_len);
+    if (bounce_buffer == NULL) {
+        return -ENOMEM;
+    }
+
+    qemu_iovec_init_external(&bounce_qiov, &iov, 1);
+
+    ret = drv->bdrv_co_readv(bs, cluster_sector_num, cluster_nb_sectors,
+                             &bounce_qiov);
+    if (ret < 0) {
+        qemu_vfree(bounce_buffer);
+        return ret;
+    }
+
+    qemu_iovec_from_buf(qiov, 0, bounce_buffer +
+                        (sector_num - cluster_sector_num) * BDRV_SECTOR_SIZE,
+                        nb_sectors * BDRV_SECTOR_SIZE);
+
+    p = g_new0(BdrvCorPopulate, 1);
+    *p = (BdrvCorPopulate) {
+        .bs         = bs,
+        .sector_num = cluster_sector_num,
+        .nb_sectors = cluster_nb_sectors,
+        .buf        = bounce_buffer,
+    };
+
+    end = cluster_sector_num + cluster_nb_sectors;
+    total_sectors = bdrv_nb_sectors(bs);
+    if (sequential && bs->cor_prefetch && total_sectors > end) {
+        int64_t prefetch = (int64_t)bs->cor_prefetch *
+                           (bdrv_get_cluster_size(bs) >> BDRV_SECTOR_BITS);
+
+        prefetch = MIN(prefetch, total_sectors - end);
+        prefetch = MIN(prefetch, BDRV_REQUEST_MAX_SECTORS - cluster_nb_sectors);
+        p->prefetch_nb_sectors = MAX(prefetch, 0);
+    }
+
+    trace_bdrv_co_cor_populate(bs, p->sector_num, p->nb_sectors,
+                               p->prefetch_nb_sectors);
+
+    bs->cor_in_flight++;
+    p->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_cor_populate_bh, p);
+    qemu_bh_schedule(p->bh);
+
+    return 0;
+}
+
 /*
  * Forwards an already correctly aligned request to the BlockDriver. This
  * handles copy on read and zeroing after EOF; any other features must be
@@ -841,7 +1067,7 @@ static int coroutine_fn bdrv_aligned_preadv(BlockDriverState *bs,
          * with each other for the same cluster.  For example, in copy-on-read
          * it ensures that the CoR read and write operations are atomic and
          * guest writes cannot interleave between them. */
-        mark_request_serialising(req, bdrv_get_cluster_size(bs));
+        bdrv_mark_request_serialising(req, bdrv_get_cluster_size(bs));
     }
 
     wait_serialising_requests(req);
@@ -860,6 +1086,22 @@ static int coroutine_fn bdrv_aligned_preadv(BlockDriverState *bs,
         }
     }
 
+    if ((flags & BDRV_REQ_COR_BACKGROUND) &&
+        bs->cor_in_flight < BDRV_COR_MAX_IN_FLIGHT) {
+        int pnum;
+
+        ret = bdrv_is_allocated(bs, sector_num, nb_sectors, &pnum);
+        if (ret < 0) {
+            goto out;
+        }
+
+        if (!ret || pnum != nb_sectors) {
+            ret = bdrv_co_cor_background_readv(bs, sector_num, nb_sectors,
+                                               qiov);
+            goto out;
+        }
+    }
+
     /* Forward the request to the BlockDriver */
     if (!bs->zero_beyond_eof) {
         ret = drv->bdrv_co_readv(bs, sector_num, nb_sectors, qiov);
@@ -905,6 +1147,165 @@ out:
     return ret;
 }
 
+/*
+ * Request merging
+ *
+ * When bs->merge_requests is set, a plain read or write waits for a short
+ * window before it is submitted: bs->merge_window_ns, or until the event loop
+ * runs bottom halves if that is zero.  Requests in the same direction that
+ * are adjacent to the waiting batch join it, and the whole batch is then
+ * submitted as one request with a concatenated I/O vector.
+ */
+typedef struct BdrvMergeReq {
+    int64_t offset;
+    unsigned int bytes;
+    QEMUIOVector *qiov;
+    int ret;
+    QTAILQ_ENTRY(BdrvMergeReq) next;
+} BdrvMergeReq;
+
+struct BdrvMergeBatch {
+    bool is_write;
+    int64_t offset;
+    unsigned int bytes;
+    int niov;
+    int nb_reqs;
+    Coroutine *co;          /* first request, which submits the batch */
+    CoQueue waiters;        /* other requests in the batch */
+    QTAILQ_HEAD(, BdrvMergeReq) reqs;   /* sorted by offset */
+};
+
+static void bdrv_merge_batch_cb(void *opaque)
+{
+    BdrvMergeBatch *batch = opaque;
+
+    qemu_coroutine_enter(batch->co, NULL);
+}
+
+static bool bdrv_merge_batch_add(BlockDriverState *bs, BdrvMergeBatch *batch,
+                                 BdrvMergeReq *req, bool is_write)
+{
+    int max_sectors = MIN_NON_ZERO(bs->bl.max_transfer_length,
+                                   BDRV_REQUEST_MAX_SECTORS);
+
+    if (batch->is_write != is_write ||
+        batch->niov + req->qiov->niov > IOV_MAX ||
+        ((uint64_t)batch->bytes + req->bytes) >> BDRV_SECTOR_BITS >
+        max_sectors) {
+        return false;
+    }
+
+    if (req->offset == batch->offset + batch->bytes) {
+        QTAILQ_INSERT_TAIL(&batch->reqs, req, next);
+    } else if (req->offset + req->bytes == batch->offset) {
+        QTAILQ_INSERT_HEAD(&batch->reqs, req, next);
+        batch->offset = req->offset;
+    } else {
+        return false;
+    }
+
+    batch->bytes += req->bytes;
+    batch->niov += req->qiov->niov;
+    batch->nb_reqs++;
+    return true;
+}
+
+static int coroutine_fn bdrv_co_merge_request(BlockDriverState *bs,
+    int64_t offset, unsigned int bytes, QEMUIOVector *qiov, bool is_write)
+{
+    AioContext *aio_context = bdrv_get_aio_context(bs);
+    BdrvMergeReq req = {
+        .offset = offset,
+        .bytes  = bytes,
+        .qiov   = qiov,
+    };
+    BdrvMergeReq *r;
+    BdrvMergeBatch batch;
+    QEMUIOVector merged_qiov;
+    QEMUTimer *timer = NULL;
+    QEMUBH *bh = NULL;
+    int ret;
+
+    if (bs->merge_batch) {
+        if (bdrv_merge_batch_add(bs, bs->merge_batch, &req, is_write)) {
+            qemu_co_queue_wait(&bs->merge_batch->waiters);
+            return req.ret;
+        }
+        /* Do not delay requests that cannot be merged */
+        goto submit;
+    }
+
+    batch = (BdrvMergeBatch) {
+        .is_write   = is_write,
+        .offset     = offset,
+        .bytes      = bytes,
+        .niov       = qiov->niov,
+        .nb_reqs    = 1,
+        .co         = qemu_coroutine_self(),
+    };
+    qemu_co_queue_init(&batch.waiters);
+    QTAILQ_INIT(&batch.reqs);
+    QTAILQ_INSERT_TAIL(&batch.reqs, &req, next);
+    bs->merge_batch = &batch;
+
+    if (bs->merge_window_ns) {
+        timer = aio_timer_new(aio_context, QEMU_CLOCK_REALTIME, SCALE_NS,
+                              bdrv_merge_batch_cb, &batch);
+        timer_mod(timer, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                         bs->merge_window_ns);
+    } else {
+        bh = aio_bh_new(aio_context, bdrv_merge_batch_cb, &batch);
+        qemu_bh_schedule(bh);
+    }
+
+    qemu_coroutine_yield();
+
+    if (timer) {
+        timer_del(timer);
+        timer_free(timer);
+    } else {
+        qemu_bh_delete(bh);
+    }
+    assert(bs->merge_batch == &batch);
+    bs->merge_batch = NULL;
+
+    if (batch.nb_reqs == 1) {
+        goto submit;
+    }
+
+    trace_bdrv_co_merge_request(bs, batch.offset, batch.bytes, batch.nb_reqs);
+    block_acct_merge_done(&bs->stats,
+                          is_write ? BLOCK_ACCT_WRITE : BLOCK_ACCT_READ,
+                          batch.nb_reqs - 1);
+
+    qemu_iovec_init(&merged_qiov, batch.niov);
+    QTAILQ_FOREACH(r, &batch.reqs, next) {
+        qemu_iovec_concat(&merged_qiov, r->qiov, 0, r->bytes);
+    }
+
+    if (is_write) {
+        ret = bdrv_co_do_pwritev(bs, batch.offset, batch.bytes, &merged_qiov,
+                                 BDRV_REQ_NO_MERGE);
+    } else {
+        ret = bdrv_co_do_preadv(bs, batch.offset, batch.bytes, &merged_qiov,
+                                BDRV_REQ_NO_MERGE);
+    }
+    qemu_iovec_destroy(&merged_qiov);
+
+    QTAILQ_FOREACH(r, &batch.reqs, next) {
+        r->ret = ret;
+    }
+    qemu_co_queue_restart_all(&batch.waiters);
+    return ret;
+
+submit:
+    if (is_write) {
+        return bdrv_co_do_pwritev(bs, offset, bytes, qiov, BDRV_REQ_NO_MERGE);
+    } else {
+        return bdrv_co_do_preadv(bs, offset, bytes, qiov, BDRV_REQ_NO_MERGE);
+    }
+}
+
 /*
  * Handle a read request in coroutine context
  */
@@ -932,9 +1333,15 @@ static int coroutine_fn bdrv_co_do_preadv(BlockDriverState *bs,
         return ret;
     }
 
-    if (bs->copy_on_read) {
-        flags |= BDRV_REQ_COPY_ON_READ;
+    if (bs->copy_on_read && !(flags & BDRV_REQ_COPY_ON_READ)) {
+        flags |= bs->cor_background ? BDRV_REQ_COR_BACKGROUND
+                                    : BDRV_REQ_COPY_ON_READ;
+    }
+
+    if (bs->merge_requests && !flags) {
+        return bdrv_co_merge_request(bs, offset, bytes, qiov, false);
     }
+    flags &= ~BDRV_REQ_NO_MERGE;
 
     /* throttling disk I/O */
     if (bs->io_limits_enabled) {
@@ -1113,6 +1520,10 @@ static int coroutine_fn bdrv_aligned_pwritev(BlockDriverState *bs,
     assert(req->overlap_offset <= offset);
     assert(offset + bytes <= req->overlap_offset + req->overlap_bytes);
 
+    req->write_offset = offset;
+    req->write_bytes = bytes;
+    req->qiov = qiov;
+    req->flags = flags;
     ret = notifier_with_return_list_notify(&bs->before_write_notifiers, req);
 
     if (!ret && bs->detect_zeroes != BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF &&
@@ -1180,7 +1591,7 @@ static int coroutine_fn bdrv_co_do_zero_pwritev(BlockDriverState *bs,
         uint64_t zero_bytes = MIN(bytes, align - head_padding_bytes);
 
         /* RMW the unaligned part before head. */
-        mark_request_serialising(req, align);
+        bdrv_mark_request_serialising(req, align);
         wait_serialising_requests(req);
         BLKDBG_EVENT(bs, BLKDBG_PWRITEV_RMW_HEAD);
         ret = bdrv_aligned_preadv(bs, req, offset & ~(align - 1), align,
@@ -1218,7 +1629,7 @@ static int coroutine_fn bdrv_co_do_zero_pwritev(BlockDriverState *bs,
     if (bytes) {
         assert(align == tail_padding_bytes + bytes);
         /* RMW the unaligned part after tail. */
-        mark_request_serialising(req, align);
+        bdrv_mark_request_serialising(req, align);
         wait_serialising_requests(req);
         BLKDBG_EVENT(bs, BLKDBG_PWRITEV_RMW_TAIL);
         ret = bdrv_aligned_preadv(bs, req, offset, align,
@@ -1266,6 +1677,11 @@ static int coroutine_fn bdrv_co_do_pwritev(BlockDriverState *bs,
         return ret;
     }
 
+    if (bs->merge_requests && !flags && qiov) {
+        return bdrv_co_merge_request(bs, offset, bytes, qiov, true);
+    }
+    flags &= ~BDRV_REQ_NO_MERGE;
+
     /* throttling disk I/O */
     if (bs->io_limits_enabled) {
         throttle_group_co_io_limits_intercept(bs, bytes, true);
@@ -1287,7 +1703,7 @@ static int coroutine_fn bdrv_co_do_pwritev(BlockDriverState *bs,
         QEMUIOVector head_qiov;
         struct iovec head_iov;
 
-        mark_request_serialising(&req, align);
+        bdrv_mark_request_serialising(&req, align);
         wait_serialising_requests(&req);
 
         head_buf = qemu_blockalign(bs, align);
@@ -1320,7 +1736,7 @@ static int coroutine_fn bdrv_co_do_pwritev(BlockDriverState *bs,
         size_t tail_bytes;
         bool waited;
 
-        mark_request_serialising(&req, align);
+        bdrv_mark_request_serialising(&req, align);
         waited = wait_serialising_requests(&req);
         assert(!waited || !use_local_qiov);
 
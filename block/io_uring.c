@@ -0,0 +1,363 @@
+/*
+ * Linux io_uring support.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "qemu/queue.h"
+#include "block/raw-aio.h"
+
+#include <liburing.h>
+
+/*
+ * Ring size (per-device).  This is also the maximum number of requests that
+ * are in flight in the kernel, so that the completion ring cannot overflow;
+ * further requests wait in the pending queue.
+ */
+#define MAX_ENTRIES 128
+
+/* Delay before retrying a submission that failed with nothing in flight */
+#define RETRY_DELAY_MS 1
+
+struct qemu_luringcb {
+    BlockAIOCB common;
+    struct qemu_luring_state *ctx;
+    int fd;
+    int type;
+    off_t offset;
+    ssize_t ret;
+    size_t nbytes;
+    QEMUIOVector *qiov;
+
+    /* Short reads are resubmitted for the remaining part of qiov */
+    size_t total_read;
+    QEMUIOVector resubmit_qiov;
+
+    QSIMPLEQ_ENTRY(qemu_luringcb) next;
+};
+
+typedef struct {
+    int plugged;
+    unsigned int in_flight;     /* submitted to the kernel, not completed */
+    QSIMPLEQ_HEAD(, qemu_luringcb) pending;
+} LuringQueue;
+
+struct qemu_luring_state {
+    struct io_uring ring;
+
+    /* File registered with the ring as fixed file 0, or -1 */
+    int registered_fd;
+
+    /* io queue for submit at batch */
+    LuringQueue io_q;
+
+    /* Retries the submission if the kernel refused it while no completion
+     * would trigger another attempt */
+    QEMUTimer *retry_timer;
+};
+
+static void ioq_submit(struct qemu_luring_state *s);
+
+static void luring_resubmit_short_read(struct qemu_luring_state *s,
+                                       struct qemu_luringcb *luringcb)
+{
+    QEMUIOVector *resubmit_qiov = &luringcb->resubmit_qiov;
+
+    if (!resubmit_qiov->iov) {
+        qemu_iovec_init(resubmit_qiov, luringcb->qiov->niov);
+    } else {
+        qemu_iovec_reset(resubmit_qiov);
+    }
+    qemu_iovec_concat(resubmit_qiov, luringcb->qiov, luringcb->total_read,
+                      luringcb->nbytes - luringcb->total_read);
+
+    QSIMPLEQ_INSERT_HEAD(&s->io_q.pending, luringcb, next);
+}
+
+/*
+ * Completes an io_uring request (calls the callback and frees the ACB).
+ */
+static void qemu_luring_process_completion(struct qemu_luring_state *s,
+                                           struct qemu_luringcb *luringcb)
+{
+    ssize_t ret = luringcb->ret;
+
+    if (ret >= 0 && luringcb->type == QEMU_AIO_READ) {
+        /* Buffered reads can be short even before EOF; retry the rest */
+        luringcb->total_read += ret;
+        if (ret > 0 && luringcb->total_read < luringcb->nbytes) {
+            luring_resubmit_short_read(s, luringcb);
+            return;
+        }
+        ret = luringcb->total_read;
+    }
+
+    if (ret == luringcb->nbytes) {
+        ret = 0;
+    } else if (ret >= 0) {
+        /* Short reads mean EOF, pad with zeros. */
+        if (luringcb->type == QEMU_AIO_READ) {
+            qemu_iovec_memset(luringcb->qiov, ret, 0,
+                              luringcb->qiov->size - ret);
+            ret = 0;
+        } else {
+            ret = -EINVAL;
+        }
+    }
+
+    if (luringcb->resubmit_qiov.iov) {
+        qemu_iovec_destroy(&luringcb->resubmit_qiov);
+    }
+    luringcb->common.cb(luringcb->common.opaque, ret);
+
+    qemu_aio_unref(luringcb);
+}
+
+/* The ring file descriptor becomes readable when there are completions.
+ * Each completion is consumed before its callback is invoked, so that nested
+ * event loops (for example when a request callback invokes aio_poll()) only
+ * see the ones that are still pending.
+ */
+static void qemu_luring_completion_cb(void *opaque)
+{
+    struct qemu_luring_state *s = opaque;
+    struct io_uring_cqe *cqe;
+
+    while (io_uring_peek_cqe(&s->ring, &cqe) == 0) {
+        struct qemu_luringcb *luringcb = io_uring_cqe_get_data(cqe);
+
+        luringcb->ret = cqe->res;
+        io_uring_cqe_seen(&s->ring, cqe);
+        s->io_q.in_flight--;
+
+        qemu_luring_process_completion(s, luringcb);
+    }
+
+    if (!s->io_q.plugged) {
+        ioq_submit(s);
+    }
+}
+
+static const AIOCBInfo luring_aiocb_info = {
+    .aiocb_size         = sizeof(struct qemu_luringcb),
+};
+
+static void ioq_init(LuringQueue *io_q)
+{
+    QSIMPLEQ_INIT(&io_q->pending);
+    io_q->plugged = 0;
+    io_q->in_flight = 0;
+}
+
+static void luring_prep_sqe(struct qemu_luring_state *s,
+                            struct io_uring_sqe *sqe,
+                            struct qemu_luringcb *luringcb)
+{
+    QEMUIOVector *qiov = luringcb->qiov;
+    off_t offset = luringcb->offset;
+    bool fixed = (luringcb->fd == s->registered_fd);
+    int fd = fixed ? 0 : luringcb->fd;
+
+    if (luringcb->total_read) {
+        qiov = &luringcb->resubmit_qiov;
+        offset += luringcb->total_read;
+    }
+
+    switch (luringcb->type) {
+    case QEMU_AIO_WRITE:
+        io_uring_prep_writev(sqe, fd, qiov->iov, qiov->niov, offset);
+        break;
+    case QEMU_AIO_READ:
+        io_uring_prep_readv(sqe, fd, qiov->iov, qiov->niov, offset);
+        break;
+    case QEMU_AIO_FLUSH:
+        io_uring_prep_fsync(sqe, fd, IORING_FSYNC_DATASYNC);
+        break;
+    default:
+        abort();
+    }
+
+    if (fixed) {
+        io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+    }
+    io_uring_sqe_set_data(sqe, luringcb);
+}
+
+static void ioq_submit(struct qemu_luring_state *s)
+{
+    struct qemu_luringcb *luringcb;
+    struct io_uring_sqe *sqe;
+    int ret;
+
+    /* Entries that are in the ring, but not yet consumed by the kernel,
+     * count against the limit as well */
+    while (s->io_q.in_flight + io_uring_sq_ready(&s->ring) < MAX_ENTRIES &&
+           !QSIMPLEQ_EMPTY(&s->io_q.pending)) {
+        sqe = io_uring_get_sqe(&s->ring);
+        if (!sqe) {
+            break;
+        }
+        luringcb = QSIMPLEQ_FIRST(&s->io_q.pending);
+        QSIMPLEQ_REMOVE_HEAD(&s->io_q.pending, next);
+        luring_prep_sqe(s, sqe, luringcb);
+    }
+
+    if (!io_uring_sq_ready(&s->ring)) {
+        return;
+    }
+
+    /* A single system call submits the whole batch; with SQ polling it is
+     * only needed to wake up the kernel thread.  Entries that could not be
+     * submitted stay in the ring and are submitted on the next completion.
+     */
+    do {
+        ret = io_uring_submit(&s->ring);
+    } while (ret == -EINTR);
+    if (ret < 0 && ret != -EAGAIN && ret != -EBUSY) {
+        abort();
+    }
+    if (ret > 0) {
+        s->io_q.in_flight += ret;
+    }
+
+    /* Without requests in flight there is no completion to wait for */
+    if (io_uring_sq_ready(&s->ring) && s->io_q.in_flight == 0 &&
+        s->retry_timer) {
+        timer_mod(s->retry_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + RETRY_DELAY_MS);
+    }
+}
+
+static void luring_retry_cb(void *opaque)
+{
+    struct qemu_luring_state *s = opaque;
+
+    ioq_submit(s);
+}
+
+void luring_io_plug(BlockDriverState *bs, void *aio_ctx)
+{
+    struct qemu_luring_state *s = aio_ctx;
+
+    s->io_q.plugged++;
+}
+
+void luring_io_unplug(BlockDriverState *bs, void *aio_ctx, bool unplug)
+{
+    struct qemu_luring_state *s = aio_ctx;
+
+    assert(s->io_q.plugged > 0 || !unplug);
+
+    if (unplug && --s->io_q.plugged > 0) {
+        return;
+    }
+
+    ioq_submit(s);
+}
+
+BlockAIOCB *luring_submit(BlockDriverState *bs, void *aio_ctx, int fd,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockCompletionFunc *cb, void *opaque, int type)
+{
+    struct qemu_luring_state *s = aio_ctx;
+    struct qemu_luringcb *luringcb;
+
+    switch (type) {
+    case QEMU_AIO_WRITE:
+    case QEMU_AIO_READ:
+    case QEMU_AIO_FLUSH:
+        break;
+    default:
+        fprintf(stderr, "%s: invalid AIO request type 0x%x.\n",
+                        __func__, type);
+        return NULL;
+    }
+
+    luringcb = qemu_aio_get(&luring_aiocb_info, bs, cb, opaque);
+    luringcb->ctx = s;
+    luringcb->fd = fd;
+    luringcb->type = type;
+    luringcb->offset = sector_num * 512;
+    luringcb->ret = -EINPROGRESS;
+    luringcb->nbytes = nb_sectors * 512;
+    luringcb->qiov = qiov;
+    luringcb->total_read = 0;
+    memset(&luringcb->resubmit_qiov, 0, sizeof(luringcb->resubmit_qiov));
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.pending, luringcb, next);
+    if (!s->io_q.plugged ||
+        io_uring_sq_space_left(&s->ring) == 0) {
+        ioq_submit(s);
+    }
+    return &luringcb->common;
+}
+
+/* Register @fd with the ring, so that requests for it do not have to look
+ * up the file on every submission.  Failure is not fatal, requests then use
+ * @fd directly.
+ */
+void luring_register_fd(void *s_, int fd)
+{
+    struct qemu_luring_state *s = s_;
+
+    if (s->registered_fd == fd) {
+        return;
+    }
+    if (s->registered_fd != -1) {
+        io_uring_unregister_files(&s->ring);
+        s->registered_fd = -1;
+    }
+    if (io_uring_register_files(&s->ring, &fd, 1) == 0) {
+        s->registered_fd = fd;
+    }
+}
+
+void luring_detach_aio_context(void *s_, AioContext *old_context)
+{
+    struct qemu_luring_state *s = s_;
+
+    aio_set_fd_handler(old_context, s->ring.ring_fd, NULL, NULL, NULL);
+    timer_del(s->retry_timer);
+    timer_free(s->retry_timer);
+    s->retry_timer = NULL;
+}
+
+void luring_attach_aio_context(void *s_, AioContext *new_context)
+{
+    struct qemu_luring_state *s = s_;
+
+    aio_set_fd_handler(new_context, s->ring.ring_fd,
+                       qemu_luring_completion_cb, NULL, s);
+    s->retry_timer = aio_timer_new(new_context, QEMU_CLOCK_REALTIME, SCALE_MS,
+                                   luring_retry_cb, s);
+}
+
+void *luring_init(bool sqpoll)
+{
+    struct qemu_luring_state *s;
+    int ret;
+
+    s = g_malloc0(sizeof(*s));
+    ret = io_uring_queue_init(MAX_ENTRIES, &s->ring,
+                              sqpoll ? IORING_SETUP_SQPOLL : 0);
+    if (ret < 0) {
+        g_free(s);
+        errno = -ret;
+        return NULL;
+    }
+
+    s->registered_fd = -1;
+    ioq_init(&s->io_q);
+
+    return s;
+}
+
+void luring_cleanup(void *s_)
+{
+    struct qemu_luring_state *s = s_;
+
+    io_uring_queue_exit(&s->ring);
+    g_free(s);
+}
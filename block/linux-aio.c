@@ -12,6 +12,7 @@
 #include "qemu/queue.h"
 #include "block/raw-aio.h"
 #include "qemu/event_notifier.h"
+#include "qemu/atomic.h"
 
 #include <libaio.h>
 
@@ -27,6 +28,23 @@
 
 #define MAX_QUEUED_IO  128
 
+/* Header of the completion ring that the kernel maps at the address
+ * returned by io_setup().  Userspace can peek at it to find out whether
+ * completions are pending without a system call.
+ */
+struct aio_ring {
+    unsigned id;
+    unsigned nr;
+    unsigned head;
+    unsigned tail;
+    unsigned magic;
+    unsigned compat_features;
+    unsigned incompat_features;
+    unsigned header_length;
+};
+
+#define AIO_RING_MAGIC 0xa10a10a1
+
 struct qemu_laiocb {
     BlockAIOCB common;
     struct qemu_laio_state *ctx;
@@ -147,9 +165,23 @@ static void qemu_laio_completion_cb(EventNotifier *e)
 {
     struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
 
-    if (event_notifier_test_and_clear(&s->e)) {
-        qemu_bh_schedule(s->completion_bh);
+    /* When called because of qemu_laio_poll_cb(), the kernel may not have
+     * signaled the event notifier yet; completions are there anyway.
+     */
+    event_notifier_test_and_clear(&s->e);
+    qemu_bh_schedule(s->completion_bh);
+}
+
+static bool qemu_laio_poll_cb(void *opaque)
+{
+    struct qemu_laio_state *s = container_of(opaque, struct qemu_laio_state,
+                                             e);
+    struct aio_ring *ring = (struct aio_ring *)s->ctx;
+
+    if (ring->magic != AIO_RING_MAGIC) {
+        return false;
     }
+    return atomic_read(&ring->head) != atomic_read(&ring->tail);
 }
 
 static void laio_cancel(BlockAIOCB *blockacb)
@@ -297,6 +329,7 @@ void laio_attach_aio_context(void *s_, AioContext *new_context)
 
     s->completion_bh = aio_bh_new(new_context, qemu_laio_completion_bh, s);
     aio_set_event_notifier(new_context, &s->e, qemu_laio_completion_cb);
+    aio_set_event_notifier_poll(new_context, &s->e, qemu_laio_poll_cb);
 }
 
 void *laio_init(void)
@@ -41,6 +41,8 @@ typedef struct MirrorBlockJob {
     Error *replace_blocker;
     bool is_none_mode;
     BlockdevOnError on_source_error, on_target_error;
+    MirrorCopyMode copy_mode;
+    NotifierWithReturn before_write;
     bool synced;
     bool should_complete;
     int64_t sector_num;
@@ -58,6 +60,14 @@ typedef struct MirrorBlockJob {
     int in_flight;
     int sectors_in_flight;
     int ret;
+
+    /* Guest writes waiting for chunks in in_flight_bitmap */
+    CoQueue in_flight_queue;
+    int in_flight_waiters;
+    /* Set while the job coroutine waits for in-flight I/O to complete */
+    bool waiting_for_io;
+    /* Bytes written to the target as zeroes instead of being copied */
+    int64_t bytes_skipped;
 } MirrorBlockJob;
 
 typedef struct MirrorOp {
@@ -65,6 +75,7 @@ typedef struct MirrorOp {
     QEMUIOVector qiov;
     int64_t sector_num;
     int nb_sectors;
+    bool is_zero;
 } MirrorOp;
 
 static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
@@ -80,6 +91,18 @@ static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
     }
 }
 
+static void mirror_wake_in_flight_waiters(MirrorBlockJob *s)
+{
+    int n = s->in_flight_waiters;
+
+    /* Waiters whose chunks are still busy queue up again; restart only those
+     * that were waiting already.
+     */
+    while (n-- > 0 && qemu_co_enter_next(&s->in_flight_queue)) {
+        /* nothing */
+    }
+}
+
 static void mirror_iteration_done(MirrorOp *op, int ret)
 {
     MirrorBlockJob *s = op->s;
@@ -107,16 +130,22 @@ static void mirror_iteration_done(MirrorOp *op, int ret)
             bitmap_set(s->cow_bitmap, chunk_num, nb_chunks);
         }
         s->common.offset += (uint64_t)op->nb_sectors * BDRV_SECTOR_SIZE;
+        if (op->is_zero) {
+            s->bytes_skipped += (uint64_t)op->nb_sectors * BDRV_SECTOR_SIZE;
+        }
     }
 
     qemu_iovec_destroy(&op->qiov);
     g_slice_free(MirrorOp, op);
 
-    /* Enter coroutine when it is not sleeping.  The coroutine sleeps to
-     * rate-limit itself.  The coroutine will eventually resume since there is
-     * a sleep timeout so don't wake it early.
+    mirror_wake_in_flight_waiters(s);
+
+    /* Enter the coroutine only if it waits for I/O.  When it sleeps to
+     * rate-limit itself it will eventually resume because of the sleep
+     * timeout, and it may also be waiting for something else (e.g. metadata
+     * reads in bdrv_get_block_status) that must not be interrupted.
      */
-    if (s->common.busy) {
+    if (s->waiting_for_io) {
         qemu_coroutine_enter(s->common.co, NULL);
     }
 }
@@ -153,8 +182,24 @@ static void mirror_read_complete(void *opaque, int ret)
         mirror_iteration_done(op, ret);
         return;
     }
-    bdrv_aio_writev(s->target, op->sector_num, &op->qiov, op->nb_sectors,
-                    mirror_write_complete, op);
+
+    if (qemu_iovec_is_zero(&op->qiov)) {
+        trace_mirror_write_zeroes(s, op->sector_num, op->nb_sectors);
+        op->is_zero = true;
+        bdrv_aio_write_zeroes(s->target, op->sector_num, op->nb_sectors,
+                              BDRV_REQ_MAY_UNMAP, mirror_write_complete, op);
+    } else {
+        bdrv_aio_writev(s->target, op->sector_num, &op->qiov, op->nb_sectors,
+                        mirror_write_complete, op);
+    }
+}
+
+static void coroutine_fn mirror_wait_for_io(MirrorBlockJob *s)
+{
+    assert(!s->waiting_for_io);
+    s->waiting_for_io = true;
+    qemu_coroutine_yield();
+    s->waiting_for_io = false;
 }
 
 static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
@@ -162,8 +207,10 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     BlockDriverState *source = s->common.bs;
     int nb_sectors, sectors_per_chunk, nb_chunks;
     int64_t end, sector_num, next_chunk, next_sector, hbitmap_next_sector;
+    int64_t status;
     uint64_t delay_ns = 0;
     MirrorOp *op;
+    int pnum;
 
     s->sector_num = hbitmap_iter_next(&s->hbi);
     if (s->sector_num < 0) {
@@ -196,10 +243,12 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     next_sector = sector_num;
     next_chunk = sector_num / sectors_per_chunk;
 
-    /* Wait for I/O to this cluster (from a previous iteration) to be done.  */
+    /* Wait for I/O to this cluster (from a previous iteration or from a
+     * guest write in write-blocking mode) to be done.
+     */
     while (test_bit(next_chunk, s->in_flight_bitmap)) {
         trace_mirror_yield_in_flight(s, sector_num, s->in_flight);
-        qemu_coroutine_yield();
+        mirror_wait_for_io(s);
     }
 
     do {
@@ -235,7 +284,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
          */
         while (nb_chunks == 0 && s->buf_free_count < added_chunks) {
             trace_mirror_yield_buf_busy(s, nb_chunks, s->in_flight);
-            qemu_coroutine_yield();
+            mirror_wait_for_io(s);
         }
         if (s->buf_free_count < nb_chunks + added_chunks) {
             trace_mirror_break_buf_busy(s, nb_chunks, s->in_flight);
@@ -259,6 +308,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     op->s = s;
     op->sector_num = sector_num;
     op->nb_sectors = nb_sectors;
+    op->is_zero = false;
 
     /* Now make a QEMUIOVector taking enough granularity-sized chunks
      * from s->buf_free.
@@ -290,11 +340,132 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     s->in_flight++;
     s->sectors_in_flight += nb_sectors;
     trace_mirror_one_iteration(s, sector_num, nb_sectors);
+
+    /* Ranges that read as zeroes need not be read at all.  With
+     * write-blocking copy mode, the block status could be stale because
+     * guest writes are not serialised against it, and the dirty bitmap
+     * would not catch up with them; always read in that case.
+     */
+    if (s->copy_mode == MIRROR_COPY_MODE_BACKGROUND) {
+        status = bdrv_get_block_status(source, sector_num, nb_sectors, &pnum);
+        if (status >= 0 && (status & BDRV_BLOCK_ZERO) && pnum >= nb_sectors) {
+            trace_mirror_write_zeroes(s, sector_num, nb_sectors);
+            op->is_zero = true;
+            bdrv_aio_write_zeroes(s->target, sector_num, nb_sectors,
+                                  BDRV_REQ_MAY_UNMAP,
+                                  mirror_write_complete, op);
+            return delay_ns;
+        }
+    }
+
     bdrv_aio_readv(source, sector_num, &op->qiov, nb_sectors,
                    mirror_read_complete, op);
     return delay_ns;
 }
 
+/* Copy a guest write to the target before it is written to the source.  */
+static void coroutine_fn mirror_do_active_write(MirrorBlockJob *s,
+                                                BdrvTrackedRequest *req)
+{
+    int64_t sector_num = req->write_offset >> BDRV_SECTOR_BITS;
+    int nb_sectors = req->write_bytes >> BDRV_SECTOR_BITS;
+    int64_t sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    int64_t first_chunk = sector_num / sectors_per_chunk;
+    int64_t last_chunk = (sector_num + nb_sectors - 1) / sectors_per_chunk;
+    int64_t nb_chunks = last_chunk - first_chunk + 1;
+    int64_t end = s->bdev_length >> BDRV_SECTOR_BITS;
+    int64_t clean_start, clean_end, chunk;
+    int ret;
+
+    trace_mirror_active_write(s, sector_num, nb_sectors);
+
+    /* A background copy of these chunks that is still in flight could
+     * overwrite the target with older data after us.
+     */
+    while (find_next_bit(s->in_flight_bitmap, last_chunk + 1, first_chunk) <=
+           last_chunk) {
+        s->in_flight_waiters++;
+        qemu_co_queue_wait(&s->in_flight_queue);
+        s->in_flight_waiters--;
+    }
+    bitmap_set(s->in_flight_bitmap, first_chunk, nb_chunks);
+
+    /* Background copies issued before the source is written must not read
+     * the old data.  The chunks are claimed first, so that the background
+     * copies we wait for cannot be waiting for us.  Keep the request's
+     * alignment so that the serialising area does not grow.
+     */
+    bdrv_mark_request_serialising(req, req->bs->request_alignment);
+
+    if (req->flags & BDRV_REQ_ZERO_WRITE) {
+        ret = bdrv_co_write_zeroes(s->target, sector_num, nb_sectors,
+                                   req->flags & BDRV_REQ_MAY_UNMAP);
+    } else {
+        ret = bdrv_co_writev(s->target, sector_num, nb_sectors, req->qiov);
+    }
+
+    if (ret < 0) {
+        BlockErrorAction action;
+
+        bdrv_set_dirty_bitmap(s->dirty_bitmap, sector_num, nb_sectors);
+        action = mirror_error_action(s, false, -ret);
+        if (action == BLOCK_ERROR_ACTION_REPORT && s->ret >= 0) {
+            s->ret = ret;
+        }
+    } else {
+        /* Chunks that were overwritten completely are in sync now.  If the
+         * write to the source fails, the guest sees an error and the
+         * content of the range is undefined anyway.
+         */
+        clean_start = QEMU_ALIGN_UP(sector_num, sectors_per_chunk);
+        clean_end = sector_num + nb_sectors;
+        if (clean_end < end) {
+            clean_end = QEMU_ALIGN_DOWN(clean_end, sectors_per_chunk);
+        }
+        if (clean_end > clean_start) {
+            bdrv_reset_dirty_bitmap(s->dirty_bitmap, clean_start,
+                                    clean_end - clean_start);
+        }
+
+        /* Partially overwritten chunks that are still dirty are counted by
+         * the background copy, which copies them as a whole.
+         */
+        for (chunk = first_chunk; chunk <= last_chunk; chunk++) {
+            int64_t start = MAX(sector_num, chunk * sectors_per_chunk);
+            int64_t stop = MIN(sector_num + nb_sectors,
+                               (chunk + 1) * sectors_per_chunk);
+
+            if (!bdrv_get_dirty(req->bs, s->dirty_bitmap,
+                                chunk * sectors_per_chunk)) {
+                s->common.offset += (stop - start) * BDRV_SECTOR_SIZE;
+            }
+        }
+    }
+
+    bitmap_clear(s->in_flight_bitmap, first_chunk, nb_chunks);
+    mirror_wake_in_flight_waiters(s);
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+static int coroutine_fn mirror_before_write_notify(
+        NotifierWithReturn *notifier, void *opaque)
+{
+    MirrorBlockJob *s = container_of(notifier, MirrorBlockJob, before_write);
+    BdrvTrackedRequest *req = opaque;
+
+    assert(req->bs == s->common.bs);
+    assert((req->write_offset & (BDRV_SECTOR_SIZE - 1)) == 0);
+    assert((req->write_bytes & (BDRV_SECTOR_SIZE - 1)) == 0);
+    assert(!req->qiov || req->qiov->size == req->write_bytes);
+
+    if (req->write_bytes) {
+        mirror_do_active_write(s, req);
+    }
+    return 0;
+}
+
 static void mirror_free_init(MirrorBlockJob *s)
 {
     int granularity = s->granularity;
@@ -315,7 +486,7 @@ static void mirror_free_init(MirrorBlockJob *s)
 static void mirror_drain(MirrorBlockJob *s)
 {
     while (s->in_flight > 0) {
-        qemu_coroutine_yield();
+        mirror_wait_for_io(s);
     }
 }
 
@@ -400,6 +571,17 @@ static void coroutine_fn mirror_run(void *opaque)
     length = DIV_ROUND_UP(s->bdev_length, s->granularity);
     s->in_flight_bitmap = bitmap_new(length);
 
+    if (s->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING) {
+        /* From now on guest writes are copied to the target synchronously
+         * instead of being tracked in the dirty bitmap.  Writes that are
+         * already in flight must still mark the bitmap.
+         */
+        bdrv_drain(bs);
+        s->before_write.notify = mirror_before_write_notify;
+        bdrv_add_before_write_notifier(bs, &s->before_write);
+        bdrv_disable_dirty_bitmap(s->dirty_bitmap);
+    }
+
     /* If we have no backing file yet in the destination, we cannot let
      * the destination do COW.  Instead, we copy sectors around the
      * dirty data if needed.  We need a bitmap to do that.
@@ -479,7 +661,7 @@ static void coroutine_fn mirror_run(void *opaque)
             if (s->in_flight == MAX_IN_FLIGHT || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, s->in_flight, s->buf_free_count, cnt);
-                qemu_coroutine_yield();
+                mirror_wait_for_io(s);
                 continue;
             } else if (cnt != 0) {
                 delay_ns = mirror_iteration(s);
@@ -548,6 +730,9 @@ static void coroutine_fn mirror_run(void *opaque)
     }
 
 immediate_exit:
+    if (s->before_write.notify) {
+        notifier_with_return_remove(&s->before_write);
+    }
     if (s->in_flight > 0) {
         /* We get here only if something went wrong.  Either the job failed,
          * or it was cancelled prematurely so that we do not guarantee that
@@ -557,11 +742,17 @@ immediate_exit:
         mirror_drain(s);
     }
 
+    if (s->before_write.notify) {
+        /* Guest writes may still be copying to the target */
+        bdrv_drain(bs);
+    }
+
     assert(s->in_flight == 0);
     qemu_vfree(s->buf);
     g_free(s->cow_bitmap);
     g_free(s->in_flight_bitmap);
     bdrv_release_dirty_bitmap(bs, s->dirty_bitmap);
+    s->dirty_bitmap = NULL;
     bdrv_iostatus_disable(s->target);
 
     data = g_malloc(sizeof(*data));
@@ -587,6 +778,22 @@ static void mirror_iostatus_reset(BlockJob *job)
     bdrv_iostatus_reset(s->target);
 }
 
+static void mirror_query(BlockJob *job, BlockJobInfo *info)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+
+    info->has_skipped = true;
+    info->skipped = s->bytes_skipped;
+
+    if (!s->dirty_bitmap) {
+        return;
+    }
+
+    info->has_lag = true;
+    info->lag = (bdrv_get_dirty_count(s->dirty_bitmap) +
+                 s->sectors_in_flight) * BDRV_SECTOR_SIZE;
+}
+
 static void mirror_complete(BlockJob *job, Error **errp)
 {
     MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
@@ -635,6 +842,7 @@ static const BlockJobDriver mirror_job_driver = {
     .set_speed     = mirror_set_speed,
     .iostatus_reset= mirror_iostatus_reset,
     .complete      = mirror_complete,
+    .query         = mirror_query,
 };
 
 static const BlockJobDriver commit_active_job_driver = {
@@ -644,12 +852,14 @@ static const BlockJobDriver commit_active_job_driver = {
     .iostatus_reset
                    = mirror_iostatus_reset,
     .complete      = mirror_complete,
+    .query         = mirror_query,
 };
 
 static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
                              const char *replaces,
                              int64_t speed, uint32_t granularity,
                              int64_t buf_size,
+                             MirrorCopyMode copy_mode,
                              BlockdevOnError on_source_error,
                              BlockdevOnError on_target_error,
                              BlockCompletionFunc *cb,
@@ -684,6 +894,8 @@ static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
     s->target = target;
     s->is_none_mode = is_none_mode;
     s->base = base;
+    s->copy_mode = copy_mode;
+    qemu_co_queue_init(&s->in_flight_queue);
     s->granularity = granularity;
     s->buf_size = MAX(buf_size, granularity);
 
@@ -702,7 +914,8 @@ static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
 void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   const char *replaces,
                   int64_t speed, uint32_t granularity, int64_t buf_size,
-                  MirrorSyncMode mode, BlockdevOnError on_source_error,
+                  MirrorSyncMode mode, MirrorCopyMode copy_mode,
+                  BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockCompletionFunc *cb,
                   void *opaque, Error **errp)
@@ -717,7 +930,7 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
     is_none_mode = mode == MIRROR_SYNC_MODE_NONE;
     base = mode == MIRROR_SYNC_MODE_TOP ? bs->backing_hd : NULL;
     mirror_start_job(bs, target, replaces,
-                     speed, granularity, buf_size,
+                     speed, granularity, buf_size, copy_mode,
                      on_source_error, on_target_error, cb, opaque, errp,
                      &mirror_job_driver, is_none_mode, base);
 }
@@ -765,7 +978,7 @@ void commit_active_start(BlockDriverState *bs, BlockDriverState *base,
     }
 
     bdrv_ref(base);
-    mirror_start_job(bs, base, NULL, speed, 0, 0,
+    mirror_start_job(bs, base, NULL, speed, 0, 0, MIRROR_COPY_MODE_BACKGROUND,
                      on_error, on_error, cb, opaque, &local_err,
                      &commit_active_job_driver, false, base);
     if (local_err) {
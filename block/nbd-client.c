@@ -32,34 +32,43 @@
 #define HANDLE_TO_INDEX(bs, handle) ((handle) ^ ((uint64_t)(intptr_t)bs))
 #define INDEX_TO_HANDLE(bs, index)  ((index)  ^ ((uint64_t)(intptr_t)bs))
 
+/* First extent of a block status reply */
+typedef struct NBDExtent {
+    uint32_t length;
+    uint32_t flags;
+} NBDExtent;
+
 static void nbd_recv_coroutines_enter_all(NbdClientSession *s)
 {
     int i;
 
-    for (i = 0; i < MAX_NBD_REQUESTS; i++) {
+    for (i = 0; i < s->max_requests; i++) {
         if (s->recv_coroutine[i]) {
             qemu_coroutine_enter(s->recv_coroutine[i], NULL);
         }
     }
 }
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void nbd_session_detach_aio_context(NbdClientSession *s)
 {
-    NbdClientSession *client = nbd_get_client_session(bs);
+    aio_set_fd_handler(bdrv_get_aio_context(s->bs), s->sock,
+                       NULL, NULL, NULL);
+}
 
+static void nbd_teardown_connection(NbdClientSession *client)
+{
     /* finish any pending coroutines */
     shutdown(client->sock, 2);
     nbd_recv_coroutines_enter_all(client);
 
-    nbd_client_detach_aio_context(bs);
+    nbd_session_detach_aio_context(client);
     closesocket(client->sock);
     client->sock = -1;
 }
 
 static void nbd_reply_ready(void *opaque)
 {
-    BlockDriverState *bs = opaque;
-    NbdClientSession *s = nbd_get_client_session(bs);
+    NbdClientSession *s = opaque;
     uint64_t i;
     int ret;
 
@@ -82,7 +91,7 @@ static void nbd_reply_ready(void *opaque)
      * handler acts as a synchronization point and ensures that only
      * one coroutine is called until the reply finishes.  */
     i = HANDLE_TO_INDEX(s, s->reply.handle);
-    if (i >= MAX_NBD_REQUESTS) {
+    if (i >= s->max_requests) {
         goto fail;
     }
 
@@ -92,40 +101,39 @@ static void nbd_reply_ready(void *opaque)
     }
 
 fail:
-    nbd_teardown_connection(bs);
+    nbd_teardown_connection(s);
 }
 
 static void nbd_restart_write(void *opaque)
 {
-    BlockDriverState *bs = opaque;
+    NbdClientSession *s = opaque;
 
-    qemu_coroutine_enter(nbd_get_client_session(bs)->send_coroutine, NULL);
+    qemu_coroutine_enter(s->send_coroutine, NULL);
 }
 
-static int nbd_co_send_request(BlockDriverState *bs,
+static int nbd_co_send_request(NbdClientSession *s,
                                struct nbd_request *request,
                                QEMUIOVector *qiov, int offset)
 {
-    NbdClientSession *s = nbd_get_client_session(bs);
     AioContext *aio_context;
     int rc, ret, i;
 
     qemu_co_mutex_lock(&s->send_mutex);
 
-    for (i = 0; i < MAX_NBD_REQUESTS; i++) {
+    for (i = 0; i < s->max_requests; i++) {
         if (s->recv_coroutine[i] == NULL) {
             s->recv_coroutine[i] = qemu_coroutine_self();
             break;
         }
     }
 
-    assert(i < MAX_NBD_REQUESTS);
+    assert(i < s->max_requests);
     request->handle = INDEX_TO_HANDLE(s, i);
     s->send_coroutine = qemu_coroutine_self();
-    aio_context = bdrv_get_aio_context(bs);
+    aio_context = bdrv_get_aio_context(s->bs);
 
     aio_set_fd_handler(aio_context, s->sock,
-                       nbd_reply_ready, nbd_restart_write, bs);
+                       nbd_reply_ready, nbd_restart_write, s);
     if (qiov) {
         if (!s->is_unix) {
             socket_set_cork(s->sock, 1);
@@ -144,36 +152,166 @@ static int nbd_co_send_request(BlockDriverState *bs,
     } else {
         rc = nbd_send_request(s->sock, request);
     }
-    aio_set_fd_handler(aio_context, s->sock, nbd_reply_ready, NULL, bs);
+    aio_set_fd_handler(aio_context, s->sock, nbd_reply_ready, NULL, s);
     s->send_coroutine = NULL;
     qemu_co_mutex_unlock(&s->send_mutex);
     return rc;
 }
 
+static int nbd_co_drop_payload(NbdClientSession *s, uint32_t len)
+{
+    uint8_t buf[512];
+
+    while (len > 0) {
+        uint32_t n = MIN(len, sizeof(buf));
+
+        if (qemu_co_recv(s->sock, buf, n) != n) {
+            return -EIO;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+/* Read the payload of a structured reply chunk.  Read data goes to @qiov at
+ * @offset, and the first block status extent to @extent.  The length of
+ * read data and holes is added to *@covered.  Returns the errno
+ * value from an error chunk, or a negative value if the payload is invalid
+ * and the connection cannot be used anymore.
+ */
+static int nbd_co_receive_chunk(NbdClientSession *s,
+    struct nbd_request *request, struct nbd_reply *reply,
+    QEMUIOVector *qiov, int offset, NBDExtent *extent, uint32_t *covered)
+{
+    uint32_t command = request->type & NBD_CMD_MASK_COMMAND;
+    uint8_t buf[4 + 4 + 4];
+    uint64_t from;
+    uint32_t len;
+    int error;
+
+    switch (reply->type) {
+    case NBD_REPLY_TYPE_NONE:
+        return reply->length ? -EINVAL : 0;
+
+    case NBD_REPLY_TYPE_OFFSET_DATA:
+    case NBD_REPLY_TYPE_OFFSET_HOLE:
+        if (command != NBD_CMD_READ || reply->length < 8) {
+            return -EINVAL;
+        }
+        if (qemu_co_recv(s->sock, buf, 8) != 8) {
+            return -EIO;
+        }
+        from = be64_to_cpup((uint64_t *)buf);
+        if (reply->type == NBD_REPLY_TYPE_OFFSET_DATA) {
+            len = reply->length - 8;
+        } else {
+            if (reply->length != 12 || qemu_co_recv(s->sock, buf, 4) != 4) {
+                return -EINVAL;
+            }
+            len = be32_to_cpup((uint32_t *)buf);
+        }
+
+        if (from < request->from || len > request->len ||
+            from - request->from > request->len - len) {
+            return -EINVAL;
+        }
+        offset += from - request->from;
+        if (reply->type == NBD_REPLY_TYPE_OFFSET_HOLE) {
+            qemu_iovec_memset(qiov, offset, 0, len);
+        } else if (qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
+                                 offset, len) != len) {
+            return -EIO;
+        }
+        *covered += len;
+        return 0;
+
+    case NBD_REPLY_TYPE_BLOCK_STATUS:
+        if (command != NBD_CMD_BLOCK_STATUS || reply->length < 12 ||
+            (reply->length - 4) % 8) {
+            return -EINVAL;
+        }
+        if (qemu_co_recv(s->sock, buf, 12) != 12) {
+            return -EIO;
+        }
+        if (be32_to_cpup((uint32_t *)buf) != s->ext.context_id) {
+            return -EINVAL;
+        }
+        extent->length = be32_to_cpup((uint32_t *)(buf + 4));
+        extent->flags = be32_to_cpup((uint32_t *)(buf + 8));
+        return nbd_co_drop_payload(s, reply->length - 12);
+
+    default:
+        if (!NBD_REPLY_TYPE_IS_ERR(reply->type)) {
+            /* Unknown chunks that are not errors can be ignored */
+            return nbd_co_drop_payload(s, reply->length);
+        }
+        if (reply->length < 6 || qemu_co_recv(s->sock, buf, 6) != 6) {
+            return -EINVAL;
+        }
+        error = nbd_errno_to_system_errno(be32_to_cpup((uint32_t *)buf));
+        if (nbd_co_drop_payload(s, reply->length - 6) < 0) {
+            return -EIO;
+        }
+        return error ? error : EINVAL;
+    }
+}
+
 static void nbd_co_receive_reply(NbdClientSession *s,
     struct nbd_request *request, struct nbd_reply *reply,
-    QEMUIOVector *qiov, int offset)
+    QEMUIOVector *qiov, int offset, NBDExtent *extent)
 {
+    uint32_t covered = 0;
+    bool structured = false;
+    int error = 0;
     int ret;
 
-    /* Wait until we're woken up by the read handler.  TODO: perhaps
-     * peek at the next reply and avoid yielding if it's ours?  */
-    qemu_coroutine_yield();
-    *reply = s->reply;
-    if (reply->handle != request->handle) {
-        reply->error = EIO;
-    } else {
-        if (qiov && reply->error == 0) {
-            ret = qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
-                                offset, request->len);
-            if (ret != request->len) {
+    /* A structured reply can be made of several chunks, possibly
+     * interleaved with replies to other requests.
+     */
+    do {
+        /* Wait until we're woken up by the read handler.  TODO: perhaps
+         * peek at the next reply and avoid yielding if it's ours?  */
+        qemu_coroutine_yield();
+        *reply = s->reply;
+        if (reply->handle != request->handle) {
+            reply->error = EIO;
+            return;
+        }
+
+        if (reply->magic == NBD_STRUCTURED_REPLY_MAGIC) {
+            structured = true;
+            ret = nbd_co_receive_chunk(s, request, reply, qiov, offset,
+                                       extent, &covered);
+            if (ret < 0) {
+                s->reply.handle = 0;
                 reply->error = EIO;
+                return;
+            }
+            if (!error) {
+                error = ret;
             }
+        } else {
+            if (qiov && reply->error == 0) {
+                ret = qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
+                                    offset, request->len);
+                if (ret != request->len) {
+                    reply->error = EIO;
+                }
+            }
+            error = reply->error;
         }
 
         /* Tell the read handler to read another header.  */
         s->reply.handle = 0;
+    } while (!(reply->flags & NBD_REPLY_FLAG_DONE));
+
+    /* A successful read must return data or holes for all of the request.
+     * Chunks may not overlap, so their lengths add up to the request length.
+     */
+    if (structured && qiov && !error && covered != request->len) {
+        error = EIO;
     }
+    reply->error = error;
 }
 
 static void nbd_coroutine_start(NbdClientSession *s,
@@ -181,9 +319,9 @@ static void nbd_coroutine_start(NbdClientSession *s,
 {
     /* Poor man semaphore.  The free_sema is locked when no other request
      * can be accepted, and unlocked after receiving one reply.  */
-    if (s->in_flight >= MAX_NBD_REQUESTS - 1) {
+    if (s->in_flight >= s->max_requests - 1) {
         qemu_co_mutex_lock(&s->free_sema);
-        assert(s->in_flight < MAX_NBD_REQUESTS);
+        assert(s->in_flight < s->max_requests);
     }
     s->in_flight++;
 
@@ -195,16 +333,41 @@ static void nbd_coroutine_end(NbdClientSession *s,
 {
     int i = HANDLE_TO_INDEX(s, request->handle);
     s->recv_coroutine[i] = NULL;
-    if (s->in_flight-- == MAX_NBD_REQUESTS) {
+    if (s->in_flight-- == s->max_requests) {
         qemu_co_mutex_unlock(&s->free_sema);
     }
 }
 
+/* Choose the connection for a new request: the one with the fewest requests
+ * in flight, starting after the last one chosen so that ties are spread
+ * evenly.  Broken connections are skipped unless all of them are.
+ */
+static NbdClientSession *nbd_client_pick_session(BlockDriverState *bs)
+{
+    NbdClient *client = nbd_get_client(bs);
+    NbdClientSession *best = &client->sessions[0];
+    bool found = false;
+    int i;
+
+    for (i = 0; i < client->num_sessions; i++) {
+        int n = (client->next_session + i) % client->num_sessions;
+        NbdClientSession *s = &client->sessions[n];
+
+        if (s->sock >= 0 && (!found || s->in_flight < best->in_flight)) {
+            best = s;
+            found = true;
+        }
+    }
+
+    client->next_session = (best - client->sessions + 1) % client->num_sessions;
+    return best;
+}
+
 static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
                           int nb_sectors, QEMUIOVector *qiov,
                           int offset)
 {
-    NbdClientSession *client = nbd_get_client_session(bs);
+    NbdClientSession *client = nbd_client_pick_session(bs);
     struct nbd_request request = { .type = NBD_CMD_READ };
     struct nbd_reply reply;
     ssize_t ret;
@@ -213,11 +376,11 @@ static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
     request.len = nb_sectors * 512;
 
     nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL, 0);
+    ret = nbd_co_send_request(client, &request, NULL, 0);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, qiov, offset);
+        nbd_co_receive_reply(client, &request, &reply, qiov, offset, NULL);
     }
     nbd_coroutine_end(client, &request);
     return -reply.error;
@@ -228,7 +391,7 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
                            int nb_sectors, QEMUIOVector *qiov,
                            int offset)
 {
-    NbdClientSession *client = nbd_get_client_session(bs);
+    NbdClientSession *client = nbd_client_pick_session(bs);
     struct nbd_request request = { .type = NBD_CMD_WRITE };
     struct nbd_reply reply;
     ssize_t ret;
@@ -242,11 +405,11 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
     request.len = nb_sectors * 512;
 
     nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, qiov, offset);
+    ret = nbd_co_send_request(client, &request, qiov, offset);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
+        nbd_co_receive_reply(client, &request, &reply, NULL, 0, NULL);
     }
     nbd_coroutine_end(client, &request);
     return -reply.error;
@@ -290,9 +453,12 @@ int nbd_client_co_writev(BlockDriverState *bs, int64_t sector_num,
     return nbd_co_writev_1(bs, sector_num, nb_sectors, qiov, offset);
 }
 
+/* With several connections, the server guarantees that a flush covers the
+ * writes completed on all of them, so sending it on one is enough.
+ */
 int nbd_client_co_flush(BlockDriverState *bs)
 {
-    NbdClientSession *client = nbd_get_client_session(bs);
+    NbdClientSession *client = nbd_client_pick_session(bs);
     struct nbd_request request = { .type = NBD_CMD_FLUSH };
     struct nbd_reply reply;
     ssize_t ret;
@@ -309,11 +475,11 @@ int nbd_client_co_flush(BlockDriverState *bs)
     request.len = 0;
 
     nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL, 0);
+    ret = nbd_co_send_request(client, &request, NULL, 0);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
+        nbd_co_receive_reply(client, &request, &reply, NULL, 0, NULL);
     }
     nbd_coroutine_end(client, &request);
     return -reply.error;
@@ -322,7 +488,7 @@ int nbd_client_co_flush(BlockDriverState *bs)
 int nbd_client_co_discard(BlockDriverState *bs, int64_t sector_num,
                           int nb_sectors)
 {
-    NbdClientSession *client = nbd_get_client_session(bs);
+    NbdClientSession *client = nbd_client_pick_session(bs);
     struct nbd_request request = { .type = NBD_CMD_TRIM };
     struct nbd_reply reply;
     ssize_t ret;
@@ -334,73 +500,175 @@ int nbd_client_co_discard(BlockDriverState *bs, int64_t sector_num,
     request.len = nb_sectors * 512;
 
     nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL, 0);
+    ret = nbd_co_send_request(client, &request, NULL, 0);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
+        nbd_co_receive_reply(client, &request, &reply, NULL, 0, NULL);
     }
     nbd_coroutine_end(client, &request);
     return -reply.error;
 
 }
 
+int64_t nbd_client_co_get_block_status(BlockDriverState *bs,
+                                       int64_t sector_num,
+                                       int nb_sectors, int *pnum)
+{
+    NbdClientSession *client = nbd_client_pick_session(bs);
+    struct nbd_request request = {
+        .type = NBD_CMD_BLOCK_STATUS | NBD_CMD_FLAG_REQ_ONE
+    };
+    struct nbd_reply reply;
+    NBDExtent extent = { 0, 0 };
+    int64_t ret;
+
+    if (!client->ext.base_allocation) {
+        *pnum = nb_sectors;
+        return BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID |
+               (sector_num * BDRV_SECTOR_SIZE);
+    }
+
+    request.from = sector_num * 512;
+    request.len = MIN(nb_sectors, UINT32_MAX >> BDRV_SECTOR_BITS) * 512;
+
+    nbd_coroutine_start(client, &request);
+    ret = nbd_co_send_request(client, &request, NULL, 0);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_reply(client, &request, &reply, NULL, 0, &extent);
+    }
+    nbd_coroutine_end(client, &request);
+    if (reply.error) {
+        return -reply.error;
+    }
+    if (!extent.length) {
+        return -EIO;
+    }
+
+    ret = BDRV_BLOCK_OFFSET_VALID | (sector_num * BDRV_SECTOR_SIZE);
+    if (extent.length < BDRV_SECTOR_SIZE) {
+        /* Not sector granular, so the sector has some data */
+        *pnum = 1;
+        return ret | BDRV_BLOCK_DATA;
+    }
+
+    *pnum = MIN(extent.length / BDRV_SECTOR_SIZE, nb_sectors);
+    if (!(extent.flags & NBD_STATE_HOLE)) {
+        ret |= BDRV_BLOCK_DATA;
+    }
+    if (extent.flags & NBD_STATE_ZERO) {
+        ret |= BDRV_BLOCK_ZERO;
+    }
+    return ret;
+}
+
 void nbd_client_detach_aio_context(BlockDriverState *bs)
 {
-    aio_set_fd_handler(bdrv_get_aio_context(bs),
-                       nbd_get_client_session(bs)->sock, NULL, NULL, NULL);
+    NbdClient *client = nbd_get_client(bs);
+    int i;
+
+    for (i = 0; i < client->num_sessions; i++) {
+        if (client->sessions[i].sock >= 0) {
+            nbd_session_detach_aio_context(&client->sessions[i]);
+        }
+    }
 }
 
 void nbd_client_attach_aio_context(BlockDriverState *bs,
                                    AioContext *new_context)
 {
-    aio_set_fd_handler(new_context, nbd_get_client_session(bs)->sock,
-                       nbd_reply_ready, NULL, bs);
+    NbdClient *client = nbd_get_client(bs);
+    int i;
+
+    for (i = 0; i < client->num_sessions; i++) {
+        NbdClientSession *s = &client->sessions[i];
+
+        if (s->sock >= 0) {
+            aio_set_fd_handler(new_context, s->sock, nbd_reply_ready, NULL, s);
+        }
+    }
 }
 
 void nbd_client_close(BlockDriverState *bs)
 {
-    NbdClientSession *client = nbd_get_client_session(bs);
+    NbdClient *client = nbd_get_client(bs);
     struct nbd_request request = {
         .type = NBD_CMD_DISC,
         .from = 0,
         .len = 0
     };
+    int i;
 
-    if (client->sock == -1) {
-        return;
-    }
-
-    nbd_send_request(client->sock, &request);
+    for (i = 0; i < client->num_sessions; i++) {
+        NbdClientSession *s = &client->sessions[i];
 
-    nbd_teardown_connection(bs);
+        if (s->sock != -1) {
+            nbd_send_request(s->sock, &request);
+            nbd_teardown_connection(s);
+        }
+        g_free(s->recv_coroutine);
+        s->recv_coroutine = NULL;
+    }
+    client->num_sessions = 0;
 }
 
 int nbd_client_init(BlockDriverState *bs, int sock, const char *export,
-                    Error **errp)
+                    int max_requests, Error **errp)
 {
-    NbdClientSession *client = nbd_get_client_session(bs);
+    NbdClient *nbd = nbd_get_client(bs);
+    NbdClientSession *first = &nbd->sessions[0];
+    NbdClientSession *client;
     int ret;
 
+    assert(nbd->num_sessions < NBD_MAX_CONNECTIONS);
+    client = &nbd->sessions[nbd->num_sessions];
+
     /* NBD handshake */
     logout("session init %s\n", export);
     qemu_set_block(sock);
+    client->ext.structured_reply = !nbd->no_extensions;
+    client->ext.base_allocation = !nbd->no_extensions;
     ret = nbd_receive_negotiate(sock, export,
-                                &client->nbdflags, &client->size, errp);
+                                &client->nbdflags, &client->size,
+                                &client->ext, errp);
     if (ret < 0) {
         logout("Failed to negotiate with the NBD server\n");
         closesocket(sock);
+        /* Old servers (e.g. QEMU up to 2.3) answer unknown options with
+         * NBD_REP_ERR_UNSUP, but then close the connection */
+        if (client->ext.refused && !nbd->no_extensions) {
+            nbd->no_extensions = true;
+            return -EAGAIN;
+        }
         return ret;
     }
 
+    /* Additional connections must see the same export */
+    if (client != first &&
+        (client->nbdflags != first->nbdflags || client->size != first->size ||
+         client->ext.structured_reply != first->ext.structured_reply ||
+         client->ext.base_allocation != first->ext.base_allocation)) {
+        error_setg(errp, "NBD server changed the export between connections");
+        closesocket(sock);
+        return -EINVAL;
+    }
+
     qemu_co_mutex_init(&client->send_mutex);
     qemu_co_mutex_init(&client->free_sema);
+    client->bs = bs;
     client->sock = sock;
+    client->is_unix = nbd->is_unix;
+    client->max_requests = max_requests;
+    client->recv_coroutine = g_new0(Coroutine *, max_requests);
+    nbd->num_sessions++;
 
     /* Now that we're connected, set the socket to be non-blocking and
      * kick the reply mechanism.  */
     qemu_set_nonblock(sock);
-    nbd_client_attach_aio_context(bs, bdrv_get_aio_context(bs));
+    aio_set_fd_handler(bdrv_get_aio_context(bs), sock,
+                       nbd_reply_ready, NULL, client);
 
     logout("Established connection with NBD server\n");
     return 0;
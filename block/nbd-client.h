@@ -14,28 +14,50 @@
 #define logout(fmt, ...) ((void)0)
 #endif
 
-#define MAX_NBD_REQUESTS    16
+#define NBD_MAX_CONNECTIONS 16
 
+/* One connection to the server */
 typedef struct NbdClientSession {
+    BlockDriverState *bs;
     int sock;
     uint32_t nbdflags;
     off_t size;
+    NBDExtensions ext;
 
     CoMutex send_mutex;
     CoMutex free_sema;
     Coroutine *send_coroutine;
     int in_flight;
+    int max_requests;
 
-    Coroutine *recv_coroutine[MAX_NBD_REQUESTS];
+    Coroutine **recv_coroutine;
     struct nbd_reply reply;
 
     bool is_unix;
 } NbdClientSession;
 
-NbdClientSession *nbd_get_client_session(BlockDriverState *bs);
+/* All the connections to an export.  Requests are spread across them, which
+ * the server must allow with NBD_FLAG_CAN_MULTI_CONN if there is more than
+ * one.
+ */
+typedef struct NbdClient {
+    NbdClientSession sessions[NBD_MAX_CONNECTIONS];
+    int num_sessions;
+    int next_session;
 
+    /* Set when the server dropped the connection after refusing an option;
+     * all connections are then negotiated without protocol extensions */
+    bool no_extensions;
+
+    bool is_unix;
+} NbdClient;
+
+NbdClient *nbd_get_client(BlockDriverState *bs);
+
+/* Negotiate on @sock and add it to the connections of @bs.  Returns -EAGAIN
+ * if the negotiation must be retried on a new connection. */
 int nbd_client_init(BlockDriverState *bs, int sock, const char *export_name,
-                    Error **errp);
+                    int max_requests, Error **errp);
 void nbd_client_close(BlockDriverState *bs);
 
 int nbd_client_co_discard(BlockDriverState *bs, int64_t sector_num,
@@ -45,6 +67,9 @@ int nbd_client_co_writev(BlockDriverState *bs, int64_t sector_num,
                          int nb_sectors, QEMUIOVector *qiov);
 int nbd_client_co_readv(BlockDriverState *bs, int64_t sector_num,
                         int nb_sectors, QEMUIOVector *qiov);
+int64_t nbd_client_co_get_block_status(BlockDriverState *bs,
+                                       int64_t sector_num,
+                                       int nb_sectors, int *pnum);
 
 void nbd_client_detach_aio_context(BlockDriverState *bs);
 void nbd_client_attach_aio_context(BlockDriverState *bs,
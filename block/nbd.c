@@ -41,8 +41,29 @@
 
 #define EN_OPTSTR ":exportname="
 
+#define NBD_OPT_QUEUE_DEPTH "queue-depth"
+#define NBD_OPT_CONNECTIONS "connections"
+
+static QemuOptsList nbd_runtime_opts = {
+    .name = "nbd",
+    .head = QTAILQ_HEAD_INITIALIZER(nbd_runtime_opts.head),
+    .desc = {
+        {
+            .name = NBD_OPT_QUEUE_DEPTH,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of requests in flight",
+        },
+        {
+            .name = NBD_OPT_CONNECTIONS,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to open if the server allows it",
+        },
+        { /* end of list */ }
+    },
+};
+
 typedef struct BDRVNBDState {
-    NbdClientSession client;
+    NbdClient client;
     QemuOpts *socket_opts;
 } BDRVNBDState;
 
@@ -191,8 +212,10 @@ out:
 }
 
 static void nbd_config(BDRVNBDState *s, QDict *options, char **export,
-                       Error **errp)
+                       int *max_requests, int *connections, Error **errp)
 {
+    QemuOpts *opts;
+    uint64_t queue_depth, num_conns;
     Error *local_err = NULL;
 
     if (qdict_haskey(options, "path") == qdict_haskey(options, "host")) {
@@ -219,13 +242,38 @@ static void nbd_config(BDRVNBDState *s, QDict *options, char **export,
                             &error_abort);
     }
 
+    opts = qemu_opts_create(&nbd_runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        qemu_opts_del(opts);
+        return;
+    }
+
+    queue_depth = qemu_opt_get_number(opts, NBD_OPT_QUEUE_DEPTH,
+                                      NBD_DEFAULT_MAX_REQUESTS);
+    num_conns = qemu_opt_get_number(opts, NBD_OPT_CONNECTIONS, 1);
+    qemu_opts_del(opts);
+    if (queue_depth < 1 || queue_depth > NBD_MAX_REQUESTS_LIMIT) {
+        error_setg(errp, "queue-depth must be between 1 and %d",
+                   NBD_MAX_REQUESTS_LIMIT);
+        return;
+    }
+    if (num_conns < 1 || num_conns > NBD_MAX_CONNECTIONS) {
+        error_setg(errp, "connections must be between 1 and %d",
+                   NBD_MAX_CONNECTIONS);
+        return;
+    }
+    *max_requests = queue_depth;
+    *connections = num_conns;
+
     *export = g_strdup(qdict_get_try_str(options, "export"));
     if (*export) {
         qdict_del(options, "export");
     }
 }
 
-NbdClientSession *nbd_get_client_session(BlockDriverState *bs)
+NbdClient *nbd_get_client(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
     return &s->client;
@@ -254,32 +302,76 @@ static int nbd_establish_connection(BlockDriverState *bs, Error **errp)
     return sock;
 }
 
+/* Connect to the server and negotiate one more session */
+static int nbd_connect_session(BlockDriverState *bs, const char *export,
+                               int max_requests, Error **errp)
+{
+    Error *local_err = NULL;
+    int sock, ret;
+
+    sock = nbd_establish_connection(bs, errp);
+    if (sock < 0) {
+        return sock;
+    }
+
+    ret = nbd_client_init(bs, sock, export, max_requests, &local_err);
+    if (ret == -EAGAIN) {
+        /* Try again without protocol extensions */
+        error_free(local_err);
+        local_err = NULL;
+        sock = nbd_establish_connection(bs, errp);
+        if (sock < 0) {
+            return sock;
+        }
+        ret = nbd_client_init(bs, sock, export, max_requests, &local_err);
+    }
+    if (local_err) {
+        error_propagate(errp, local_err);
+    }
+    return ret;
+}
+
 static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
                     Error **errp)
 {
     BDRVNBDState *s = bs->opaque;
     char *export = NULL;
-    int result, sock;
+    int max_requests = NBD_DEFAULT_MAX_REQUESTS;
+    int connections = 1;
+    int result;
     Error *local_err = NULL;
 
     /* Pop the config into our state object. Exit if invalid. */
-    nbd_config(s, options, &export, &local_err);
+    nbd_config(s, options, &export, &max_requests, &connections, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
         return -EINVAL;
     }
 
-    /* establish TCP connection, return error if it fails
+    /* establish TCP connection and do the NBD handshake, return error if
+     * it fails
      * TODO: Configurable retry-until-timeout behaviour.
      */
-    sock = nbd_establish_connection(bs, errp);
-    if (sock < 0) {
-        g_free(export);
-        return sock;
+    result = nbd_connect_session(bs, export, max_requests, errp);
+    if (result < 0) {
+        goto out;
+    }
+
+    /* Further connections are only safe if the server says so */
+    if (!(s->client.sessions[0].nbdflags & NBD_FLAG_CAN_MULTI_CONN)) {
+        connections = 1;
+    }
+    while (s->client.num_sessions < connections) {
+        result = nbd_connect_session(bs, export, max_requests, errp);
+        if (result < 0) {
+            break;
+        }
+    }
+    if (result < 0) {
+        nbd_client_close(bs);
     }
 
-    /* NBD handshake */
-    result = nbd_client_init(bs, sock, export, errp);
+out:
     g_free(export);
     return result;
 }
@@ -301,6 +393,13 @@ static int nbd_co_flush(BlockDriverState *bs)
     return nbd_client_co_flush(bs);
 }
 
+static int64_t coroutine_fn nbd_co_get_block_status(BlockDriverState *bs,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum)
+{
+    return nbd_client_co_get_block_status(bs, sector_num, nb_sectors, pnum);
+}
+
 static void nbd_refresh_limits(BlockDriverState *bs, Error **errp)
 {
     bs->bl.max_discard = UINT32_MAX >> BDRV_SECTOR_BITS;
@@ -325,7 +424,7 @@ static int64_t nbd_getlength(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
 
-    return s->client.size;
+    return s->client.sessions[0].size;
 }
 
 static void nbd_detach_aio_context(BlockDriverState *bs)
@@ -395,6 +494,7 @@ static BlockDriver bdrv_nbd = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_discard            = nbd_co_discard,
+    .bdrv_co_get_block_status   = nbd_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -413,6 +513,7 @@ static BlockDriver bdrv_nbd_tcp = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_discard            = nbd_co_discard,
+    .bdrv_co_get_block_status   = nbd_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -431,6 +532,7 @@ static BlockDriver bdrv_nbd_unix = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_discard            = nbd_co_discard,
+    .bdrv_co_get_block_status   = nbd_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
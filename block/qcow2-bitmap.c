@@ -0,0 +1,928 @@
+/*
+ * Persistent dirty bitmaps for the QCOW version 2 format
+ *
+ * Named dirty bitmaps can be stored in a qcow2 image so that they survive
+ * closing and reopening it, e.g. to continue incremental backups after a
+ * restart.  The layout of the bitmap directory and the bitmap tables is
+ * described in docs/specs/qcow2.txt.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/qcow2.h"
+#include "qemu/error-report.h"
+
+/* Bitmap directory entry flags */
+#define BME_RESERVED_FLAGS              0xfffffffcU
+#define BME_FLAG_IN_USE                 (1U << 0)
+#define BME_FLAG_AUTO                   (1U << 1)
+
+/* Bitmap types */
+#define BT_DIRTY_TRACKING_BITMAP        1
+
+#define BME_MAX_TABLE_SIZE              0x8000000
+#define BME_MAX_NAME_SIZE               1023
+#define BME_MIN_GRANULARITY_BITS        9
+#define BME_MAX_GRANULARITY_BITS        31
+
+#define QCOW2_MAX_BITMAPS               65535
+#define QCOW2_MAX_BITMAP_DIRECTORY_SIZE (1024 * QCOW2_MAX_BITMAPS)
+
+/* Bitmap table entries: zero means that the cluster is all zeroes */
+#define BME_TABLE_ENTRY_OFFSET_MASK     0x00fffffffffffe00ULL
+#define BME_TABLE_ENTRY_RESERVED_MASK   0xff000000000001ffULL
+
+typedef struct Qcow2Bitmap {
+    uint64_t table_offset;
+    uint32_t table_size;
+    uint32_t flags;
+    uint8_t type;
+    uint8_t granularity_bits;
+    char *name;
+    uint8_t *extra_data;            /* opaque, preserved when rewriting */
+    uint32_t extra_data_size;
+} Qcow2Bitmap;
+
+static inline uint64_t dir_entry_size(size_t name_size, size_t extra_data_size)
+{
+    return align_offset(sizeof(Qcow2BitmapDirEntry) +
+                        name_size + extra_data_size, 8);
+}
+
+/* Number of guest sectors covered by one cluster of bitmap data */
+static inline uint64_t bitmap_sectors_per_cluster(BDRVQcowState *s,
+                                                  int granularity_bits)
+{
+    return ((uint64_t)s->cluster_size * 8) <<
+           (granularity_bits - BDRV_SECTOR_BITS);
+}
+
+static inline uint64_t bitmap_table_size(BlockDriverState *bs,
+                                         int granularity_bits)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    return DIV_ROUND_UP(bs->total_sectors,
+                        bitmap_sectors_per_cluster(s, granularity_bits));
+}
+
+static void bitmap_list_free(Qcow2Bitmap *bitmaps, uint32_t nb_bitmaps)
+{
+    uint32_t i;
+
+    for (i = 0; i < nb_bitmaps; i++) {
+        g_free(bitmaps[i].name);
+        g_free(bitmaps[i].extra_data);
+    }
+    g_free(bitmaps);
+}
+
+/*
+ * Reads and validates the bitmap directory that the header extension points
+ * to.  On success, *pbitmaps contains s->nb_bitmaps entries.
+ */
+static int bitmap_list_load(BlockDriverState *bs, Qcow2Bitmap **pbitmaps,
+                            Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Bitmap *bitmaps;
+    uint8_t *dir, *dir_end, *p;
+    uint32_t i;
+    int ret;
+
+    if (s->bitmap_directory_size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+        error_setg(errp, "Bitmap directory too large");
+        return -EINVAL;
+    }
+
+    dir = g_try_malloc(s->bitmap_directory_size);
+    if (dir == NULL) {
+        error_setg(errp, "Could not allocate bitmap directory");
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(bs->file, s->bitmap_directory_offset, dir,
+                     s->bitmap_directory_size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read bitmap directory");
+        g_free(dir);
+        return ret;
+    }
+
+    bitmaps = g_new0(Qcow2Bitmap, s->nb_bitmaps);
+    dir_end = dir + s->bitmap_directory_size;
+    for (i = 0, p = dir; i < s->nb_bitmaps; i++) {
+        Qcow2BitmapDirEntry *e = (Qcow2BitmapDirEntry *)p;
+        Qcow2Bitmap *bm = &bitmaps[i];
+
+        if (dir_end - p < sizeof(*e)) {
+            error_setg(errp, "Bitmap directory is truncated");
+            ret = -EINVAL;
+            goto fail;
+        }
+
+        bm->table_offset     = be64_to_cpu(e->bitmap_table_offset);
+        bm->table_size       = be32_to_cpu(e->bitmap_table_size);
+        bm->flags            = be32_to_cpu(e->flags);
+        bm->type             = e->type;
+        bm->granularity_bits = e->granularity_bits;
+
+        if (dir_entry_size(be16_to_cpu(e->name_size),
+                           be32_to_cpu(e->extra_data_size)) > dir_end - p) {
+            error_setg(errp, "Bitmap directory is truncated");
+            ret = -EINVAL;
+            goto fail;
+        }
+        if (be16_to_cpu(e->name_size) > BME_MAX_NAME_SIZE ||
+            e->name_size == 0) {
+            error_setg(errp, "Invalid bitmap name size");
+            ret = -EINVAL;
+            goto fail;
+        }
+        bm->extra_data_size = be32_to_cpu(e->extra_data_size);
+        if (bm->extra_data_size) {
+            bm->extra_data = g_memdup(e + 1, bm->extra_data_size);
+        }
+        bm->name = g_strndup((char *)(e + 1) + bm->extra_data_size,
+                             be16_to_cpu(e->name_size));
+
+        if (bm->flags & BME_RESERVED_FLAGS) {
+            error_setg(errp, "Bitmap '%s' has unknown flags", bm->name);
+            ret = -ENOTSUP;
+            goto fail;
+        }
+        if (offset_into_cluster(s, bm->table_offset) ||
+            bm->table_size > BME_MAX_TABLE_SIZE ||
+            bm->granularity_bits < BME_MIN_GRANULARITY_BITS ||
+            bm->granularity_bits > BME_MAX_GRANULARITY_BITS) {
+            error_setg(errp, "Bitmap '%s' has an invalid directory entry",
+                       bm->name);
+            ret = -EINVAL;
+            goto fail;
+        }
+
+        p += dir_entry_size(be16_to_cpu(e->name_size),
+                            be32_to_cpu(e->extra_data_size));
+    }
+
+    g_free(dir);
+    *pbitmaps = bitmaps;
+    return 0;
+
+fail:
+    g_free(dir);
+    bitmap_list_free(bitmaps, s->nb_bitmaps);
+    return ret;
+}
+
+static Qcow2Bitmap *bitmap_list_find(Qcow2Bitmap *bitmaps,
+                                     uint32_t nb_bitmaps, const char *name)
+{
+    uint32_t i;
+
+    for (i = 0; i < nb_bitmaps; i++) {
+        if (!strcmp(bitmaps[i].name, name)) {
+            return &bitmaps[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Writes a bitmap directory for @bitmaps to newly allocated clusters and
+ * returns their offset and size in *offset and *size.  The directory that
+ * the header points to is never overwritten, so that an interrupted update
+ * cannot leave a half-written directory behind.
+ */
+static int bitmap_list_store(BlockDriverState *bs, Qcow2Bitmap *bitmaps,
+                             uint32_t nb_bitmaps, uint64_t *offset,
+                             uint64_t *size)
+{
+    uint8_t *dir, *p;
+    uint64_t dir_size = 0;
+    int64_t dir_offset;
+    uint32_t i;
+    int ret;
+
+    for (i = 0; i < nb_bitmaps; i++) {
+        dir_size += dir_entry_size(strlen(bitmaps[i].name),
+                                   bitmaps[i].extra_data_size);
+    }
+    if (dir_size == 0 || dir_size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+        return -EINVAL;
+    }
+
+    dir = g_malloc0(dir_size);
+    for (i = 0, p = dir; i < nb_bitmaps; i++) {
+        Qcow2BitmapDirEntry *e = (Qcow2BitmapDirEntry *)p;
+        size_t name_size = strlen(bitmaps[i].name);
+        uint32_t extra_data_size = bitmaps[i].extra_data_size;
+
+        e->bitmap_table_offset = cpu_to_be64(bitmaps[i].table_offset);
+        e->bitmap_table_size   = cpu_to_be32(bitmaps[i].table_size);
+        e->flags               = cpu_to_be32(bitmaps[i].flags);
+        e->type                = bitmaps[i].type;
+        e->granularity_bits    = bitmaps[i].granularity_bits;
+        e->name_size           = cpu_to_be16(name_size);
+        e->extra_data_size     = cpu_to_be32(extra_data_size);
+        memcpy(e + 1, bitmaps[i].extra_data, extra_data_size);
+        memcpy((uint8_t *)(e + 1) + extra_data_size, bitmaps[i].name,
+               name_size);
+
+        p += dir_entry_size(name_size, extra_data_size);
+    }
+
+    dir_offset = qcow2_alloc_clusters(bs, dir_size);
+    if (dir_offset < 0) {
+        ret = dir_offset;
+        goto out;
+    }
+
+    /* The directory is not covered by any overlap check category */
+    ret = qcow2_pre_write_overlap_check(bs, 0, dir_offset, dir_size);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = bdrv_pwrite(bs->file, dir_offset, dir, dir_size);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    *offset = dir_offset;
+    *size = dir_size;
+    ret = 0;
+    goto out;
+
+fail:
+    qcow2_free_clusters(bs, dir_offset, dir_size, QCOW2_DISCARD_OTHER);
+out:
+    g_free(dir);
+    return ret;
+}
+
+static int bitmap_table_load(BlockDriverState *bs, const Qcow2Bitmap *bm,
+                             uint64_t **ptable)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t *table;
+    uint32_t i;
+    int ret;
+
+    table = g_try_new(uint64_t, bm->table_size);
+    if (table == NULL) {
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(bs->file, bm->table_offset, table,
+                     bm->table_size * sizeof(uint64_t));
+    if (ret < 0) {
+        g_free(table);
+        return ret;
+    }
+
+    for (i = 0; i < bm->table_size; i++) {
+        be64_to_cpus(&table[i]);
+        if ((table[i] & BME_TABLE_ENTRY_RESERVED_MASK) ||
+            offset_into_cluster(s, table[i])) {
+            g_free(table);
+            return -EINVAL;
+        }
+    }
+
+    *ptable = table;
+    return 0;
+}
+
+/* Frees the bitmap table and all data clusters of a stored bitmap */
+static void bitmap_free_clusters(BlockDriverState *bs, const Qcow2Bitmap *bm)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t *table;
+    uint32_t i;
+
+    if (bitmap_table_load(bs, bm, &table) < 0) {
+        /* Leak the data clusters, but the table can still go */
+        goto free_table;
+    }
+
+    for (i = 0; i < bm->table_size; i++) {
+        if (table[i]) {
+            qcow2_free_clusters(bs, table[i] & BME_TABLE_ENTRY_OFFSET_MASK,
+                                s->cluster_size, QCOW2_DISCARD_OTHER);
+        }
+    }
+    g_free(table);
+
+free_table:
+    qcow2_free_clusters(bs, bm->table_offset,
+                        bm->table_size * sizeof(uint64_t),
+                        QCOW2_DISCARD_OTHER);
+}
+
+static int bitmap_load_data(BlockDriverState *bs, const Qcow2Bitmap *bm,
+                            BdrvDirtyBitmap *bitmap)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t sectors_per_cluster;
+    uint64_t *table;
+    uint8_t *buf;
+    int64_t sector, total_sectors;
+    uint32_t i;
+    int ret;
+
+    ret = bitmap_table_load(bs, bm, &table);
+    if (ret < 0) {
+        return ret;
+    }
+
+    total_sectors = bdrv_dirty_bitmap_size(bitmap);
+    sectors_per_cluster = bitmap_sectors_per_cluster(s, bm->granularity_bits);
+    buf = g_malloc(s->cluster_size);
+
+    for (i = 0, sector = 0; i < bm->table_size; i++) {
+        uint64_t count = MIN(total_sectors - sector, sectors_per_cluster);
+
+        /* The new bitmap is empty, so all-zeroes clusters can be skipped */
+        if (table[i]) {
+            ret = bdrv_pread(bs->file, table[i] & BME_TABLE_ENTRY_OFFSET_MASK,
+                             buf, s->cluster_size);
+            if (ret < 0) {
+                goto out;
+            }
+            bdrv_dirty_bitmap_deserialize_part(bitmap, buf, sector, count,
+                                               false);
+        }
+        sector += count;
+    }
+    bdrv_dirty_bitmap_deserialize_finish(bitmap);
+    ret = 0;
+
+out:
+    g_free(buf);
+    g_free(table);
+    return ret;
+}
+
+/*
+ * Writes the contents of @bitmap to newly allocated clusters and fills in the
+ * table location in @bm.  Clusters that would be all zeroes are not
+ * allocated.
+ */
+static int bitmap_store_data(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                             Qcow2Bitmap *bm)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t sectors_per_cluster;
+    uint64_t *table;
+    uint8_t *buf;
+    int64_t sector, total_sectors, table_offset;
+    uint32_t i, table_size;
+    int ret;
+
+    total_sectors = bdrv_dirty_bitmap_size(bitmap);
+    sectors_per_cluster = bitmap_sectors_per_cluster(s, bm->granularity_bits);
+    table_size = bitmap_table_size(bs, bm->granularity_bits);
+    if (table_size == 0) {
+        return -EINVAL;
+    }
+
+    table = g_new0(uint64_t, table_size);
+    buf = g_malloc(s->cluster_size);
+
+    for (i = 0, sector = 0; i < table_size; i++) {
+        uint64_t count = MIN(total_sectors - sector, sectors_per_cluster);
+        int64_t offset;
+
+        if (bdrv_dirty_bitmap_range_empty(bitmap, sector, count)) {
+            sector += count;
+            continue;
+        }
+
+        offset = qcow2_alloc_clusters(bs, s->cluster_size);
+        if (offset < 0) {
+            ret = offset;
+            goto fail;
+        }
+        table[i] = offset;
+
+        memset(buf, 0, s->cluster_size);
+        bdrv_dirty_bitmap_serialize_part(bitmap, buf, sector, count);
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, offset, s->cluster_size);
+        if (ret < 0) {
+            goto fail;
+        }
+        ret = bdrv_pwrite(bs->file, offset, buf, s->cluster_size);
+        if (ret < 0) {
+            goto fail;
+        }
+        sector += count;
+    }
+
+    table_offset = qcow2_alloc_clusters(bs, table_size * sizeof(uint64_t));
+    if (table_offset < 0) {
+        ret = table_offset;
+        goto fail;
+    }
+
+    for (i = 0; i < table_size; i++) {
+        cpu_to_be64s(&table[i]);
+    }
+    ret = qcow2_pre_write_overlap_check(bs, 0, table_offset,
+                                        table_size * sizeof(uint64_t));
+    if (ret < 0) {
+        goto fail_table;
+    }
+    ret = bdrv_pwrite(bs->file, table_offset, table,
+                      table_size * sizeof(uint64_t));
+    if (ret < 0) {
+        goto fail_table;
+    }
+
+    bm->table_offset = table_offset;
+    bm->table_size = table_size;
+    g_free(buf);
+    g_free(table);
+    return 0;
+
+fail_table:
+    qcow2_free_clusters(bs, table_offset, table_size * sizeof(uint64_t),
+                        QCOW2_DISCARD_OTHER);
+    for (i = 0; i < table_size; i++) {
+        be64_to_cpus(&table[i]);
+    }
+fail:
+    for (i = 0; i < table_size; i++) {
+        if (table[i]) {
+            qcow2_free_clusters(bs, table[i], s->cluster_size,
+                                QCOW2_DISCARD_OTHER);
+        }
+    }
+    g_free(buf);
+    g_free(table);
+    return ret;
+}
+
+/*
+ * Replaces the bitmap directory by one for @bitmaps, which describes the same
+ * s->nb_bitmaps bitmaps with possibly different flags.  The header is only
+ * switched to the new directory once it is on disk.
+ */
+static int bitmap_list_update(BlockDriverState *bs, Qcow2Bitmap *bitmaps)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t dir_offset, dir_size, old_dir_offset, old_dir_size;
+    int ret;
+
+    ret = bitmap_list_store(bs, bitmaps, s->nb_bitmaps, &dir_offset,
+                            &dir_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret == 0) {
+        ret = bdrv_flush(bs->file);
+    }
+    if (ret < 0) {
+        goto fail;
+    }
+
+    old_dir_offset = s->bitmap_directory_offset;
+    old_dir_size = s->bitmap_directory_size;
+    s->bitmap_directory_offset = dir_offset;
+    s->bitmap_directory_size = dir_size;
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->bitmap_directory_offset = old_dir_offset;
+        s->bitmap_directory_size = old_dir_size;
+        goto fail;
+    }
+
+    qcow2_free_clusters(bs, old_dir_offset, old_dir_size, QCOW2_DISCARD_OTHER);
+    return 0;
+
+fail:
+    qcow2_free_clusters(bs, dir_offset, dir_size, QCOW2_DISCARD_OTHER);
+    return ret;
+}
+
+/*
+ * Creates a persistent BdrvDirtyBitmap for every bitmap stored in the image.
+ *
+ * Bitmaps that were not written back correctly (because the image was not
+ * closed cleanly) are marked in use and cannot be trusted; they are not
+ * loaded, but stay in the image until a bitmap with the same name replaces
+ * them.  If the image is opened read-write, all stored bitmaps are marked in
+ * use until qcow2_store_bitmaps() writes them back.
+ */
+int qcow2_read_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Bitmap *bitmaps;
+    BdrvDirtyBitmap **created;
+    uint32_t i, nb_created = 0;
+    int ret;
+
+    if (s->nb_bitmaps == 0) {
+        return 0;
+    }
+
+    ret = bitmap_list_load(bs, &bitmaps, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    created = g_new0(BdrvDirtyBitmap *, s->nb_bitmaps);
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        Qcow2Bitmap *bm = &bitmaps[i];
+        BdrvDirtyBitmap *bitmap;
+
+        if (bm->type != BT_DIRTY_TRACKING_BITMAP) {
+            error_setg(errp, "Bitmap '%s' has unsupported type %d",
+                       bm->name, bm->type);
+            ret = -ENOTSUP;
+            goto fail;
+        }
+
+        /* A bitmap received through migration takes precedence */
+        if (bdrv_find_dirty_bitmap(bs, bm->name)) {
+            continue;
+        }
+
+        if (bm->flags & BME_FLAG_IN_USE) {
+            error_report("qcow2: Bitmap '%s' was not saved correctly; it is "
+                         "kept in the image, but not loaded", bm->name);
+            s->inconsistent_bitmaps = g_slist_prepend(s->inconsistent_bitmaps,
+                                                      g_strdup(bm->name));
+            continue;
+        }
+
+        if (bm->table_size != bitmap_table_size(bs, bm->granularity_bits)) {
+            error_setg(errp, "Bitmap '%s' does not match the image size",
+                       bm->name);
+            ret = -EINVAL;
+            goto fail;
+        }
+
+        bitmap = bdrv_create_dirty_bitmap(bs, 1U << bm->granularity_bits,
+                                          bm->name, errp);
+        if (bitmap == NULL) {
+            ret = -EINVAL;
+            goto fail;
+        }
+        created[nb_created++] = bitmap;
+
+        ret = bitmap_load_data(bs, bm, bitmap);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read bitmap '%s'",
+                             bm->name);
+            goto fail;
+        }
+
+        bdrv_dirty_bitmap_set_persistence(bitmap, true);
+        if (!(bm->flags & BME_FLAG_AUTO)) {
+            bdrv_disable_dirty_bitmap(bitmap);
+        }
+    }
+
+    if (!bs->read_only) {
+        for (i = 0; i < s->nb_bitmaps; i++) {
+            bitmaps[i].flags |= BME_FLAG_IN_USE;
+        }
+        ret = bitmap_list_update(bs, bitmaps);
+        if (ret == 0) {
+            ret = bdrv_flush(bs->file);
+        }
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not mark bitmaps in use");
+            goto fail;
+        }
+    }
+
+    bitmap_list_free(bitmaps, s->nb_bitmaps);
+    g_free(created);
+    return 0;
+
+fail:
+    for (i = 0; i < nb_created; i++) {
+        bdrv_release_dirty_bitmap(bs, created[i]);
+    }
+    bitmap_list_free(bitmaps, s->nb_bitmaps);
+    g_free(created);
+    return ret;
+}
+
+/*
+ * Returns whether the stored bitmap @bm must be kept when storing bitmaps:
+ * it could not be loaded and no persistent bitmap of the same name replaces
+ * it.
+ */
+static bool bitmap_is_kept(BlockDriverState *bs, const Qcow2Bitmap *bm)
+{
+    BDRVQcowState *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+
+    if (!g_slist_find_custom(s->inconsistent_bitmaps, bm->name,
+                             (GCompareFunc)strcmp)) {
+        return false;
+    }
+
+    bitmap = bdrv_find_dirty_bitmap(bs, bm->name);
+    return bitmap == NULL || !bdrv_dirty_bitmap_get_persistence(bitmap);
+}
+
+/*
+ * Writes all persistent dirty bitmaps of @bs to the image, replacing the
+ * bitmaps that were stored before.  The new data and directory are written
+ * to newly allocated clusters before the header is switched over to them,
+ * so a failure leaves the old bitmaps intact.
+ */
+int qcow2_store_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    Qcow2Bitmap *old_bitmaps = NULL, *new_bitmaps;
+    uint32_t i, j, nb_old = 0, nb_new = 0, nb_kept = 0;
+    GSList *l, *next;
+    uint64_t dir_offset = 0, dir_size = 0;
+    uint64_t old_dir_offset, old_dir_size, old_autoclear;
+    Error *local_err = NULL;
+    int ret;
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap != NULL;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) {
+        if (bdrv_dirty_bitmap_get_persistence(bitmap)) {
+            nb_new++;
+        }
+    }
+
+    if (nb_new == 0 && s->nb_bitmaps == 0) {
+        return 0;
+    }
+
+    if (s->nb_bitmaps) {
+        if (bitmap_list_load(bs, &old_bitmaps, &local_err) < 0) {
+            /* The old bitmaps' clusters are leaked, but can be replaced */
+            error_report_err(local_err);
+        } else {
+            nb_old = s->nb_bitmaps;
+        }
+    }
+
+    for (j = 0; j < nb_old; j++) {
+        if (bitmap_is_kept(bs, &old_bitmaps[j])) {
+            nb_kept++;
+        }
+    }
+
+    new_bitmaps = g_new0(Qcow2Bitmap, nb_new + nb_kept);
+    i = 0;
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap != NULL;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) {
+        Qcow2Bitmap *bm, *old_bm;
+
+        if (!bdrv_dirty_bitmap_get_persistence(bitmap)) {
+            continue;
+        }
+
+        bm = &new_bitmaps[i];
+        bm->name = g_strdup(bdrv_dirty_bitmap_name(bitmap));
+        old_bm = bitmap_list_find(old_bitmaps, nb_old, bm->name);
+        if (old_bm && old_bm->extra_data_size) {
+            bm->extra_data = g_memdup(old_bm->extra_data,
+                                      old_bm->extra_data_size);
+            bm->extra_data_size = old_bm->extra_data_size;
+        }
+        bm->type = BT_DIRTY_TRACKING_BITMAP;
+        bm->granularity_bits = ctz32(bdrv_dirty_bitmap_granularity(bitmap));
+        bm->flags = bdrv_dirty_bitmap_enabled(bitmap) ? BME_FLAG_AUTO : 0;
+
+        ret = bitmap_store_data(bs, bitmap, bm);
+        if (ret < 0) {
+            goto fail;
+        }
+        i++;
+    }
+
+    /* Kept bitmaps go after the new ones and reuse their old clusters */
+    for (j = 0, nb_kept = 0; j < nb_old; j++) {
+        Qcow2Bitmap *bm = &new_bitmaps[nb_new + nb_kept];
+
+        if (!bitmap_is_kept(bs, &old_bitmaps[j])) {
+            continue;
+        }
+        *bm = old_bitmaps[j];
+        bm->name = g_strdup(old_bitmaps[j].name);
+        bm->extra_data = g_memdup(old_bitmaps[j].extra_data,
+                                  old_bitmaps[j].extra_data_size);
+        nb_kept++;
+    }
+
+    if (nb_new + nb_kept) {
+        ret = bitmap_list_store(bs, new_bitmaps, nb_new + nb_kept,
+                                &dir_offset, &dir_size);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    /* The new bitmaps must be on disk before the header points to them */
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret == 0) {
+        ret = bdrv_flush(bs->file);
+    }
+    if (ret < 0) {
+        goto fail_dir;
+    }
+
+    old_dir_offset = s->bitmap_directory_offset;
+    old_dir_size = s->bitmap_directory_size;
+    old_autoclear = s->autoclear_features;
+
+    s->nb_bitmaps = nb_new + nb_kept;
+    s->bitmap_directory_offset = dir_offset;
+    s->bitmap_directory_size = dir_size;
+    if (s->nb_bitmaps) {
+        s->autoclear_features |= QCOW2_AUTOCLEAR_BITMAPS;
+    } else {
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_BITMAPS;
+    }
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->nb_bitmaps = nb_old;
+        s->bitmap_directory_offset = old_dir_offset;
+        s->bitmap_directory_size = old_dir_size;
+        s->autoclear_features = old_autoclear;
+        goto fail_dir;
+    }
+
+    /* Now the old bitmaps are unreferenced, except for the kept ones */
+    for (j = 0; j < nb_old; j++) {
+        if (!bitmap_is_kept(bs, &old_bitmaps[j])) {
+            bitmap_free_clusters(bs, &old_bitmaps[j]);
+        }
+    }
+
+    if (old_dir_size) {
+        qcow2_free_clusters(bs, old_dir_offset, old_dir_size,
+                            QCOW2_DISCARD_OTHER);
+    }
+
+    /* Forget about the inconsistent bitmaps that have been replaced */
+    for (l = s->inconsistent_bitmaps; l != NULL; l = next) {
+        next = l->next;
+        if (!bitmap_list_find(new_bitmaps + nb_new, nb_kept, l->data)) {
+            g_free(l->data);
+            s->inconsistent_bitmaps =
+                g_slist_delete_link(s->inconsistent_bitmaps, l);
+        }
+    }
+
+    bitmap_list_free(old_bitmaps, nb_old);
+    bitmap_list_free(new_bitmaps, nb_new + nb_kept);
+    return 0;
+
+fail_dir:
+    if (dir_size) {
+        qcow2_free_clusters(bs, dir_offset, dir_size, QCOW2_DISCARD_OTHER);
+    }
+fail:
+    while (i-- > 0) {
+        bitmap_free_clusters(bs, &new_bitmaps[i]);
+    }
+    bitmap_list_free(old_bitmaps, nb_old);
+    bitmap_list_free(new_bitmaps, nb_new + nb_kept);
+    return ret;
+}
+
+bool qcow2_can_store_dirty_bitmap(BlockDriverState *bs, const char *name,
+                                  uint32_t granularity, Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    uint32_t nb_bitmaps = 0;
+    int granularity_bits;
+
+    if (s->qcow_version < 3) {
+        error_setg(errp, "Persistent bitmaps require a qcow2 image with at "
+                   "least qemu 1.1 compatibility level");
+        return false;
+    }
+
+    if (bs->read_only) {
+        error_setg(errp, "Cannot store bitmaps in a read-only image");
+        return false;
+    }
+
+    if (strlen(name) > BME_MAX_NAME_SIZE) {
+        error_setg(errp, "Bitmap name too long; may not exceed %d bytes",
+                   BME_MAX_NAME_SIZE);
+        return false;
+    }
+
+    granularity_bits = ctz32(granularity);
+    if (granularity_bits > BME_MAX_GRANULARITY_BITS) {
+        error_setg(errp, "Bitmap granularity too large; may not exceed "
+                   "2^%d bytes", BME_MAX_GRANULARITY_BITS);
+        return false;
+    }
+
+    if (bitmap_table_size(bs, granularity_bits) > BME_MAX_TABLE_SIZE) {
+        error_setg(errp, "Bitmap granularity too small for the image size");
+        return false;
+    }
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap != NULL;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) {
+        if (bdrv_dirty_bitmap_get_persistence(bitmap)) {
+            nb_bitmaps++;
+        }
+    }
+    /* Bitmaps that are kept in the image count as well */
+    nb_bitmaps += g_slist_length(s->inconsistent_bitmaps);
+    if (nb_bitmaps >= QCOW2_MAX_BITMAPS) {
+        error_setg(errp, "Too many persistent bitmaps");
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Accounts for the bitmap directory, the bitmap tables and the bitmap data
+ * clusters when checking the image's refcounts.
+ */
+int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                                  void **refcount_table,
+                                  int64_t *refcount_table_size)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Bitmap *bitmaps;
+    Error *local_err = NULL;
+    uint32_t i, j;
+    int ret;
+
+    if (s->nb_bitmaps == 0) {
+        return 0;
+    }
+
+    ret = qcow2_inc_refcounts(bs, res, refcount_table, refcount_table_size,
+                              s->bitmap_directory_offset,
+                              s->bitmap_directory_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (bitmap_list_load(bs, &bitmaps, &local_err) < 0) {
+        fprintf(stderr, "ERROR %s\n", error_get_pretty(local_err));
+        error_free(local_err);
+        res->corruptions++;
+        return 0;
+    }
+
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        uint64_t *table;
+
+        ret = qcow2_inc_refcounts(bs, res, refcount_table,
+                                  refcount_table_size,
+                                  bitmaps[i].table_offset,
+                                  bitmaps[i].table_size * sizeof(uint64_t));
+        if (ret < 0) {
+            goto out;
+        }
+
+        if (bitmap_table_load(bs, &bitmaps[i], &table) < 0) {
+            fprintf(stderr, "ERROR bitmap table of '%s' is invalid\n",
+                    bitmaps[i].name);
+            res->corruptions++;
+            continue;
+        }
+
+        for (j = 0; j < bitmaps[i].table_size; j++) {
+            if (table[j] == 0) {
+                continue;
+            }
+            ret = qcow2_inc_refcounts(bs, res, refcount_table,
+                                      refcount_table_size,
+                                      table[j] & BME_TABLE_ENTRY_OFFSET_MASK,
+                                      s->cluster_size);
+            if (ret < 0) {
+                g_free(table);
+                goto out;
+            }
+        }
+        g_free(table);
+    }
+    ret = 0;
+
+out:
+    bitmap_list_free(bitmaps, s->nb_bitmaps);
+    return ret;
+}
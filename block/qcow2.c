@@ -35,6 +35,7 @@
 #include "qapi-event.h"
 #include "trace.h"
 #include "qemu/option_int.h"
+#include "block/thread-pool.h"
 
 /*
   Differences with QCOW:
@@ -61,6 +62,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -160,6 +162,51 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             break;
 
+        case QCOW2_EXT_MAGIC_BITMAPS:
+        {
+            Qcow2BitmapHeaderExt bitmaps_ext;
+
+            /* The extension is stale if the autoclear bit has been cleared */
+            if (!(s->autoclear_features & QCOW2_AUTOCLEAR_BITMAPS)) {
+                break;
+            }
+            if (ext.len != sizeof(bitmaps_ext)) {
+                error_setg(errp, "ERROR: bitmaps_ext: Invalid extension "
+                           "length");
+                return -EINVAL;
+            }
+            ret = bdrv_pread(bs->file, offset, &bitmaps_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: bitmaps_ext: "
+                                 "Could not read ext header");
+                return ret;
+            }
+            be32_to_cpus(&bitmaps_ext.nb_bitmaps);
+            be64_to_cpus(&bitmaps_ext.bitmap_directory_size);
+            be64_to_cpus(&bitmaps_ext.bitmap_directory_offset);
+
+            if (bitmaps_ext.reserved32 != 0) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "Reserved field is not zero");
+                return -EINVAL;
+            }
+            if (bitmaps_ext.nb_bitmaps == 0 ||
+                offset_into_cluster(s, bitmaps_ext.bitmap_directory_offset)) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "Invalid bitmap directory");
+                return -EINVAL;
+            }
+
+            s->nb_bitmaps = bitmaps_ext.nb_bitmaps;
+            s->bitmap_directory_size = bitmaps_ext.bitmap_directory_size;
+            s->bitmap_directory_offset = bitmaps_ext.bitmap_directory_offset;
+#ifdef DEBUG_EXT
+            printf("Qcow2: Got bitmaps extension: nb_bitmaps=%" PRIu32 "\n",
+                   s->nb_bitmaps);
+#endif
+            break;
+        }
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             {
@@ -904,8 +951,9 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     /* Clear unknown autoclear feature bits */
-    if (!bs->read_only && !(flags & BDRV_O_INCOMING) && s->autoclear_features) {
-        s->autoclear_features = 0;
+    if (!bs->read_only && !(flags & BDRV_O_INCOMING) &&
+        (s->autoclear_features & ~QCOW2_AUTOCLEAR_MASK)) {
+        s->autoclear_features &= QCOW2_AUTOCLEAR_MASK;
         ret = qcow2_update_header(bs);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Could not update qcow2 header");
@@ -992,6 +1040,14 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    /* An incoming migration loads the bitmaps in qcow2_invalidate_cache() */
+    if (!(flags & BDRV_O_INCOMING)) {
+        ret = qcow2_read_bitmaps(bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
@@ -1075,9 +1131,17 @@ static int qcow2_set_key(BlockDriverState *bs, const char *key)
 static int qcow2_reopen_prepare(BDRVReopenState *state,
                                 BlockReopenQueue *queue, Error **errp)
 {
+    BDRVQcowState *s = state->bs->opaque;
     int ret;
 
-    if ((state->flags & BDRV_O_RDWR) == 0) {
+    /* After migration, the image belongs to the destination */
+    if ((state->flags & BDRV_O_RDWR) == 0 && !(s->flags & BDRV_O_INACTIVE)) {
+        ret = qcow2_store_bitmaps(state->bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not store persistent bitmaps");
+            return ret;
+        }
+
         ret = bdrv_flush(state->bs);
         if (ret < 0) {
             return ret;
@@ -1439,11 +1503,27 @@ fail:
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+
+    /* s->flags still has BDRV_O_INCOMING or BDRV_O_INACTIVE if called from
+     * invalidate_cache; an inactive image has already been written back by
+     * qcow2_inactivate() and may be in use by the migration destination */
+    if (!(s->flags & (BDRV_O_INCOMING | BDRV_O_INACTIVE)) && !bs->read_only) {
+        int ret = qcow2_store_bitmaps(bs);
+        if (ret < 0) {
+            error_report("Failed to store persistent bitmaps: %s",
+                         strerror(-ret));
+        }
+    }
+
+    g_slist_foreach(s->inconsistent_bitmaps, (GFunc)g_free, NULL);
+    g_slist_free(s->inconsistent_bitmaps);
+    s->inconsistent_bitmaps = NULL;
+
     qemu_vfree(s->l1_table);
     /* else pre-write overlap checks in cache_destroy may crash */
     s->l1_table = NULL;
 
-    if (!(bs->open_flags & BDRV_O_INCOMING)) {
+    if (!(bs->open_flags & BDRV_O_INCOMING) && !(s->flags & BDRV_O_INACTIVE)) {
         int ret1, ret2;
 
         ret1 = qcow2_cache_flush(bs, s->l2_table_cache);
@@ -1478,10 +1558,41 @@ static void qcow2_close(BlockDriverState *bs)
     qcow2_free_snapshots(bs);
 }
 
+static int qcow2_inactivate(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret = 0;
+
+    if (!bs->read_only) {
+        ret = qcow2_store_bitmaps(bs);
+        if (ret < 0) {
+            error_report("Failed to store persistent bitmaps: %s",
+                         strerror(-ret));
+            return ret;
+        }
+
+        ret = qcow2_cache_flush(bs, s->l2_table_cache);
+        if (ret == 0) {
+            ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+        }
+        if (ret == 0) {
+            ret = qcow2_mark_clean(bs);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    s->flags |= BDRV_O_INACTIVE;
+    return 0;
+}
+
 static void qcow2_invalidate_cache(BlockDriverState *bs, Error **errp)
 {
     BDRVQcowState *s = bs->opaque;
-    int flags = s->flags;
+    /* The image is ours now, so open it like any other image (this also
+     * loads persistent bitmaps that were not migrated) */
+    int flags = s->flags & ~(BDRV_O_INCOMING | BDRV_O_INACTIVE);
     AES_KEY aes_encrypt_key;
     AES_KEY aes_decrypt_key;
     uint32_t crypt_method = 0;
@@ -1651,6 +1762,27 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Bitmaps header extension */
+    if (s->nb_bitmaps > 0) {
+        Qcow2BitmapHeaderExt bitmaps_header = {
+            .nb_bitmaps = cpu_to_be32(s->nb_bitmaps),
+            .bitmap_directory_size =
+                cpu_to_be64(s->bitmap_directory_size),
+            .bitmap_directory_offset =
+                cpu_to_be64(s->bitmap_directory_offset),
+        };
+
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_BITMAPS,
+                             &bitmaps_header, sizeof(bitmaps_header),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Feature table */
     Qcow2Feature features[] = {
         {
@@ -1668,6 +1800,11 @@ int qcow2_update_header(BlockDriverState *bs)
             .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
             .name = "lazy refcounts",
         },
+        {
+            .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+            .bit  = QCOW2_AUTOCLEAR_BITMAPS_BITNR,
+            .name = "bitmaps",
+        },
     };
 
     ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -2213,11 +2350,60 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
 
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
+typedef struct Qcow2CompressData {
+    uint8_t *dest;
+    const uint8_t *src;
+    size_t size;
+    ssize_t ret;
+} Qcow2CompressData;
+
+/* Compress one cluster into @dest, which must be at least as large as the
+ * input.  Returns the compressed size, or -ENOSPC if the data does not become
+ * smaller and should be written uncompressed.
+ */
+static int qcow2_compress(void *opaque)
+{
+    Qcow2CompressData *data = opaque;
+    z_stream strm;
+    int ret;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != 0) {
+        data->ret = -EINVAL;
+        return 0;
+    }
+
+    strm.avail_in = data->size;
+    strm.next_in = (uint8_t *)data->src;
+    strm.avail_out = data->size;
+    strm.next_out = data->dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret == Z_STREAM_END) {
+        data->ret = strm.next_out - data->dest;
+    } else if (ret == Z_OK) {
+        /* The output buffer is full */
+        data->ret = -ENOSPC;
+    } else {
+        data->ret = -EINVAL;
+    }
+    deflateEnd(&strm);
+
+    if (data->ret >= (ssize_t)data->size) {
+        data->ret = -ENOSPC;
+    }
+    return 0;
+}
+
 static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
                                   const uint8_t *buf, int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
-    z_stream strm;
+    Qcow2CompressData data;
     int ret, out_len;
     uint8_t *out_buf;
     uint64_t cluster_offset;
@@ -2245,42 +2431,46 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
         return ret;
     }
 
-    out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
+    out_buf = g_malloc(s->cluster_size);
 
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
+    data = (Qcow2CompressData) {
+        .dest   = out_buf,
+        .src    = buf,
+        .size   = s->cluster_size,
+    };
 
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
+    /* Compression is CPU bound, so when several compressed writes are in
+     * flight (qemu-img convert with several coroutines), let them run in
+     * parallel in the thread pool instead of blocking the event loop.
+     */
+    if (qemu_in_coroutine()) {
+        ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+        thread_pool_submit_co(pool, qcow2_compress, &data);
+    } else {
+        qcow2_compress(&data);
+    }
 
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
+    if (data.ret < 0 && data.ret != -ENOSPC) {
+        ret = data.ret;
         goto fail;
     }
-    out_len = strm.next_out - out_buf;
-
-    deflateEnd(&strm);
+    out_len = data.ret;
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    if (out_len < 0) {
         /* could not compress: write normal cluster */
         ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
         if (ret < 0) {
             goto fail;
         }
     } else {
+        if (qemu_in_coroutine()) {
+            qemu_co_mutex_lock(&s->lock);
+        }
         cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
             sector_num << 9, out_len);
+        if (qemu_in_coroutine()) {
+            qemu_co_mutex_unlock(&s->lock);
+        }
         if (!cluster_offset) {
             ret = -EIO;
             goto fail;
@@ -2663,6 +2853,13 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version,
         return -ENOTSUP;
     }
 
+    /* persistent bitmaps cannot be stored in version 2 images */
+    if (s->nb_bitmaps) {
+        error_report("qcow2_downgrade: Images with persistent bitmaps cannot "
+                     "be downgraded.");
+        return -ENOTSUP;
+    }
+
     /* since we can ignore compatible features, we can set them to 0 as well */
     s->compatible_features = 0;
     /* if lazy refcounts have been used, they have already been fixed through
@@ -2971,10 +3168,12 @@ BlockDriver bdrv_qcow2 = {
 
     .bdrv_refresh_limits        = qcow2_refresh_limits,
     .bdrv_invalidate_cache      = qcow2_invalidate_cache,
+    .bdrv_inactivate            = qcow2_inactivate,
 
     .create_opts         = &qcow2_create_opts,
     .bdrv_check          = qcow2_check,
     .bdrv_amend_options  = qcow2_amend_options,
+    .bdrv_can_store_dirty_bitmap = qcow2_can_store_dirty_bitmap,
 };
 
 static void bdrv_qcow2_init(void)
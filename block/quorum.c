@@ -13,9 +13,8 @@
  * See the COPYING file in the top-level directory.
  */
 
-#include <gnutls/gnutls.h>
-#include <gnutls/crypto.h>
 #include "block/block_int.h"
+#include "qemu/timer.h"
 #include "qapi/qmp/qbool.h"
 #include "qapi/qmp/qdict.h"
 #include "qapi/qmp/qerror.h"
@@ -25,16 +24,18 @@
 #include "qapi/qmp/qstring.h"
 #include "qapi-event.h"
 
-#define HASH_LENGTH 32
-
 #define QUORUM_OPT_VOTE_THRESHOLD "vote-threshold"
 #define QUORUM_OPT_BLKVERIFY      "blkverify"
 #define QUORUM_OPT_REWRITE        "rewrite-corrupted"
 #define QUORUM_OPT_READ_PATTERN   "read-pattern"
 
-/* This union holds a vote hash value */
+/* Completion time charged to a child for a failed request */
+#define QUORUM_FAILURE_LATENCY_NS (1000 * SCALE_MS)
+
+/* This union holds a vote value: an error code, or for read payloads the
+ * index of the first child that returned this version of the data
+ */
 typedef union QuorumVoteValue {
-    char h[HASH_LENGTH];       /* SHA-256 hash */
     int64_t l;                 /* simpler 64 bits hash */
 } QuorumVoteValue;
 
@@ -83,6 +84,13 @@ typedef struct BDRVQuorumState {
                             */
 
     QuorumReadPattern read_pattern;
+
+    int64_t *latency_ns;   /* average completion time of each child, used
+                            * by the fastest read pattern
+                            */
+    int background_requests; /* threshold reads completed to the caller but
+                              * still waiting for slower children
+                              */
 } BDRVQuorumState;
 
 typedef struct QuorumAIOCB QuorumAIOCB;
@@ -97,6 +105,7 @@ typedef struct QuorumChildRequest {
     QEMUIOVector qiov;
     uint8_t *buf;
     int ret;
+    int64_t start_ns;
     QuorumAIOCB *parent;
 } QuorumChildRequest;
 
@@ -127,6 +136,11 @@ struct QuorumAIOCB {
     bool is_read;
     int vote_ret;
     int child_iter;             /* which child to read in fifo pattern */
+
+    bool completed;             /* threshold pattern: the caller already got
+                                 * the winning version
+                                 */
+    QuorumVoteVersion *winner;
 };
 
 static bool quorum_vote(QuorumAIOCB *acb);
@@ -150,33 +164,38 @@ static AIOCBInfo quorum_aiocb_info = {
     .cancel_async       = quorum_aio_cancel,
 };
 
+static void quorum_free_vote_list(QuorumVotes *votes);
+
 static void quorum_aio_finalize(QuorumAIOCB *acb)
 {
+    BDRVQuorumState *s = acb->common.bs->opaque;
     int i, ret = 0;
 
     if (acb->vote_ret) {
         ret = acb->vote_ret;
     }
 
-    acb->common.cb(acb->common.opaque, ret);
+    if (acb->completed) {
+        s->background_requests--;
+    } else {
+        acb->common.cb(acb->common.opaque, ret);
+    }
 
     if (acb->is_read) {
-        /* on the quorum case acb->child_iter == s->num_children - 1 */
-        for (i = 0; i <= acb->child_iter; i++) {
-            qemu_vfree(acb->qcrs[i].buf);
-            qemu_iovec_destroy(&acb->qcrs[i].qiov);
+        /* only the children that were actually read have a buffer */
+        for (i = 0; i < s->num_children; i++) {
+            if (acb->qcrs[i].buf) {
+                qemu_vfree(acb->qcrs[i].buf);
+                qemu_iovec_destroy(&acb->qcrs[i].qiov);
+            }
         }
     }
 
+    quorum_free_vote_list(&acb->votes);
     g_free(acb->qcrs);
     qemu_aio_unref(acb);
 }
 
-static bool quorum_sha256_compare(QuorumVoteValue *a, QuorumVoteValue *b)
-{
-    return !memcmp(a->h, b->h, HASH_LENGTH);
-}
-
 static bool quorum_64bits_compare(QuorumVoteValue *a, QuorumVoteValue *b)
 {
     return a->l == b->l;
@@ -201,10 +220,12 @@ static QuorumAIOCB *quorum_aio_get(BDRVQuorumState *s,
     acb->count = 0;
     acb->success_count = 0;
     acb->rewrite_count = 0;
-    acb->votes.compare = quorum_sha256_compare;
+    acb->votes.compare = quorum_64bits_compare;
     QLIST_INIT(&acb->votes.vote_list);
     acb->is_read = false;
     acb->vote_ret = 0;
+    acb->completed = false;
+    acb->winner = NULL;
 
     for (i = 0; i < s->num_children; i++) {
         acb->qcrs[i].buf = NULL;
@@ -277,16 +298,64 @@ static void quorum_copy_qiov(QEMUIOVector *dest, QEMUIOVector *source)
     }
 }
 
+/* Keep a moving average of the completion time of each child, so that a
+ * failing child stops being preferred.
+ */
+static void quorum_account_latency(BDRVQuorumState *s, int index, int ret,
+                                   int64_t start_ns)
+{
+    int64_t latency_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_ns;
+
+    if (ret < 0) {
+        latency_ns = MAX(latency_ns, QUORUM_FAILURE_LATENCY_NS);
+    }
+    s->latency_ns[index] += (latency_ns - s->latency_ns[index]) / 8;
+}
+
+/* Select the next child to read in the fifo and fastest patterns, return
+ * false if all children have been tried
+ */
+static bool quorum_next_child(QuorumAIOCB *acb)
+{
+    BDRVQuorumState *s = acb->common.bs->opaque;
+    int i, best = -1;
+
+    if (s->read_pattern == QUORUM_READ_PATTERN_FIFO) {
+        return ++acb->child_iter < s->num_children;
+    }
+
+    for (i = 0; i < s->num_children; i++) {
+        /* children that were already tried have a buffer */
+        if (acb->qcrs[i].buf) {
+            continue;
+        }
+        if (best < 0 || s->latency_ns[i] < s->latency_ns[best]) {
+            best = i;
+        }
+    }
+
+    acb->child_iter = best;
+    return best >= 0;
+}
+
+static void quorum_threshold_vote(QuorumAIOCB *acb, int index);
+static void quorum_threshold_finish(QuorumAIOCB *acb);
+
 static void quorum_aio_cb(void *opaque, int ret)
 {
     QuorumChildRequest *sacb = opaque;
     QuorumAIOCB *acb = sacb->parent;
     BDRVQuorumState *s = acb->common.bs->opaque;
+    int index = sacb - acb->qcrs;
     bool rewrite = false;
 
-    if (acb->is_read && s->read_pattern == QUORUM_READ_PATTERN_FIFO) {
-        /* We try to read next child in FIFO order if we fail to read */
-        if (ret < 0 && ++acb->child_iter < s->num_children) {
+    sacb->aiocb = NULL;
+    quorum_account_latency(s, index, ret, sacb->start_ns);
+
+    if (acb->is_read && (s->read_pattern == QUORUM_READ_PATTERN_FIFO ||
+                         s->read_pattern == QUORUM_READ_PATTERN_FASTEST)) {
+        /* We try to read the next child if we fail to read */
+        if (ret < 0 && quorum_next_child(acb)) {
             read_fifo_child(acb);
             return;
         }
@@ -304,16 +373,24 @@ static void quorum_aio_cb(void *opaque, int ret)
     if (ret == 0) {
         acb->success_count++;
     } else {
-        quorum_report_bad(acb, sacb->aiocb->bs->node_name, ret);
+        quorum_report_bad(acb, s->bs[index]->node_name, ret);
     }
     assert(acb->count <= s->num_children);
     assert(acb->success_count <= s->num_children);
+
+    if (acb->is_read && s->read_pattern == QUORUM_READ_PATTERN_THRESHOLD &&
+        ret == 0) {
+        quorum_threshold_vote(acb, index);
+    }
+
     if (acb->count < s->num_children) {
         return;
     }
 
     /* Do the vote on read */
-    if (acb->is_read) {
+    if (acb->is_read && s->read_pattern == QUORUM_READ_PATTERN_THRESHOLD) {
+        quorum_threshold_finish(acb);
+    } else if (acb->is_read) {
         rewrite = quorum_vote(acb);
     } else {
         quorum_has_too_much_io_failed(acb);
@@ -426,29 +503,6 @@ static void quorum_free_vote_list(QuorumVotes *votes)
     }
 }
 
-static int quorum_compute_hash(QuorumAIOCB *acb, int i, QuorumVoteValue *hash)
-{
-    int j, ret;
-    gnutls_hash_hd_t dig;
-    QEMUIOVector *qiov = &acb->qcrs[i].qiov;
-
-    ret = gnutls_hash_init(&dig, GNUTLS_DIG_SHA256);
-
-    if (ret < 0) {
-        return ret;
-    }
-
-    for (j = 0; j < qiov->niov; j++) {
-        ret = gnutls_hash(dig, qiov->iov[j].iov_base, qiov->iov[j].iov_len);
-        if (ret < 0) {
-            break;
-        }
-    }
-
-    gnutls_hash_deinit(dig, (void *) hash);
-    return ret;
-}
-
 static QuorumVoteVersion *quorum_get_vote_winner(QuorumVotes *votes)
 {
     int max = 0;
@@ -489,6 +543,30 @@ static bool quorum_iovec_compare(QEMUIOVector *a, QEMUIOVector *b)
     return true;
 }
 
+/* Count the data read from child @index as a vote.  Instead of hashing the
+ * payloads, each version is compared directly with the data of the first
+ * child that returned it: memcmp() is much cheaper than a cryptographic hash,
+ * and there are rarely more than one or two versions.
+ */
+static QuorumVoteVersion *quorum_count_read_vote(QuorumAIOCB *acb, int index)
+{
+    QuorumVoteVersion *version;
+    QuorumVoteValue value;
+
+    QLIST_FOREACH(version, &acb->votes.vote_list, next) {
+        if (quorum_iovec_compare(&acb->qcrs[version->index].qiov,
+                                 &acb->qcrs[index].qiov)) {
+            value = version->value;
+            quorum_count_vote(&acb->votes, &value, index);
+            return version;
+        }
+    }
+
+    value.l = index;
+    quorum_count_vote(&acb->votes, &value, index);
+    return QLIST_FIRST(&acb->votes.vote_list);
+}
+
 static void GCC_FMT_ATTR(2, 3) quorum_err(QuorumAIOCB *acb,
                                           const char *fmt, ...)
 {
@@ -560,8 +638,7 @@ static bool quorum_vote(QuorumAIOCB *acb)
 {
     bool quorum = true;
     bool rewrite = false;
-    int i, j, ret;
-    QuorumVoteValue hash;
+    int i, j;
     BDRVQuorumState *s = acb->common.bs->opaque;
     QuorumVoteVersion *winner;
 
@@ -597,18 +674,12 @@ static bool quorum_vote(QuorumAIOCB *acb)
         return false;
     }
 
-    /* compute hashes for each successful read, also store indexes */
+    /* sort the successful reads into versions */
     for (i = 0; i < s->num_children; i++) {
         if (acb->qcrs[i].ret) {
             continue;
         }
-        ret = quorum_compute_hash(acb, i, &hash);
-        /* if ever the hash computation failed */
-        if (ret < 0) {
-            acb->vote_ret = ret;
-            goto free_exit;
-        }
-        quorum_count_vote(&acb->votes, &hash, i);
+        quorum_count_read_vote(acb, i);
     }
 
     /* vote to select the most represented version */
@@ -638,6 +709,58 @@ free_exit:
     return rewrite;
 }
 
+/* In the threshold read pattern the request completes as soon as enough
+ * children returned the same data, so the slower children do not add to the
+ * latency seen by the caller.  The remaining reads are still waited for,
+ * which keeps the buffers alive and reports late bad versions.
+ */
+static void quorum_threshold_vote(QuorumAIOCB *acb, int index)
+{
+    BDRVQuorumState *s = acb->common.bs->opaque;
+    QuorumVoteVersion *version;
+
+    /* Votes of children that complete after the caller got its data are
+     * still counted so that quorum_threshold_finish() reports them.
+     */
+    version = quorum_count_read_vote(acb, index);
+    if (acb->completed || version->vote_count < s->threshold) {
+        return;
+    }
+
+    quorum_copy_qiov(acb->qiov, &acb->qcrs[version->index].qiov);
+    acb->winner = version;
+    acb->completed = true;
+    s->background_requests++;
+    acb->common.cb(acb->common.opaque, 0);
+}
+
+/* Called once every child of a threshold read has completed */
+static void quorum_threshold_finish(QuorumAIOCB *acb)
+{
+    BDRVQuorumState *s = acb->common.bs->opaque;
+
+    if (acb->completed) {
+        quorum_report_bad_versions(s, acb, &acb->winner->value);
+        return;
+    }
+
+    if (!quorum_has_too_much_io_failed(acb)) {
+        /* enough children answered but they disagree */
+        quorum_report_failure(acb);
+        acb->vote_ret = -EIO;
+    }
+}
+
+static void quorum_read_child(QuorumAIOCB *acb, int i)
+{
+    BDRVQuorumState *s = acb->common.bs->opaque;
+
+    acb->qcrs[i].start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    acb->qcrs[i].aiocb = bdrv_aio_readv(s->bs[i], acb->sector_num,
+                                        &acb->qcrs[i].qiov, acb->nb_sectors,
+                                        quorum_aio_cb, &acb->qcrs[i]);
+}
+
 static BlockAIOCB *read_quorum_children(QuorumAIOCB *acb)
 {
     BDRVQuorumState *s = acb->common.bs->opaque;
@@ -650,8 +773,7 @@ static BlockAIOCB *read_quorum_children(QuorumAIOCB *acb)
     }
 
     for (i = 0; i < s->num_children; i++) {
-        bdrv_aio_readv(s->bs[i], acb->sector_num, &acb->qcrs[i].qiov,
-                       acb->nb_sectors, quorum_aio_cb, &acb->qcrs[i]);
+        quorum_read_child(acb, i);
     }
 
     return &acb->common;
@@ -666,9 +788,7 @@ static BlockAIOCB *read_fifo_child(QuorumAIOCB *acb)
     qemu_iovec_init(&acb->qcrs[acb->child_iter].qiov, acb->qiov->niov);
     qemu_iovec_clone(&acb->qcrs[acb->child_iter].qiov, acb->qiov,
                      acb->qcrs[acb->child_iter].buf);
-    bdrv_aio_readv(s->bs[acb->child_iter], acb->sector_num,
-                   &acb->qcrs[acb->child_iter].qiov, acb->nb_sectors,
-                   quorum_aio_cb, &acb->qcrs[acb->child_iter]);
+    quorum_read_child(acb, acb->child_iter);
 
     return &acb->common;
 }
@@ -685,12 +805,14 @@ static BlockAIOCB *quorum_aio_readv(BlockDriverState *bs,
                                       nb_sectors, cb, opaque);
     acb->is_read = true;
 
-    if (s->read_pattern == QUORUM_READ_PATTERN_QUORUM) {
+    if (s->read_pattern == QUORUM_READ_PATTERN_QUORUM ||
+        s->read_pattern == QUORUM_READ_PATTERN_THRESHOLD) {
         acb->child_iter = s->num_children - 1;
         return read_quorum_children(acb);
     }
 
-    acb->child_iter = 0;
+    acb->child_iter = -1;
+    quorum_next_child(acb);
     return read_fifo_child(acb);
 }
 
@@ -707,6 +829,7 @@ static BlockAIOCB *quorum_aio_writev(BlockDriverState *bs,
     int i;
 
     for (i = 0; i < s->num_children; i++) {
+        acb->qcrs[i].start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
         acb->qcrs[i].aiocb = bdrv_aio_writev(s->bs[i], sector_num, qiov,
                                              nb_sectors, &quorum_aio_cb,
                                              &acb->qcrs[i]);
@@ -836,7 +959,8 @@ static QemuOptsList quorum_runtime_opts = {
         {
             .name = QUORUM_OPT_READ_PATTERN,
             .type = QEMU_OPT_STRING,
-            .help = "Allowed pattern: quorum, fifo. Quorum is default",
+            .help = "Allowed pattern: quorum, fifo, threshold, fastest. "
+                    "Quorum is default",
         },
         { /* end of list */ }
     },
@@ -896,11 +1020,27 @@ static int quorum_open(BlockDriverState *bs, QDict *options, int flags,
     s->threshold = qemu_opt_get_number(opts, QUORUM_OPT_VOTE_THRESHOLD, 0);
     ret = parse_read_pattern(qemu_opt_get(opts, QUORUM_OPT_READ_PATTERN));
     if (ret < 0) {
-        error_setg(&local_err, "Please set read-pattern as fifo or quorum");
+        error_setg(&local_err, "Please set read-pattern as quorum, fifo, "
+                   "threshold or fastest");
         goto exit;
     }
     s->read_pattern = ret;
 
+    if (s->read_pattern == QUORUM_READ_PATTERN_THRESHOLD) {
+        ret = quorum_valid_threshold(s->threshold, s->num_children, &local_err);
+        if (ret < 0) {
+            goto exit;
+        }
+
+        /* Bad versions may only be known after the request has completed */
+        if (qemu_opt_get_bool(opts, QUORUM_OPT_REWRITE, false)) {
+            error_setg(&local_err, "rewrite-corrupted=on cannot be used with "
+                       "read-pattern=threshold");
+            ret = -EINVAL;
+            goto exit;
+        }
+    }
+
     if (s->read_pattern == QUORUM_READ_PATTERN_QUORUM) {
         /* and validate it against s->num_children */
         ret = quorum_valid_threshold(s->threshold, s->num_children, &local_err);
@@ -929,6 +1069,7 @@ static int quorum_open(BlockDriverState *bs, QDict *options, int flags,
 
     /* allocate the children BlockDriverState array */
     s->bs = g_new0(BlockDriverState *, s->num_children);
+    s->latency_ns = g_new0(int64_t, s->num_children);
     opened = g_new0(bool, s->num_children);
 
     for (i = 0; i < s->num_children; i++) {
@@ -957,6 +1098,7 @@ close_exit:
         bdrv_unref(s->bs[i]);
     }
     g_free(s->bs);
+    g_free(s->latency_ns);
     g_free(opened);
 exit:
     qemu_opts_del(opts);
@@ -967,16 +1109,36 @@ exit:
     return ret;
 }
 
+static bool quorum_requests_pending(BlockDriverState *bs)
+{
+    BDRVQuorumState *s = bs->opaque;
+
+    return s->background_requests > 0;
+}
+
+/* Wait for the threshold reads that are still waiting for slow children */
+static void quorum_drain_background(BlockDriverState *bs)
+{
+    BDRVQuorumState *s = bs->opaque;
+
+    while (s->background_requests > 0) {
+        aio_poll(bdrv_get_aio_context(bs), true);
+    }
+}
+
 static void quorum_close(BlockDriverState *bs)
 {
     BDRVQuorumState *s = bs->opaque;
     int i;
 
+    quorum_drain_background(bs);
+
     for (i = 0; i < s->num_children; i++) {
         bdrv_unref(s->bs[i]);
     }
 
     g_free(s->bs);
+    g_free(s->latency_ns);
 }
 
 static void quorum_detach_aio_context(BlockDriverState *bs)
@@ -984,6 +1146,8 @@ static void quorum_detach_aio_context(BlockDriverState *bs)
     BDRVQuorumState *s = bs->opaque;
     int i;
 
+    quorum_drain_background(bs);
+
     for (i = 0; i < s->num_children; i++) {
         bdrv_detach_aio_context(s->bs[i]);
     }
@@ -1053,6 +1217,7 @@ static BlockDriver bdrv_quorum = {
 
     .bdrv_detach_aio_context            = quorum_detach_aio_context,
     .bdrv_attach_aio_context            = quorum_attach_aio_context,
+    .bdrv_requests_pending              = quorum_requests_pending,
 
     .is_filter                          = true,
     .bdrv_recurse_is_first_non_filter   = quorum_recurse_is_first_non_filter,
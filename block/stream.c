@@ -24,18 +24,35 @@ enum {
      * contiguous regions of the image is efficient.
      */
     STREAM_BUFFER_SIZE = 512 * 1024, /* in bytes */
+
+    /* Number of buffers that are copied in parallel */
+    STREAM_MAX_IN_FLIGHT = 8,
 };
 
 #define SLICE_TIME 100000000ULL /* ns */
 
+typedef struct StreamOp StreamOp;
+
 typedef struct StreamBlockJob {
     BlockJob common;
     RateLimit limit;
     BlockDriverState *base;
     BlockdevOnError on_error;
     char *backing_file_str;
+
+    int in_flight;
+    bool waiting_for_io;
+    QSIMPLEQ_HEAD(, StreamOp) failed_ops;
 } StreamBlockJob;
 
+struct StreamOp {
+    StreamBlockJob *s;
+    int64_t sector_num;
+    int nb_sectors;
+    int ret;
+    QSIMPLEQ_ENTRY(StreamOp) next;
+};
+
 static int coroutine_fn stream_populate(BlockDriverState *bs,
                                         int64_t sector_num, int nb_sectors,
                                         void *buf)
@@ -52,6 +69,109 @@ static int coroutine_fn stream_populate(BlockDriverState *bs,
     return bdrv_co_copy_on_readv(bs, sector_num, nb_sectors, &qiov);
 }
 
+static void coroutine_fn stream_co_populate(void *opaque)
+{
+    StreamOp *op = opaque;
+    StreamBlockJob *s = op->s;
+    BlockDriverState *bs = s->common.bs;
+    void *buf;
+
+    buf = qemu_try_blockalign(bs, op->nb_sectors * BDRV_SECTOR_SIZE);
+    if (buf == NULL) {
+        op->ret = -ENOMEM;
+    } else {
+        op->ret = stream_populate(bs, op->sector_num, op->nb_sectors, buf);
+        qemu_vfree(buf);
+    }
+
+    s->in_flight--;
+    if (op->ret < 0) {
+        /* The job coroutine decides what to do with it */
+        QSIMPLEQ_INSERT_TAIL(&s->failed_ops, op, next);
+    } else {
+        /* Publish progress */
+        s->common.offset += op->nb_sectors * BDRV_SECTOR_SIZE;
+        g_free(op);
+    }
+
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+static void coroutine_fn stream_wait_for_io(StreamBlockJob *s)
+{
+    assert(!s->waiting_for_io);
+    s->waiting_for_io = true;
+    qemu_coroutine_yield();
+    s->waiting_for_io = false;
+}
+
+/* Start copying a range in the background, once a slot is free */
+static void coroutine_fn stream_submit(StreamBlockJob *s, int64_t sector_num,
+                                       int nb_sectors)
+{
+    StreamOp *op;
+    Coroutine *co;
+
+    while (s->in_flight >= STREAM_MAX_IN_FLIGHT) {
+        stream_wait_for_io(s);
+    }
+
+    op = g_new0(StreamOp, 1);
+    *op = (StreamOp) {
+        .s          = s,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+    };
+
+    s->in_flight++;
+    co = qemu_coroutine_create(stream_co_populate);
+    qemu_coroutine_enter(co, op);
+}
+
+/* Apply the error policy to the requests that failed.  Requests are retried
+ * when the job is resumed after stopping.  Returns the error if the job must
+ * end, 0 otherwise.
+ */
+static int coroutine_fn stream_handle_failed_ops(StreamBlockJob *s,
+                                                 int *error)
+{
+    StreamOp *op;
+    int ret;
+
+    while (!QSIMPLEQ_EMPTY(&s->failed_ops)) {
+        BlockErrorAction action;
+
+        op = QSIMPLEQ_FIRST(&s->failed_ops);
+        QSIMPLEQ_REMOVE_HEAD(&s->failed_ops, next);
+        ret = op->ret;
+
+        action = block_job_error_action(&s->common, s->common.bs, s->on_error,
+                                        true, -ret);
+        if (action == BLOCK_ERROR_ACTION_STOP) {
+            /* This waits until the job is resumed */
+            block_job_sleep_ns(&s->common, QEMU_CLOCK_REALTIME, 0);
+            if (!block_job_is_cancelled(&s->common)) {
+                stream_submit(s, op->sector_num, op->nb_sectors);
+            }
+            g_free(op);
+            continue;
+        }
+
+        if (*error == 0) {
+            *error = ret;
+        }
+        s->common.offset += op->nb_sectors * BDRV_SECTOR_SIZE;
+        g_free(op);
+        if (action == BLOCK_ERROR_ACTION_REPORT) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
 static void close_unused_images(BlockDriverState *top, BlockDriverState *base,
                                 const char *base_id)
 {
@@ -116,10 +236,10 @@ static void coroutine_fn stream_run(void *opaque)
     BlockDriverState *bs = s->common.bs;
     BlockDriverState *base = s->base;
     int64_t sector_num, end;
+    bool aborted;
     int error = 0;
     int ret = 0;
     int n = 0;
-    void *buf;
 
     if (!bs->backing_hd) {
         block_job_completed(&s->common, 0);
@@ -133,7 +253,6 @@ static void coroutine_fn stream_run(void *opaque)
     }
 
     end = s->common.len >> BDRV_SECTOR_BITS;
-    buf = qemu_blockalign(bs, STREAM_BUFFER_SIZE);
 
     /* Turn on copy-on-read for the whole block device so that guest read
      * requests help us make progress.  Only do this when copying the entire
@@ -157,10 +276,22 @@ wait:
             break;
         }
 
+        n = 0;
+        if (stream_handle_failed_ops(s, &error) < 0) {
+            break;
+        }
+        if (block_job_is_cancelled(&s->common)) {
+            break;
+        }
+
         copy = false;
 
+        /* Look at large ranges so that unallocated areas are skipped in one
+         * go; only the copies are split into buffers.
+         */
         ret = bdrv_is_allocated(bs, sector_num,
-                                STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE, &n);
+                                MIN(end - sector_num, BDRV_REQUEST_MAX_SECTORS),
+                                &n);
         if (ret == 1) {
             /* Allocated in the top, no need to copy.  */
         } else if (ret >= 0) {
@@ -176,6 +307,9 @@ wait:
 
             copy = (ret == 1);
         }
+        if (copy) {
+            n = MIN(n, STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE);
+        }
         trace_stream_one_iteration(s, sector_num, n, ret);
         if (copy) {
             if (s->common.speed) {
@@ -184,7 +318,8 @@ wait:
                     goto wait;
                 }
             }
-            ret = stream_populate(bs, sector_num, n, buf);
+            stream_submit(s, sector_num, n);
+            continue;
         }
         if (ret < 0) {
             BlockErrorAction action =
@@ -207,6 +342,30 @@ wait:
         s->common.offset += n * BDRV_SECTOR_SIZE;
     }
 
+    /* Wait for the copies in flight.  If the loop ended early, failed
+     * requests are only dropped; otherwise they go through the error policy.
+     */
+    aborted = sector_num < end;
+    for (;;) {
+        while (s->in_flight > 0) {
+            stream_wait_for_io(s);
+        }
+        if (QSIMPLEQ_EMPTY(&s->failed_ops)) {
+            break;
+        }
+        if (aborted || block_job_is_cancelled(&s->common)) {
+            StreamOp *op = QSIMPLEQ_FIRST(&s->failed_ops);
+
+            QSIMPLEQ_REMOVE_HEAD(&s->failed_ops, next);
+            if (error == 0) {
+                error = op->ret;
+            }
+            g_free(op);
+        } else if (stream_handle_failed_ops(s, &error) < 0) {
+            aborted = true;
+        }
+    }
+
     if (!base) {
         bdrv_disable_copy_on_read(bs);
     }
@@ -214,8 +373,6 @@ wait:
     /* Do not remove the backing file if an error was there but ignored.  */
     ret = error;
 
-    qemu_vfree(buf);
-
     /* Modify backing chain and close BDSes in main loop */
     data = g_malloc(sizeof(*data));
     data->ret = ret;
@@ -264,6 +421,7 @@ void stream_start(BlockDriverState *bs, BlockDriverState *base,
     s->backing_file_str = g_strdup(backing_file_str);
 
     s->on_error = on_error;
+    QSIMPLEQ_INIT(&s->failed_ops);
     s->common.co = qemu_coroutine_create(stream_run);
     trace_stream_start(bs, base, s, s->common.co, opaque);
     qemu_coroutine_enter(s->common.co, s);
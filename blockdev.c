@@ -355,12 +355,20 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
     ThrottleConfig cfg;
     int snapshot = 0;
     bool copy_on_read;
+    bool cor_background;
+    int64_t cor_prefetch;
     Error *error = NULL;
     QemuOpts *opts;
     const char *id;
     bool has_driver_specific_opts;
     BlockdevDetectZeroesOptions detect_zeroes;
     const char *throttling_group;
+    bool merge_requests;
+    int64_t merge_window;
+    bool account_invalid, account_failed;
+    unsigned *stats_intervals = NULL;
+    unsigned stats_intervals_len = 0;
+    unsigned i;
 
     /* Check common options by copying from bs_opts to opts, all other options
      * stay in bs_opts for processing by bdrv_open(). */
@@ -405,15 +413,11 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
         bdrv_flags |= BDRV_O_NO_FLUSH;
     }
 
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     if ((buf = qemu_opt_get(opts, "aio")) != NULL) {
-        if (!strcmp(buf, "native")) {
-            bdrv_flags |= BDRV_O_NATIVE_AIO;
-        } else if (!strcmp(buf, "threads")) {
-            /* this is the default */
-        } else {
-           error_setg(errp, "invalid aio option");
-           goto early_err;
+        if (bdrv_parse_aio(buf, &bdrv_flags) < 0) {
+            error_setg(errp, "invalid aio option");
+            goto early_err;
         }
     }
 #endif
@@ -506,6 +510,52 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
         goto early_err;
     }
 
+    cor_background = qemu_opt_get_bool(opts, "copy-on-read-background", false);
+    cor_prefetch = qemu_opt_get_number(opts, "copy-on-read-prefetch", 0);
+    if (cor_prefetch < 0 || cor_prefetch > 256) {
+        error_setg(errp, "copy-on-read-prefetch must be between 0 and 256");
+        goto early_err;
+    }
+    if (cor_prefetch && !cor_background) {
+        error_setg(errp, "copy-on-read-prefetch requires "
+                         "copy-on-read-background");
+        goto early_err;
+    }
+
+    merge_requests = qemu_opt_get_bool(opts, "merge-requests", false);
+    merge_window = qemu_opt_get_number(opts, "merge-window", 0);
+    if (merge_window < 0 || merge_window > INT64_MAX / SCALE_US) {
+        error_setg(errp, "merge-window is out of range");
+        goto early_err;
+    }
+
+    account_invalid = qemu_opt_get_bool(opts, "stats-account-invalid", true);
+    account_failed = qemu_opt_get_bool(opts, "stats-account-failed", true);
+
+    buf = qemu_opt_get(opts, "stats-intervals");
+    if (buf) {
+        gchar **intervals = g_strsplit(buf, ":", 0);
+
+        stats_intervals_len = g_strv_length(intervals);
+        stats_intervals = g_new(unsigned, stats_intervals_len);
+        for (i = 0; i < stats_intervals_len; i++) {
+            char *end;
+            unsigned long length;
+
+            errno = 0;
+            length = strtoul(intervals[i], &end, 10);
+            if (errno || *end || !*intervals[i] || length == 0 ||
+                length > UINT_MAX) {
+                error_setg(errp, "Invalid interval length: '%s'",
+                           intervals[i]);
+                g_strfreev(intervals);
+                goto early_err;
+            }
+            stats_intervals[i] = length;
+        }
+        g_strfreev(intervals);
+    }
+
     /* init */
     if ((!file || !*file) && !has_driver_specific_opts) {
         blk = blk_new_with_bs(qemu_opts_id(opts), errp);
@@ -548,6 +598,15 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
     }
 
     bs->detect_zeroes = detect_zeroes;
+    bs->cor_background = cor_background;
+    bs->cor_prefetch = cor_prefetch;
+    bs->merge_requests = merge_requests;
+    bs->merge_window_ns = merge_window * SCALE_US;
+
+    block_acct_init(blk_get_stats(blk), account_invalid, account_failed);
+    for (i = 0; i < stats_intervals_len; i++) {
+        block_acct_add_interval(blk_get_stats(blk), stats_intervals[i]);
+    }
 
     bdrv_set_on_error(bs, on_read_error, on_write_error);
 
@@ -566,10 +625,12 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
 
 err_no_bs_opts:
     qemu_opts_del(opts);
+    g_free(stats_intervals);
     return blk;
 
 early_err:
     qemu_opts_del(opts);
+    g_free(stats_intervals);
 err_no_opts:
     QDECREF(bs_opts);
     return NULL;
@@ -2043,10 +2104,12 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
 
 void qmp_block_dirty_bitmap_add(const char *node, const char *name,
                                 bool has_granularity, uint32_t granularity,
+                                bool has_persistent, bool persistent,
                                 Error **errp)
 {
     AioContext *aio_context;
     BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
 
     if (!name || name[0] == '\0') {
         error_setg(errp, "Bitmap name cannot be empty");
@@ -2072,7 +2135,15 @@ void qmp_block_dirty_bitmap_add(const char *node, const char *name,
         granularity = bdrv_get_default_bitmap_granularity(bs);
     }
 
-    bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (has_persistent && persistent &&
+        !bdrv_can_store_dirty_bitmap(bs, name, granularity, errp)) {
+        goto out;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (bitmap && has_persistent) {
+        bdrv_dirty_bitmap_set_persistence(bitmap, persistent);
+    }
 
  out:
     aio_context_release(aio_context);
@@ -2096,6 +2167,11 @@ void qmp_block_dirty_bitmap_remove(const char *node, const char *name,
                    name);
         goto out;
     }
+    if (bdrv_dirty_bitmap_has_meta(bitmap)) {
+        error_setg(errp, "Bitmap '%s' is being migrated and cannot be removed",
+                   name);
+        goto out;
+    }
     bdrv_dirty_bitmap_make_anon(bitmap);
     bdrv_release_dirty_bitmap(bs, bitmap);
 
@@ -2189,6 +2265,70 @@ void hmp_drive_del(Monitor *mon, const QDict *qdict)
     aio_context_release(aio_context);
 }
 
+void qmp_block_latency_histogram_set(const char *device,
+                                     bool has_boundaries,
+                                     uint64List *boundaries,
+                                     bool has_boundaries_read,
+                                     uint64List *boundaries_read,
+                                     bool has_boundaries_write,
+                                     uint64List *boundaries_write,
+                                     bool has_boundaries_flush,
+                                     uint64List *boundaries_flush,
+                                     Error **errp)
+{
+    BlockBackend *blk;
+    BlockAcctStats *stats;
+    AioContext *aio_context;
+    uint64List *type_boundaries[BLOCK_MAX_IOTYPE];
+    bool has_type_boundaries[BLOCK_MAX_IOTYPE];
+    int i;
+
+    blk = blk_by_name(device);
+    if (!blk) {
+        error_set(errp, ERROR_CLASS_DEVICE_NOT_FOUND,
+                  "Device '%s' not found", device);
+        return;
+    }
+    stats = blk_get_stats(blk);
+
+    has_type_boundaries[BLOCK_ACCT_READ] = has_boundaries_read;
+    type_boundaries[BLOCK_ACCT_READ] = boundaries_read;
+    has_type_boundaries[BLOCK_ACCT_WRITE] = has_boundaries_write;
+    type_boundaries[BLOCK_ACCT_WRITE] = boundaries_write;
+    has_type_boundaries[BLOCK_ACCT_FLUSH] = has_boundaries_flush;
+    type_boundaries[BLOCK_ACCT_FLUSH] = boundaries_flush;
+
+    aio_context = blk_get_aio_context(blk);
+    aio_context_acquire(aio_context);
+
+    if (!has_boundaries && !has_boundaries_read && !has_boundaries_write &&
+        !has_boundaries_flush) {
+        block_latency_histograms_clear(stats);
+        goto out;
+    }
+
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        uint64List *list;
+
+        if (has_type_boundaries[i]) {
+            list = type_boundaries[i];
+        } else if (has_boundaries) {
+            list = boundaries;
+        } else {
+            continue;
+        }
+
+        if (block_latency_histogram_set(stats, i, list) < 0) {
+            error_setg(errp, "Latency histogram boundaries must be greater "
+                       "than zero and in increasing order");
+            goto out;
+        }
+    }
+
+out:
+    aio_context_release(aio_context);
+}
+
 void qmp_block_resize(bool has_device, const char *device,
                       bool has_node_name, const char *node_name,
                       int64_t size, Error **errp)
@@ -2658,6 +2798,7 @@ void qmp_drive_mirror(const char *device, const char *target,
                       bool has_buf_size, int64_t buf_size,
                       bool has_on_source_error, BlockdevOnError on_source_error,
                       bool has_on_target_error, BlockdevOnError on_target_error,
+                      bool has_copy_mode, MirrorCopyMode copy_mode,
                       Error **errp)
 {
     BlockBackend *blk;
@@ -2686,6 +2827,9 @@ void qmp_drive_mirror(const char *device, const char *target,
     if (!has_granularity) {
         granularity = 0;
     }
+    if (!has_copy_mode) {
+        copy_mode = MIRROR_COPY_MODE_BACKGROUND;
+    }
     if (!has_buf_size) {
         buf_size = DEFAULT_MIRROR_BUF_SIZE;
     }
@@ -2828,7 +2972,7 @@ void qmp_drive_mirror(const char *device, const char *target,
      */
     mirror_start(bs, target_bs,
                  has_replaces ? replaces : NULL,
-                 speed, granularity, buf_size, sync,
+                 speed, granularity, buf_size, sync, copy_mode,
                  on_source_error, on_target_error,
                  block_job_cb, bs, &local_err);
     if (local_err != NULL) {
@@ -3226,10 +3370,41 @@ QemuOptsList qemu_common_drive_opts = {
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
             .help = "copy read data from backing file into image file",
+        },{
+            .name = "copy-on-read-background",
+            .type = QEMU_OPT_BOOL,
+            .help = "write copy-on-read data after completing the read",
+        },{
+            .name = "copy-on-read-prefetch",
+            .type = QEMU_OPT_NUMBER,
+            .help = "number of clusters to copy ahead of sequential reads",
         },{
             .name = "detect-zeroes",
             .type = QEMU_OPT_STRING,
             .help = "try to optimize zero writes (off, on, unmap)",
+        },{
+            .name = "merge-requests",
+            .type = QEMU_OPT_BOOL,
+            .help = "coalesce adjacent read and write requests",
+        },{
+            .name = "merge-window",
+            .type = QEMU_OPT_NUMBER,
+            .help = "time to wait for requests to merge, in microseconds",
+        },{
+            .name = "stats-account-invalid",
+            .type = QEMU_OPT_BOOL,
+            .help = "whether to account for invalid I/O operations "
+                    "in the statistics",
+        },{
+            .name = "stats-account-failed",
+            .type = QEMU_OPT_BOOL,
+            .help = "whether to account for failed I/O operations "
+                    "in the statistics",
+        },{
+            .name = "stats-intervals",
+            .type = QEMU_OPT_STRING,
+            .help = "colon-separated list of intervals "
+                    "for collecting I/O statistics, in seconds",
         },
         { /* end of list */ }
     },
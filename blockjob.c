@@ -36,6 +36,8 @@
 #include "qemu/timer.h"
 #include "qapi-event.h"
 
+#define THROUGHPUT_SAMPLE_TIME 1000000000LL /* ns */
+
 void *block_job_create(const BlockJobDriver *driver, BlockDriverState *bs,
                        int64_t speed, BlockCompletionFunc *cb,
                        void *opaque, Error **errp)
@@ -58,6 +60,8 @@ void *block_job_create(const BlockJobDriver *driver, BlockDriverState *bs,
     job->cb            = cb;
     job->opaque        = opaque;
     job->busy          = true;
+    job->throughput    = -1;
+    job->throughput_sample_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     bs->job = job;
 
     /* Only set speed when necessary to avoid NotSupported error */
@@ -229,10 +233,25 @@ int block_job_complete_sync(BlockJob *job, Error **errp)
     return block_job_finish_sync(job, &block_job_complete, errp);
 }
 
+static void block_job_sample_throughput(BlockJob *job)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t elapsed = now - job->throughput_sample_ns;
+
+    if (elapsed >= THROUGHPUT_SAMPLE_TIME) {
+        job->throughput = (job->offset - job->throughput_sample_offset) /
+                          ((double)elapsed / 1000000000);
+        job->throughput_sample_ns = now;
+        job->throughput_sample_offset = job->offset;
+    }
+}
+
 void block_job_sleep_ns(BlockJob *job, QEMUClockType type, int64_t ns)
 {
     assert(job->busy);
 
+    block_job_sample_throughput(job);
+
     /* Check cancellation *before* setting busy = false, too!  */
     if (block_job_is_cancelled(job)) {
         return;
@@ -273,6 +292,13 @@ BlockJobInfo *block_job_query(BlockJob *job)
     info->speed     = job->speed;
     info->io_status = job->iostatus;
     info->ready     = job->ready;
+    if (job->throughput >= 0) {
+        info->has_throughput = true;
+        info->throughput = job->throughput;
+    }
+    if (job->driver->query) {
+        job->driver->query(job, info);
+    }
     return info;
 }
 
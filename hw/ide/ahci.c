@@ -925,8 +925,11 @@ static void ncq_cb(void *opaque, int ret)
     DPRINTF(ncq_tfs->drive->port_no, "NCQ transfer tag %d finished\n",
             ncq_tfs->tag);
 
-    block_acct_done(blk_get_stats(ncq_tfs->drive->port.ifs[0].blk),
-                    &ncq_tfs->acct);
+    if (ret < 0) {
+        block_acct_failed(blk_get_stats(ide_state->blk), &ncq_tfs->acct);
+    } else {
+        block_acct_done(blk_get_stats(ide_state->blk), &ncq_tfs->acct);
+    }
     qemu_sglist_destroy(&ncq_tfs->sglist);
     ncq_tfs->used = 0;
 }
@@ -23,6 +23,7 @@
 #include "hw/virtio/virtio-bus.h"
 #include "qapi/qmp/qjson.h"
 #include "qapi-event.h"
+#include "qmp-commands.h"
 #include "hw/virtio/virtio-access.h"
 
 #define VIRTIO_NET_VM_VERSION    11
@@ -111,6 +112,8 @@ static void virtio_net_announce_timer(void *opaque)
     virtio_notify_config(vdev);
 }
 
+static void virtio_net_set_queues(VirtIONet *n);
+
 static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
@@ -145,6 +148,11 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
             error_report("unable to start vhost net: %d: "
                          "falling back on userspace virtio", -r);
             n->vhost_started = 0;
+        } else {
+            /* Disable the queue pairs the guest is not using; this
+             * matters when a reconnected backend is restarted.
+             */
+            virtio_net_set_queues(n);
         }
     } else {
         vhost_net_stop(vdev, n->nic->ncs, queues);
@@ -177,7 +185,8 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
         if (virtio_net_started(n, queue_status) && !n->vhost_started) {
             if (q->tx_timer) {
                 timer_mod(q->tx_timer,
-                               qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + n->tx_timeout);
+                          qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                          q->tx_timeout);
             } else {
                 qemu_bh_schedule(q->tx_bh);
             }
@@ -398,6 +407,10 @@ static int peer_attach(VirtIONet *n, int index)
         return 0;
     }
 
+    if (nc->peer->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER) {
+        vhost_set_vring_enable(nc->peer, 1);
+    }
+
     if (nc->peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
         return 0;
     }
@@ -413,6 +426,10 @@ static int peer_detach(VirtIONet *n, int index)
         return 0;
     }
 
+    if (nc->peer->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER) {
+        vhost_set_vring_enable(nc->peer, 0);
+    }
+
     if (nc->peer->info->type !=  NET_CLIENT_OPTIONS_KIND_TAP) {
         return 0;
     }
@@ -802,20 +819,25 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
     VirtIONet *n = VIRTIO_NET(vdev);
     struct virtio_net_ctrl_hdr ctrl;
     virtio_net_ctrl_ack status = VIRTIO_NET_ERR;
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     size_t s;
     struct iovec *iov, *iov2;
     unsigned int iov_cnt;
 
-    while (virtqueue_pop(vq, &elem)) {
-        if (iov_size(elem.in_sg, elem.in_num) < sizeof(status) ||
-            iov_size(elem.out_sg, elem.out_num) < sizeof(ctrl)) {
+    for (;;) {
+        elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
+        if (!elem) {
+            break;
+        }
+        if (iov_size(elem->in_sg, elem->in_num) < sizeof(status) ||
+            iov_size(elem->out_sg, elem->out_num) < sizeof(ctrl)) {
             error_report("virtio-net ctrl missing headers");
             exit(1);
         }
 
-        iov_cnt = elem.out_num;
-        iov2 = iov = g_memdup(elem.out_sg, sizeof(struct iovec) * elem.out_num);
+        iov_cnt = elem->out_num;
+        iov2 = iov = g_memdup(elem->out_sg,
+                              sizeof(struct iovec) * elem->out_num);
         s = iov_to_buf(iov, iov_cnt, 0, &ctrl, sizeof(ctrl));
         iov_discard_front(&iov, &iov_cnt, sizeof(ctrl));
         if (s != sizeof(ctrl)) {
@@ -834,12 +856,14 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
             status = virtio_net_handle_offloads(n, ctrl.cmd, iov, iov_cnt);
         }
 
-        s = iov_from_buf(elem.in_sg, elem.in_num, 0, &status, sizeof(status));
+        s = iov_from_buf(elem->in_sg, elem->in_num, 0, &status,
+                         sizeof(status));
         assert(s == sizeof(status));
 
-        virtqueue_push(vq, &elem, sizeof(status));
+        virtqueue_push(vq, elem, sizeof(status));
         virtio_notify(vdev, vq);
         g_free(iov2);
+        g_free(elem);
     }
 }
 
@@ -1003,6 +1027,40 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     return 0;
 }
 
+/* Make the used entries of received packets visible to the guest */
+static void virtio_net_rx_flush(VirtIONetQueue *q)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(q->n);
+
+    if (q->rx_pending) {
+        virtqueue_flush(q->rx_vq, q->rx_pending);
+        q->rx_pending = 0;
+        virtio_notify(vdev, q->rx_vq);
+    }
+}
+
+static void virtio_net_rx_complete(VirtIONetQueue *q, unsigned count)
+{
+    q->rx_pending += count;
+    if (!q->rx_batch) {
+        virtio_net_rx_flush(q);
+    }
+}
+
+static void virtio_net_receive_batch(NetClientState *nc, bool begin)
+{
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    if (begin) {
+        q->rx_batch++;
+    } else {
+        assert(q->rx_batch > 0);
+        if (--q->rx_batch == 0) {
+            virtio_net_rx_flush(q);
+        }
+    }
+}
+
 static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
@@ -1028,13 +1086,14 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
     offset = i = 0;
 
     while (offset < size) {
-        VirtQueueElement elem;
+        VirtQueueElement *elem;
         int len, total;
-        const struct iovec *sg = elem.in_sg;
+        const struct iovec *sg;
 
         total = 0;
 
-        if (virtqueue_pop(q->rx_vq, &elem) == 0) {
+        elem = virtqueue_pop(q->rx_vq, sizeof(VirtQueueElement));
+        if (!elem) {
             if (i == 0)
                 return -1;
             error_report("virtio-net unexpected empty queue: "
@@ -1047,21 +1106,22 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
             exit(1);
         }
 
-        if (elem.in_num < 1) {
+        if (elem->in_num < 1) {
             error_report("virtio-net receive queue contains no in buffers");
             exit(1);
         }
 
+        sg = elem->in_sg;
         if (i == 0) {
             assert(offset == 0);
             if (n->mergeable_rx_bufs) {
                 mhdr_cnt = iov_copy(mhdr_sg, ARRAY_SIZE(mhdr_sg),
-                                    sg, elem.in_num,
+                                    sg, elem->in_num,
                                     offsetof(typeof(mhdr), num_buffers),
                                     sizeof(mhdr.num_buffers));
             }
 
-            receive_header(n, sg, elem.in_num, buf, size);
+            receive_header(n, sg, elem->in_num, buf, size);
             offset = n->host_hdr_len;
             total += n->guest_hdr_len;
             guest_offset = n->guest_hdr_len;
@@ -1070,7 +1130,7 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
         }
 
         /* copy in packet.  ugh */
-        len = iov_from_buf(sg, elem.in_num, guest_offset,
+        len = iov_from_buf(sg, elem->in_num, guest_offset,
                            buf + offset, size - offset);
         total += len;
         offset += len;
@@ -1085,11 +1145,13 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
                          i, n->mergeable_rx_bufs,
                          offset, size, n->guest_hdr_len, n->host_hdr_len);
 #endif
+            g_free(elem);
             return size;
         }
 
         /* signal other side */
-        virtqueue_fill(q->rx_vq, &elem, total, i++);
+        virtqueue_fill(q->rx_vq, elem, total, q->rx_pending + i++);
+        g_free(elem);
     }
 
     if (mhdr_cnt) {
@@ -1099,8 +1161,156 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
                      &mhdr.num_buffers, sizeof mhdr.num_buffers);
     }
 
-    virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    virtio_net_rx_complete(q, i);
+
+    return size;
+}
+
+/* Like receive_header(), for a packet that the backend wrote in place.
+ * @iov holds the packet as the backend sees it, and @sg is the first
+ * guest buffer.
+ */
+static void receive_header_iov(VirtIONet *n, const struct iovec *sg,
+                               int sg_cnt, const struct iovec *iov,
+                               int iov_cnt, size_t size)
+{
+    if (n->has_vnet_hdr) {
+        struct virtio_net_hdr hdr;
+        size_t len = size - n->host_hdr_len;
+
+        iov_to_buf(iov, iov_cnt, 0, &hdr, sizeof(hdr));
+        if ((hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) && len < 1500) {
+            uint8_t pkt[1500];
+
+            iov_to_buf(iov, iov_cnt, n->host_hdr_len, pkt, len);
+            work_around_broken_dhclient(&hdr, pkt, len);
+            if (!(hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+                iov_from_buf(iov, iov_cnt, n->host_hdr_len, pkt, len);
+            }
+        }
+        virtio_net_hdr_swap(VIRTIO_DEVICE(n), &hdr);
+        iov_from_buf(sg, sg_cnt, 0, &hdr, sizeof(hdr));
+    } else {
+        struct virtio_net_hdr hdr = {
+            .flags = 0,
+            .gso_type = VIRTIO_NET_HDR_GSO_NONE
+        };
+        iov_from_buf(sg, sg_cnt, 0, &hdr, sizeof hdr);
+    }
+}
+
+/* Number of bytes of the first guest buffer covered when the backend wrote
+ * @written bytes to it.  The packet is moved from after the host header to
+ * after the guest header.
+ */
+static size_t virtio_net_direct_len(VirtIONet *n, size_t written)
+{
+    if (written <= n->host_hdr_len) {
+        return written;
+    }
+    return written - n->host_hdr_len + n->guest_hdr_len;
+}
+
+/* Let the backend read a packet straight into a guest buffer.  The part of
+ * the packet that does not fit lands in q->rx_buf, and is then copied to
+ * further buffers if they can be merged.
+ */
+static ssize_t virtio_net_receive_direct(NetClientState *nc,
+                                         NetReadIOV *read_iov, void *opaque)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    struct iovec iov[VIRTQUEUE_MAX_SIZE + 2];
+    uint8_t head[sizeof(struct virtio_net_hdr_mrg_rxbuf) + 16];
+    VirtQueueElement *first, *elem;
+    unsigned iov_cnt, i;
+    size_t guest_len, first_len, len, offset;
+    ssize_t size;
+
+    /* With mergeable buffers, make sure that the largest packet fits */
+    if (!virtio_net_has_buffers(q, NET_BUFSIZE - n->host_hdr_len +
+                                   n->guest_hdr_len)) {
+        return 0;
+    }
+
+    first = virtqueue_pop(q->rx_vq, sizeof(VirtQueueElement));
+    if (!first) {
+        return 0;
+    }
+    if (first->in_num < 1) {
+        error_report("virtio-net receive queue contains no in buffers");
+        exit(1);
+    }
+
+    /* The host header goes at the start of the buffer and the packet after
+     * the guest header; these are different if only the guest uses
+     * num_buffers.
+     */
+    iov_cnt = iov_copy(iov, ARRAY_SIZE(iov) - 1, first->in_sg, first->in_num,
+                       0, n->host_hdr_len);
+    iov_cnt += iov_copy(iov + iov_cnt, ARRAY_SIZE(iov) - 1 - iov_cnt,
+                        first->in_sg, first->in_num, n->guest_hdr_len, -1);
+    guest_len = iov_size(iov, iov_cnt);
+
+    if (!q->rx_buf) {
+        q->rx_buf = g_malloc(NET_BUFSIZE);
+    }
+    iov[iov_cnt].iov_base = q->rx_buf;
+    iov[iov_cnt].iov_len = NET_BUFSIZE;
+    iov_cnt++;
+
+    size = read_iov(opaque, iov, iov_cnt);
+    if (size <= 0) {
+        virtqueue_unpop(q->rx_vq, first, 0);
+        g_free(first);
+        return -1;
+    }
+
+    memset(head, 0, sizeof(head));
+    iov_to_buf(iov, iov_cnt, 0, head, MIN(size, n->host_hdr_len + 16));
+    if (size <= n->host_hdr_len || !receive_filter(n, head, size) ||
+        (!n->mergeable_rx_bufs && size > guest_len)) {
+        /* Drop the packet; a non-mergeable buffer cannot hold it all */
+        virtqueue_unpop(q->rx_vq, first,
+                        virtio_net_direct_len(n, MIN(size, guest_len)));
+        g_free(first);
+        return size;
+    }
+
+    first_len = virtio_net_direct_len(n, MIN(size, guest_len));
+
+    receive_header_iov(n, first->in_sg, first->in_num, iov, iov_cnt, size);
+
+    /* Copy what did not fit to the next buffers */
+    i = 1;
+    for (offset = guest_len; offset < size; offset += len) {
+        elem = virtqueue_pop(q->rx_vq, sizeof(VirtQueueElement));
+        if (!elem) {
+            error_report("virtio-net unexpected empty queue: "
+                         "i %u offset %zd, size %zd",
+                         i, offset, size);
+            exit(1);
+        }
+        len = iov_from_buf(elem->in_sg, elem->in_num, 0,
+                           q->rx_buf + offset - guest_len, size - offset);
+        virtqueue_fill(q->rx_vq, elem, len, q->rx_pending + i++);
+        g_free(elem);
+    }
+
+    if (n->mergeable_rx_bufs) {
+        struct virtio_net_hdr_mrg_rxbuf mhdr;
+
+        virtio_stw_p(vdev, &mhdr.num_buffers, i);
+        iov_from_buf(first->in_sg, first->in_num,
+                     offsetof(typeof(mhdr), num_buffers),
+                     &mhdr.num_buffers, sizeof mhdr.num_buffers);
+    }
+
+    virtqueue_fill(q->rx_vq, first, first_len, q->rx_pending);
+    g_free(first);
+
+    virtio_net_rx_complete(q, i);
 
     return size;
 }
@@ -1113,10 +1323,15 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
-    virtqueue_push(q->tx_vq, &q->async_tx.elem, 0);
+    q->tx_stats.packets++;
+    q->tx_stats.bytes += len;
+
+    virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
     virtio_notify(vdev, q->tx_vq);
 
-    q->async_tx.elem.out_num = q->async_tx.len = 0;
+    g_free(q->async_tx.elem);
+    q->async_tx.elem = NULL;
+    q->async_tx.len = 0;
 
     virtio_queue_set_notification(q->tx_vq, 1);
     virtio_net_flush_tx(q);
@@ -1127,23 +1342,39 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     int32_t num_packets = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    NetClientState *nc = qemu_get_subqueue(n->nic, queue_index);
+    bool busy = false;
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return num_packets;
     }
 
-    if (q->async_tx.elem.out_num) {
+    if (q->async_tx.elem) {
         virtio_queue_set_notification(q->tx_vq, 0);
         return num_packets;
     }
 
-    while (virtqueue_pop(q->tx_vq, &elem)) {
+    q->tx_stats.flushes++;
+
+    /* Let the backend send the whole burst at once, and return the
+     * buffers to the guest with a single used index update and
+     * notification.
+     */
+    qemu_send_batch(nc, true);
+    for (;;) {
         ssize_t ret, len;
-        unsigned int out_num = elem.out_num;
-        struct iovec *out_sg = &elem.out_sg[0];
-        struct iovec sg[VIRTQUEUE_MAX_SIZE];
+        unsigned int out_num;
+        struct iovec sg[VIRTQUEUE_MAX_SIZE], *out_sg;
+
+        elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
+        if (!elem) {
+            break;
+        }
+
+        out_num = elem->out_num;
+        out_sg = elem->out_sg;
 
         if (out_num < 1) {
             error_report("virtio-net header not in first element");
@@ -1177,31 +1408,81 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 
         len = n->guest_hdr_len;
 
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
+        ret = qemu_sendv_packet_async(nc, out_sg, out_num,
+                                      virtio_net_tx_complete);
         if (ret == 0) {
             virtio_queue_set_notification(q->tx_vq, 0);
             q->async_tx.elem = elem;
             q->async_tx.len  = len;
-            return -EBUSY;
+            q->tx_stats.backend_busy++;
+            busy = true;
+            break;
         }
 
         len += ret;
 
-        virtqueue_push(q->tx_vq, &elem, 0);
-        virtio_notify(vdev, q->tx_vq);
+        q->tx_stats.packets++;
+        q->tx_stats.bytes += ret;
+
+        virtqueue_fill(q->tx_vq, elem, 0, num_packets);
+        g_free(elem);
 
-        if (++num_packets >= n->tx_burst) {
+        if (++num_packets >= q->tx_burst) {
+            q->tx_stats.full_bursts++;
             break;
         }
     }
-    return num_packets;
+    qemu_send_batch(nc, false);
+
+    if (num_packets) {
+        virtqueue_flush(q->tx_vq, num_packets);
+        virtio_notify(vdev, q->tx_vq);
+    }
+    return busy ? -EBUSY : num_packets;
+}
+
+/* Adapt the burst limit to the load: grow it while the guest keeps
+ * filling whole bursts, so that a busy queue is drained with fewer
+ * flushes, and shrink it again when the load drops, so that a queue
+ * waking up with a large backlog cannot monopolize the main loop.
+ * Returns whether the flush stopped at the burst limit.
+ */
+static bool virtio_net_tx_update_burst(VirtIONetQueue *q, int32_t ret)
+{
+    VirtIONet *n = q->n;
+
+    if (ret >= q->tx_burst) {
+        q->tx_burst = MIN(q->tx_burst * 2, n->tx_burst);
+        return true;
+    }
+    if (ret < q->tx_burst / 2) {
+        q->tx_burst = MAX(q->tx_burst / 2, n->net_conf.txburst_min);
+    }
+    return false;
+}
+
+/* Delaying transmission only pays off if more packets arrive in the
+ * meantime.  Shorten the timer when it expires with at most one packet
+ * queued and lengthen it back to the configured interval when it
+ * collects a full burst.
+ */
+static void virtio_net_tx_update_timer(VirtIONetQueue *q, int32_t ret,
+                                       bool full)
+{
+    VirtIONet *n = q->n;
+
+    if (full) {
+        q->tx_timeout = MIN(q->tx_timeout * 2, n->tx_timeout);
+    } else if (ret <= 1) {
+        q->tx_timeout = MAX(q->tx_timeout / 2, n->net_conf.txtimer_min);
+    }
 }
 
 static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
+    int32_t ret;
 
     /* This happens when device was stopped but VCPU wasn't. */
     if (!vdev->vm_running) {
@@ -1213,10 +1494,13 @@ static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
         virtio_queue_set_notification(vq, 1);
         timer_del(q->tx_timer);
         q->tx_waiting = 0;
-        virtio_net_flush_tx(q);
+        ret = virtio_net_flush_tx(q);
+        if (ret >= 0) {
+            virtio_net_tx_update_burst(q, ret);
+        }
     } else {
         timer_mod(q->tx_timer,
-                       qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + n->tx_timeout);
+                       qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + q->tx_timeout);
         q->tx_waiting = 1;
         virtio_queue_set_notification(vq, 0);
     }
@@ -1244,6 +1528,9 @@ static void virtio_net_tx_timer(void *opaque)
     VirtIONetQueue *q = opaque;
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    int32_t ret;
+    bool full;
+
     /* This happens when device was stopped but BH wasn't. */
     if (!vdev->vm_running) {
         /* Make sure tx waiting is set, so we'll run when restarted. */
@@ -1259,7 +1546,11 @@ static void virtio_net_tx_timer(void *opaque)
     }
 
     virtio_queue_set_notification(q->tx_vq, 1);
-    virtio_net_flush_tx(q);
+    ret = virtio_net_flush_tx(q);
+    if (ret >= 0) {
+        full = virtio_net_tx_update_burst(q, ret);
+        virtio_net_tx_update_timer(q, ret, full);
+    }
 }
 
 static void virtio_net_tx_bh(void *opaque)
@@ -1290,7 +1581,7 @@ static void virtio_net_tx_bh(void *opaque)
 
     /* If we flush a full burst of packets, assume there are
      * more coming and immediately reschedule */
-    if (ret >= n->tx_burst) {
+    if (virtio_net_tx_update_burst(q, ret)) {
         qemu_bh_schedule(q->tx_bh);
         q->tx_waiting = 1;
         return;
@@ -1307,6 +1598,47 @@ static void virtio_net_tx_bh(void *opaque)
     }
 }
 
+VirtioNetTxStatsList *qmp_query_virtio_net_tx_stats(const char *path,
+                                                    Error **errp)
+{
+    VirtioNetTxStatsList *head = NULL, **p_next = &head;
+    VirtIODevice *vdev;
+    VirtIONet *n;
+    int i;
+
+    vdev = virtio_device_find(path, errp);
+    if (!vdev) {
+        return NULL;
+    }
+    if (!object_dynamic_cast(OBJECT(vdev), TYPE_VIRTIO_NET)) {
+        error_setg(errp, "Device '%s' is not a virtio-net device", path);
+        return NULL;
+    }
+    n = VIRTIO_NET(vdev);
+
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+        VirtioNetTxStatsList *elem;
+        VirtioNetTxStats *info;
+
+        info = g_new0(VirtioNetTxStats, 1);
+        info->queue = i;
+        info->packets = q->tx_stats.packets;
+        info->bytes = q->tx_stats.bytes;
+        info->flushes = q->tx_stats.flushes;
+        info->full_bursts = q->tx_stats.full_bursts;
+        info->backend_busy = q->tx_stats.backend_busy;
+        info->burst = q->tx_burst;
+        info->timeout = q->tx_timer ? q->tx_timeout : 0;
+
+        elem = g_new0(VirtioNetTxStatsList, 1);
+        elem->value = info;
+        *p_next = elem;
+        p_next = &elem->next;
+    }
+    return head;
+}
+
 static void virtio_net_set_multiqueue(VirtIONet *n, int multiqueue)
 {
     n->multiqueue = multiqueue;
@@ -1505,6 +1837,8 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_direct = virtio_net_receive_direct,
+    .receive_batch = virtio_net_receive_batch,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
 };
@@ -1574,6 +1908,10 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     n->vqs = g_malloc0(sizeof(VirtIONetQueue) * n->max_queues);
     n->curr_queues = 1;
     n->tx_timeout = n->net_conf.txtimer;
+    n->net_conf.txtimer_min = MIN(MAX(n->net_conf.txtimer_min, 1),
+                                  n->net_conf.txtimer);
+    n->net_conf.txburst_min = MIN(MAX(n->net_conf.txburst_min, 1),
+                                  n->net_conf.txburst);
 
     if (n->net_conf.tx && strcmp(n->net_conf.tx, "timer")
                        && strcmp(n->net_conf.tx, "bh")) {
@@ -1598,6 +1936,8 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         }
 
         n->vqs[i].tx_waiting = 0;
+        n->vqs[i].tx_burst = n->net_conf.txburst;
+        n->vqs[i].tx_timeout = n->net_conf.txtimer;
         n->vqs[i].n = n;
     }
 
@@ -1672,6 +2012,8 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
         NetClientState *nc = qemu_get_subqueue(n->nic, i);
 
         qemu_purge_queued_packets(nc);
+        g_free(q->async_tx.elem);
+        g_free(q->rx_buf);
 
         if (q->tx_timer) {
             timer_del(q->tx_timer);
@@ -1747,7 +2089,11 @@ static Property virtio_net_properties[] = {
     DEFINE_NIC_PROPERTIES(VirtIONet, nic_conf),
     DEFINE_PROP_UINT32("x-txtimer", VirtIONet, net_conf.txtimer,
                        TX_TIMER_INTERVAL),
+    DEFINE_PROP_UINT32("x-txtimer-min", VirtIONet, net_conf.txtimer_min,
+                       TX_TIMER_INTERVAL_MIN),
     DEFINE_PROP_INT32("x-txburst", VirtIONet, net_conf.txburst, TX_BURST),
+    DEFINE_PROP_INT32("x-txburst-min", VirtIONet, net_conf.txburst_min,
+                      TX_BURST_MIN),
     DEFINE_PROP_STRING("tx", VirtIONet, net_conf.tx),
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -548,6 +548,42 @@ static const struct SCSIReqOps reqops_target_command = {
 };
 
 
+/* Requests whose size matches the device's fast-path request ops are
+ * recycled through a small per-device free list.  They are allocated and
+ * released with the device's AioContext held, so no locking is needed.
+ */
+#define SCSI_REQ_POOL_MAX 64
+
+static bool scsi_req_pool_accepts(SCSIDevice *d, size_t size)
+{
+    SCSIDeviceClass *sc = SCSI_DEVICE_GET_CLASS(d);
+
+    return sc->rw_reqops && sc->rw_reqops->size == size;
+}
+
+static SCSIRequest *scsi_req_pool_get(SCSIDevice *d, size_t size)
+{
+    SCSIRequest *req = QSLIST_FIRST(&d->req_pool);
+
+    if (!req || !scsi_req_pool_accepts(d, size)) {
+        return NULL;
+    }
+    QSLIST_REMOVE_HEAD(&d->req_pool, pool_next);
+    d->req_pool_count--;
+    return req;
+}
+
+static bool scsi_req_pool_put(SCSIDevice *d, SCSIRequest *req)
+{
+    if (d->req_pool_count >= SCSI_REQ_POOL_MAX ||
+        !scsi_req_pool_accepts(d, req->ops->size)) {
+        return false;
+    }
+    QSLIST_INSERT_HEAD(&d->req_pool, req, pool_next);
+    d->req_pool_count++;
+    return true;
+}
+
 SCSIRequest *scsi_req_alloc(const SCSIReqOps *reqops, SCSIDevice *d,
                             uint32_t tag, uint32_t lun, void *hba_private)
 {
@@ -557,7 +593,10 @@ SCSIRequest *scsi_req_alloc(const SCSIReqOps *reqops, SCSIDevice *d,
     const int memset_off = offsetof(SCSIRequest, sense)
                            + sizeof(req->sense);
 
-    req = g_slice_alloc(reqops->size);
+    req = scsi_req_pool_get(d, reqops->size);
+    if (!req) {
+        req = g_slice_alloc(reqops->size);
+    }
     memset((uint8_t *)req + memset_off, 0, reqops->size - memset_off);
     req->refcount = 1;
     req->bus = bus;
@@ -574,6 +613,54 @@ SCSIRequest *scsi_req_alloc(const SCSIReqOps *reqops, SCSIDevice *d,
     return req;
 }
 
+/* Decode READ/WRITE(10/12/16) without going through the generic parser.
+ * Returns false for any other command, or if the transfer is too large,
+ * so that the caller falls back to scsi_req_parse_cdb.
+ */
+static bool scsi_req_parse_rw_cdb(SCSIDevice *d, SCSICommand *cmd,
+                                  uint8_t *buf)
+{
+    uint64_t xfer;
+
+    switch (buf[0]) {
+    case READ_10:
+    case WRITE_10:
+        cmd->len = 10;
+        cmd->lba = ldl_be_p(&buf[2]) & 0xffffffffULL;
+        xfer = lduw_be_p(&buf[7]);
+        break;
+    case READ_12:
+    case WRITE_12:
+        cmd->len = 12;
+        cmd->lba = ldl_be_p(&buf[2]) & 0xffffffffULL;
+        xfer = ldl_be_p(&buf[6]) & 0xffffffffULL;
+        break;
+    case READ_16:
+    case WRITE_16:
+        cmd->len = 16;
+        cmd->lba = ldq_be_p(&buf[2]);
+        xfer = ldl_be_p(&buf[10]) & 0xffffffffULL;
+        break;
+    default:
+        return false;
+    }
+
+    xfer *= d->blocksize;
+    if (xfer > INT32_MAX) {
+        return false;
+    }
+    cmd->xfer = xfer;
+    if (!xfer) {
+        cmd->mode = SCSI_XFER_NONE;
+    } else if (buf[0] == READ_10 || buf[0] == READ_12 || buf[0] == READ_16) {
+        cmd->mode = SCSI_XFER_FROM_DEV;
+    } else {
+        cmd->mode = SCSI_XFER_TO_DEV;
+    }
+    memcpy(cmd->buf, buf, cmd->len);
+    return true;
+}
+
 SCSIRequest *scsi_req_new(SCSIDevice *d, uint32_t tag, uint32_t lun,
                           uint8_t *buf, void *hba_private)
 {
@@ -584,6 +671,17 @@ SCSIRequest *scsi_req_new(SCSIDevice *d, uint32_t tag, uint32_t lun,
     SCSICommand cmd = { .len = 0 };
     int ret;
 
+    /* Fast path for plain reads and writes to the addressed LUN */
+    if (sc->rw_reqops && lun == d->lun &&
+        d->unit_attention.key != UNIT_ATTENTION &&
+        bus->unit_attention.key != UNIT_ATTENTION &&
+        scsi_req_parse_rw_cdb(d, &cmd, buf)) {
+        req = scsi_req_alloc(sc->rw_reqops, d, tag, lun, hba_private);
+        req->cmd = cmd;
+        req->resid = cmd.xfer;
+        return req;
+    }
+
     if ((d->unit_attention.key == UNIT_ATTENTION ||
          bus->unit_attention.key == UNIT_ATTENTION) &&
         (buf[0] != INQUIRY &&
@@ -1605,7 +1703,8 @@ void scsi_req_unref(SCSIRequest *req)
 {
     assert(req->refcount > 0);
     if (--req->refcount == 0) {
-        BusState *qbus = req->dev->qdev.parent_bus;
+        SCSIDevice *d = req->dev;
+        BusState *qbus = d->qdev.parent_bus;
         SCSIBus *bus = DO_UPCAST(SCSIBus, qbus, qbus);
 
         if (bus->info->free_request && req->hba_private) {
@@ -1614,9 +1713,11 @@ void scsi_req_unref(SCSIRequest *req)
         if (req->ops->free_req) {
             req->ops->free_req(req);
         }
-        object_unref(OBJECT(req->dev));
+        if (!scsi_req_pool_put(d, req)) {
+            g_slice_free1(req->ops->size, req);
+        }
+        object_unref(OBJECT(d));
         object_unref(OBJECT(qbus->parent));
-        g_slice_free1(req->ops->size, req);
     }
 }
 
@@ -2025,6 +2126,18 @@ static void scsi_dev_instance_init(Object *obj)
                                   &s->qdev, NULL);
 }
 
+static void scsi_dev_instance_finalize(Object *obj)
+{
+    SCSIDevice *s = SCSI_DEVICE(obj);
+    SCSIDeviceClass *sc = SCSI_DEVICE_GET_CLASS(s);
+    SCSIRequest *req;
+
+    while ((req = QSLIST_FIRST(&s->req_pool)) != NULL) {
+        QSLIST_REMOVE_HEAD(&s->req_pool, pool_next);
+        g_slice_free1(sc->rw_reqops->size, req);
+    }
+}
+
 static const TypeInfo scsi_device_type_info = {
     .name = TYPE_SCSI_DEVICE,
     .parent = TYPE_DEVICE,
@@ -2033,6 +2146,7 @@ static const TypeInfo scsi_device_type_info = {
     .class_size = sizeof(SCSIDeviceClass),
     .class_init = scsi_device_class_init,
     .instance_init = scsi_dev_instance_init,
+    .instance_finalize = scsi_dev_instance_finalize,
 };
 
 static void scsi_register_types(void)
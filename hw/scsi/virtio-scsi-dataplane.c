@@ -18,17 +18,27 @@
 #include <block/scsi.h>
 #include <hw/virtio/virtio-bus.h>
 #include "hw/virtio/virtio-access.h"
+#include "qemu/atomic.h"
+#include "qapi/error.h"
 #include "stdio.h"
 
+static bool virtio_scsi_thread_run(VirtIOSCSIThread *t);
+
+static void virtio_scsi_thread_bh(void *opaque)
+{
+    virtio_scsi_thread_run(opaque);
+}
+
 /* Context: QEMU global mutex held */
-void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread)
+void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread,
+                              Error **errp)
 {
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
     VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
+    unsigned int i, n = 1 + vs->conf.num_iothreads;
 
     assert(!s->ctx);
-    s->ctx = iothread_get_aio_context(vs->conf.iothread);
 
     /* Don't try if transport does not support notifiers. */
     if (!k->set_guest_notifiers || !k->set_host_notifier) {
@@ -36,9 +46,166 @@ void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread)
                    "(transport does not support notifiers)");
         exit(1);
     }
+
+    s->threads = g_new0(VirtIOSCSIThread, n);
+    s->threads[0].iothread = iothread;
+    for (i = 1; i < n; i++) {
+        const char *id = vs->conf.iothreads[i - 1];
+        Object *obj = NULL;
+
+        if (id) {
+            obj = object_resolve_path_component(object_get_objects_root(),
+                                                id);
+        }
+        if (!obj || !object_dynamic_cast(obj, TYPE_IOTHREAD)) {
+            error_setg(errp, "iothreads[%u] is not an IOThread", i - 1);
+            g_free(s->threads);
+            s->threads = NULL;
+            return;
+        }
+        s->threads[i].iothread = IOTHREAD(obj);
+    }
+
+    for (i = 0; i < n; i++) {
+        VirtIOSCSIThread *t = &s->threads[i];
+
+        object_ref(OBJECT(t->iothread));
+        t->parent = s;
+        t->ctx = iothread_get_aio_context(t->iothread);
+        t->bh = aio_bh_new(t->ctx, virtio_scsi_thread_bh, t);
+        qemu_mutex_init(&t->lock);
+        QSIMPLEQ_INIT(&t->submit);
+        QSIMPLEQ_INIT(&t->complete);
+    }
+    s->num_threads = n;
+    s->ctx = s->threads[0].ctx;
+}
+
+/* Context: QEMU global mutex held */
+void virtio_scsi_dataplane_cleanup(VirtIOSCSI *s)
+{
+    unsigned int i;
+
+    for (i = 0; i < s->num_threads; i++) {
+        VirtIOSCSIThread *t = &s->threads[i];
+
+        qemu_bh_delete(t->bh);
+        qemu_mutex_destroy(&t->lock);
+        object_unref(OBJECT(t->iothread));
+    }
+    g_free(s->threads);
+    s->threads = NULL;
+    s->num_threads = 0;
+    s->ctx = NULL;
+}
+
+static VirtIOSCSIThread *virtio_scsi_ctx_thread(VirtIOSCSI *s,
+                                                AioContext *ctx)
+{
+    unsigned int i;
+
+    for (i = 0; i < s->num_threads; i++) {
+        if (s->threads[i].ctx == ctx) {
+            return &s->threads[i];
+        }
+    }
+    return NULL;
+}
+
+static void virtio_scsi_thread_queue(VirtIOSCSIThread *t, VirtIOSCSIReq *req,
+                                     bool complete)
+{
+    bool kick;
+
+    /* A BH is already pending if either list is non-empty */
+    qemu_mutex_lock(&t->lock);
+    kick = QSIMPLEQ_EMPTY(&t->submit) && QSIMPLEQ_EMPTY(&t->complete);
+    if (complete) {
+        QSIMPLEQ_INSERT_TAIL(&t->complete, req, handoff);
+    } else {
+        QSIMPLEQ_INSERT_TAIL(&t->submit, req, handoff);
+    }
+    qemu_mutex_unlock(&t->lock);
+
+    if (kick) {
+        qemu_bh_schedule(t->bh);
+    }
+}
+
+/* Pass @req to the thread that runs @ctx, which continues processing it
+ * in virtio_scsi_thread_run.
+ *
+ * Context: req->ctx held
+ */
+void virtio_scsi_dataplane_forward_req(VirtIOSCSIReq *req, AioContext *ctx)
+{
+    VirtIOSCSIThread *t = virtio_scsi_ctx_thread(req->dev, ctx);
+
+    assert(t);
+    req->ctx = ctx;
+    virtio_scsi_thread_queue(t, req, false);
+}
+
+/* Context: req->ctx held */
+void virtio_scsi_dataplane_complete_req(VirtIOSCSIReq *req)
+{
+    VirtIOSCSIThread *t = req->vring->thread;
+
+    if (req->ctx == t->ctx) {
+        virtio_scsi_vring_push_notify(req);
+        virtio_scsi_free_req(req);
+    } else {
+        req->ctx = t->ctx;
+        virtio_scsi_thread_queue(t, req, true);
+    }
+}
+
+typedef struct {
+    VirtIOSCSIReq *tmf_req;
+    SCSIDevice *d;
+    AioContext *ctx;
+    QEMUBH *bh;
+} VirtIOSCSILunReset;
+
+static void virtio_scsi_lun_reset_bh(void *opaque)
+{
+    VirtIOSCSILunReset *r = opaque;
+    VirtIOSCSIReq *req = r->tmf_req;
+    VirtIOSCSI *s = req->dev;
+
+    qemu_bh_delete(r->bh);
+    atomic_inc(&s->resetting);
+    qdev_reset_all(&r->d->qdev);
+    atomic_dec(&s->resetting);
+    object_unref(OBJECT(r->d));
+
+    if (atomic_fetch_dec(&req->remaining) == 1) {
+        req->ctx = r->ctx;
+        virtio_scsi_complete_req(req);
+    }
+    g_slice_free(VirtIOSCSILunReset, r);
+}
+
+/* Reset @d in the thread that owns it.  The TMF request is completed by
+ * whoever drops req->remaining to zero.
+ *
+ * Context: req->ctx held
+ */
+void virtio_scsi_dataplane_reset_lun(VirtIOSCSIReq *req, SCSIDevice *d)
+{
+    VirtIOSCSILunReset *r = g_slice_new(VirtIOSCSILunReset);
+
+    atomic_inc(&req->remaining);
+    object_ref(OBJECT(d));
+    r->tmf_req = req;
+    r->d = d;
+    r->ctx = blk_get_aio_context(d->conf.blk);
+    r->bh = aio_bh_new(r->ctx, virtio_scsi_lun_reset_bh, r);
+    qemu_bh_schedule(r->bh);
 }
 
 static VirtIOSCSIVring *virtio_scsi_vring_init(VirtIOSCSI *s,
+                                               VirtIOSCSIThread *t,
                                                VirtQueue *vq,
                                                EventNotifierHandler *handler,
                                                int n)
@@ -60,18 +227,21 @@ static VirtIOSCSIVring *virtio_scsi_vring_init(VirtIOSCSI *s,
     r = g_slice_new(VirtIOSCSIVring);
     r->host_notifier = *virtio_queue_get_host_notifier(vq);
     r->guest_notifier = *virtio_queue_get_guest_notifier(vq);
-    aio_set_event_notifier(s->ctx, &r->host_notifier, handler);
-
     r->parent = s;
+    r->thread = t;
 
     if (!vring_setup(&r->vring, VIRTIO_DEVICE(s), n)) {
         fprintf(stderr, "virtio-scsi: VRing setup failed\n");
         goto fail_vring;
     }
+
+    /* The handler may run in t's IOThread as soon as it is set */
+    aio_context_acquire(t->ctx);
+    aio_set_event_notifier(t->ctx, &r->host_notifier, handler);
+    aio_context_release(t->ctx);
     return r;
 
 fail_vring:
-    aio_set_event_notifier(s->ctx, &r->host_notifier, NULL);
     k->set_host_notifier(qbus->parent, n, false);
     g_slice_free(VirtIOSCSIVring, r);
     return NULL;
@@ -80,28 +250,86 @@ fail_vring:
 VirtIOSCSIReq *virtio_scsi_pop_req_vring(VirtIOSCSI *s,
                                          VirtIOSCSIVring *vring)
 {
-    VirtIOSCSIReq *req = virtio_scsi_init_req(s, NULL);
-    int r;
+    VirtIOSCSICommon *vs = (VirtIOSCSICommon *)s;
+    VirtIOSCSIReq *req;
 
-    req->vring = vring;
-    r = vring_pop((VirtIODevice *)s, &vring->vring, &req->elem);
-    if (r < 0) {
-        virtio_scsi_free_req(req);
-        req = NULL;
+    req = vring_pop((VirtIODevice *)s, &vring->vring,
+                    sizeof(VirtIOSCSIReq) + vs->cdb_size);
+    if (!req) {
+        return NULL;
     }
+    virtio_scsi_init_req(s, NULL, req);
+    req->vring = vring;
+    req->ctx = vring->thread->ctx;
     return req;
 }
 
+static void virtio_scsi_vring_notify(VirtIOSCSIVring *vring)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(vring->parent);
+
+    if (vring_should_notify(vdev, &vring->vring)) {
+        event_notifier_set(&vring->guest_notifier);
+    }
+}
+
 void virtio_scsi_vring_push_notify(VirtIOSCSIReq *req)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(req->vring->parent);
 
     vring_push(vdev, &req->vring->vring, &req->elem,
                req->qsgl.size + req->resp_iov.size);
+    virtio_scsi_vring_notify(req->vring);
+}
+
+/* Process the requests that other threads passed to @t.  Completions are
+ * pushed first and the guest is notified once per run of requests on the
+ * same vring.  Returns true if there was anything to do.
+ *
+ * Context: t->ctx held
+ */
+static bool virtio_scsi_thread_run(VirtIOSCSIThread *t)
+{
+    VirtIOSCSI *s = t->parent;
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    QSIMPLEQ_HEAD(, VirtIOSCSIReq) submit, complete;
+    QTAILQ_HEAD(, VirtIOSCSIReq) reqs = QTAILQ_HEAD_INITIALIZER(reqs);
+    VirtIOSCSIReq *req, *next;
+
+    QSIMPLEQ_INIT(&submit);
+    QSIMPLEQ_INIT(&complete);
+    qemu_mutex_lock(&t->lock);
+    QSIMPLEQ_CONCAT(&submit, &t->submit);
+    QSIMPLEQ_CONCAT(&complete, &t->complete);
+    qemu_mutex_unlock(&t->lock);
+
+    if (QSIMPLEQ_EMPTY(&submit) && QSIMPLEQ_EMPTY(&complete)) {
+        return false;
+    }
+
+    QSIMPLEQ_FOREACH_SAFE(req, &complete, handoff, next) {
+        VirtIOSCSIVring *vring = req->vring;
+
+        vring_push(vdev, &vring->vring, &req->elem,
+                   req->qsgl.size + req->resp_iov.size);
+        virtio_scsi_free_req(req);
+        if (!next || next->vring != vring) {
+            virtio_scsi_vring_notify(vring);
+        }
+    }
+
+    QSIMPLEQ_FOREACH_SAFE(req, &submit, handoff, next) {
+        if (req->vring == s->ctrl_vring) {
+            virtio_scsi_handle_tmf_req_forwarded(s, req);
+        } else if (virtio_scsi_handle_cmd_req_forwarded(s, req)) {
+            QTAILQ_INSERT_TAIL(&reqs, req, next);
+        }
+    }
 
-    if (vring_should_notify(vdev, &req->vring->vring)) {
-        event_notifier_set(&req->vring->guest_notifier);
+    QTAILQ_FOREACH_SAFE(req, &reqs, next, next) {
+        virtio_scsi_handle_cmd_req_submit(s, req);
     }
+    return true;
 }
 
 static void virtio_scsi_iothread_handle_ctrl(EventNotifier *notifier)
@@ -155,25 +383,64 @@ static void virtio_scsi_iothread_handle_cmd(EventNotifier *notifier)
     }
 }
 
-/* assumes s->ctx held */
+static void virtio_scsi_vring_clear_aio(VirtIOSCSIVring *r)
+{
+    AioContext *ctx = r->thread->ctx;
+
+    aio_context_acquire(ctx);
+    aio_set_event_notifier(ctx, &r->host_notifier, NULL);
+    aio_context_release(ctx);
+}
+
 static void virtio_scsi_clear_aio(VirtIOSCSI *s)
 {
     VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
     int i;
 
     if (s->ctrl_vring) {
-        aio_set_event_notifier(s->ctx, &s->ctrl_vring->host_notifier, NULL);
+        virtio_scsi_vring_clear_aio(s->ctrl_vring);
     }
     if (s->event_vring) {
-        aio_set_event_notifier(s->ctx, &s->event_vring->host_notifier, NULL);
+        virtio_scsi_vring_clear_aio(s->event_vring);
     }
     if (s->cmd_vrings) {
         for (i = 0; i < vs->conf.num_queues && s->cmd_vrings[i]; i++) {
-            aio_set_event_notifier(s->ctx, &s->cmd_vrings[i]->host_notifier, NULL);
+            virtio_scsi_vring_clear_aio(s->cmd_vrings[i]);
         }
     }
 }
 
+/* Run whatever is still queued between threads.  Returns true if any
+ * thread had work to do.
+ */
+static bool virtio_scsi_dataplane_flush(VirtIOSCSI *s)
+{
+    bool progress = false;
+    unsigned int i;
+
+    for (i = 0; i < s->num_threads; i++) {
+        VirtIOSCSIThread *t = &s->threads[i];
+
+        aio_context_acquire(t->ctx);
+        progress |= virtio_scsi_thread_run(t);
+        aio_context_release(t->ctx);
+    }
+    return progress;
+}
+
+/* Stop processing the vrings and complete every request that was popped */
+static void virtio_scsi_dataplane_quiesce(VirtIOSCSI *s)
+{
+    virtio_scsi_clear_aio(s);
+
+    /* Requests may still be queued between threads, and running them can
+     * start more I/O.  Repeat until everything has been pushed back.
+     */
+    do {
+        blk_drain_all(); /* ensure there are no in-flight requests */
+    } while (virtio_scsi_dataplane_flush(s));
+}
+
 static void virtio_scsi_vring_teardown(VirtIOSCSI *s)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
@@ -229,22 +496,24 @@ void virtio_scsi_dataplane_start(VirtIOSCSI *s)
     }
 
     aio_context_acquire(s->ctx);
-    s->ctrl_vring = virtio_scsi_vring_init(s, vs->ctrl_vq,
+    s->ctrl_vring = virtio_scsi_vring_init(s, &s->threads[0], vs->ctrl_vq,
                                            virtio_scsi_iothread_handle_ctrl,
                                            0);
     if (!s->ctrl_vring) {
         goto fail_vrings;
     }
-    s->event_vring = virtio_scsi_vring_init(s, vs->event_vq,
+    s->event_vring = virtio_scsi_vring_init(s, &s->threads[0], vs->event_vq,
                                             virtio_scsi_iothread_handle_event,
                                             1);
     if (!s->event_vring) {
         goto fail_vrings;
     }
-    s->cmd_vrings = g_new(VirtIOSCSIVring *, vs->conf.num_queues);
+    /* Spread the request queues over the IOThreads */
+    s->cmd_vrings = g_new0(VirtIOSCSIVring *, vs->conf.num_queues);
     for (i = 0; i < vs->conf.num_queues; i++) {
         s->cmd_vrings[i] =
-            virtio_scsi_vring_init(s, vs->cmd_vqs[i],
+            virtio_scsi_vring_init(s, &s->threads[i % s->num_threads],
+                                   vs->cmd_vqs[i],
                                    virtio_scsi_iothread_handle_cmd,
                                    i + 2);
         if (!s->cmd_vrings[i]) {
@@ -258,8 +527,8 @@ void virtio_scsi_dataplane_start(VirtIOSCSI *s)
     return;
 
 fail_vrings:
-    virtio_scsi_clear_aio(s);
     aio_context_release(s->ctx);
+    virtio_scsi_dataplane_quiesce(s);
     virtio_scsi_vring_teardown(s);
     for (i = 0; i < vs->conf.num_queues + 2; i++) {
         k->set_host_notifier(qbus->parent, i, false);
@@ -288,17 +557,7 @@ void virtio_scsi_dataplane_stop(VirtIOSCSI *s)
     s->dataplane_stopping = true;
     assert(s->ctx == iothread_get_aio_context(vs->conf.iothread));
 
-    aio_context_acquire(s->ctx);
-
-    aio_set_event_notifier(s->ctx, &s->ctrl_vring->host_notifier, NULL);
-    aio_set_event_notifier(s->ctx, &s->event_vring->host_notifier, NULL);
-    for (i = 0; i < vs->conf.num_queues; i++) {
-        aio_set_event_notifier(s->ctx, &s->cmd_vrings[i]->host_notifier, NULL);
-    }
-
-    blk_drain_all(); /* ensure there are no in-flight requests */
-
-    aio_context_release(s->ctx);
+    virtio_scsi_dataplane_quiesce(s);
 
     /* Sync vring state back to virtqueue so that non-dataplane request
      * processing can continue when we disable the host notifier below.
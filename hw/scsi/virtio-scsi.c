@@ -17,6 +17,7 @@
 #include "hw/virtio/virtio-scsi.h"
 #include "qemu/error-report.h"
 #include "qemu/iov.h"
+#include "qemu/atomic.h"
 #include "sysemu/block-backend.h"
 #include <hw/scsi/scsi.h>
 #include <block/scsi.h>
@@ -40,50 +41,47 @@ static inline SCSIDevice *virtio_scsi_device_find(VirtIOSCSI *s, uint8_t *lun)
     return scsi_device_find(&s->bus, 0, lun[1], virtio_scsi_get_lun(lun));
 }
 
-VirtIOSCSIReq *virtio_scsi_init_req(VirtIOSCSI *s, VirtQueue *vq)
+void virtio_scsi_init_req(VirtIOSCSI *s, VirtQueue *vq, VirtIOSCSIReq *req)
 {
-    VirtIOSCSIReq *req;
-    VirtIOSCSICommon *vs = (VirtIOSCSICommon *)s;
-    const size_t zero_skip = offsetof(VirtIOSCSIReq, elem)
-                             + sizeof(VirtQueueElement);
+    const size_t zero_skip = offsetof(VirtIOSCSIReq, resp_iov)
+                             + sizeof(req->resp_iov);
 
-    req = g_slice_alloc(sizeof(*req) + vs->cdb_size);
     req->vq = vq;
     req->dev = s;
     qemu_sglist_init(&req->qsgl, DEVICE(s), 8, &address_space_memory);
     qemu_iovec_init(&req->resp_iov, 1);
     memset((uint8_t *)req + zero_skip, 0, sizeof(*req) - zero_skip);
-    return req;
 }
 
 void virtio_scsi_free_req(VirtIOSCSIReq *req)
 {
-    VirtIOSCSICommon *vs = (VirtIOSCSICommon *)req->dev;
-
     qemu_iovec_destroy(&req->resp_iov);
     qemu_sglist_destroy(&req->qsgl);
-    g_slice_free1(sizeof(*req) + vs->cdb_size, req);
+    g_free(req);
 }
 
-static void virtio_scsi_complete_req(VirtIOSCSIReq *req)
+void virtio_scsi_complete_req(VirtIOSCSIReq *req)
 {
     VirtIOSCSI *s = req->dev;
     VirtQueue *vq = req->vq;
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
 
     qemu_iovec_from_buf(&req->resp_iov, 0, &req->resp, req->resp_size);
-    if (req->vring) {
-        assert(req->vq == NULL);
-        virtio_scsi_vring_push_notify(req);
-    } else {
-        virtqueue_push(vq, &req->elem, req->qsgl.size + req->resp_iov.size);
-        virtio_notify(vdev, vq);
-    }
 
+    /* Drop the SCSI request in the context that owns the LUN */
     if (req->sreq) {
         req->sreq->hba_private = NULL;
         scsi_req_unref(req->sreq);
+        req->sreq = NULL;
+    }
+
+    if (req->vring) {
+        assert(req->vq == NULL);
+        virtio_scsi_dataplane_complete_req(req);
+        return;
     }
+    virtqueue_push(vq, &req->elem, req->qsgl.size + req->resp_iov.size);
+    virtio_notify(vdev, vq);
     virtio_scsi_free_req(req);
 }
 
@@ -176,11 +174,14 @@ static int virtio_scsi_parse_req(VirtIOSCSIReq *req,
 
 static VirtIOSCSIReq *virtio_scsi_pop_req(VirtIOSCSI *s, VirtQueue *vq)
 {
-    VirtIOSCSIReq *req = virtio_scsi_init_req(s, vq);
-    if (!virtqueue_pop(vq, &req->elem)) {
-        virtio_scsi_free_req(req);
+    VirtIOSCSICommon *vs = (VirtIOSCSICommon *)s;
+    VirtIOSCSIReq *req;
+
+    req = virtqueue_pop(vq, sizeof(VirtIOSCSIReq) + vs->cdb_size);
+    if (!req) {
         return NULL;
     }
+    virtio_scsi_init_req(s, vq, req);
     return req;
 }
 
@@ -192,7 +193,7 @@ static void virtio_scsi_save_request(QEMUFile *f, SCSIRequest *sreq)
 
     assert(n < vs->conf.num_queues);
     qemu_put_be32s(f, &n);
-    qemu_put_buffer(f, (unsigned char *)&req->elem, sizeof(req->elem));
+    qemu_put_virtqueue_element(f, &req->elem);
 }
 
 static void *virtio_scsi_load_request(QEMUFile *f, SCSIRequest *sreq)
@@ -205,17 +206,8 @@ static void *virtio_scsi_load_request(QEMUFile *f, SCSIRequest *sreq)
 
     qemu_get_be32s(f, &n);
     assert(n < vs->conf.num_queues);
-    req = virtio_scsi_init_req(s, vs->cmd_vqs[n]);
-    qemu_get_buffer(f, (unsigned char *)&req->elem, sizeof(req->elem));
-    /* TODO: add a way for SCSIBusInfo's load_request to fail,
-     * and fail migration instead of asserting here.
-     * When we do, we might be able to re-enable NDEBUG below.
-     */
-#ifdef NDEBUG
-#error building with NDEBUG is not supported
-#endif
-    assert(req->elem.in_num <= ARRAY_SIZE(req->elem.in_sg));
-    assert(req->elem.out_num <= ARRAY_SIZE(req->elem.out_sg));
+    req = qemu_get_virtqueue_element(f, sizeof(VirtIOSCSIReq) + vs->cdb_size);
+    virtio_scsi_init_req(s, vs->cmd_vqs[n], req);
 
     if (virtio_scsi_parse_req(req, sizeof(VirtIOSCSICmdReq) + vs->cdb_size,
                               sizeof(VirtIOSCSICmdResp) + vs->sense_size) < 0) {
@@ -259,13 +251,20 @@ static int virtio_scsi_do_tmf(VirtIOSCSI *s, VirtIOSCSIReq *req)
     int target;
     int ret = 0;
 
-    if (s->dataplane_started) {
-        assert(blk_get_aio_context(d->conf.blk) == s->ctx);
+    /* TMFs that address a single LUN run in the thread that owns it */
+    if (d && req->vring &&
+        req->req.tmf.subtype != VIRTIO_SCSI_T_TMF_I_T_NEXUS_RESET) {
+        AioContext *ctx = blk_get_aio_context(d->conf.blk);
+
+        if (ctx != req->ctx) {
+            virtio_scsi_dataplane_forward_req(req, ctx);
+            return -EINPROGRESS;
+        }
     }
+
     /* Here VIRTIO_SCSI_S_OK means "FUNCTION COMPLETE".  */
     req->resp.tmf.response = VIRTIO_SCSI_S_OK;
 
-    virtio_tswap32s(VIRTIO_DEVICE(s), &req->req.tmf.subtype);
     switch (req->req.tmf.subtype) {
     case VIRTIO_SCSI_T_TMF_ABORT_TASK:
     case VIRTIO_SCSI_T_TMF_QUERY_TASK:
@@ -312,9 +311,9 @@ static int virtio_scsi_do_tmf(VirtIOSCSI *s, VirtIOSCSIReq *req)
         if (d->lun != virtio_scsi_get_lun(req->req.tmf.lun)) {
             goto incorrect_lun;
         }
-        s->resetting++;
+        atomic_inc(&s->resetting);
         qdev_reset_all(&d->qdev);
-        s->resetting--;
+        atomic_dec(&s->resetting);
         break;
 
     case VIRTIO_SCSI_T_TMF_ABORT_TASK_SET:
@@ -359,14 +358,29 @@ static int virtio_scsi_do_tmf(VirtIOSCSI *s, VirtIOSCSIReq *req)
 
     case VIRTIO_SCSI_T_TMF_I_T_NEXUS_RESET:
         target = req->req.tmf.lun[1];
-        s->resetting++;
+
+        /* LUNs owned by other IOThreads are reset there.  As above,
+         * "remaining" holds an extra reference until the loop is done;
+         * it is updated atomically because those threads drop theirs
+         * concurrently.
+         */
+        req->remaining = 1;
+        atomic_inc(&s->resetting);
         QTAILQ_FOREACH(kid, &s->bus.qbus.children, sibling) {
              d = DO_UPCAST(SCSIDevice, qdev, kid->child);
-             if (d->channel == 0 && d->id == target) {
+             if (d->channel != 0 || d->id != target) {
+                continue;
+             }
+             if (req->vring && blk_get_aio_context(d->conf.blk) != req->ctx) {
+                virtio_scsi_dataplane_reset_lun(req, d);
+             } else {
                 qdev_reset_all(&d->qdev);
              }
         }
-        s->resetting--;
+        atomic_dec(&s->resetting);
+        if (atomic_fetch_dec(&req->remaining) > 1) {
+            ret = -EINPROGRESS;
+        }
         break;
 
     case VIRTIO_SCSI_T_TMF_CLEAR_ACA:
@@ -404,6 +418,7 @@ void virtio_scsi_handle_ctrl_req(VirtIOSCSI *s, VirtIOSCSIReq *req)
                     sizeof(VirtIOSCSICtrlTMFResp)) < 0) {
             virtio_scsi_bad_req();
         } else {
+            virtio_tswap32s(vdev, &req->req.tmf.subtype);
             r = virtio_scsi_do_tmf(s, req);
         }
 
@@ -424,6 +439,14 @@ void virtio_scsi_handle_ctrl_req(VirtIOSCSI *s, VirtIOSCSIReq *req)
     }
 }
 
+/* Continue a TMF that was passed to the thread owning its LUN */
+void virtio_scsi_handle_tmf_req_forwarded(VirtIOSCSI *s, VirtIOSCSIReq *req)
+{
+    if (virtio_scsi_do_tmf(s, req) == 0) {
+        virtio_scsi_complete_req(req);
+    }
+}
+
 static void virtio_scsi_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOSCSI *s = (VirtIOSCSI *)vdev;
@@ -506,7 +529,7 @@ static void virtio_scsi_request_cancelled(SCSIRequest *r)
     if (!req) {
         return;
     }
-    if (req->dev->resetting) {
+    if (atomic_read(&req->dev->resetting)) {
         req->resp.cmd.response = VIRTIO_SCSI_S_RESET;
     } else {
         req->resp.cmd.response = VIRTIO_SCSI_S_ABORTED;
@@ -520,6 +543,25 @@ static void virtio_scsi_fail_cmd_req(VirtIOSCSIReq *req)
     virtio_scsi_complete_cmd_req(req);
 }
 
+static bool virtio_scsi_cmd_req_new(VirtIOSCSI *s, VirtIOSCSIReq *req,
+                                    SCSIDevice *d)
+{
+    req->sreq = scsi_req_new(d, req->req.cmd.tag,
+                             virtio_scsi_get_lun(req->req.cmd.lun),
+                             req->req.cmd.cdb, req);
+
+    if (req->sreq->cmd.mode != SCSI_XFER_NONE
+        && (req->sreq->cmd.mode != req->mode ||
+            req->sreq->cmd.xfer > req->qsgl.size)) {
+        req->resp.cmd.response = VIRTIO_SCSI_S_OVERRUN;
+        virtio_scsi_complete_cmd_req(req);
+        return false;
+    }
+    scsi_req_ref(req->sreq);
+    blk_io_plug(d->conf.blk);
+    return true;
+}
+
 bool virtio_scsi_handle_cmd_req_prepare(VirtIOSCSI *s, VirtIOSCSIReq *req)
 {
     VirtIOSCSICommon *vs = &s->parent_obj;
@@ -543,23 +585,30 @@ bool virtio_scsi_handle_cmd_req_prepare(VirtIOSCSI *s, VirtIOSCSIReq *req)
         virtio_scsi_complete_cmd_req(req);
         return false;
     }
-    if (s->dataplane_started) {
-        assert(blk_get_aio_context(d->conf.blk) == s->ctx);
+    if (req->vring) {
+        AioContext *ctx = blk_get_aio_context(d->conf.blk);
+
+        /* The LUN is served by another IOThread */
+        if (ctx != req->ctx) {
+            virtio_scsi_dataplane_forward_req(req, ctx);
+            return false;
+        }
     }
-    req->sreq = scsi_req_new(d, req->req.cmd.tag,
-                             virtio_scsi_get_lun(req->req.cmd.lun),
-                             req->req.cmd.cdb, req);
+    return virtio_scsi_cmd_req_new(s, req, d);
+}
 
-    if (req->sreq->cmd.mode != SCSI_XFER_NONE
-        && (req->sreq->cmd.mode != req->mode ||
-            req->sreq->cmd.xfer > req->qsgl.size)) {
-        req->resp.cmd.response = VIRTIO_SCSI_S_OVERRUN;
+/* Continue a command that was passed to the thread owning its LUN */
+bool virtio_scsi_handle_cmd_req_forwarded(VirtIOSCSI *s, VirtIOSCSIReq *req)
+{
+    SCSIDevice *d = virtio_scsi_device_find(s, req->req.cmd.lun);
+
+    /* The LUN may have been unplugged in the meantime */
+    if (!d || blk_get_aio_context(d->conf.blk) != req->ctx) {
+        req->resp.cmd.response = VIRTIO_SCSI_S_BAD_TARGET;
         virtio_scsi_complete_cmd_req(req);
         return false;
     }
-    scsi_req_ref(req->sreq);
-    blk_io_plug(d->conf.blk);
-    return true;
+    return virtio_scsi_cmd_req_new(s, req, d);
 }
 
 void virtio_scsi_handle_cmd_req_submit(VirtIOSCSI *s, VirtIOSCSIReq *req)
@@ -646,9 +695,9 @@ static void virtio_scsi_reset(VirtIODevice *vdev)
     if (s->ctx) {
         virtio_scsi_dataplane_stop(s);
     }
-    s->resetting++;
+    atomic_inc(&s->resetting);
     qbus_reset_all(&s->bus.qbus);
-    s->resetting--;
+    atomic_dec(&s->resetting);
 
     vs->sense_size = VIRTIO_SCSI_SENSE_DEFAULT_SIZE;
     vs->cdb_size = VIRTIO_SCSI_CDB_DEFAULT_SIZE;
@@ -768,13 +817,18 @@ static void virtio_scsi_hotplug(HotplugHandler *hotplug_dev, DeviceState *dev,
     SCSIDevice *sd = SCSI_DEVICE(dev);
 
     if (s->ctx && !s->dataplane_disabled) {
+        VirtIOSCSIThread *t;
+
         if (blk_op_is_blocked(sd->conf.blk, BLOCK_OP_TYPE_DATAPLANE, errp)) {
             return;
         }
         blk_op_block_all(sd->conf.blk, s->blocker);
-        aio_context_acquire(s->ctx);
-        blk_set_aio_context(sd->conf.blk, s->ctx);
-        aio_context_release(s->ctx);
+
+        /* Assign LUNs to the IOThreads round-robin */
+        t = &s->threads[s->next_lun_thread++ % s->num_threads];
+        aio_context_acquire(t->ctx);
+        blk_set_aio_context(sd->conf.blk, t->ctx);
+        aio_context_release(t->ctx);
     }
 
     if (virtio_has_feature(vdev, VIRTIO_SCSI_F_HOTPLUG)) {
@@ -851,7 +905,20 @@ void virtio_scsi_common_realize(DeviceState *dev, Error **errp,
     }
 
     if (s->conf.iothread) {
-        virtio_scsi_set_iothread(VIRTIO_SCSI(s), s->conf.iothread);
+        Error *err = NULL;
+
+        virtio_scsi_set_iothread(VIRTIO_SCSI(s), s->conf.iothread, &err);
+        if (err) {
+            error_propagate(errp, err);
+            g_free(s->cmd_vqs);
+            virtio_cleanup(vdev);
+            return;
+        }
+    } else if (s->conf.num_iothreads) {
+        error_setg(errp, "iothreads requires iothread to be set");
+        g_free(s->cmd_vqs);
+        virtio_cleanup(vdev);
+        return;
     }
 }
 
@@ -926,6 +993,14 @@ static void virtio_scsi_instance_init(Object *obj)
                              OBJ_PROP_LINK_UNREF_ON_RELEASE, &error_abort);
 }
 
+static void virtio_scsi_instance_finalize(Object *obj)
+{
+    VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(obj);
+
+    /* the elements were freed along with the iothreads[] properties */
+    g_free(vs->conf.iothreads);
+}
+
 void virtio_scsi_common_unrealize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
@@ -940,6 +1015,9 @@ static void virtio_scsi_device_unrealize(DeviceState *dev, Error **errp)
     VirtIOSCSI *s = VIRTIO_SCSI(dev);
 
     error_free(s->blocker);
+    if (s->ctx) {
+        virtio_scsi_dataplane_cleanup(s);
+    }
 
     unregister_savevm(dev, "virtio-scsi", s);
     remove_migration_state_change_notifier(&s->migration_state_notifier);
@@ -953,6 +1031,8 @@ static Property virtio_scsi_properties[] = {
                                                   0xFFFF),
     DEFINE_PROP_UINT32("cmd_per_lun", VirtIOSCSI, parent_obj.conf.cmd_per_lun,
                                                   128),
+    DEFINE_PROP_ARRAY("iothreads", VirtIOSCSI, parent_obj.conf.num_iothreads,
+                      parent_obj.conf.iothreads, qdev_prop_string, char *),
     DEFINE_PROP_BIT("any_layout", VirtIOSCSI, host_features,
                                               VIRTIO_F_ANY_LAYOUT, true),
     DEFINE_PROP_BIT("hotplug", VirtIOSCSI, host_features,
@@ -1001,6 +1081,7 @@ static const TypeInfo virtio_scsi_info = {
     .parent = TYPE_VIRTIO_SCSI_COMMON,
     .instance_size = sizeof(VirtIOSCSI),
     .instance_init = virtio_scsi_instance_init,
+    .instance_finalize = virtio_scsi_instance_finalize,
     .class_init = virtio_scsi_class_init,
     .interfaces = (InterfaceInfo[]) {
         { TYPE_HOTPLUG_HANDLER },
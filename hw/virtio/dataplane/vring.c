@@ -157,10 +157,21 @@ bool vring_should_notify(VirtIODevice *vdev, Vring *vring)
 }
 
 
-static int get_desc(VirtIODevice *vdev, Vring *vring, VirtQueueElement *elem,
-                    struct vring_desc *desc)
+/* The descriptors of the element being popped are collected here, on the
+ * stack, so that the element can be allocated with the right size at the
+ * end.  Output descriptors come first, followed by input descriptors.
+ */
+typedef struct VirtQueueCurrentElement {
+    unsigned in_num;
+    unsigned out_num;
+    hwaddr addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+} VirtQueueCurrentElement;
+
+static int get_desc(VirtIODevice *vdev, Vring *vring,
+                    VirtQueueCurrentElement *elem, struct vring_desc *desc)
 {
-    unsigned *num;
+    unsigned num = elem->in_num + elem->out_num;
     struct iovec *iov;
     hwaddr *addr;
     MemoryRegion *mr;
@@ -168,26 +179,19 @@ static int get_desc(VirtIODevice *vdev, Vring *vring, VirtQueueElement *elem,
     uint32_t len = virtio_tswap32(vdev, desc->len);
     uint64_t desc_addr = virtio_tswap64(vdev, desc->addr);
 
-    if (is_write) {
-        num = &elem->in_num;
-        iov = &elem->in_sg[*num];
-        addr = &elem->in_addr[*num];
-    } else {
-        num = &elem->out_num;
-        iov = &elem->out_sg[*num];
-        addr = &elem->out_addr[*num];
-
-        /* If it's an output descriptor, they're all supposed
-         * to come before any input descriptors. */
-        if (unlikely(elem->in_num)) {
-            error_report("Descriptor has out after in");
-            return -EFAULT;
-        }
+    /* Stop for now if there are not enough iovecs available. */
+    if (num >= VIRTQUEUE_MAX_SIZE) {
+        error_report("Invalid SG num: %u", num);
+        return -EFAULT;
     }
 
-    /* Stop for now if there are not enough iovecs available. */
-    if (*num >= VIRTQUEUE_MAX_SIZE) {
-        error_report("Invalid SG num: %u", *num);
+    iov = &elem->iov[num];
+    addr = &elem->addr[num];
+
+    /* If it's an output descriptor, they're all supposed
+     * to come before any input descriptors. */
+    if (!is_write && unlikely(elem->in_num)) {
+        error_report("Descriptor has out after in");
         return -EFAULT;
     }
 
@@ -203,7 +207,11 @@ static int get_desc(VirtIODevice *vdev, Vring *vring, VirtQueueElement *elem,
      * ref in place.  */
     iov->iov_len = len;
     *addr = desc_addr;
-    *num += 1;
+    if (is_write) {
+        elem->in_num++;
+    } else {
+        elem->out_num++;
+    }
     return 0;
 }
 
@@ -219,7 +227,8 @@ static void copy_in_vring_desc(VirtIODevice *vdev,
 
 /* This is stolen from linux/drivers/vhost/vhost.c. */
 static int get_indirect(VirtIODevice *vdev, Vring *vring,
-                        VirtQueueElement *elem, struct vring_desc *indirect)
+                        VirtQueueCurrentElement *cur_elem,
+                        struct vring_desc *indirect)
 {
     struct vring_desc desc;
     unsigned int i = 0, count, found = 0;
@@ -281,7 +290,7 @@ static int get_indirect(VirtIODevice *vdev, Vring *vring,
             return -EFAULT;
         }
 
-        ret = get_desc(vdev, vring, elem, &desc);
+        ret = get_desc(vdev, vring, cur_elem, &desc);
         if (ret < 0) {
             vring->broken |= (ret == -EFAULT);
             return ret;
@@ -291,6 +300,19 @@ static int get_indirect(VirtIODevice *vdev, Vring *vring,
     return 0;
 }
 
+static void vring_unmap_current_element(VirtQueueCurrentElement *elem)
+{
+    unsigned i;
+
+    for (i = 0; i < elem->out_num; i++) {
+        vring_unmap(elem->iov[i].iov_base, false);
+    }
+
+    for (i = elem->out_num; i < elem->out_num + elem->in_num; i++) {
+        vring_unmap(elem->iov[i].iov_base, true);
+    }
+}
+
 static void vring_unmap_element(VirtQueueElement *elem)
 {
     int i;
@@ -313,22 +335,23 @@ static void vring_unmap_element(VirtQueueElement *elem)
  * number of output then some number of input descriptors, it's actually two
  * iovecs, but we pack them into one and note how many of each there were.
  *
- * This function returns the descriptor number found, or vq->num (which is
- * never a valid descriptor number) if none was found.  A negative code is
- * returned on error.
+ * This function returns an element of @sz bytes with the descriptors of the
+ * first available buffer, or NULL if none was found.  On error NULL is
+ * returned too, and the vring is marked as broken.
  *
  * Stolen from linux/drivers/vhost/vhost.c.
  */
-int vring_pop(VirtIODevice *vdev, Vring *vring,
-              VirtQueueElement *elem)
+void *vring_pop(VirtIODevice *vdev, Vring *vring, size_t sz)
 {
     struct vring_desc desc;
     unsigned int i, head, found = 0, num = vring->vr.num;
     uint16_t avail_idx, last_avail_idx;
+    VirtQueueCurrentElement cur_elem;
+    VirtQueueElement *elem = NULL;
     int ret;
 
-    /* Initialize elem so it can be safely unmapped */
-    elem->in_num = elem->out_num = 0;
+    /* Initialize cur_elem so it can be safely unmapped */
+    cur_elem.in_num = cur_elem.out_num = 0;
 
     /* If there was a fatal error then refuse operation */
     if (vring->broken) {
@@ -361,8 +384,6 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
      * the index we've seen. */
     head = vring_get_avail_ring(vdev, vring, last_avail_idx % num);
 
-    elem->index = head;
-
     /* If their number is silly, that's an error. */
     if (unlikely(head >= num)) {
         error_report("Guest says index %u > %u is available", head, num);
@@ -389,14 +410,14 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
         barrier();
 
         if (virtio_tswap16(vdev, desc.flags) & VRING_DESC_F_INDIRECT) {
-            ret = get_indirect(vdev, vring, elem, &desc);
+            ret = get_indirect(vdev, vring, &cur_elem, &desc);
             if (ret < 0) {
                 goto out;
             }
             continue;
         }
 
-        ret = get_desc(vdev, vring, elem, &desc);
+        ret = get_desc(vdev, vring, &cur_elem, &desc);
         if (ret < 0) {
             goto out;
         }
@@ -410,15 +431,27 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
         vring_avail_event(&vring->vr) = vring->last_avail_idx;
     }
 
-    return head;
+    /* Now copy what we have collected and mapped */
+    elem = virtqueue_alloc_element(sz, cur_elem.out_num, cur_elem.in_num);
+    elem->index = head;
+    for (i = 0; i < cur_elem.out_num; i++) {
+        elem->out_addr[i] = cur_elem.addr[i];
+        elem->out_sg[i] = cur_elem.iov[i];
+    }
+    for (i = 0; i < cur_elem.in_num; i++) {
+        elem->in_addr[i] = cur_elem.addr[cur_elem.out_num + i];
+        elem->in_sg[i] = cur_elem.iov[cur_elem.out_num + i];
+    }
+
+    return elem;
 
 out:
     assert(ret < 0);
     if (ret == -EFAULT) {
         vring->broken = true;
     }
-    vring_unmap_element(elem);
-    return ret;
+    vring_unmap_current_element(&cur_elem);
+    return NULL;
 }
 
 /* After we've used one of their buffers, we tell them about it.
@@ -21,6 +21,8 @@
 #include "hw/virtio/virtio-bus.h"
 #include "migration/migration.h"
 #include "hw/virtio/virtio-access.h"
+#include "qapi/qmp/qerror.h"
+#include "qmp-commands.h"
 
 /*
  * The alignment to use between consumer and producer parts of vring.
@@ -57,6 +59,13 @@ typedef struct VRingUsed
     VRingUsedElem ring[0];
 } VRingUsed;
 
+/* Host mapping of one of the three parts of a vring */
+typedef struct VRingMap {
+    MemoryRegion *mr;   /* holds a reference while the mapping is cached */
+    void *ptr;          /* NULL if the part is not directly accessible */
+    hwaddr offset;      /* offset of ptr within mr, for dirty tracking */
+} VRingMap;
+
 typedef struct VRing
 {
     unsigned int num;
@@ -64,6 +73,14 @@ typedef struct VRing
     hwaddr desc;
     hwaddr avail;
     hwaddr used;
+
+    /* The maps below are computed lazily and dropped whenever the ring
+     * addresses or the guest memory map change.
+     */
+    bool mapped;
+    VRingMap desc_map;
+    VRingMap avail_map;
+    VRingMap used_map;
 } VRing;
 
 struct VirtQueue
@@ -84,6 +101,18 @@ struct VirtQueue
     int inuse;
 
     uint16_t vector;
+
+    /* Interrupt coalescing */
+    VirtIOCoalesceConf coalesce;
+    QEMUTimer *coalesce_timer;
+    uint32_t coalesce_usecs;        /* delay currently applied */
+    uint32_t pending;               /* completions since the last interrupt */
+    int64_t sample_start;           /* start of the rate sample, in ns */
+    uint64_t sample_completions;    /* value of completions at sample_start */
+    uint64_t rate;                  /* completions/s in the last sample */
+    uint64_t completions;
+    uint64_t interrupts;
+
     void (*handle_output)(VirtIODevice *vdev, VirtQueue *vq);
     VirtIODevice *vdev;
     EventNotifier guest_notifier;
@@ -91,11 +120,97 @@ struct VirtQueue
     QLIST_ENTRY(VirtQueue) node;
 };
 
+static void vring_map_part(VRingMap *map, hwaddr pa, hwaddr len,
+                          bool is_write)
+{
+    MemoryRegionSection section;
+
+    section = memory_region_find(get_system_memory(), pa, len);
+    if (!section.mr) {
+        return;
+    }
+    if (int128_get64(section.size) < len ||
+        !memory_region_is_ram(section.mr) ||
+        (is_write && section.readonly)) {
+        memory_region_unref(section.mr);
+        return;
+    }
+
+    map->mr = section.mr;
+    map->offset = section.offset_within_region;
+    map->ptr = memory_region_get_ram_ptr(section.mr) + map->offset;
+}
+
+static void vring_unmap_part(VRingMap *map)
+{
+    if (map->mr) {
+        memory_region_unref(map->mr);
+    }
+    map->mr = NULL;
+    map->ptr = NULL;
+}
+
+/* Cache host pointers to the rings of @vq.  Parts that are not entirely
+ * contained in a RAM region keep a NULL pointer and are accessed through
+ * the physical memory accessors.
+ */
+static void vring_map_rings(VirtQueue *vq)
+{
+    VRing *vring = &vq->vring;
+    unsigned int num = vring->num;
+
+    if (vring->desc && num) {
+        vring_map_part(&vring->desc_map, vring->desc,
+                       num * sizeof(VRingDesc), false);
+        vring_map_part(&vring->avail_map, vring->avail,
+                       offsetof(VRingAvail, ring[num]) + sizeof(uint16_t),
+                       false);
+        vring_map_part(&vring->used_map, vring->used,
+                       offsetof(VRingUsed, ring[num]) + sizeof(uint16_t),
+                       true);
+    }
+    vring->mapped = true;
+}
+
+static void vring_unmap_rings(VirtQueue *vq)
+{
+    VRing *vring = &vq->vring;
+
+    if (!vring->mapped) {
+        return;
+    }
+    vring_unmap_part(&vring->desc_map);
+    vring_unmap_part(&vring->avail_map);
+    vring_unmap_part(&vring->used_map);
+    vring->mapped = false;
+}
+
+static inline void vring_check_maps(VirtQueue *vq)
+{
+    if (unlikely(!vq->vring.mapped)) {
+        vring_map_rings(vq);
+    }
+}
+
+/* Any change to the memory map can move or remove the RAM backing the
+ * rings, so drop all cached mappings; they are recomputed on next use.
+ */
+static void virtio_memory_listener_commit(MemoryListener *listener)
+{
+    VirtIODevice *vdev = container_of(listener, VirtIODevice, listener);
+    int i;
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        vring_unmap_rings(&vdev->vq[i]);
+    }
+}
+
 /* virt queue functions */
 void virtio_queue_update_rings(VirtIODevice *vdev, int n)
 {
     VRing *vring = &vdev->vq[n].vring;
 
+    vring_unmap_rings(&vdev->vq[n]);
     if (!vring->desc) {
         /* not yet setup -> nothing to do */
         return;
@@ -106,56 +221,89 @@ void virtio_queue_update_rings(VirtIODevice *vdev, int n)
                               vring->align);
 }
 
-static inline uint64_t vring_desc_addr(VirtIODevice *vdev, hwaddr desc_pa,
-                                       int i)
+/* Return the cached mapping of the descriptor table of @vq, or NULL */
+static inline const VRingDesc *vring_desc_ptr(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, addr);
-    return virtio_ldq_phys(vdev, pa);
+    vring_check_maps(vq);
+    return vq->vring.desc_map.ptr;
 }
 
-static inline uint32_t vring_desc_len(VirtIODevice *vdev, hwaddr desc_pa, int i)
+/* Read descriptor @i of the table at @desc_pa, which is mapped at
+ * @desc_ptr unless that is NULL.
+ */
+static void vring_desc_read(VirtIODevice *vdev, VRingDesc *desc,
+                            hwaddr desc_pa, const VRingDesc *desc_ptr,
+                            unsigned int i)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, len);
-    return virtio_ldl_phys(vdev, pa);
+    if (desc_ptr) {
+        memcpy(desc, &desc_ptr[i], sizeof(*desc));
+    } else {
+        cpu_physical_memory_read(desc_pa + i * sizeof(VRingDesc),
+                                 desc, sizeof(*desc));
+    }
+    virtio_tswap64s(vdev, &desc->addr);
+    virtio_tswap32s(vdev, &desc->len);
+    virtio_tswap16s(vdev, &desc->flags);
+    virtio_tswap16s(vdev, &desc->next);
 }
 
-static inline uint16_t vring_desc_flags(VirtIODevice *vdev, hwaddr desc_pa,
-                                        int i)
+static inline uint16_t vring_avail_lduw(VirtQueue *vq, hwaddr offset)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, flags);
-    return virtio_lduw_phys(vdev, pa);
+    vring_check_maps(vq);
+    if (likely(vq->vring.avail_map.ptr)) {
+        return virtio_lduw_p(vq->vdev, vq->vring.avail_map.ptr + offset);
+    }
+    return virtio_lduw_phys(vq->vdev, vq->vring.avail + offset);
 }
 
-static inline uint16_t vring_desc_next(VirtIODevice *vdev, hwaddr desc_pa,
-                                       int i)
+static inline uint16_t vring_used_lduw(VirtQueue *vq, hwaddr offset)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, next);
-    return virtio_lduw_phys(vdev, pa);
+    vring_check_maps(vq);
+    if (likely(vq->vring.used_map.ptr)) {
+        return virtio_lduw_p(vq->vdev, vq->vring.used_map.ptr + offset);
+    }
+    return virtio_lduw_phys(vq->vdev, vq->vring.used + offset);
+}
+
+static inline void vring_used_stw(VirtQueue *vq, hwaddr offset, uint16_t val)
+{
+    VRingMap *map = &vq->vring.used_map;
+
+    vring_check_maps(vq);
+    if (likely(map->ptr)) {
+        virtio_stw_p(vq->vdev, map->ptr + offset, val);
+        memory_region_set_dirty(map->mr, map->offset + offset, sizeof(val));
+    } else {
+        virtio_stw_phys(vq->vdev, vq->vring.used + offset, val);
+    }
+}
+
+static inline void vring_used_stl(VirtQueue *vq, hwaddr offset, uint32_t val)
+{
+    VRingMap *map = &vq->vring.used_map;
+
+    vring_check_maps(vq);
+    if (likely(map->ptr)) {
+        virtio_stl_p(vq->vdev, map->ptr + offset, val);
+        memory_region_set_dirty(map->mr, map->offset + offset, sizeof(val));
+    } else {
+        virtio_stl_phys(vq->vdev, vq->vring.used + offset, val);
+    }
 }
 
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, flags);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_avail_lduw(vq, offsetof(VRingAvail, flags));
 }
 
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, idx);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_avail_lduw(vq, offsetof(VRingAvail, idx));
 }
 
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_avail_lduw(vq, offsetof(VRingAvail, ring[i]));
 }
 
 static inline uint16_t vring_get_used_event(VirtQueue *vq)
@@ -165,56 +313,44 @@ static inline uint16_t vring_get_used_event(VirtQueue *vq)
 
 static inline void vring_used_ring_id(VirtQueue *vq, int i, uint32_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].id);
-    virtio_stl_phys(vq->vdev, pa, val);
+    vring_used_stl(vq, offsetof(VRingUsed, ring[i].id), val);
 }
 
 static inline void vring_used_ring_len(VirtQueue *vq, int i, uint32_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].len);
-    virtio_stl_phys(vq->vdev, pa, val);
+    vring_used_stl(vq, offsetof(VRingUsed, ring[i].len), val);
 }
 
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_used_lduw(vq, offsetof(VRingUsed, idx));
 }
 
 static inline void vring_used_idx_set(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    virtio_stw_phys(vq->vdev, pa, val);
+    vring_used_stw(vq, offsetof(VRingUsed, idx), val);
 }
 
 static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
 {
-    VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) | mask);
+    hwaddr offset = offsetof(VRingUsed, flags);
+
+    vring_used_stw(vq, offset, vring_used_lduw(vq, offset) | mask);
 }
 
 static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
 {
-    VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) & ~mask);
+    hwaddr offset = offsetof(VRingUsed, flags);
+
+    vring_used_stw(vq, offset, vring_used_lduw(vq, offset) & ~mask);
 }
 
 static inline void vring_set_avail_event(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
     if (!vq->notification) {
         return;
     }
-    pa = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]);
-    virtio_stw_phys(vq->vdev, pa, val);
+    vring_used_stw(vq, offsetof(VRingUsed, ring[vq->vring.num]), val);
 }
 
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
@@ -243,14 +379,12 @@ int virtio_queue_empty(VirtQueue *vq)
     return vring_avail_idx(vq) == vq->last_avail_idx;
 }
 
-void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
-                    unsigned int len, unsigned int idx)
+static void virtqueue_unmap_sg(VirtQueue *vq, const VirtQueueElement *elem,
+                               unsigned int len)
 {
     unsigned int offset;
     int i;
 
-    trace_virtqueue_fill(vq, elem, len, idx);
-
     offset = 0;
     for (i = 0; i < elem->in_num; i++) {
         size_t size = MIN(len - offset, elem->in_sg[i].iov_len);
@@ -266,6 +400,25 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
         cpu_physical_memory_unmap(elem->out_sg[i].iov_base,
                                   elem->out_sg[i].iov_len,
                                   0, elem->out_sg[i].iov_len);
+}
+
+/* Give back the most recently popped element, as if it had never been
+ * popped.  @len is the number of bytes written to its in buffers.
+ */
+void virtqueue_unpop(VirtQueue *vq, const VirtQueueElement *elem,
+                     unsigned int len)
+{
+    virtqueue_unmap_sg(vq, elem, len);
+    vq->last_avail_idx--;
+    vq->inuse--;
+}
+
+void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                    unsigned int len, unsigned int idx)
+{
+    trace_virtqueue_fill(vq, elem, len, idx);
+
+    virtqueue_unmap_sg(vq, elem, len);
 
     idx = (idx + vring_used_idx(vq)) % vq->vring.num;
 
@@ -284,6 +437,8 @@ void virtqueue_flush(VirtQueue *vq, unsigned int count)
     new = old + count;
     vring_used_idx_set(vq, new);
     vq->inuse -= count;
+    vq->pending += count;
+    vq->completions += count;
     if (unlikely((int16_t)(new - vq->signalled_used) < (uint16_t)(new - old)))
         vq->signalled_used_valid = false;
 }
@@ -331,18 +486,23 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     return head;
 }
 
-static unsigned virtqueue_next_desc(VirtIODevice *vdev, hwaddr desc_pa,
-                                    unsigned int i, unsigned int max)
+/* Read the descriptor that follows @desc into @desc and return its
+ * index, or @max if @desc is the last one in the chain.
+ */
+static unsigned virtqueue_read_next_desc(VirtIODevice *vdev, VRingDesc *desc,
+                                         hwaddr desc_pa,
+                                         const VRingDesc *desc_ptr,
+                                         unsigned int max)
 {
     unsigned int next;
 
     /* If this descriptor says it doesn't chain, we're done. */
-    if (!(vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_NEXT)) {
+    if (!(desc->flags & VRING_DESC_F_NEXT)) {
         return max;
     }
 
     /* Check they're not leading us off end of descriptors. */
-    next = vring_desc_next(vdev, desc_pa, i);
+    next = desc->next;
     /* Make sure compiler knows to grab that: we don't want it changing! */
     smp_wmb();
 
@@ -351,6 +511,7 @@ static unsigned virtqueue_next_desc(VirtIODevice *vdev, hwaddr desc_pa,
         exit(1);
     }
 
+    vring_desc_read(vdev, desc, desc_pa, desc_ptr, next);
     return next;
 }
 
@@ -367,16 +528,20 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
     while (virtqueue_num_heads(vq, idx)) {
         VirtIODevice *vdev = vq->vdev;
         unsigned int max, num_bufs, indirect = 0;
+        const VRingDesc *desc_ptr;
+        VRingDesc desc;
         hwaddr desc_pa;
-        int i;
+        unsigned int i;
 
         max = vq->vring.num;
         num_bufs = total_bufs;
         i = virtqueue_get_head(vq, idx++);
         desc_pa = vq->vring.desc;
+        desc_ptr = vring_desc_ptr(vq);
+        vring_desc_read(vdev, &desc, desc_pa, desc_ptr, i);
 
-        if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_INDIRECT) {
-            if (vring_desc_len(vdev, desc_pa, i) % sizeof(VRingDesc)) {
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (desc.len % sizeof(VRingDesc)) {
                 error_report("Invalid size for indirect buffer table");
                 exit(1);
             }
@@ -389,9 +554,11 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
 
             /* loop over the indirect descriptor table */
             indirect = 1;
-            max = vring_desc_len(vdev, desc_pa, i) / sizeof(VRingDesc);
-            desc_pa = vring_desc_addr(vdev, desc_pa, i);
-            num_bufs = i = 0;
+            max = desc.len / sizeof(VRingDesc);
+            desc_pa = desc.addr;
+            desc_ptr = NULL;
+            num_bufs = 0;
+            vring_desc_read(vdev, &desc, desc_pa, desc_ptr, 0);
         }
 
         do {
@@ -401,15 +568,16 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                 exit(1);
             }
 
-            if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_WRITE) {
-                in_total += vring_desc_len(vdev, desc_pa, i);
+            if (desc.flags & VRING_DESC_F_WRITE) {
+                in_total += desc.len;
             } else {
-                out_total += vring_desc_len(vdev, desc_pa, i);
+                out_total += desc.len;
             }
             if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
                 goto done;
             }
-        } while ((i = virtqueue_next_desc(vdev, desc_pa, i, max)) != max);
+        } while (virtqueue_read_next_desc(vdev, &desc, desc_pa, desc_ptr,
+                                          max) != max);
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -456,17 +624,49 @@ void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
     }
 }
 
-int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
+/* Allocate an element of @sz bytes, followed by the arrays for @out_num
+ * and @in_num descriptors.  VirtQueueElement must be the first member of
+ * the device structure.
+ */
+void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
+{
+    VirtQueueElement *elem;
+    size_t in_addr_ofs = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0]));
+    size_t out_addr_ofs = in_addr_ofs + in_num * sizeof(elem->in_addr[0]);
+    size_t out_addr_end = out_addr_ofs + out_num * sizeof(elem->out_addr[0]);
+    size_t in_sg_ofs = QEMU_ALIGN_UP(out_addr_end, __alignof__(elem->in_sg[0]));
+    size_t out_sg_ofs = in_sg_ofs + in_num * sizeof(elem->in_sg[0]);
+    size_t out_sg_end = out_sg_ofs + out_num * sizeof(elem->out_sg[0]);
+
+    assert(sz >= sizeof(VirtQueueElement));
+    elem = g_malloc(out_sg_end);
+    elem->out_num = out_num;
+    elem->in_num = in_num;
+    elem->in_addr = (void *)elem + in_addr_ofs;
+    elem->out_addr = (void *)elem + out_addr_ofs;
+    elem->in_sg = (void *)elem + in_sg_ofs;
+    elem->out_sg = (void *)elem + out_sg_ofs;
+    return elem;
+}
+
+void *virtqueue_pop(VirtQueue *vq, size_t sz)
 {
     unsigned int i, head, max;
     hwaddr desc_pa = vq->vring.desc;
+    const VRingDesc *desc_ptr;
     VirtIODevice *vdev = vq->vdev;
+    VirtQueueElement *elem;
+    VRingDesc desc;
+    unsigned out_num, in_num;
+    hwaddr addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
 
-    if (!virtqueue_num_heads(vq, vq->last_avail_idx))
-        return 0;
+    if (!virtqueue_num_heads(vq, vq->last_avail_idx)) {
+        return NULL;
+    }
 
     /* When we start there are none of either input nor output. */
-    elem->out_num = elem->in_num = 0;
+    out_num = in_num = 0;
 
     max = vq->vring.num;
 
@@ -475,57 +675,159 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
         vring_set_avail_event(vq, vq->last_avail_idx);
     }
 
-    if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_INDIRECT) {
-        if (vring_desc_len(vdev, desc_pa, i) % sizeof(VRingDesc)) {
+    desc_ptr = vring_desc_ptr(vq);
+    vring_desc_read(vdev, &desc, desc_pa, desc_ptr, i);
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        if (desc.len % sizeof(VRingDesc)) {
             error_report("Invalid size for indirect buffer table");
             exit(1);
         }
 
         /* loop over the indirect descriptor table */
-        max = vring_desc_len(vdev, desc_pa, i) / sizeof(VRingDesc);
-        desc_pa = vring_desc_addr(vdev, desc_pa, i);
-        i = 0;
+        max = desc.len / sizeof(VRingDesc);
+        desc_pa = desc.addr;
+        desc_ptr = NULL;
+        vring_desc_read(vdev, &desc, desc_pa, desc_ptr, 0);
     }
 
-    /* Collect all the descriptors */
+    /* Collect all the descriptors.  Output descriptors come first, so
+     * both kinds can be gathered in a single array on the stack; only the
+     * element is allocated, with room for exactly this many descriptors.
+     */
     do {
-        struct iovec *sg;
+        unsigned n = out_num + in_num;
 
-        if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_WRITE) {
-            if (elem->in_num >= ARRAY_SIZE(elem->in_sg)) {
-                error_report("Too many write descriptors in indirect table");
-                exit(1);
-            }
-            elem->in_addr[elem->in_num] = vring_desc_addr(vdev, desc_pa, i);
-            sg = &elem->in_sg[elem->in_num++];
+        /* If we've got too many, that implies a descriptor loop. */
+        if (n >= max || n >= VIRTQUEUE_MAX_SIZE) {
+            error_report("Looped descriptor");
+            exit(1);
+        }
+
+        if (desc.flags & VRING_DESC_F_WRITE) {
+            in_num++;
         } else {
-            if (elem->out_num >= ARRAY_SIZE(elem->out_sg)) {
-                error_report("Too many read descriptors in indirect table");
+            if (in_num) {
+                error_report("Incorrect order for descriptors");
                 exit(1);
             }
-            elem->out_addr[elem->out_num] = vring_desc_addr(vdev, desc_pa, i);
-            sg = &elem->out_sg[elem->out_num++];
+            out_num++;
         }
 
-        sg->iov_len = vring_desc_len(vdev, desc_pa, i);
+        addr[n] = desc.addr;
+        iov[n].iov_len = desc.len;
+    } while (virtqueue_read_next_desc(vdev, &desc, desc_pa, desc_ptr,
+                                      max) != max);
 
-        /* If we've got too many, that implies a descriptor loop. */
-        if ((elem->in_num + elem->out_num) > max) {
-            error_report("Looped descriptor");
-            exit(1);
-        }
-    } while ((i = virtqueue_next_desc(vdev, desc_pa, i, max)) != max);
+    /* Now copy what we have collected and map it */
+    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem->index = head;
+    for (i = 0; i < out_num; i++) {
+        elem->out_addr[i] = addr[i];
+        elem->out_sg[i] = iov[i];
+    }
+    for (i = 0; i < in_num; i++) {
+        elem->in_addr[i] = addr[out_num + i];
+        elem->in_sg[i] = iov[out_num + i];
+    }
 
-    /* Now map what we have collected */
     virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
     virtqueue_map_sg(elem->out_sg, elem->out_addr, elem->out_num, 0);
 
-    elem->index = head;
-
     vq->inuse++;
 
     trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
-    return elem->in_num + elem->out_num;
+    return elem;
+}
+
+/* Reading and writing a structure directly to QEMUFile is *awful*, but
+ * it is what QEMU has always done by mistake.  We can change it sooner
+ * or later by bumping the version number of the affected vm states.
+ * In the meanwhile, since the in-memory layout of VirtQueueElement
+ * has changed, we need to marshal to and from the layout that was
+ * used before the change.
+ */
+typedef struct VirtQueueElementOld {
+    unsigned int index;
+    unsigned int out_num;
+    unsigned int in_num;
+    hwaddr in_addr[VIRTQUEUE_MAX_SIZE];
+    hwaddr out_addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec in_sg[VIRTQUEUE_MAX_SIZE];
+    struct iovec out_sg[VIRTQUEUE_MAX_SIZE];
+} VirtQueueElementOld;
+
+void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz)
+{
+    VirtQueueElement *elem;
+    VirtQueueElementOld data;
+    int i;
+
+    qemu_get_buffer(f, (uint8_t *)&data, sizeof(VirtQueueElementOld));
+
+    if (data.in_num > VIRTQUEUE_MAX_SIZE ||
+        data.out_num > VIRTQUEUE_MAX_SIZE) {
+        error_report("virtio: invalid element in migration stream: "
+                     "in %u out %u", data.in_num, data.out_num);
+        exit(1);
+    }
+
+    elem = virtqueue_alloc_element(sz, data.out_num, data.in_num);
+    elem->index = data.index;
+
+    for (i = 0; i < elem->in_num; i++) {
+        elem->in_addr[i] = data.in_addr[i];
+    }
+
+    for (i = 0; i < elem->out_num; i++) {
+        elem->out_addr[i] = data.out_addr[i];
+    }
+
+    for (i = 0; i < elem->in_num; i++) {
+        /* Base is overwritten by virtqueue_map_sg.  */
+        elem->in_sg[i].iov_base = 0;
+        elem->in_sg[i].iov_len = data.in_sg[i].iov_len;
+    }
+
+    for (i = 0; i < elem->out_num; i++) {
+        /* Base is overwritten by virtqueue_map_sg.  */
+        elem->out_sg[i].iov_base = 0;
+        elem->out_sg[i].iov_len = data.out_sg[i].iov_len;
+    }
+
+    virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
+    virtqueue_map_sg(elem->out_sg, elem->out_addr, elem->out_num, 0);
+    return elem;
+}
+
+void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
+{
+    VirtQueueElementOld data;
+    int i;
+
+    memset(&data, 0, sizeof(data));
+    data.index = elem->index;
+    data.in_num = elem->in_num;
+    data.out_num = elem->out_num;
+
+    for (i = 0; i < elem->in_num; i++) {
+        data.in_addr[i] = elem->in_addr[i];
+    }
+
+    for (i = 0; i < elem->out_num; i++) {
+        data.out_addr[i] = elem->out_addr[i];
+    }
+
+    for (i = 0; i < elem->in_num; i++) {
+        /* Base is overwritten by virtqueue_map_sg when loading.  Do not
+         * save it, as it would leak the QEMU address space layout.  */
+        data.in_sg[i].iov_len = elem->in_sg[i].iov_len;
+    }
+
+    for (i = 0; i < elem->out_num; i++) {
+        /* Do not save iov_base as above.  */
+        data.out_sg[i].iov_len = elem->out_sg[i].iov_len;
+    }
+    qemu_put_buffer(f, (uint8_t *)&data, sizeof(VirtQueueElementOld));
 }
 
 /* virtio device */
@@ -625,6 +927,11 @@ void virtio_reset(void *opaque)
     virtio_notify_vector(vdev, vdev->config_vector);
 
     for(i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        vring_unmap_rings(&vdev->vq[i]);
+        if (vdev->vq[i].coalesce_timer) {
+            timer_del(vdev->vq[i].coalesce_timer);
+        }
+        vdev->vq[i].pending = 0;
         vdev->vq[i].vring.desc = 0;
         vdev->vq[i].vring.avail = 0;
         vdev->vq[i].vring.used = 0;
@@ -839,6 +1146,7 @@ hwaddr virtio_queue_get_addr(VirtIODevice *vdev, int n)
 void virtio_queue_set_rings(VirtIODevice *vdev, int n, hwaddr desc,
                             hwaddr avail, hwaddr used)
 {
+    vring_unmap_rings(&vdev->vq[n]);
     vdev->vq[n].vring.desc = desc;
     vdev->vq[n].vring.avail = avail;
     vdev->vq[n].vring.used = used;
@@ -854,6 +1162,7 @@ void virtio_queue_set_num(VirtIODevice *vdev, int n, int num)
         num < 0) {
         return;
     }
+    vring_unmap_rings(&vdev->vq[n]);
     vdev->vq[n].vring.num = num;
 }
 
@@ -950,6 +1259,14 @@ void virtio_queue_set_vector(VirtIODevice *vdev, int n, uint16_t vector)
     }
 }
 
+static void virtqueue_init_coalesce(VirtQueue *vq,
+                                    const VirtIOCoalesceConf *conf)
+{
+    vq->coalesce = *conf;
+    vq->coalesce_usecs = conf->adaptive ? 0 : conf->usecs;
+    vq->sample_start = 0;
+}
+
 VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
                             void (*handle_output)(VirtIODevice *, VirtQueue *))
 {
@@ -966,6 +1283,7 @@ VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
     vdev->vq[i].vring.num = queue_size;
     vdev->vq[i].vring.align = VIRTIO_PCI_VRING_ALIGN;
     vdev->vq[i].handle_output = handle_output;
+    virtqueue_init_coalesce(&vdev->vq[i], &vdev->coalesce);
 
     return &vdev->vq[i];
 }
@@ -976,6 +1294,12 @@ void virtio_del_queue(VirtIODevice *vdev, int n)
         abort();
     }
 
+    vring_unmap_rings(&vdev->vq[n]);
+    if (vdev->vq[n].coalesce_timer) {
+        timer_del(vdev->vq[n].coalesce_timer);
+        timer_free(vdev->vq[n].coalesce_timer);
+        vdev->vq[n].coalesce_timer = NULL;
+    }
     vdev->vq[n].vring.num = 0;
 }
 
@@ -1009,17 +1333,125 @@ static bool vring_notify(VirtIODevice *vdev, VirtQueue *vq)
     return !v || vring_need_event(vring_get_used_event(vq), new, old);
 }
 
-void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
+static void virtio_notify_now(VirtIODevice *vdev, VirtQueue *vq)
 {
+    vq->pending = 0;
     if (!vring_notify(vdev, vq)) {
         return;
     }
 
     trace_virtio_notify(vdev, vq);
+    vq->interrupts++;
     vdev->isr |= 0x01;
     virtio_notify_vector(vdev, vq->vector);
 }
 
+static void virtio_coalesce_timer_cb(void *opaque)
+{
+    VirtQueue *vq = opaque;
+
+    virtio_notify_now(vq->vdev, vq);
+}
+
+/* Send the interrupt that is being delayed on @vq, if any */
+static void virtqueue_coalesce_flush(VirtQueue *vq)
+{
+    if (vq->coalesce_timer && timer_pending(vq->coalesce_timer)) {
+        timer_del(vq->coalesce_timer);
+        virtio_notify_now(vq->vdev, vq);
+    }
+}
+
+#define VIRTIO_COALESCE_SAMPLE_NS (50 * SCALE_MS)
+
+/* Scale the delay linearly between rate_low and rate_high, so that a
+ * lightly loaded queue gets an interrupt per completion and a busy one
+ * gets the configured delay.
+ */
+static void virtqueue_coalesce_adapt(VirtQueue *vq, int64_t now)
+{
+    const VirtIOCoalesceConf *conf = &vq->coalesce;
+    int64_t elapsed = now - vq->sample_start;
+
+    if (elapsed < VIRTIO_COALESCE_SAMPLE_NS) {
+        return;
+    }
+
+    vq->rate = (vq->completions - vq->sample_completions) *
+               get_ticks_per_sec() / elapsed;
+    vq->sample_start = now;
+    vq->sample_completions = vq->completions;
+
+    if (vq->rate <= conf->rate_low) {
+        vq->coalesce_usecs = 0;
+    } else if (vq->rate >= conf->rate_high) {
+        vq->coalesce_usecs = conf->usecs;
+    } else {
+        vq->coalesce_usecs = (uint64_t)conf->usecs *
+                             (vq->rate - conf->rate_low) /
+                             (conf->rate_high - conf->rate_low);
+    }
+    trace_virtqueue_coalesce_adapt(vq, vq->rate, vq->coalesce_usecs);
+}
+
+static void virtqueue_set_coalesce(VirtQueue *vq,
+                                   const VirtIOCoalesceConf *conf)
+{
+    virtqueue_coalesce_flush(vq);
+    virtqueue_init_coalesce(vq, conf);
+}
+
+static void virtio_coalesce_check(const VirtIOCoalesceConf *conf,
+                                  Error **errp)
+{
+    if (conf->usecs > VIRTIO_COALESCE_MAX_USECS) {
+        error_setg(errp, "Interrupt coalescing delay must not exceed %d us",
+                   VIRTIO_COALESCE_MAX_USECS);
+    } else if (conf->adaptive && conf->rate_low >= conf->rate_high) {
+        error_setg(errp, "Adaptive interrupt coalescing needs a low rate "
+                   "threshold below the high one");
+    }
+}
+
+/* Signal the guest that buffers were used.  With interrupt coalescing,
+ * the interrupt is delayed by up to coalesce_usecs so that further
+ * completions can share it, unless coalesce.frames completions are
+ * already pending.
+ */
+void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    int64_t now;
+
+    if (!vq->coalesce.usecs) {
+        virtio_notify_now(vdev, vq);
+        return;
+    }
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    if (vq->coalesce.adaptive) {
+        virtqueue_coalesce_adapt(vq, now);
+    }
+
+    if (!vq->coalesce_usecs ||
+        (vq->coalesce.frames && vq->pending >= vq->coalesce.frames)) {
+        if (vq->coalesce_timer) {
+            timer_del(vq->coalesce_timer);
+        }
+        virtio_notify_now(vdev, vq);
+        return;
+    }
+
+    if (!vq->coalesce_timer) {
+        vq->coalesce_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                          virtio_coalesce_timer_cb, vq);
+    }
+    if (!timer_pending(vq->coalesce_timer)) {
+        timer_mod(vq->coalesce_timer,
+                  now + (int64_t)vq->coalesce_usecs * SCALE_US);
+    }
+    trace_virtio_notify_coalesced(vdev, vq, vq->pending);
+}
+
 void virtio_notify_config(VirtIODevice *vdev)
 {
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK))
@@ -1213,6 +1645,7 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
     }
 
     for (i = 0; i < num; i++) {
+        vring_unmap_rings(&vdev->vq[i]);
         vdev->vq[i].vring.num = qemu_get_be32(f);
         if (k->has_variable_vring_alignment) {
             vdev->vq[i].vring.align = qemu_get_be32(f);
@@ -1300,6 +1733,16 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    int i;
+
+    memory_listener_unregister(&vdev->listener);
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        vring_unmap_rings(&vdev->vq[i]);
+        if (vdev->vq[i].coalesce_timer) {
+            timer_del(vdev->vq[i].coalesce_timer);
+            timer_free(vdev->vq[i].coalesce_timer);
+        }
+    }
     qemu_del_vm_change_state_handler(vdev->vmstate);
     g_free(vdev->config);
     g_free(vdev->vq);
@@ -1325,6 +1768,17 @@ static void virtio_vmstate_change(void *opaque, int running, RunState state)
     if (!backend_run) {
         virtio_set_status(vdev, vdev->status);
     }
+
+    if (!running) {
+        int i;
+
+        /* Do not leave interrupts behind in the timers while stopped, they
+         * would be lost on migration.
+         */
+        for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+            virtqueue_coalesce_flush(&vdev->vq[i]);
+        }
+    }
 }
 
 void virtio_instance_init_common(Object *proxy_obj, void *data,
@@ -1364,6 +1818,11 @@ void virtio_init(VirtIODevice *vdev, const char *name,
         vdev->vq[i].queue_index = i;
     }
 
+    vdev->listener = (MemoryListener) {
+        .commit = virtio_memory_listener_commit,
+    };
+    memory_listener_register(&vdev->listener, &address_space_memory);
+
     vdev->name = name;
     vdev->config_len = config_size;
     if (vdev->config_len) {
@@ -1429,6 +1888,13 @@ void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx)
     vdev->vq[n].last_avail_idx = idx;
 }
 
+void virtio_queue_restore_last_avail_idx(VirtIODevice *vdev, int n)
+{
+    if (vdev->vq[n].vring.desc) {
+        vdev->vq[n].last_avail_idx = vring_used_idx(&vdev->vq[n]);
+    }
+}
+
 void virtio_queue_invalidate_signalled_used(VirtIODevice *vdev, int n)
 {
     vdev->vq[n].signalled_used_valid = false;
@@ -1514,6 +1980,12 @@ static void virtio_device_realize(DeviceState *dev, Error **errp)
     VirtioDeviceClass *vdc = VIRTIO_DEVICE_GET_CLASS(dev);
     Error *err = NULL;
 
+    virtio_coalesce_check(&vdev->coalesce, &err);
+    if (err != NULL) {
+        error_propagate(errp, err);
+        return;
+    }
+
     if (vdc->realize != NULL) {
         vdc->realize(dev, &err);
         if (err != NULL) {
@@ -1551,9 +2023,155 @@ static void virtio_device_unrealize(DeviceState *dev, Error **errp)
 
 static Property virtio_properties[] = {
     DEFINE_VIRTIO_COMMON_FEATURES(VirtIODevice, host_features),
+    DEFINE_PROP_UINT32("coalesce-usecs", VirtIODevice, coalesce.usecs, 0),
+    DEFINE_PROP_UINT32("coalesce-frames", VirtIODevice, coalesce.frames, 0),
+    DEFINE_PROP_BOOL("coalesce-adaptive", VirtIODevice, coalesce.adaptive,
+                     false),
+    DEFINE_PROP_UINT32("coalesce-rate-low", VirtIODevice, coalesce.rate_low,
+                       10000),
+    DEFINE_PROP_UINT32("coalesce-rate-high", VirtIODevice,
+                       coalesce.rate_high, 100000),
     DEFINE_PROP_END_OF_LIST(),
 };
 
+VirtIODevice *virtio_device_find(const char *path, Error **errp)
+{
+    bool ambiguous = false;
+    Object *obj;
+
+    obj = object_resolve_path(path, &ambiguous);
+    if (!obj) {
+        if (ambiguous) {
+            error_setg(errp, "Path '%s' is ambiguous", path);
+        } else {
+            error_set(errp, ERROR_CLASS_DEVICE_NOT_FOUND,
+                      "Device '%s' not found", path);
+        }
+        return NULL;
+    }
+
+    /* Accept the transport device too, e.g. virtio-net-pci */
+    if (!object_dynamic_cast(obj, TYPE_VIRTIO_DEVICE)) {
+        obj = object_resolve_path_component(obj, "virtio-backend");
+    }
+    if (!obj || !object_dynamic_cast(obj, TYPE_VIRTIO_DEVICE)) {
+        error_setg(errp, "Device '%s' is not a virtio device", path);
+        return NULL;
+    }
+    return VIRTIO_DEVICE(obj);
+}
+
+VirtioCoalescingInfoList *qmp_query_virtio_coalescing(const char *path,
+                                                      Error **errp)
+{
+    VirtioCoalescingInfoList *head = NULL, **p_next = &head;
+    VirtIODevice *vdev;
+    int i;
+
+    vdev = virtio_device_find(path, errp);
+    if (!vdev) {
+        return NULL;
+    }
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        VirtQueue *vq = &vdev->vq[i];
+        VirtioCoalescingInfoList *elem;
+        VirtioCoalescingInfo *info;
+
+        if (!vq->vring.num) {
+            continue;
+        }
+
+        info = g_new0(VirtioCoalescingInfo, 1);
+        info->queue = i;
+        info->usecs = vq->coalesce.usecs;
+        info->frames = vq->coalesce.frames;
+        info->adaptive = vq->coalesce.adaptive;
+        info->rate_low = vq->coalesce.rate_low;
+        info->rate_high = vq->coalesce.rate_high;
+        info->current_usecs = vq->coalesce.usecs ? vq->coalesce_usecs : 0;
+        info->rate = vq->rate;
+        info->completions = vq->completions;
+        info->interrupts = vq->interrupts;
+
+        elem = g_new0(VirtioCoalescingInfoList, 1);
+        elem->value = info;
+        *p_next = elem;
+        p_next = &elem->next;
+    }
+    return head;
+}
+
+void qmp_virtio_set_coalescing(const char *path,
+                               bool has_queue, int64_t queue,
+                               bool has_usecs, int64_t usecs,
+                               bool has_frames, int64_t frames,
+                               bool has_adaptive, bool adaptive,
+                               bool has_rate_low, int64_t rate_low,
+                               bool has_rate_high, int64_t rate_high,
+                               Error **errp)
+{
+    VirtIOCoalesceConf conf;
+    Error *local_err = NULL;
+    VirtIODevice *vdev;
+    int i;
+
+    vdev = virtio_device_find(path, errp);
+    if (!vdev) {
+        return;
+    }
+
+    if (has_queue && (queue < 0 || queue >= VIRTIO_QUEUE_MAX ||
+                      !vdev->vq[queue].vring.num)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "queue",
+                   "the index of an existing virtqueue");
+        return;
+    }
+    if ((has_usecs && (usecs < 0 || usecs > UINT32_MAX)) ||
+        (has_frames && (frames < 0 || frames > UINT32_MAX)) ||
+        (has_rate_low && (rate_low < 0 || rate_low > UINT32_MAX)) ||
+        (has_rate_high && (rate_high < 0 || rate_high > UINT32_MAX))) {
+        error_setg(errp, "Coalescing parameters must be between 0 and %u",
+                   UINT32_MAX);
+        return;
+    }
+
+    conf = has_queue ? vdev->vq[queue].coalesce : vdev->coalesce;
+    if (has_usecs) {
+        conf.usecs = usecs;
+    }
+    if (has_frames) {
+        conf.frames = frames;
+    }
+    if (has_adaptive) {
+        conf.adaptive = adaptive;
+    }
+    if (has_rate_low) {
+        conf.rate_low = rate_low;
+    }
+    if (has_rate_high) {
+        conf.rate_high = rate_high;
+    }
+
+    virtio_coalesce_check(&conf, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    if (has_queue) {
+        virtqueue_set_coalesce(&vdev->vq[queue], &conf);
+        return;
+    }
+
+    vdev->coalesce = conf;
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        if (vdev->vq[i].vring.num) {
+            virtqueue_set_coalesce(&vdev->vq[i], &conf);
+        }
+    }
+}
+
 static void virtio_device_class_init(ObjectClass *klass, void *data)
 {
     /* Set the default value here. */
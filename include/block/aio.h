@@ -47,6 +47,7 @@ void qemu_aio_ref(void *p);
 typedef struct AioHandler AioHandler;
 typedef void QEMUBHFunc(void *opaque);
 typedef void IOHandler(void *opaque);
+typedef bool AioPollFn(void *opaque);
 
 struct AioContext {
     GSource source;
@@ -87,11 +88,47 @@ struct AioContext {
 
     /* TimerLists for calling timers - one per clock type */
     QEMUTimerListGroup tlg;
+
+    /* Set by aio_notify() so that a busy-polling aio_poll() can stop
+     * spinning without waiting for the event notifier.
+     */
+    bool notified;
+
+    /* Adaptive polling: aio_poll() spins for up to poll_ns nanoseconds
+     * before blocking, as long as all handlers can be polled.  poll_ns
+     * grows and shrinks within [0, poll_max_ns] according to how long
+     * aio_poll() actually had to wait.  Polling is disabled when
+     * poll_max_ns is zero.
+     */
+    int64_t poll_max_ns;
+    int64_t poll_ns;
+    int64_t poll_grow;
+    int64_t poll_shrink;
+
+    /* Number of handlers without a poll callback; busy polling is only
+     * possible when this is zero.
+     */
+    int poll_disable_cnt;
+
+#ifdef CONFIG_EPOLL_CREATE1
+    /* Contexts with many handlers switch from ppoll() to epoll, so that
+     * the kernel keeps the set of file descriptors across aio_poll() calls.
+     */
+    int epollfd;
+    bool epoll_enabled;
+    bool epoll_available;
+#endif
 };
 
 /* Used internally to synchronize aio_poll against qemu_bh_schedule.  */
 void aio_set_dispatching(AioContext *ctx, bool dispatching);
 
+/* Used internally to set up and tear down the host-specific parts of an
+ * AioContext.
+ */
+void aio_context_setup(AioContext *ctx);
+void aio_context_destroy(AioContext *ctx);
+
 /**
  * aio_context_new: Allocate a new AioContext.
  *
@@ -264,6 +301,36 @@ void aio_set_event_notifier(AioContext *ctx,
                             EventNotifier *notifier,
                             EventNotifierHandler *io_read);
 
+/* Register a poll callback for an event notifier that was previously set up
+ * with aio_set_event_notifier().  @io_poll is called with the notifier as
+ * its argument while aio_poll() busy-waits and must return true, without
+ * side effects, if the io_read callback has work to do even though the
+ * notifier may not have been signaled yet.  The io_read callback is then
+ * invoked as if the notifier had fired.
+ *
+ * Busy-waiting only happens if all the handlers in the AioContext have a
+ * poll callback.  Pass NULL to remove the poll callback.
+ */
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll);
+
+/**
+ * aio_context_set_poll_params:
+ * @ctx: the aio context
+ * @max_ns: how long to busy poll for, in nanoseconds; 0 disables polling
+ * @grow: how much to scale the polling time up when it was too short,
+ *        or 0 to use the default
+ * @shrink: how much to scale the polling time down when it was too long,
+ *          or 0 to stop polling until the time grows again
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Configure the adaptive busy-polling phase of aio_poll().  Polling is only
+ * implemented on POSIX hosts; elsewhere the parameters are ignored.
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink, Error **errp);
+
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
  */
@@ -32,6 +32,7 @@
 #include "qemu/timer.h"
 #include "qapi-types.h"
 #include "qemu/hbitmap.h"
+#include "qemu/interval-tree.h"
 #include "block/snapshot.h"
 #include "qemu/main-loop.h"
 #include "qemu/throttle.h"
@@ -68,12 +69,23 @@ typedef struct BdrvTrackedRequest {
     bool serialising;
     int64_t overlap_offset;
     unsigned int overlap_bytes;
+    IntervalTreeNode overlap_node; /* indexes [overlap_offset, +bytes) */
 
     QLIST_ENTRY(BdrvTrackedRequest) list;
     Coroutine *co; /* owner, used for deadlock detection */
     CoQueue wait_queue; /* coroutines blocked on this request */
 
     struct BdrvTrackedRequest *waiting_for;
+
+    /* Aligned part of the request that is being written and its payload,
+     * valid while before_write_notifiers run.  A request may be written in
+     * several such parts, e.g. the head, middle and tail of an unaligned
+     * zero write.
+     */
+    int64_t write_offset;
+    unsigned int write_bytes;
+    QEMUIOVector *qiov;
+    int flags;
 } BdrvTrackedRequest;
 
 struct BlockDriver {
@@ -164,6 +176,12 @@ struct BlockDriver {
      */
     void (*bdrv_invalidate_cache)(BlockDriverState *bs, Error **errp);
 
+    /*
+     * Write back everything that is only cached in memory before another
+     * process takes over the image (at the end of outgoing migration).
+     */
+    int (*bdrv_inactivate)(BlockDriverState *bs);
+
     /*
      * Flushes all data that was already written to the OS all the way down to
      * the disk (for example raw-posix calls fsync()).
@@ -237,6 +255,17 @@ struct BlockDriver {
     int (*bdrv_amend_options)(BlockDriverState *bs, QemuOpts *opts,
                               BlockDriverAmendStatusCB *status_cb);
 
+    /*
+     * Returns true if a dirty bitmap with the given name and granularity
+     * can be stored in the image when @bs is closed.  Drivers that set
+     * this callback load their persistent bitmaps in bdrv_open and write
+     * them back in bdrv_close.
+     */
+    bool (*bdrv_can_store_dirty_bitmap)(BlockDriverState *bs,
+                                        const char *name,
+                                        uint32_t granularity,
+                                        Error **errp);
+
     void (*bdrv_debug_event)(BlockDriverState *bs, BlkDebugEvent event);
 
     /* TODO Better pass a option string/QDict/QemuOpts to add any rule? */
@@ -273,6 +302,12 @@ struct BlockDriver {
     void (*bdrv_io_unplug)(BlockDriverState *bs);
     void (*bdrv_flush_io_queue)(BlockDriverState *bs);
 
+    /* Return true if the driver still has requests of its own in flight,
+     * e.g. on children other than bs->file and bs->backing_hd.  Used by
+     * bdrv_drain() and bdrv_drain_all().
+     */
+    bool (*bdrv_requests_pending)(BlockDriverState *bs);
+
     /**
      * Try to get @bs's logical and physical block size.
      * On success, store them in @bsz and return zero.
@@ -318,6 +353,7 @@ typedef struct BlockLimits {
 } BlockLimits;
 
 typedef struct BdrvOpBlocker BdrvOpBlocker;
+typedef struct BdrvMergeBatch BdrvMergeBatch;
 
 typedef struct BdrvAioNotifier {
     void (*attached_aio_context)(AioContext *new_context, void *opaque);
@@ -357,6 +393,10 @@ struct BlockDriverState {
     int sg;        /* if true, the device is a /dev/sg* */
     int copy_on_read; /* if true, copy read backing sectors into image
                          note this is a reference count */
+    bool cor_background; /* copy-on-read writes happen after the read */
+    int cor_prefetch;     /* clusters to prefetch for sequential reads */
+    int cor_in_flight;    /* background copy-on-read coroutines */
+    int64_t cor_next_sector; /* end of the last copy-on-read request */
     bool probed;
 
     BlockDriver *drv; /* NULL means no media */
@@ -433,6 +473,8 @@ struct BlockDriverState {
     int refcnt;
 
     QLIST_HEAD(, BdrvTrackedRequest) tracked_requests;
+    /* The same requests, indexed by overlap range */
+    IntervalTreeRoot tracked_requests_tree;
 
     /* operation blockers */
     QLIST_HEAD(, BdrvOpBlocker) op_blockers[BLOCK_OP_TYPE_MAX];
@@ -449,6 +491,11 @@ struct BlockDriverState {
     QDict *options;
     BlockdevDetectZeroesOptions detect_zeroes;
 
+    /* Coalescing of adjacent reads and writes, see bdrv_co_merge_request() */
+    bool merge_requests;
+    int64_t merge_window_ns;
+    BdrvMergeBatch *merge_batch;
+
     /* The error object in use for blocking operations on backing_hd */
     Error *backing_blocker;
 
@@ -490,6 +537,14 @@ void bdrv_set_io_limits(BlockDriverState *bs,
 void bdrv_add_before_write_notifier(BlockDriverState *bs,
                                     NotifierWithReturn *notifier);
 
+/**
+ * bdrv_mark_request_serialising:
+ *
+ * Make @req wait for and block all overlapping requests, where requests are
+ * considered overlapping if they touch the same @align-sized block.
+ */
+void bdrv_mark_request_serialising(BdrvTrackedRequest *req, uint64_t align);
+
 /**
  * bdrv_detach_aio_context:
  *
@@ -610,6 +665,7 @@ void commit_active_start(BlockDriverState *bs, BlockDriverState *base,
  * @granularity: The chosen granularity for the dirty bitmap.
  * @buf_size: The amount of data that can be in flight at one time.
  * @mode: Whether to collapse all images in the chain to the target.
+ * @copy_mode: Whether guest writes are also copied to @target synchronously.
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
  * @cb: Completion function for the job.
@@ -624,7 +680,8 @@ void commit_active_start(BlockDriverState *bs, BlockDriverState *base,
 void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   const char *replaces,
                   int64_t speed, uint32_t granularity, int64_t buf_size,
-                  MirrorSyncMode mode, BlockdevOnError on_source_error,
+                  MirrorSyncMode mode, MirrorCopyMode copy_mode,
+                  BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockCompletionFunc *cb,
                   void *opaque, Error **errp);
@@ -50,6 +50,12 @@ typedef struct BlockJobDriver {
      * manually.
      */
     void (*complete)(BlockJob *job, Error **errp);
+
+    /**
+     * Optional callback for job types that report additional information
+     * in query-block-jobs.
+     */
+    void (*query)(BlockJob *job, BlockJobInfo *info);
 } BlockJobDriver;
 
 /**
@@ -114,6 +120,15 @@ struct BlockJob {
     /** Speed that was set with @block_job_set_speed.  */
     int64_t speed;
 
+    /**
+     * Progress rate in bytes per second, measured over roughly one second
+     * while the job runs; -1 until the first measurement.  Published by the
+     * query-block-jobs QMP API.
+     */
+    int64_t throughput;
+    int64_t throughput_sample_ns;
+    int64_t throughput_sample_offset;
+
     /** The completion function that will be called when the job completes.  */
     BlockCompletionFunc *cb;
 
@@ -36,14 +36,24 @@ struct nbd_reply {
     uint32_t magic;
     uint32_t error;
     uint64_t handle;
+
+    /* Only for structured reply chunks (magic == NBD_STRUCTURED_REPLY_MAGIC),
+     * which carry the error in an NBD_REPLY_TYPE_ERROR* payload instead.  */
+    uint16_t flags;
+    uint16_t type;
+    uint32_t length;
 } QEMU_PACKED;
 
+#define NBD_SIMPLE_REPLY_MAGIC      0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC  0x668e33ef
+
 #define NBD_FLAG_HAS_FLAGS      (1 << 0)        /* Flags are there */
 #define NBD_FLAG_READ_ONLY      (1 << 1)        /* Device is read-only */
 #define NBD_FLAG_SEND_FLUSH     (1 << 2)        /* Send FLUSH */
 #define NBD_FLAG_SEND_FUA       (1 << 3)        /* Send FUA (Force Unit Access) */
 #define NBD_FLAG_ROTATIONAL     (1 << 4)        /* Use elevator algorithm - rotational media */
 #define NBD_FLAG_SEND_TRIM      (1 << 5)        /* Send TRIM (discard) */
+#define NBD_FLAG_CAN_MULTI_CONN (1 << 8)        /* Multiple connections OK */
 
 /* New-style global flags. */
 #define NBD_FLAG_FIXED_NEWSTYLE     (1 << 0)    /* Fixed newstyle protocol. */
@@ -54,28 +64,65 @@ struct nbd_reply {
 /* Reply types. */
 #define NBD_REP_ACK             (1)             /* Data sending finished. */
 #define NBD_REP_SERVER          (2)             /* Export description. */
+#define NBD_REP_META_CONTEXT    (4)             /* Meta context id. */
 #define NBD_REP_ERR_UNSUP       ((UINT32_C(1) << 31) | 1) /* Unknown option. */
 #define NBD_REP_ERR_INVALID     ((UINT32_C(1) << 31) | 3) /* Invalid length. */
 
 #define NBD_CMD_MASK_COMMAND	0x0000ffff
 #define NBD_CMD_FLAG_FUA	(1 << 16)
+#define NBD_CMD_FLAG_REQ_ONE	(1 << 19)       /* One block status extent */
 
 enum {
     NBD_CMD_READ = 0,
     NBD_CMD_WRITE = 1,
     NBD_CMD_DISC = 2,
     NBD_CMD_FLUSH = 3,
-    NBD_CMD_TRIM = 4
+    NBD_CMD_TRIM = 4,
+    NBD_CMD_BLOCK_STATUS = 7
 };
 
+/* Structured reply chunks */
+#define NBD_REPLY_FLAG_DONE         (1 << 0)    /* Last chunk of the reply */
+
+#define NBD_REPLY_TYPE_NONE         0
+#define NBD_REPLY_TYPE_OFFSET_DATA  1
+#define NBD_REPLY_TYPE_OFFSET_HOLE  2
+#define NBD_REPLY_TYPE_BLOCK_STATUS 5
+#define NBD_REPLY_TYPE_ERROR        ((1 << 15) + 1)
+#define NBD_REPLY_TYPE_ERROR_OFFSET ((1 << 15) + 2)
+#define NBD_REPLY_TYPE_IS_ERR(type) (!!((type) & (1 << 15)))
+
+/* Extent flags for the "base:allocation" meta context */
+#define NBD_META_CONTEXT_BASE_ALLOCATION "base:allocation"
+#define NBD_STATE_HOLE              (1 << 0)
+#define NBD_STATE_ZERO              (1 << 1)
+
 #define NBD_DEFAULT_PORT	10809
 
 /* Maximum size of a single READ/WRITE data buffer */
 #define NBD_MAX_BUFFER_SIZE (32 * 1024 * 1024)
 
+/* Number of requests that a client or a server can have in flight */
+#define NBD_DEFAULT_MAX_REQUESTS    16
+#define NBD_MAX_REQUESTS_LIMIT      1024
+
+/* Protocol extensions for nbd_receive_negotiate().  The caller sets the
+ * fields for the extensions it wants, and they are cleared on return if the
+ * server does not support them.  @refused is set (also on failure) if the
+ * server answered an option with an error; some servers drop the
+ * connection right after that.
+ */
+typedef struct NBDExtensions {
+    bool structured_reply;      /* OFFSET_DATA/OFFSET_HOLE read replies */
+    bool base_allocation;       /* NBD_CMD_BLOCK_STATUS */
+    uint32_t context_id;        /* Server's id for "base:allocation" */
+    bool refused;
+} NBDExtensions;
+
 ssize_t nbd_wr_sync(int fd, void *buffer, size_t size, bool do_read);
 int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
-                          off_t *size, Error **errp);
+                          off_t *size, NBDExtensions *ext, Error **errp);
+int nbd_errno_to_system_errno(int err);
 int nbd_init(int fd, int csock, uint32_t flags, off_t size);
 ssize_t nbd_send_request(int csock, struct nbd_request *request);
 ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply);
@@ -89,6 +136,7 @@ NBDExport *nbd_export_new(BlockBackend *blk, off_t dev_offset, off_t size,
                           uint32_t nbdflags, void (*close)(NBDExport *),
                           Error **errp);
 void nbd_export_close(NBDExport *exp);
+void nbd_export_set_max_requests(NBDExport *exp, int max_requests);
 void nbd_export_get(NBDExport *exp);
 void nbd_export_put(NBDExport *exp);
 
@@ -71,6 +71,7 @@ struct SCSIRequest {
     BlockAIOCB        *aiocb;
     QEMUSGList        *sg;
     QTAILQ_ENTRY(SCSIRequest) next;
+    QSLIST_ENTRY(SCSIRequest) pool_next;
 };
 
 #define TYPE_SCSI_DEVICE "scsi-device"
@@ -89,6 +90,12 @@ typedef struct SCSIDeviceClass {
     SCSIRequest *(*alloc_req)(SCSIDevice *s, uint32_t tag, uint32_t lun,
                               uint8_t *buf, void *hba_private);
     void (*unit_attention_reported)(SCSIDevice *s);
+
+    /* Request ops for READ/WRITE(10/12/16).  If set, scsi_req_new decodes
+     * these CDBs itself and skips the generic parser.  Freed requests of
+     * the same size are recycled through the per-device request pool.
+     */
+    const SCSIReqOps *rw_reqops;
 } SCSIDeviceClass;
 
 struct SCSIDevice
@@ -108,6 +115,10 @@ struct SCSIDevice
     int blocksize;
     int type;
     uint64_t max_lba;
+
+    /* Free requests, protected by the AioContext of conf.blk */
+    QSLIST_HEAD(, SCSIRequest) req_pool;
+    unsigned int req_pool_count;
 };
 
 extern const VMStateDescription vmstate_scsi_device;
@@ -47,6 +47,9 @@ struct vhost_dev {
     unsigned long long features;
     unsigned long long acked_features;
     unsigned long long backend_features;
+    /* vhost-user protocol features and number of queue pairs */
+    uint64_t protocol_features;
+    uint64_t max_queues;
     bool started;
     bool log_enabled;
     unsigned long long log_size;
@@ -61,7 +61,7 @@ struct virtio_gpu_conf {
 };
 
 struct virtio_gpu_ctrl_command {
-    VirtQueueElement elem;
+    VirtQueueElement elem;      /* must be first, see virtqueue_pop() */
     VirtQueue *vq;
     struct virtio_gpu_ctrl_hdr cmd_hdr;
     uint32_t error;
@@ -26,6 +26,10 @@
 
 #define TX_TIMER_INTERVAL 150000 /* 150 us */
 
+/* The transmit timer shrinks towards this value when waiting for more
+ * packets does not pay off. */
+#define TX_TIMER_INTERVAL_MIN 20000 /* 20 us */
+
 /* Limit the number of packets that can be sent via a single flush
  * of the TX queue.  This gives us a guaranteed exit condition and
  * ensures fairness in the io path.  256 conveniently matches the
@@ -33,10 +37,16 @@
  * and latency. */
 #define TX_BURST 256
 
+/* The burst limit shrinks towards this value while the guest transmits
+ * less than a burst per flush, and grows back to TX_BURST under load. */
+#define TX_BURST_MIN 32
+
 typedef struct virtio_net_conf
 {
     uint32_t txtimer;
+    uint32_t txtimer_min;
     int32_t txburst;
+    int32_t txburst_min;
     char *tx;
 } virtio_net_conf;
 
@@ -45,14 +55,26 @@ typedef struct virtio_net_conf
 
 typedef struct VirtIONetQueue {
     VirtQueue *rx_vq;
+    unsigned rx_pending;    /* used entries not yet flushed */
+    int rx_batch;           /* nesting depth of receive batches */
+    uint8_t *rx_buf;        /* overflow of packets received in place */
     VirtQueue *tx_vq;
     QEMUTimer *tx_timer;
     QEMUBH *tx_bh;
     int tx_waiting;
+    int32_t tx_burst;       /* current burst limit */
+    uint32_t tx_timeout;    /* current timer interval */
     struct {
-        VirtQueueElement elem;
+        VirtQueueElement *elem;
         ssize_t len;
     } async_tx;
+    struct {
+        uint64_t packets;
+        uint64_t bytes;
+        uint64_t flushes;
+        uint64_t full_bursts;
+        uint64_t backend_busy;
+    } tx_stats;
     struct VirtIONet *n;
 } VirtIONetQueue;
 
@@ -54,12 +54,33 @@ struct VirtIOSCSIConf {
     char *wwpn;
     uint32_t boot_tpgt;
     IOThread *iothread;
+    uint32_t num_iothreads;
+    char **iothreads;
 };
 
 struct VirtIOSCSI;
+struct VirtIOSCSIReq;
+
+/* An IOThread serving some of the request queues and LUNs in dataplane
+ * mode.  Requests are passed between threads through the submit and
+ * complete lists instead of acquiring another thread's AioContext.
+ */
+typedef struct {
+    struct VirtIOSCSI *parent;
+    IOThread *iothread;
+    AioContext *ctx;
+    QEMUBH *bh;
+
+    QemuMutex lock;
+    /* Requests for LUNs owned by this thread */
+    QSIMPLEQ_HEAD(, VirtIOSCSIReq) submit;
+    /* Requests to be pushed to vrings owned by this thread */
+    QSIMPLEQ_HEAD(, VirtIOSCSIReq) complete;
+} VirtIOSCSIThread;
 
 typedef struct {
     struct VirtIOSCSI *parent;
+    VirtIOSCSIThread *thread;
     Vring vring;
     EventNotifier host_notifier;
     EventNotifier guest_notifier;
@@ -84,7 +105,12 @@ typedef struct VirtIOSCSI {
     bool events_dropped;
 
     /* Fields for dataplane below */
-    AioContext *ctx; /* one iothread per virtio-scsi-pci for now */
+    AioContext *ctx; /* runs the control and event queues */
+
+    /* threads[0] runs ctx, the others come from conf.iothreads */
+    VirtIOSCSIThread *threads;
+    unsigned int num_threads;
+    unsigned int next_lun_thread;
 
     /* Vring is used instead of vq in dataplane code, because of the underlying
      * memory layer thread safety */
@@ -102,25 +128,30 @@ typedef struct VirtIOSCSI {
 } VirtIOSCSI;
 
 typedef struct VirtIOSCSIReq {
+    /* Note:
+     * - elem is filled in by virtqueue_pop() or vring_pop(), which also
+     *   allocate the request;
+     * - fields up to resp_iov are initialized by virtio_scsi_init_req;
+     * - fields after resp_iov are zeroed by virtio_scsi_init_req.
+     * */
+    VirtQueueElement elem;
+
     VirtIOSCSI *dev;
     VirtQueue *vq;
     QEMUSGList qsgl;
     QEMUIOVector resp_iov;
 
-    /* Note:
-     * - fields before elem are initialized by virtio_scsi_init_req;
-     * - elem is uninitialized at the time of allocation.
-     * - fields after elem are zeroed by virtio_scsi_init_req.
-     * */
-
-    VirtQueueElement elem;
     /* Set by dataplane code. */
     VirtIOSCSIVring *vring;
+    AioContext *ctx; /* context that currently owns the request */
 
     union {
         /* Used for two-stage request submission */
         QTAILQ_ENTRY(VirtIOSCSIReq) next;
 
+        /* Used to pass the request to another thread */
+        QSIMPLEQ_ENTRY(VirtIOSCSIReq) handoff;
+
         /* Used for cancellation of request during TMFs */
         int remaining;
     };
@@ -150,15 +181,23 @@ void virtio_scsi_common_realize(DeviceState *dev, Error **errp,
 void virtio_scsi_common_unrealize(DeviceState *dev, Error **errp);
 void virtio_scsi_handle_ctrl_req(VirtIOSCSI *s, VirtIOSCSIReq *req);
 bool virtio_scsi_handle_cmd_req_prepare(VirtIOSCSI *s, VirtIOSCSIReq *req);
+bool virtio_scsi_handle_cmd_req_forwarded(VirtIOSCSI *s, VirtIOSCSIReq *req);
 void virtio_scsi_handle_cmd_req_submit(VirtIOSCSI *s, VirtIOSCSIReq *req);
-VirtIOSCSIReq *virtio_scsi_init_req(VirtIOSCSI *s, VirtQueue *vq);
+void virtio_scsi_handle_tmf_req_forwarded(VirtIOSCSI *s, VirtIOSCSIReq *req);
+void virtio_scsi_init_req(VirtIOSCSI *s, VirtQueue *vq, VirtIOSCSIReq *req);
 void virtio_scsi_free_req(VirtIOSCSIReq *req);
+void virtio_scsi_complete_req(VirtIOSCSIReq *req);
 void virtio_scsi_push_event(VirtIOSCSI *s, SCSIDevice *dev,
                             uint32_t event, uint32_t reason);
 
-void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread);
+void virtio_scsi_set_iothread(VirtIOSCSI *s, IOThread *iothread,
+                              Error **errp);
+void virtio_scsi_dataplane_cleanup(VirtIOSCSI *s);
 void virtio_scsi_dataplane_start(VirtIOSCSI *s);
 void virtio_scsi_dataplane_stop(VirtIOSCSI *s);
+void virtio_scsi_dataplane_forward_req(VirtIOSCSIReq *req, AioContext *ctx);
+void virtio_scsi_dataplane_complete_req(VirtIOSCSIReq *req);
+void virtio_scsi_dataplane_reset_lun(VirtIOSCSIReq *req, SCSIDevice *d);
 void virtio_scsi_vring_push_notify(VirtIOSCSIReq *req);
 VirtIOSCSIReq *virtio_scsi_pop_req_vring(VirtIOSCSI *s,
                                          VirtIOSCSIVring *vring);
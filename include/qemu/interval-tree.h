@@ -0,0 +1,88 @@
+/*
+ * Interval tree
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_INTERVAL_TREE_H
+#define QEMU_INTERVAL_TREE_H 1
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* An interval tree stores closed intervals [start, last] and finds all the
+ * intervals that overlap a given one in O(log n + k) time, where k is the
+ * number of results.  It is a height-balanced binary search tree ordered by
+ * start, where each node also records the largest "last" found in its
+ * subtree.
+ *
+ * Nodes are meant to be embedded in the structure they index; the tree never
+ * allocates memory.  Intervals with the same start are allowed.
+ */
+typedef struct IntervalTreeNode IntervalTreeNode;
+
+struct IntervalTreeNode {
+    uint64_t start;
+    uint64_t last;
+
+    /* private */
+    uint64_t subtree_last;
+    IntervalTreeNode *left;
+    IntervalTreeNode *right;
+    IntervalTreeNode *parent;
+    int height;
+};
+
+typedef struct IntervalTreeRoot {
+    IntervalTreeNode *root;
+} IntervalTreeRoot;
+
+/**
+ * interval_tree_insert:
+ * @node: Node to insert.  start and last must be set by the caller, with
+ * start <= last.
+ * @root: The tree.
+ *
+ * Insert @node in the tree.  start and last must not be changed while the node
+ * is in the tree; remove it and insert it again instead.
+ */
+void interval_tree_insert(IntervalTreeNode *node, IntervalTreeRoot *root);
+
+/**
+ * interval_tree_remove:
+ * @node: Node to remove, which must be in the tree.
+ * @root: The tree.
+ *
+ * Remove @node from the tree.
+ */
+void interval_tree_remove(IntervalTreeNode *node, IntervalTreeRoot *root);
+
+/**
+ * interval_tree_iter_first:
+ * @root: The tree.
+ * @start: First element of the interval to look up.
+ * @last: Last element of the interval to look up.
+ *
+ * Return the node with the lowest start among those that overlap
+ * [@start, @last], or %NULL if there is none.
+ */
+IntervalTreeNode *interval_tree_iter_first(IntervalTreeRoot *root,
+                                           uint64_t start, uint64_t last);
+
+/**
+ * interval_tree_iter_next:
+ * @node: A node returned by interval_tree_iter_first or
+ * interval_tree_iter_next.
+ * @start: First element of the interval to look up.
+ * @last: Last element of the interval to look up.
+ *
+ * Return the next node, in start order, that overlaps [@start, @last], or
+ * %NULL if there is none.  @start and @last must be the same that were passed
+ * to interval_tree_iter_first.  The tree must not be modified during the
+ * iteration.
+ */
+IntervalTreeNode *interval_tree_iter_next(IntervalTreeNode *node,
+                                          uint64_t start, uint64_t last);
+
+#endif
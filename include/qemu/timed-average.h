@@ -0,0 +1,93 @@
+/*
+ * Timed average computation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_TIMED_AVERAGE_H
+#define QEMU_TIMED_AVERAGE_H 1
+
+#include <stdint.h>
+
+#include "qemu/timer.h"
+
+/* A TimedAverage computes the minimum, maximum and average of the values
+ * accounted during (roughly) the last @period nanoseconds.  It uses two
+ * windows of length @period that overlap by half a period; values are added
+ * to both, and the older window, which covers between period/2 and period
+ * nanoseconds of history, is the one that is reported.  When a window
+ * expires it is reset and becomes the newer one.
+ *
+ * Accounting a value is O(1) and does not allocate memory.
+ */
+typedef struct TimedAverageWindow {
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+    uint64_t count;
+    int64_t expiration;         /* end of the window, in ns */
+} TimedAverageWindow;
+
+typedef struct TimedAverage {
+    /* private */
+    uint64_t period;            /* in ns */
+    TimedAverageWindow windows[2];
+    unsigned current;           /* index of the older window */
+    QEMUClockType clock_type;
+} TimedAverage;
+
+/**
+ * timed_average_init:
+ * @ta: The TimedAverage to initialize.
+ * @clock_type: The clock used to expire the windows.
+ * @period: Length of the windows, in nanoseconds.  Must not be zero.
+ */
+void timed_average_init(TimedAverage *ta, QEMUClockType clock_type,
+                        uint64_t period);
+
+/**
+ * timed_average_account:
+ * @ta: The TimedAverage.
+ * @value: The value to account.
+ */
+void timed_average_account(TimedAverage *ta, uint64_t value);
+
+/**
+ * timed_average_min:
+ * @ta: The TimedAverage.
+ *
+ * Return the smallest value accounted in the current window, or 0 if there
+ * is none.
+ */
+uint64_t timed_average_min(TimedAverage *ta);
+
+/**
+ * timed_average_max:
+ * @ta: The TimedAverage.
+ *
+ * Return the largest value accounted in the current window, or 0 if there
+ * is none.
+ */
+uint64_t timed_average_max(TimedAverage *ta);
+
+/**
+ * timed_average_avg:
+ * @ta: The TimedAverage.
+ *
+ * Return the average of the values accounted in the current window, or 0 if
+ * there is none.
+ */
+uint64_t timed_average_avg(TimedAverage *ta);
+
+/**
+ * timed_average_sum:
+ * @ta: The TimedAverage.
+ * @elapsed: If not %NULL, set to the time covered by the current window, in
+ * nanoseconds.
+ *
+ * Return the sum of the values accounted in the current window.
+ */
+uint64_t timed_average_sum(TimedAverage *ta, uint64_t *elapsed);
+
+#endif
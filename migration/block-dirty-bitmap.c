@@ -0,0 +1,569 @@
+/*
+ * Block dirty bitmap migration
+ *
+ * Named dirty bitmaps of block devices are sent to the destination in
+ * chunks.  During the bulk phase every chunk is sent once while the guest
+ * keeps running; a meta bitmap records which chunks change afterwards, and
+ * only those are sent again after the guest has been stopped.
+ *
+ * Stream format (all integers big endian):
+ *
+ *   flags (1 byte)
+ *   device name (2 length bytes + string)   unless flags == EOS
+ *   bitmap name (2 length bytes + string)   unless flags == EOS
+ *   START:    granularity (4 bytes), enabled (1 byte), persistent (1 byte)
+ *   BITS:     start sector (8 bytes), sector count (8 bytes),
+ *             data size (8 bytes), data
+ *   ZEROES:   start sector (8 bytes), sector count (8 bytes)
+ *   COMPLETE: nothing
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "block/block.h"
+#include "block/block_int.h"
+#include "qemu/error-report.h"
+#include "qemu/hbitmap.h"
+#include "qemu/main-loop.h"
+#include "hw/hw.h"
+#include "migration/block.h"
+#include "migration/migration.h"
+#include "sysemu/block-backend.h"
+
+#define DIRTY_BITMAP_MIG_FLAG_EOS           0x01
+#define DIRTY_BITMAP_MIG_FLAG_START         0x02
+#define DIRTY_BITMAP_MIG_FLAG_BITS          0x04
+#define DIRTY_BITMAP_MIG_FLAG_ZEROES        0x08
+#define DIRTY_BITMAP_MIG_FLAG_COMPLETE      0x10
+
+/* Longest device or bitmap name that can be migrated; this matches the
+ * limit for persistent bitmap names in qcow2 */
+#define DIRTY_BITMAP_MIG_NAME_MAX           1023
+
+/* Serialization units (64 bits each) per chunk */
+#define DIRTY_BITMAP_MIG_CHUNK_WORDS        1024
+
+/* #define DEBUG_DIRTY_BITMAP_MIGRATION */
+
+#ifdef DEBUG_DIRTY_BITMAP_MIGRATION
+#define DPRINTF(fmt, ...) \
+    do { printf("dirty_bitmap_migration: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+typedef struct DirtyBitmapMigBitmapState {
+    /* Written during setup phase.  */
+    BlockDriverState *bs;
+    const char *device_name;
+    BdrvDirtyBitmap *bitmap;
+    int64_t total_sectors;
+    int64_t sectors_per_chunk;
+    QSIMPLEQ_ENTRY(DirtyBitmapMigBitmapState) entry;
+
+    /* For bulk phase.  */
+    bool bulk_completed;
+    int64_t cur_sector;
+} DirtyBitmapMigBitmapState;
+
+typedef struct DirtyBitmapMigState {
+    QSIMPLEQ_HEAD(dbms_list, DirtyBitmapMigBitmapState) dbms_list;
+
+    bool bulk_completed;
+
+    /* Destination only: bitmaps to enable once they are complete */
+    GSList *enabled_bitmaps;
+} DirtyBitmapMigState;
+
+static DirtyBitmapMigState dirty_bitmap_mig_state;
+
+static void put_name(QEMUFile *f, const char *name)
+{
+    int len = strlen(name);
+
+    assert(len <= DIRTY_BITMAP_MIG_NAME_MAX);
+    qemu_put_be16(f, len);
+    qemu_put_buffer(f, (const uint8_t *)name, len);
+}
+
+static int get_name(QEMUFile *f, char name[DIRTY_BITMAP_MIG_NAME_MAX + 1])
+{
+    int len = qemu_get_be16(f);
+
+    if (len > DIRTY_BITMAP_MIG_NAME_MAX) {
+        error_report("Dirty bitmap migration: name too long (%d bytes)", len);
+        return -EINVAL;
+    }
+    qemu_get_buffer(f, (uint8_t *)name, len);
+    name[len] = '\0';
+    return 0;
+}
+
+static void send_bitmap_header(QEMUFile *f, DirtyBitmapMigBitmapState *dbms,
+                               uint8_t flags)
+{
+    qemu_put_byte(f, flags);
+    put_name(f, dbms->device_name);
+    put_name(f, bdrv_dirty_bitmap_name(dbms->bitmap));
+}
+
+static void send_bitmap_start(QEMUFile *f, DirtyBitmapMigBitmapState *dbms)
+{
+    send_bitmap_header(f, dbms, DIRTY_BITMAP_MIG_FLAG_START);
+    qemu_put_be32(f, bdrv_dirty_bitmap_granularity(dbms->bitmap));
+    qemu_put_byte(f, bdrv_dirty_bitmap_enabled(dbms->bitmap));
+    qemu_put_byte(f, bdrv_dirty_bitmap_get_persistence(dbms->bitmap));
+}
+
+static void send_bitmap_complete(QEMUFile *f, DirtyBitmapMigBitmapState *dbms)
+{
+    send_bitmap_header(f, dbms, DIRTY_BITMAP_MIG_FLAG_COMPLETE);
+}
+
+/* Called with iothread lock taken.  */
+
+static void send_bitmap_bits(QEMUFile *f, DirtyBitmapMigBitmapState *dbms,
+                             int64_t start_sector, int64_t nr_sectors)
+{
+    AioContext *aio_context = bdrv_get_aio_context(dbms->bs);
+    uint64_t buf_size;
+    uint8_t *buf = NULL;
+
+    aio_context_acquire(aio_context);
+    if (bdrv_dirty_bitmap_range_empty(dbms->bitmap, start_sector,
+                                      nr_sectors)) {
+        send_bitmap_header(f, dbms, DIRTY_BITMAP_MIG_FLAG_ZEROES);
+        qemu_put_be64(f, start_sector);
+        qemu_put_be64(f, nr_sectors);
+    } else {
+        buf_size = bdrv_dirty_bitmap_serialization_size(dbms->bitmap,
+                                                        start_sector,
+                                                        nr_sectors);
+        buf = g_malloc(buf_size);
+        bdrv_dirty_bitmap_serialize_part(dbms->bitmap, buf, start_sector,
+                                         nr_sectors);
+
+        send_bitmap_header(f, dbms, DIRTY_BITMAP_MIG_FLAG_BITS);
+        qemu_put_be64(f, start_sector);
+        qemu_put_be64(f, nr_sectors);
+        qemu_put_be64(f, buf_size);
+        qemu_put_buffer(f, buf, buf_size);
+    }
+
+    /* The destination is up to date for this chunk now */
+    bdrv_dirty_bitmap_meta_reset(dbms->bitmap, start_sector, nr_sectors);
+    aio_context_release(aio_context);
+
+    g_free(buf);
+}
+
+/* Called with iothread lock taken.  */
+
+static void init_dirty_bitmap_migration(void)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+    DirtyBitmapMigBitmapState *dbms;
+
+    dirty_bitmap_mig_state.bulk_completed = false;
+
+    for (bs = bdrv_next(NULL); bs; bs = bdrv_next(bs)) {
+        const char *device_name = bdrv_get_device_name(bs);
+
+        if (!device_name[0]) {
+            continue;
+        }
+        if (strlen(device_name) > DIRTY_BITMAP_MIG_NAME_MAX) {
+            error_report("Dirty bitmaps of device '%s' are not migrated: "
+                         "the device name is too long", device_name);
+            continue;
+        }
+
+        for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap;
+             bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) {
+            if (!bdrv_dirty_bitmap_name(bitmap)) {
+                continue;
+            }
+            if (bdrv_dirty_bitmap_frozen(bitmap)) {
+                error_report("Dirty bitmap '%s' of device '%s' is frozen and "
+                             "is not migrated",
+                             bdrv_dirty_bitmap_name(bitmap), device_name);
+                continue;
+            }
+            if (strlen(bdrv_dirty_bitmap_name(bitmap)) >
+                DIRTY_BITMAP_MIG_NAME_MAX) {
+                error_report("Dirty bitmap '%s' of device '%s' is not "
+                             "migrated: the name is too long",
+                             bdrv_dirty_bitmap_name(bitmap), device_name);
+                continue;
+            }
+
+            dbms = g_new0(DirtyBitmapMigBitmapState, 1);
+            dbms->bs = bs;
+            dbms->device_name = device_name;
+            dbms->bitmap = bitmap;
+            dbms->total_sectors = bdrv_dirty_bitmap_size(bitmap);
+            dbms->sectors_per_chunk = DIRTY_BITMAP_MIG_CHUNK_WORDS *
+                bdrv_dirty_bitmap_serialization_align(bitmap);
+            bdrv_create_meta_dirty_bitmap(bitmap, dbms->sectors_per_chunk);
+            bdrv_ref(bs);
+
+            DPRINTF("Start migration of bitmap '%s' of device '%s'\n",
+                    bdrv_dirty_bitmap_name(bitmap), device_name);
+
+            QSIMPLEQ_INSERT_TAIL(&dirty_bitmap_mig_state.dbms_list, dbms,
+                                 entry);
+        }
+    }
+}
+
+/* Called with iothread lock taken.  */
+
+static void bulk_phase_send_chunk(QEMUFile *f, DirtyBitmapMigBitmapState *dbms)
+{
+    int64_t nr_sectors = MIN(dbms->total_sectors - dbms->cur_sector,
+                             dbms->sectors_per_chunk);
+
+    send_bitmap_bits(f, dbms, dbms->cur_sector, nr_sectors);
+
+    dbms->cur_sector += nr_sectors;
+    if (dbms->cur_sector >= dbms->total_sectors) {
+        dbms->bulk_completed = true;
+    }
+}
+
+/* Called with iothread lock taken.  */
+
+static void bulk_phase(QEMUFile *f, bool limit)
+{
+    DirtyBitmapMigBitmapState *dbms;
+
+    QSIMPLEQ_FOREACH(dbms, &dirty_bitmap_mig_state.dbms_list, entry) {
+        while (!dbms->bulk_completed) {
+            bulk_phase_send_chunk(f, dbms);
+            if (limit && qemu_file_rate_limit(f)) {
+                return;
+            }
+        }
+    }
+
+    dirty_bitmap_mig_state.bulk_completed = true;
+}
+
+/* Called with iothread lock taken.  */
+
+static void dirty_phase(QEMUFile *f)
+{
+    DirtyBitmapMigBitmapState *dbms;
+    HBitmapIter hbi;
+    int64_t sector, nr_sectors;
+
+    QSIMPLEQ_FOREACH(dbms, &dirty_bitmap_mig_state.dbms_list, entry) {
+        bdrv_dirty_bitmap_meta_iter_init(dbms->bitmap, &hbi);
+        while ((sector = hbitmap_iter_next(&hbi)) >= 0) {
+            sector -= sector % dbms->sectors_per_chunk;
+            nr_sectors = MIN(dbms->total_sectors - sector,
+                             dbms->sectors_per_chunk);
+            send_bitmap_bits(f, dbms, sector, nr_sectors);
+        }
+    }
+}
+
+/* Called with iothread lock taken.  */
+
+static void dirty_bitmap_mig_cleanup(void)
+{
+    DirtyBitmapMigBitmapState *dbms;
+
+    while ((dbms = QSIMPLEQ_FIRST(&dirty_bitmap_mig_state.dbms_list)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&dirty_bitmap_mig_state.dbms_list, entry);
+        bdrv_release_meta_dirty_bitmap(dbms->bitmap);
+        bdrv_unref(dbms->bs);
+        g_free(dbms);
+    }
+}
+
+static void dirty_bitmap_migration_cancel(void *opaque)
+{
+    dirty_bitmap_mig_cleanup();
+}
+
+static int dirty_bitmap_save_setup(QEMUFile *f, void *opaque)
+{
+    DirtyBitmapMigBitmapState *dbms;
+
+    qemu_mutex_lock_iothread();
+    init_dirty_bitmap_migration();
+
+    QSIMPLEQ_FOREACH(dbms, &dirty_bitmap_mig_state.dbms_list, entry) {
+        send_bitmap_start(f, dbms);
+    }
+    qemu_mutex_unlock_iothread();
+
+    qemu_put_byte(f, DIRTY_BITMAP_MIG_FLAG_EOS);
+    return 0;
+}
+
+static int dirty_bitmap_save_iterate(QEMUFile *f, void *opaque)
+{
+    if (!dirty_bitmap_mig_state.bulk_completed) {
+        qemu_mutex_lock_iothread();
+        bulk_phase(f, true);
+        qemu_mutex_unlock_iothread();
+    }
+
+    qemu_put_byte(f, DIRTY_BITMAP_MIG_FLAG_EOS);
+
+    return dirty_bitmap_mig_state.bulk_completed;
+}
+
+/* Called with iothread lock taken.  */
+
+static int dirty_bitmap_save_complete(QEMUFile *f, void *opaque)
+{
+    DirtyBitmapMigBitmapState *dbms;
+
+    if (!dirty_bitmap_mig_state.bulk_completed) {
+        bulk_phase(f, false);
+    }
+
+    dirty_phase(f);
+
+    QSIMPLEQ_FOREACH(dbms, &dirty_bitmap_mig_state.dbms_list, entry) {
+        send_bitmap_complete(f, dbms);
+    }
+
+    qemu_put_byte(f, DIRTY_BITMAP_MIG_FLAG_EOS);
+
+    DPRINTF("Dirty bitmap migration completed\n");
+
+    dirty_bitmap_mig_cleanup();
+    return 0;
+}
+
+static uint64_t dirty_bitmap_save_pending(QEMUFile *f, void *opaque,
+                                          uint64_t max_size)
+{
+    DirtyBitmapMigBitmapState *dbms;
+    uint64_t pending = 0;
+
+    qemu_mutex_lock_iothread();
+
+    QSIMPLEQ_FOREACH(dbms, &dirty_bitmap_mig_state.dbms_list, entry) {
+        int64_t sectors = bdrv_dirty_bitmap_meta_count(dbms->bitmap);
+
+        if (!dbms->bulk_completed) {
+            sectors += dbms->total_sectors - dbms->cur_sector;
+        }
+        pending += DIV_ROUND_UP(sectors,
+                                bdrv_dirty_bitmap_serialization_align(
+                                    dbms->bitmap)) * sizeof(uint64_t);
+    }
+
+    qemu_mutex_unlock_iothread();
+
+    DPRINTF("Enter save live pending %" PRIu64 "\n", pending);
+    return pending;
+}
+
+static BdrvDirtyBitmap *load_bitmap_header(QEMUFile *f, BlockDriverState **pbs,
+                                           char *bitmap_name)
+{
+    char device_name[DIRTY_BITMAP_MIG_NAME_MAX + 1];
+    BlockBackend *blk;
+    BdrvDirtyBitmap *bitmap;
+
+    if (get_name(f, device_name) < 0 || get_name(f, bitmap_name) < 0) {
+        return NULL;
+    }
+
+    blk = blk_by_name(device_name);
+    if (!blk) {
+        error_report("Error unknown block device '%s'", device_name);
+        return NULL;
+    }
+    *pbs = blk_bs(blk);
+
+    bitmap = bdrv_find_dirty_bitmap(*pbs, bitmap_name);
+    if (!bitmap) {
+        error_report("Error unknown dirty bitmap '%s' of device '%s'",
+                     bitmap_name, device_name);
+    }
+    return bitmap;
+}
+
+static int load_bitmap_start(QEMUFile *f)
+{
+    char device_name[DIRTY_BITMAP_MIG_NAME_MAX + 1];
+    char bitmap_name[DIRTY_BITMAP_MIG_NAME_MAX + 1];
+    BlockBackend *blk;
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+    uint32_t granularity;
+    bool enabled, persistent;
+    Error *local_err = NULL;
+
+    if (get_name(f, device_name) < 0 || get_name(f, bitmap_name) < 0) {
+        return -EINVAL;
+    }
+    granularity = qemu_get_be32(f);
+    enabled = qemu_get_byte(f);
+    persistent = qemu_get_byte(f);
+
+    blk = blk_by_name(device_name);
+    if (!blk) {
+        error_report("Error unknown block device '%s'", device_name);
+        return -EINVAL;
+    }
+    bs = blk_bs(blk);
+
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity, bitmap_name,
+                                      &local_err);
+    if (!bitmap) {
+        error_report_err(local_err);
+        return -EINVAL;
+    }
+
+    /* Writes done by block migration must not show up in the bitmap, so it
+     * stays disabled until it has been received completely */
+    bdrv_disable_dirty_bitmap(bitmap);
+    if (enabled) {
+        dirty_bitmap_mig_state.enabled_bitmaps =
+            g_slist_prepend(dirty_bitmap_mig_state.enabled_bitmaps, bitmap);
+    }
+    bdrv_dirty_bitmap_set_persistence(bitmap, persistent);
+
+    return 0;
+}
+
+static int load_bitmap_bits(QEMUFile *f, bool zeroes)
+{
+    char bitmap_name[DIRTY_BITMAP_MIG_NAME_MAX + 1];
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+    uint64_t start_sector, nr_sectors, buf_size;
+    uint8_t *buf;
+
+    bitmap = load_bitmap_header(f, &bs, bitmap_name);
+    if (!bitmap) {
+        return -EINVAL;
+    }
+
+    start_sector = qemu_get_be64(f);
+    nr_sectors = qemu_get_be64(f);
+    if (start_sector > bdrv_dirty_bitmap_size(bitmap) ||
+        nr_sectors > bdrv_dirty_bitmap_size(bitmap) - start_sector) {
+        error_report("Dirty bitmap '%s' chunk out of range", bitmap_name);
+        return -EINVAL;
+    }
+
+    if (zeroes) {
+        bdrv_dirty_bitmap_deserialize_zeroes(bitmap, start_sector, nr_sectors,
+                                             false);
+        return 0;
+    }
+
+    buf_size = qemu_get_be64(f);
+    if (buf_size != bdrv_dirty_bitmap_serialization_size(bitmap, start_sector,
+                                                         nr_sectors)) {
+        error_report("Dirty bitmap '%s' chunk has an invalid size",
+                     bitmap_name);
+        return -EINVAL;
+    }
+
+    buf = g_malloc(buf_size);
+    qemu_get_buffer(f, buf, buf_size);
+    bdrv_dirty_bitmap_deserialize_part(bitmap, buf, start_sector, nr_sectors,
+                                       false);
+    g_free(buf);
+    return 0;
+}
+
+static int load_bitmap_complete(QEMUFile *f)
+{
+    char bitmap_name[DIRTY_BITMAP_MIG_NAME_MAX + 1];
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bitmap = load_bitmap_header(f, &bs, bitmap_name);
+    if (!bitmap) {
+        return -EINVAL;
+    }
+
+    bdrv_dirty_bitmap_deserialize_finish(bitmap);
+
+    if (g_slist_find(dirty_bitmap_mig_state.enabled_bitmaps, bitmap)) {
+        dirty_bitmap_mig_state.enabled_bitmaps =
+            g_slist_remove(dirty_bitmap_mig_state.enabled_bitmaps, bitmap);
+        bdrv_enable_dirty_bitmap(bitmap);
+    }
+    return 0;
+}
+
+static int dirty_bitmap_load(QEMUFile *f, void *opaque, int version_id)
+{
+    int flags;
+    int ret;
+
+    do {
+        flags = qemu_get_byte(f);
+
+        switch (flags) {
+        case DIRTY_BITMAP_MIG_FLAG_START:
+            ret = load_bitmap_start(f);
+            break;
+        case DIRTY_BITMAP_MIG_FLAG_BITS:
+            ret = load_bitmap_bits(f, false);
+            break;
+        case DIRTY_BITMAP_MIG_FLAG_ZEROES:
+            ret = load_bitmap_bits(f, true);
+            break;
+        case DIRTY_BITMAP_MIG_FLAG_COMPLETE:
+            ret = load_bitmap_complete(f);
+            break;
+        case DIRTY_BITMAP_MIG_FLAG_EOS:
+            ret = 0;
+            break;
+        default:
+            error_report("Unknown dirty bitmap migration flags: %#x", flags);
+            return -EINVAL;
+        }
+
+        if (ret < 0) {
+            return ret;
+        }
+        ret = qemu_file_get_error(f);
+        if (ret != 0) {
+            return ret;
+        }
+    } while (flags != DIRTY_BITMAP_MIG_FLAG_EOS);
+
+    return 0;
+}
+
+static bool dirty_bitmap_is_active(void *opaque)
+{
+    return migrate_dirty_bitmaps();
+}
+
+static SaveVMHandlers savevm_dirty_bitmap_handlers = {
+    .save_live_setup = dirty_bitmap_save_setup,
+    .save_live_iterate = dirty_bitmap_save_iterate,
+    .save_live_complete = dirty_bitmap_save_complete,
+    .save_live_pending = dirty_bitmap_save_pending,
+    .load_state = dirty_bitmap_load,
+    .cancel = dirty_bitmap_migration_cancel,
+    .is_active = dirty_bitmap_is_active,
+};
+
+void dirty_bitmap_mig_init(void)
+{
+    QSIMPLEQ_INIT(&dirty_bitmap_mig_state.dbms_list);
+
+    register_savevm_live(NULL, "dirty-bitmap", 0, 1,
+                         &savevm_dirty_bitmap_handlers,
+                         &dirty_bitmap_mig_state);
+}
@@ -704,6 +704,15 @@ bool migrate_zero_blocks(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_BLOCKS];
 }
 
+bool migrate_dirty_bitmaps(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_DIRTY_BITMAPS];
+}
+
 bool migrate_use_compression(void)
 {
     MigrationState *s;
@@ -769,6 +778,7 @@ static void *migration_thread(void *opaque)
     int64_t max_size = 0;
     int64_t start_time = initial_time;
     bool old_vm_running = false;
+    bool block_inactive = false;
 
     qemu_savevm_state_header(s->file);
     qemu_savevm_state_begin(s->file, &s->params);
@@ -797,6 +807,11 @@ static void *migration_thread(void *opaque)
                 if (ret >= 0) {
                     qemu_file_set_rate_limit(s->file, INT64_MAX);
                     qemu_savevm_state_complete(s->file);
+                    if (!qemu_file_get_error(s->file)) {
+                        /* The destination owns the images from now on */
+                        ret = bdrv_inactivate_all();
+                        block_inactive = true;
+                    }
                 }
                 qemu_mutex_unlock_iothread();
 
@@ -859,6 +874,14 @@ static void *migration_thread(void *opaque)
         }
         runstate_set(RUN_STATE_POSTMIGRATE);
     } else {
+        if (block_inactive) {
+            Error *local_err = NULL;
+
+            bdrv_invalidate_cache_all(&local_err);
+            if (local_err) {
+                error_report_err(local_err);
+            }
+        }
         if (old_vm_running) {
             vm_start();
         }
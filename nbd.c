@@ -64,8 +64,8 @@
 
 #define NBD_REQUEST_SIZE        (4 + 4 + 8 + 8 + 4)
 #define NBD_REPLY_SIZE          (4 + 4 + 8)
+#define NBD_STRUCTURED_REPLY_SIZE (4 + 2 + 2 + 8 + 4)
 #define NBD_REQUEST_MAGIC       0x25609513
-#define NBD_REPLY_MAGIC         0x67446698
 #define NBD_OPTS_MAGIC          0x49484156454F5054LL
 #define NBD_CLIENT_MAGIC        0x0000420281861253LL
 #define NBD_REP_MAGIC           0x3e889045565a9LL
@@ -85,6 +85,17 @@
 #define NBD_OPT_EXPORT_NAME     (1)
 #define NBD_OPT_ABORT           (2)
 #define NBD_OPT_LIST            (3)
+#define NBD_OPT_STRUCTURED_REPLY (8)
+#define NBD_OPT_SET_META_CONTEXT (10)
+
+/* Maximum length of option data that the server accepts */
+#define NBD_MAX_OPTION_SIZE     4096
+
+/* Context id that the server assigns to "base:allocation" */
+#define NBD_META_ID_BASE_ALLOCATION 0
+
+/* Maximum number of extents in a block status reply */
+#define NBD_MAX_BLOCK_STATUS_EXTENTS 256
 
 /* NBD errors are based on errno numbers, so there is a 1:1 mapping,
  * but only a limited set of errno values is specified in the protocol.
@@ -120,7 +131,7 @@ static int system_errno_to_nbd_errno(int err)
     }
 }
 
-static int nbd_errno_to_system_errno(int err)
+int nbd_errno_to_system_errno(int err)
 {
     switch (err) {
     case NBD_SUCCESS:
@@ -158,6 +169,7 @@ struct NBDExport {
     off_t dev_offset;
     off_t size;
     uint32_t nbdflags;
+    int max_requests;
     QTAILQ_HEAD(, NBDClient) clients;
     QTAILQ_ENTRY(NBDExport) next;
 
@@ -180,6 +192,10 @@ struct NBDClient {
 
     bool can_read;
 
+    /* Negotiated protocol extensions */
+    bool structured_reply;
+    bool base_allocation;
+
     QTAILQ_ENTRY(NBDClient) next;
     int nb_requests;
     bool closing;
@@ -303,10 +319,10 @@ static ssize_t write_sync(int fd, void *buffer, size_t size)
 
 */
 
-static int nbd_send_rep(int csock, uint32_t type, uint32_t opt)
+static int nbd_send_rep_len(int csock, uint32_t type, uint32_t opt,
+                            uint32_t len)
 {
     uint64_t magic;
-    uint32_t len;
 
     magic = cpu_to_be64(NBD_REP_MAGIC);
     if (write_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
@@ -323,7 +339,7 @@ static int nbd_send_rep(int csock, uint32_t type, uint32_t opt)
         LOG("write failed (rep type)");
         return -EINVAL;
     }
-    len = cpu_to_be32(0);
+    len = cpu_to_be32(len);
     if (write_sync(csock, &len, sizeof(len)) != sizeof(len)) {
         LOG("write failed (rep data length)");
         return -EINVAL;
@@ -331,6 +347,11 @@ static int nbd_send_rep(int csock, uint32_t type, uint32_t opt)
     return 0;
 }
 
+static int nbd_send_rep(int csock, uint32_t type, uint32_t opt)
+{
+    return nbd_send_rep_len(csock, type, opt, 0);
+}
+
 static int nbd_send_rep_list(int csock, NBDExport *exp)
 {
     uint64_t magic, name_len;
@@ -424,6 +445,102 @@ fail:
     return rc;
 }
 
+static int nbd_handle_structured_reply(NBDClient *client, uint32_t length)
+{
+    int csock = client->sock;
+
+    if (length) {
+        if (drop_sync(csock, length) != length) {
+            return -EIO;
+        }
+        return nbd_send_rep(csock, NBD_REP_ERR_INVALID,
+                            NBD_OPT_STRUCTURED_REPLY);
+    }
+
+    client->structured_reply = true;
+    return nbd_send_rep(csock, NBD_REP_ACK, NBD_OPT_STRUCTURED_REPLY);
+}
+
+/* Only "base:allocation" is supported; the export name in the request is
+ * ignored because the context is the same for all exports.
+ */
+static int nbd_handle_set_meta_context(NBDClient *client, uint32_t length)
+{
+    int csock = client->sock;
+    const char *name = NBD_META_CONTEXT_BASE_ALLOCATION;
+    uint32_t name_len = strlen(name);
+    uint32_t pos, len, nr_queries, id;
+    uint8_t *buf;
+    int ret = -EINVAL;
+
+    if (!client->structured_reply || length > NBD_MAX_OPTION_SIZE) {
+        if (drop_sync(csock, length) != length) {
+            return -EIO;
+        }
+        return nbd_send_rep(csock, NBD_REP_ERR_INVALID,
+                            NBD_OPT_SET_META_CONTEXT);
+    }
+
+    /* Client sends:
+        [ 0 ..   3]   export name length
+        ...           export name
+        [ 0 ..   3]   number of queries
+        [ 0 ..   3]   query length
+        ...           query
+     */
+    buf = g_malloc(length);
+    if (read_sync(csock, buf, length) != length) {
+        g_free(buf);
+        return -EIO;
+    }
+
+    if (length < 8) {
+        goto invalid;
+    }
+    len = be32_to_cpup((uint32_t *)buf);
+    if (len > length - 8) {
+        goto invalid;
+    }
+    pos = 4 + len;
+    nr_queries = be32_to_cpup((uint32_t *)(buf + pos));
+    pos += 4;
+
+    while (nr_queries--) {
+        if (length - pos < 4) {
+            goto invalid;
+        }
+        len = be32_to_cpup((uint32_t *)(buf + pos));
+        pos += 4;
+        if (len > length - pos) {
+            goto invalid;
+        }
+        if (len == name_len && !memcmp(buf + pos, name, len)) {
+            client->base_allocation = true;
+        }
+        pos += len;
+    }
+
+    if (client->base_allocation) {
+        id = cpu_to_be32(NBD_META_ID_BASE_ALLOCATION);
+        if (nbd_send_rep_len(csock, NBD_REP_META_CONTEXT,
+                             NBD_OPT_SET_META_CONTEXT,
+                             sizeof(id) + name_len) < 0 ||
+            write_sync(csock, &id, sizeof(id)) != sizeof(id) ||
+            write_sync(csock, (char *)name, name_len) != name_len) {
+            LOG("write failed (meta context)");
+            goto out;
+        }
+    }
+    ret = nbd_send_rep(csock, NBD_REP_ACK, NBD_OPT_SET_META_CONTEXT);
+    goto out;
+
+invalid:
+    ret = nbd_send_rep(csock, NBD_REP_ERR_INVALID, NBD_OPT_SET_META_CONTEXT);
+out:
+    g_free(buf);
+    return ret;
+}
+
 static int nbd_receive_options(NBDClient *client)
 {
     int csock = client->sock;
@@ -495,11 +612,32 @@ static int nbd_receive_options(NBDClient *client)
         case NBD_OPT_EXPORT_NAME:
             return nbd_handle_export_name(client, length);
 
+        case NBD_OPT_STRUCTURED_REPLY:
+            ret = nbd_handle_structured_reply(client, length);
+            if (ret < 0) {
+                return ret;
+            }
+            break;
+
+        case NBD_OPT_SET_META_CONTEXT:
+            ret = nbd_handle_set_meta_context(client, length);
+            if (ret < 0) {
+                return ret;
+            }
+            break;
+
         default:
             tmp = be32_to_cpu(tmp);
             LOG("Unsupported option 0x%x", tmp);
-            nbd_send_rep(client->sock, NBD_REP_ERR_UNSUP, tmp);
-            return -EINVAL;
+            if (drop_sync(csock, length) != length) {
+                return -EIO;
+            }
+            ret = nbd_send_rep(client->sock, NBD_REP_ERR_UNSUP, tmp);
+            /* Fixed newstyle clients can go on with other options */
+            if (ret < 0 || !(flags & NBD_FLAG_C_FIXED_NEWSTYLE)) {
+                return -EINVAL;
+            }
+            break;
         }
     }
 }
@@ -579,17 +717,177 @@ fail:
     return rc;
 }
 
+static int nbd_send_option_request(int csock, uint32_t opt, uint32_t len,
+                                   const void *data, Error **errp)
+{
+    uint64_t magic = cpu_to_be64(NBD_OPTS_MAGIC);
+    uint32_t tmp;
+
+    if (write_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
+        error_setg(errp, "Failed to send option magic");
+        return -EIO;
+    }
+    tmp = cpu_to_be32(opt);
+    if (write_sync(csock, &tmp, sizeof(tmp)) != sizeof(tmp)) {
+        error_setg(errp, "Failed to send option number");
+        return -EIO;
+    }
+    tmp = cpu_to_be32(len);
+    if (write_sync(csock, &tmp, sizeof(tmp)) != sizeof(tmp)) {
+        error_setg(errp, "Failed to send option length");
+        return -EIO;
+    }
+    if (len && write_sync(csock, (void *)data, len) != len) {
+        error_setg(errp, "Failed to send option data");
+        return -EIO;
+    }
+    return 0;
+}
+
+/* Read the header of a reply to option @opt; the caller reads or drops the
+ * @len bytes of data that follow.
+ */
+static int nbd_receive_option_reply(int csock, uint32_t opt, uint32_t *type,
+                                    uint32_t *len, Error **errp)
+{
+    uint64_t magic;
+    uint32_t tmp;
+
+    /* Server sends:
+        [ 0 ..   7]   NBD_REP_MAGIC
+        [ 8 ..  11]   option
+        [12 ..  15]   reply type
+        [16 ..  19]   data length
+     */
+    if (read_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
+        error_setg(errp, "Failed to read option reply magic");
+        return -EIO;
+    }
+    if (be64_to_cpu(magic) != NBD_REP_MAGIC) {
+        error_setg(errp, "Bad option reply magic received");
+        return -EINVAL;
+    }
+    if (read_sync(csock, &tmp, sizeof(tmp)) != sizeof(tmp)) {
+        error_setg(errp, "Failed to read option reply");
+        return -EIO;
+    }
+    if (be32_to_cpu(tmp) != opt) {
+        error_setg(errp, "Reply to unexpected option received");
+        return -EINVAL;
+    }
+    if (read_sync(csock, type, sizeof(*type)) != sizeof(*type) ||
+        read_sync(csock, len, sizeof(*len)) != sizeof(*len)) {
+        error_setg(errp, "Failed to read option reply");
+        return -EIO;
+    }
+    *type = be32_to_cpu(*type);
+    *len = be32_to_cpu(*len);
+    return 0;
+}
+
+/* Send an option without data.  Return 1 if the server acknowledged it,
+ * 0 if it refused it, or a negative errno value.
+ */
+static int nbd_negotiate_simple_option(int csock, uint32_t opt, Error **errp)
+{
+    uint32_t type, len;
+    int ret;
+
+    ret = nbd_send_option_request(csock, opt, 0, NULL, errp);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = nbd_receive_option_reply(csock, opt, &type, &len, errp);
+    if (ret < 0) {
+        return ret;
+    }
+    if (len && drop_sync(csock, len) != len) {
+        error_setg(errp, "Failed to read option reply");
+        return -EIO;
+    }
+    return type == NBD_REP_ACK;
+}
+
+static int nbd_negotiate_base_allocation(int csock, const char *name,
+                                         NBDExtensions *ext, Error **errp)
+{
+    const char *query = NBD_META_CONTEXT_BASE_ALLOCATION;
+    uint32_t name_len = strlen(name);
+    uint32_t query_len = strlen(query);
+    uint32_t len = 4 + name_len + 4 + 4 + query_len;
+    uint32_t type, id;
+    char *buf;
+    int ret;
+
+    buf = g_malloc(len);
+    cpu_to_be32w((uint32_t *)buf, name_len);
+    memcpy(buf + 4, name, name_len);
+    cpu_to_be32w((uint32_t *)(buf + 4 + name_len), 1);
+    cpu_to_be32w((uint32_t *)(buf + 8 + name_len), query_len);
+    memcpy(buf + 12 + name_len, query, query_len);
+    ret = nbd_send_option_request(csock, NBD_OPT_SET_META_CONTEXT, len, buf,
+                                  errp);
+    g_free(buf);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Zero or more NBD_REP_META_CONTEXT replies, then NBD_REP_ACK */
+    for (;;) {
+        char reply_name[64];
+
+        ret = nbd_receive_option_reply(csock, NBD_OPT_SET_META_CONTEXT,
+                                       &type, &len, errp);
+        if (ret < 0) {
+            return ret;
+        }
+        if (type != NBD_REP_META_CONTEXT) {
+            if (len && drop_sync(csock, len) != len) {
+                error_setg(errp, "Failed to read option reply");
+                return -EIO;
+            }
+            if (type != NBD_REP_ACK) {
+                /* Typically NBD_REP_ERR_UNSUP: go on without the context */
+                ext->refused = true;
+                ext->base_allocation = false;
+            }
+            return 0;
+        }
+
+        if (len < sizeof(id) || len - sizeof(id) >= sizeof(reply_name)) {
+            error_setg(errp, "Invalid meta context reply received");
+            return -EINVAL;
+        }
+        len -= sizeof(id);
+        if (read_sync(csock, &id, sizeof(id)) != sizeof(id) ||
+            read_sync(csock, reply_name, len) != len) {
+            error_setg(errp, "Failed to read meta context reply");
+            return -EIO;
+        }
+        reply_name[len] = '\0';
+        if (!strcmp(reply_name, query)) {
+            ext->base_allocation = true;
+            ext->context_id = be32_to_cpu(id);
+        }
+    }
+}
+
 int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
-                          off_t *size, Error **errp)
+                          off_t *size, NBDExtensions *ext, Error **errp)
 {
     char buf[256];
     uint64_t magic, s;
     uint16_t tmp;
+    NBDExtensions wanted = { 0 };
     int rc;
 
     TRACE("Receiving negotiation.");
 
     rc = -EINVAL;
+    if (ext) {
+        wanted = *ext;
+        memset(ext, 0, sizeof(*ext));
+    }
 
     if (read_sync(csock, buf, 8) != 8) {
         error_setg(errp, "Failed to read data");
@@ -625,9 +923,10 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
     TRACE("Magic is 0x%" PRIx64, magic);
 
     if (name) {
-        uint32_t reserved = 0;
+        uint32_t client_flags = 0;
         uint32_t opt;
         uint32_t namesize;
+        bool fixed;
 
         TRACE("Checking magic (opts_magic)");
         if (magic != NBD_OPTS_MAGIC) {
@@ -643,12 +942,37 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
             goto fail;
         }
         *flags = be16_to_cpu(tmp) << 16;
-        /* reserved for future use */
-        if (write_sync(csock, &reserved, sizeof(reserved)) !=
-            sizeof(reserved)) {
-            error_setg(errp, "Failed to read reserved field");
+
+        /* Options other than NBD_OPT_EXPORT_NAME need the fixed newstyle
+         * protocol, where the server replies to options it does not know.
+         */
+        fixed = !!(*flags & (NBD_FLAG_FIXED_NEWSTYLE << 16));
+        if (fixed) {
+            client_flags = cpu_to_be32(NBD_FLAG_C_FIXED_NEWSTYLE);
+        }
+        if (write_sync(csock, &client_flags, sizeof(client_flags)) !=
+            sizeof(client_flags)) {
+            error_setg(errp, "Failed to send client flags");
             goto fail;
         }
+
+        if (fixed && wanted.structured_reply) {
+            rc = nbd_negotiate_simple_option(csock, NBD_OPT_STRUCTURED_REPLY,
+                                             errp);
+            if (rc < 0) {
+                goto fail;
+            }
+            /* If the server refused the option, do without it */
+            ext->structured_reply = rc;
+            ext->refused = !rc;
+            rc = -EINVAL;
+        }
+        if (ext && ext->structured_reply && wanted.base_allocation) {
+            if (nbd_negotiate_base_allocation(csock, name, ext, errp) < 0) {
+                goto fail;
+            }
+        }
+
         /* write the export name */
         magic = cpu_to_be64(magic);
         if (write_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
@@ -885,37 +1209,73 @@ static ssize_t nbd_receive_request(int csock, struct nbd_request *request)
 
 ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
     uint32_t magic;
     ssize_t ret;
 
-    ret = read_sync(csock, buf, sizeof(buf));
+    ret = read_sync(csock, buf, NBD_REPLY_SIZE);
     if (ret < 0) {
         return ret;
     }
 
-    if (ret != sizeof(buf)) {
+    if (ret != NBD_REPLY_SIZE) {
         LOG("read failed");
         return -EINVAL;
     }
 
     /* Reply
-       [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
+       [ 0 ..  3]    magic   (NBD_SIMPLE_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
        [ 7 .. 15]    handle
+
+       Structured reply chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags
+       [ 6 ..  7]    type
+       [ 8 .. 15]    handle
+       [16 .. 19]    length of the payload
      */
 
     magic = be32_to_cpup((uint32_t*)buf);
-    reply->error  = be32_to_cpup((uint32_t*)(buf + 4));
+    reply->magic = magic;
     reply->handle = be64_to_cpup((uint64_t*)(buf + 8));
 
+    if (magic == NBD_STRUCTURED_REPLY_MAGIC) {
+        /* The length is sent together with the rest of the header, so it
+         * is not worth yielding for it.
+         */
+        do {
+            ret = read_sync(csock, buf + NBD_REPLY_SIZE,
+                            NBD_STRUCTURED_REPLY_SIZE - NBD_REPLY_SIZE);
+        } while (ret == -EAGAIN);
+        if (ret != NBD_STRUCTURED_REPLY_SIZE - NBD_REPLY_SIZE) {
+            LOG("read failed");
+            return -EINVAL;
+        }
+
+        reply->error  = 0;
+        reply->flags  = be16_to_cpup((uint16_t*)(buf + 4));
+        reply->type   = be16_to_cpup((uint16_t*)(buf + 6));
+        reply->length = be32_to_cpup((uint32_t*)(buf + 16));
+
+        TRACE("Got reply chunk: "
+              "{ .flags = 0x%x, .type = %d, handle = %" PRIu64
+              ", length = %u }",
+              reply->flags, reply->type, reply->handle, reply->length);
+        return 0;
+    }
+
+    reply->error  = be32_to_cpup((uint32_t*)(buf + 4));
     reply->error = nbd_errno_to_system_errno(reply->error);
+    reply->flags = NBD_REPLY_FLAG_DONE;
+    reply->type = NBD_REPLY_TYPE_NONE;
+    reply->length = 0;
 
     TRACE("Got reply: "
           "{ magic = 0x%x, .error = %d, handle = %" PRIu64" }",
           magic, reply->error, reply->handle);
 
-    if (magic != NBD_REPLY_MAGIC) {
+    if (magic != NBD_SIMPLE_REPLY_MAGIC) {
         LOG("invalid magic (got 0x%x)", magic);
         return -EINVAL;
     }
@@ -930,11 +1290,11 @@ static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
     reply->error = system_errno_to_nbd_errno(reply->error);
 
     /* Reply
-       [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
+       [ 0 ..  3]    magic   (NBD_SIMPLE_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
        [ 7 .. 15]    handle
      */
-    cpu_to_be32w((uint32_t*)buf, NBD_REPLY_MAGIC);
+    cpu_to_be32w((uint32_t*)buf, NBD_SIMPLE_REPLY_MAGIC);
     cpu_to_be32w((uint32_t*)(buf + 4), reply->error);
     cpu_to_be64w((uint64_t*)(buf + 8), reply->handle);
 
@@ -952,7 +1312,10 @@ static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
     return 0;
 }
 
-#define MAX_NBD_REQUESTS 16
+static int nbd_client_max_requests(NBDClient *client)
+{
+    return client->exp ? client->exp->max_requests : NBD_DEFAULT_MAX_REQUESTS;
+}
 
 void nbd_client_get(NBDClient *client)
 {
@@ -1001,7 +1364,7 @@ static NBDRequest *nbd_request_get(NBDClient *client)
 {
     NBDRequest *req;
 
-    assert(client->nb_requests <= MAX_NBD_REQUESTS - 1);
+    assert(client->nb_requests <= nbd_client_max_requests(client) - 1);
     client->nb_requests++;
     nbd_update_can_read(client);
 
@@ -1063,6 +1426,7 @@ NBDExport *nbd_export_new(BlockBackend *blk, off_t dev_offset, off_t size,
     exp->blk = blk;
     exp->dev_offset = dev_offset;
     exp->nbdflags = nbdflags;
+    exp->max_requests = NBD_DEFAULT_MAX_REQUESTS;
     exp->size = size < 0 ? blk_getlength(blk) : size;
     if (exp->size < 0) {
         error_setg_errno(errp, -exp->size,
@@ -1088,6 +1452,15 @@ fail:
     return NULL;
 }
 
+/* Each request in flight may hold a buffer of up to NBD_MAX_BUFFER_SIZE
+ * bytes, so the default is kept low.
+ */
+void nbd_export_set_max_requests(NBDExport *exp, int max_requests)
+{
+    assert(max_requests > 0 && max_requests <= NBD_MAX_REQUESTS_LIMIT);
+    exp->max_requests = max_requests;
+}
+
 NBDExport *nbd_export_find(const char *name)
 {
     NBDExport *exp;
@@ -1208,6 +1581,220 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
     return rc;
 }
 
+/* Send a structured reply chunk.  The payload is made of @hdr_len bytes at
+ * @hdr (the part of the payload that depends on the chunk type), followed
+ * by @len bytes of data.
+ */
+static ssize_t nbd_co_send_chunk(NBDRequest *req, uint64_t handle,
+                                 uint16_t flags, uint16_t type,
+                                 void *hdr, size_t hdr_len,
+                                 void *data, size_t len)
+{
+    NBDClient *client = req->client;
+    int csock = client->sock;
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
+    ssize_t rc = 0;
+
+    /* Reply chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags
+       [ 6 ..  7]    type
+       [ 8 .. 15]    handle
+       [16 .. 19]    length of the payload
+     */
+    cpu_to_be32w((uint32_t *)buf, NBD_STRUCTURED_REPLY_MAGIC);
+    cpu_to_be16w((uint16_t *)(buf + 4), flags);
+    cpu_to_be16w((uint16_t *)(buf + 6), type);
+    cpu_to_be64w((uint64_t *)(buf + 8), handle);
+    cpu_to_be32w((uint32_t *)(buf + 16), hdr_len + len);
+
+    TRACE("Sending reply chunk to client: "
+          "{ .flags = 0x%x, .type = %d, .handle = %" PRIu64 ", len = %zu }",
+          flags, type, handle, hdr_len + len);
+
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+    nbd_set_handlers(client);
+
+    socket_set_cork(csock, 1);
+    if (qemu_co_send(csock, buf, sizeof(buf)) != sizeof(buf) ||
+        (hdr_len && qemu_co_send(csock, hdr, hdr_len) != hdr_len) ||
+        (len && qemu_co_send(csock, data, len) != len)) {
+        rc = -EIO;
+    }
+    socket_set_cork(csock, 0);
+
+    client->send_coroutine = NULL;
+    nbd_set_handlers(client);
+    qemu_co_mutex_unlock(&client->send_lock);
+    return rc;
+}
+
+static ssize_t nbd_co_send_structured_error(NBDRequest *req, uint64_t handle,
+                                            int error)
+{
+    uint8_t hdr[4 + 2];
+
+    /* Error chunk
+       [ 0 ..  3]    error
+       [ 4 ..  5]    length of the message (no message is sent)
+     */
+    cpu_to_be32w((uint32_t *)hdr, system_errno_to_nbd_errno(error));
+    cpu_to_be16w((uint16_t *)(hdr + 4), 0);
+
+    return nbd_co_send_chunk(req, handle, NBD_REPLY_FLAG_DONE,
+                             NBD_REPLY_TYPE_ERROR, hdr, sizeof(hdr), NULL, 0);
+}
+
+/* Return the length of the extent that starts at @offset and is at most
+ * @bytes long, and store its NBD_STATE_* flags in @flags.  Only the flags in
+ * @mask are considered when merging consecutive block status results, so
+ * the extent can be longer than what the image format reports.
+ */
+static uint32_t nbd_get_extent(NBDExport *exp, uint64_t offset,
+                               uint32_t bytes, uint32_t mask,
+                               uint32_t *flags)
+{
+    BlockDriverState *bs = blk_bs(exp->blk);
+    uint64_t start = offset + exp->dev_offset;
+    int64_t sector_num = start / BDRV_SECTOR_SIZE;
+    int64_t end = DIV_ROUND_UP(start + bytes, BDRV_SECTOR_SIZE);
+    int64_t cur = sector_num;
+
+    while (cur < end) {
+        int64_t ret;
+        uint32_t cur_flags = 0;
+        int n;
+
+        ret = bdrv_get_block_status(bs, cur, end - cur, &n);
+        if (ret < 0 || n == 0) {
+            /* Unknown, so report data that must be read */
+            n = end - cur;
+        } else {
+            if (!(ret & BDRV_BLOCK_DATA)) {
+                cur_flags |= NBD_STATE_HOLE;
+            }
+            if (ret & BDRV_BLOCK_ZERO) {
+                cur_flags |= NBD_STATE_ZERO;
+            }
+        }
+
+        cur_flags &= mask;
+        if (cur == sector_num) {
+            *flags = cur_flags;
+        } else if (cur_flags != *flags) {
+            break;
+        }
+        cur += n;
+    }
+
+    return MIN(cur * BDRV_SECTOR_SIZE - start, bytes);
+}
+
+/* Reply to a read with data chunks for the parts of the range that contain
+ * data, and hole chunks for those that read as zeroes; the latter are not
+ * read from the image at all.
+ */
+static ssize_t nbd_co_send_structured_read(NBDRequest *req,
+                                           struct nbd_request *request)
+{
+    NBDExport *exp = req->client->exp;
+    uint64_t offset = request->from;
+    uint64_t end = request->from + request->len;
+    uint8_t hdr[8 + 4];
+    ssize_t rc;
+    int ret;
+
+    if (!request->len) {
+        return nbd_co_send_chunk(req, request->handle, NBD_REPLY_FLAG_DONE,
+                                 NBD_REPLY_TYPE_NONE, NULL, 0, NULL, 0);
+    }
+
+    while (offset < end) {
+        uint32_t state;
+        uint32_t len = nbd_get_extent(exp, offset, end - offset,
+                                      NBD_STATE_ZERO, &state);
+        uint16_t flags = offset + len == end ? NBD_REPLY_FLAG_DONE : 0;
+
+        /* Data/hole chunk
+           [ 0 ..  7]    offset
+           [ 8 .. 11]    length of the hole (hole chunks only)
+         */
+        cpu_to_be64w((uint64_t *)hdr, offset);
+        if (state & NBD_STATE_ZERO) {
+            cpu_to_be32w((uint32_t *)(hdr + 8), len);
+            rc = nbd_co_send_chunk(req, request->handle, flags,
+                                   NBD_REPLY_TYPE_OFFSET_HOLE,
+                                   hdr, sizeof(hdr), NULL, 0);
+        } else {
+            uint8_t *data = req->data + (offset - request->from);
+
+            ret = blk_read(exp->blk,
+                           (offset + exp->dev_offset) / BDRV_SECTOR_SIZE,
+                           data, len / BDRV_SECTOR_SIZE);
+            if (ret < 0) {
+                LOG("reading from file failed");
+                return nbd_co_send_structured_error(req, request->handle,
+                                                    -ret);
+            }
+            rc = nbd_co_send_chunk(req, request->handle, flags,
+                                   NBD_REPLY_TYPE_OFFSET_DATA,
+                                   hdr, 8, data, len);
+        }
+        if (rc < 0) {
+            return rc;
+        }
+        offset += len;
+    }
+
+    TRACE("Read %u byte(s)", request->len);
+    return 0;
+}
+
+static ssize_t nbd_co_send_block_status(NBDRequest *req,
+                                        struct nbd_request *request)
+{
+    NBDExport *exp = req->client->exp;
+    uint64_t offset = request->from;
+    uint64_t end = request->from + request->len;
+    int max_extents = NBD_MAX_BLOCK_STATUS_EXTENTS;
+    int nb_extents = 0;
+    uint8_t *hdr;
+    ssize_t rc;
+
+    if (request->type & NBD_CMD_FLAG_REQ_ONE) {
+        max_extents = 1;
+    }
+
+    /* Block status chunk
+       [ 0 ..  3]    context id
+       followed by one or more extents
+       [ 0 ..  3]    length
+       [ 4 ..  7]    NBD_STATE_* flags
+     */
+    hdr = g_malloc(4 + max_extents * 8);
+    cpu_to_be32w((uint32_t *)hdr, NBD_META_ID_BASE_ALLOCATION);
+
+    while (offset < end && nb_extents < max_extents) {
+        uint8_t *extent = hdr + 4 + nb_extents * 8;
+        uint32_t state;
+        uint32_t len = nbd_get_extent(exp, offset, end - offset,
+                                      NBD_STATE_HOLE | NBD_STATE_ZERO,
+                                      &state);
+
+        cpu_to_be32w((uint32_t *)extent, len);
+        cpu_to_be32w((uint32_t *)(extent + 4), state);
+        nb_extents++;
+        offset += len;
+    }
+
+    rc = nbd_co_send_chunk(req, request->handle, NBD_REPLY_FLAG_DONE,
+                           NBD_REPLY_TYPE_BLOCK_STATUS,
+                           hdr, 4 + nb_extents * 8, NULL, 0);
+    g_free(hdr);
+    return rc;
+}
+
 static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *request)
 {
     NBDClient *client = req->client;
@@ -1226,7 +1813,9 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
         goto out;
     }
 
-    if (request->len > NBD_MAX_BUFFER_SIZE) {
+    command = request->type & NBD_CMD_MASK_COMMAND;
+    if (command != NBD_CMD_BLOCK_STATUS &&
+        request->len > NBD_MAX_BUFFER_SIZE) {
         LOG("len (%u) is larger than max len (%u)",
             request->len, NBD_MAX_BUFFER_SIZE);
         rc = -EINVAL;
@@ -1242,7 +1831,6 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
 
     TRACE("Decoding type");
 
-    command = request->type & NBD_CMD_MASK_COMMAND;
     if (command == NBD_CMD_READ || command == NBD_CMD_WRITE) {
         req->data = blk_blockalign(client->exp->blk, request->len);
     }
@@ -1290,12 +1878,12 @@ static void nbd_trip(void *opaque)
 
     reply.handle = request.handle;
     reply.error = 0;
+    command = request.type & NBD_CMD_MASK_COMMAND;
 
     if (ret < 0) {
         reply.error = -ret;
         goto error_reply;
     }
-    command = request.type & NBD_CMD_MASK_COMMAND;
     if (command != NBD_CMD_DISC && (request.from + request.len) > exp->size) {
             LOG("From: %" PRIu64 ", Len: %u, Size: %" PRIu64
             ", Offset: %" PRIu64 "\n",
@@ -1318,6 +1906,13 @@ static void nbd_trip(void *opaque)
             }
         }
 
+        if (client->structured_reply) {
+            if (nbd_co_send_structured_read(req, &request) < 0) {
+                goto out;
+            }
+            break;
+        }
+
         ret = blk_read(exp->blk,
                        (request.from + exp->dev_offset) / BDRV_SECTOR_SIZE,
                        req->data, request.len / BDRV_SECTOR_SIZE);
@@ -1393,12 +1988,29 @@ static void nbd_trip(void *opaque)
             goto out;
         }
         break;
+    case NBD_CMD_BLOCK_STATUS:
+        TRACE("Request type is BLOCK_STATUS");
+        if (!client->base_allocation || !request.len) {
+            goto invalid_request;
+        }
+        if (nbd_co_send_block_status(req, &request) < 0) {
+            goto out;
+        }
+        break;
     default:
         LOG("invalid request type (%u) received", request.type);
     invalid_request:
         reply.error = EINVAL;
     error_reply:
-        if (nbd_co_send_reply(req, &reply, 0) < 0) {
+        /* Structured replies are mandatory for these commands */
+        if (client->structured_reply &&
+            (command == NBD_CMD_READ || command == NBD_CMD_BLOCK_STATUS)) {
+            ret = nbd_co_send_structured_error(req, reply.handle,
+                                               reply.error);
+        } else {
+            ret = nbd_co_send_reply(req, &reply, 0);
+        }
+        if (ret < 0) {
             goto out;
         }
         break;
@@ -1453,7 +2065,7 @@ static void nbd_unset_handlers(NBDClient *client)
 static void nbd_update_can_read(NBDClient *client)
 {
     bool can_read = client->recv_coroutine ||
-                    client->nb_requests < MAX_NBD_REQUESTS;
+                    client->nb_requests < nbd_client_max_requests(client);
 
     if (can_read != client->can_read) {
         client->can_read = can_read;
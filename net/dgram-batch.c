@@ -0,0 +1,88 @@
+/*
+ * Batched transmission of datagrams with sendmmsg()
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "net/dgram-batch.h"
+
+static void net_dgram_batch_reset(NetDgramBatch *b)
+{
+    b->count = 0;
+    b->sent = 0;
+    b->used = 0;
+}
+
+/* Copy a datagram to the end of the batch.  Returns false if the batch is
+ * full and must be flushed first.
+ */
+bool net_dgram_batch_add(NetDgramBatch *b, const uint8_t *buf, size_t size)
+{
+    if (b->count == NET_DGRAM_BATCH_MAX) {
+        return false;
+    }
+
+    if (b->used + size > b->size) {
+        b->size = MAX(b->size * 2, b->used + size);
+        b->buf = g_realloc(b->buf, b->size);
+    }
+    memcpy(b->buf + b->used, buf, size);
+    b->used += size;
+    b->len[b->count++] = size;
+    return true;
+}
+
+/* Send the queued datagrams to @dst.  Returns -EAGAIN if @send could not
+ * take all of them; the unsent ones are kept for the next call.  Otherwise
+ * the batch is emptied and 0 is returned, also if the datagrams were
+ * dropped because of an error, as sending a single datagram would.
+ */
+int net_dgram_batch_flush(NetDgramBatch *b, NetDgramBatchSend *send,
+                          void *opaque, struct sockaddr *dst,
+                          socklen_t dst_len)
+{
+    struct mmsghdr *mmsg;
+    size_t offset = 0;
+    unsigned int i;
+    int ret;
+
+    /* buf may have moved since the datagrams were added */
+    for (i = 0; i < b->count; i++) {
+        b->iov[i].iov_base = b->buf + offset;
+        b->iov[i].iov_len = b->len[i];
+        offset += b->len[i];
+
+        mmsg = &b->msgs[i];
+        memset(mmsg, 0, sizeof(*mmsg));
+        mmsg->msg_hdr.msg_name = dst;
+        mmsg->msg_hdr.msg_namelen = dst_len;
+        mmsg->msg_hdr.msg_iov = &b->iov[i];
+        mmsg->msg_hdr.msg_iovlen = 1;
+    }
+
+    while (b->sent < b->count) {
+        ret = send(opaque, b->msgs + b->sent, b->count - b->sent);
+        if (ret == -EINTR) {
+            continue;
+        }
+        if (ret == -EAGAIN || ret == 0) {
+            return -EAGAIN;
+        }
+        if (ret < 0) {
+            break;
+        }
+        b->sent += ret;
+    }
+
+    net_dgram_batch_reset(b);
+    return 0;
+}
+
+void net_dgram_batch_cleanup(NetDgramBatch *b)
+{
+    net_dgram_batch_reset(b);
+    g_free(b->buf);
+    b->buf = NULL;
+    b->size = 0;
+}
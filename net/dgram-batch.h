@@ -0,0 +1,40 @@
+/*
+ * Batched transmission of datagrams with sendmmsg()
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_NET_DGRAM_BATCH_H
+#define QEMU_NET_DGRAM_BATCH_H
+
+#include "qemu-common.h"
+#include "qemu/sockets.h"
+
+/* Maximum number of datagrams handed to a single sendmmsg() call */
+#define NET_DGRAM_BATCH_MAX 64
+
+typedef struct NetDgramBatch {
+    unsigned int count;           /* datagrams queued in buf */
+    unsigned int sent;            /* datagrams of the batch already sent */
+    uint8_t *buf;                 /* queued datagrams, back to back */
+    size_t used;
+    size_t size;
+    size_t len[NET_DGRAM_BATCH_MAX];
+    struct mmsghdr msgs[NET_DGRAM_BATCH_MAX];
+    struct iovec iov[NET_DGRAM_BATCH_MAX];
+} NetDgramBatch;
+
+/* Send up to @vlen messages like sendmmsg(); return the number of messages
+ * sent or a negative errno value.
+ */
+typedef int (NetDgramBatchSend)(void *opaque, struct mmsghdr *msgs,
+                                unsigned int vlen);
+
+bool net_dgram_batch_add(NetDgramBatch *b, const uint8_t *buf, size_t size);
+int net_dgram_batch_flush(NetDgramBatch *b, NetDgramBatchSend *send,
+                          void *opaque, struct sockaddr *dst,
+                          socklen_t dst_len);
+void net_dgram_batch_cleanup(NetDgramBatch *b);
+
+#endif
@@ -596,6 +596,8 @@ void qemu_purge_queued_packets(NetClientState *nc)
 static
 void qemu_flush_or_purge_queued_packets(NetClientState *nc, bool purge)
 {
+    bool flushed;
+
     nc->receive_disabled = 0;
 
     if (nc->peer && nc->peer->info->type == NET_CLIENT_OPTIONS_KIND_HUBPORT) {
@@ -603,7 +605,15 @@ void qemu_flush_or_purge_queued_packets(NetClientState *nc, bool purge)
             qemu_notify_event();
         }
     }
-    if (qemu_net_queue_flush(nc->incoming_queue)) {
+    if (nc->info->receive_batch) {
+        nc->info->receive_batch(nc, true);
+    }
+    flushed = qemu_net_queue_flush(nc->incoming_queue);
+    if (nc->info->receive_batch) {
+        nc->info->receive_batch(nc, false);
+    }
+
+    if (flushed) {
         /* We emptied the queue successfully, signal to the IO thread to repoll
          * the file descriptor (for tap, for example).
          */
@@ -648,6 +658,41 @@ ssize_t qemu_send_packet_async(NetClientState *sender,
                                              buf, size, sent_cb);
 }
 
+/* Let the peer of @sender receive a packet straight into its own buffers.
+ * @read_iov is called with those buffers and must read one packet into
+ * them, returning its size.
+ *
+ * Returns the size of the packet, 0 if the peer cannot receive it this way
+ * right now (the caller should then use qemu_send_packet_async()), or a
+ * negative value if @read_iov had nothing to read.
+ */
+ssize_t qemu_send_packet_direct(NetClientState *sender, NetReadIOV *read_iov,
+                                void *opaque)
+{
+    NetClientState *nc = sender->peer;
+
+    if (sender->link_down || !nc || nc->link_down ||
+        !nc->info->receive_direct ||
+        !qemu_net_queue_can_bypass(nc->incoming_queue) ||
+        !qemu_can_send_packet(sender)) {
+        return 0;
+    }
+
+    return nc->info->receive_direct(nc, read_iov, opaque);
+}
+
+/* Bracket a burst of packets sent by @sender, so that the peer can
+ * complete them all at once when the burst ends.
+ */
+void qemu_send_batch(NetClientState *sender, bool begin)
+{
+    NetClientState *nc = sender->peer;
+
+    if (nc && nc->info->receive_batch) {
+        nc->info->receive_batch(nc, begin);
+    }
+}
+
 void qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size)
 {
     qemu_send_packet_async(nc, buf, size, NULL);
@@ -270,3 +270,11 @@ bool qemu_net_queue_flush(NetQueue *queue)
     }
     return true;
 }
+
+/* Return true if a packet can be delivered without going through the queue,
+ * that is if no packets are waiting and no delivery is in progress.
+ */
+bool qemu_net_queue_can_bypass(NetQueue *queue)
+{
+    return !queue->delivering && QTAILQ_EMPTY(&queue->packets);
+}
@@ -32,6 +32,9 @@
 #include "qemu/sockets.h"
 #include "qemu/iov.h"
 #include "qemu/main-loop.h"
+#ifdef CONFIG_SENDMMSG
+#include "net/dgram-batch.h"
+#endif
 
 typedef struct NetSocketState {
     NetClientState nc;
@@ -46,10 +49,17 @@ typedef struct NetSocketState {
     IOHandler *send_fn;           /* differs between SOCK_STREAM/SOCK_DGRAM */
     bool read_poll;               /* waiting to receive data? */
     bool write_poll;              /* waiting to transmit data? */
+#ifdef CONFIG_SENDMMSG
+    int batching;                 /* nesting depth of sender bursts */
+    NetDgramBatch batch;
+#endif
 } NetSocketState;
 
 static void net_socket_accept(void *opaque);
 static void net_socket_writable(void *opaque);
+#ifdef CONFIG_SENDMMSG
+static bool net_socket_batch_flush(NetSocketState *s);
+#endif
 
 static void net_socket_update_fd_handler(NetSocketState *s)
 {
@@ -77,6 +87,11 @@ static void net_socket_writable(void *opaque)
 
     net_socket_write_poll(s, false);
 
+#ifdef CONFIG_SENDMMSG
+    if (s->batch.count && !net_socket_batch_flush(s)) {
+        return;
+    }
+#endif
     qemu_flush_queued_packets(&s->nc);
 }
 
@@ -115,11 +130,75 @@ static ssize_t net_socket_receive(NetClientState *nc, const uint8_t *buf, size_t
     return size;
 }
 
+#ifdef CONFIG_SENDMMSG
+static int net_socket_sendmmsg(void *opaque, struct mmsghdr *msgs,
+                               unsigned int vlen)
+{
+    NetSocketState *s = opaque;
+    int ret;
+
+    ret = sendmmsg(s->fd, msgs, vlen, 0);
+    return ret < 0 ? -errno : ret;
+}
+
+/* Transmit the queued datagrams.  Returns false if the socket is full; the
+ * unsent datagrams are then kept and sent again from net_socket_writable().
+ */
+static bool net_socket_batch_flush(NetSocketState *s)
+{
+    int ret;
+
+    ret = net_dgram_batch_flush(&s->batch, net_socket_sendmmsg, s,
+                                (struct sockaddr *)&s->dgram_dst,
+                                sizeof(s->dgram_dst));
+    if (ret == -EAGAIN) {
+        net_socket_write_poll(s, true);
+        return false;
+    }
+    return true;
+}
+
+/* Datagrams received during a burst are queued and transmitted with a
+ * single sendmmsg() call when the burst ends or the batch is full.
+ */
+static ssize_t net_socket_receive_dgram_batch(NetSocketState *s,
+                                              const uint8_t *buf, size_t size)
+{
+    if (!net_dgram_batch_add(&s->batch, buf, size)) {
+        if (!net_socket_batch_flush(s)) {
+            return 0;
+        }
+        net_dgram_batch_add(&s->batch, buf, size);
+    }
+    return size;
+}
+
+static void net_socket_receive_batch(NetClientState *nc, bool begin)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+
+    s->batching += begin ? 1 : -1;
+    if (!s->batching && s->batch.count) {
+        net_socket_batch_flush(s);
+    }
+}
+#endif
+
 static ssize_t net_socket_receive_dgram(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
     ssize_t ret;
 
+#ifdef CONFIG_SENDMMSG
+    if (s->batch.count && s->write_poll) {
+        /* Keep the order: the last batch is still waiting for the socket */
+        return 0;
+    }
+    if (s->batching && !s->write_poll) {
+        return net_socket_receive_dgram_batch(s, buf, size);
+    }
+#endif
+
     do {
         ret = qemu_sendto(s->fd, buf, size, 0,
                           (struct sockaddr *)&s->dgram_dst,
@@ -332,6 +411,12 @@ fail:
 static void net_socket_cleanup(NetClientState *nc)
 {
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+#ifdef CONFIG_SENDMMSG
+    if (s->batch.count && s->fd != -1) {
+        net_socket_batch_flush(s);
+    }
+    net_dgram_batch_cleanup(&s->batch);
+#endif
     if (s->fd != -1) {
         net_socket_read_poll(s, false);
         net_socket_write_poll(s, false);
@@ -349,6 +434,9 @@ static NetClientInfo net_dgram_socket_info = {
     .type = NET_CLIENT_OPTIONS_KIND_SOCKET,
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive_dgram,
+#ifdef CONFIG_SENDMMSG
+    .receive_batch = net_socket_receive_batch,
+#endif
     .cleanup = net_socket_cleanup,
 };
 
@@ -169,8 +169,33 @@ ssize_t tap_read_packet(int tapfd, uint8_t *buf, int maxlen)
 {
     return read(tapfd, buf, maxlen);
 }
+
+static ssize_t tap_read_iov(void *opaque, const struct iovec *iov, int iovcnt)
+{
+    TAPState *s = opaque;
+    ssize_t len;
+
+    do {
+        len = readv(s->fd, iov, iovcnt);
+    } while (len == -1 && errno == EINTR);
+
+    return len;
+}
 #endif
 
+/* Try to read a packet straight into the buffers of the peer.  This is only
+ * possible if the vnet header, if any, is passed through unmodified.
+ */
+static ssize_t tap_send_direct(TAPState *s)
+{
+#ifndef __sun__
+    if (!s->host_vnet_hdr_len || s->using_vnet_hdr) {
+        return qemu_send_packet_direct(&s->nc, tap_read_iov, s);
+    }
+#endif
+    return 0;
+}
+
 static void tap_send_completed(NetClientState *nc, ssize_t len)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -183,25 +208,34 @@ static void tap_send(void *opaque)
     int size;
     int packets = 0;
 
+    qemu_send_batch(&s->nc, true);
     while (true) {
         uint8_t *buf = s->buf;
 
-        size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
-        if (size <= 0) {
+        size = tap_send_direct(s);
+        if (size < 0) {
             break;
         }
 
-        if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
-            buf  += s->host_vnet_hdr_len;
-            size -= s->host_vnet_hdr_len;
-        }
-
-        size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
         if (size == 0) {
-            tap_read_poll(s, false);
-            break;
-        } else if (size < 0) {
-            break;
+            size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
+            if (size <= 0) {
+                break;
+            }
+
+            if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+                buf  += s->host_vnet_hdr_len;
+                size -= s->host_vnet_hdr_len;
+            }
+
+            size = qemu_send_packet_async(&s->nc, buf, size,
+                                          tap_send_completed);
+            if (size == 0) {
+                tap_read_poll(s, false);
+                break;
+            } else if (size < 0) {
+                break;
+            }
         }
 
         /*
@@ -215,6 +249,7 @@ static void tap_send(void *opaque)
             break;
         }
     }
+    qemu_send_batch(&s->nc, false);
 }
 
 static bool tap_has_ufo(NetClientState *nc)
@@ -19,6 +19,8 @@ typedef struct VhostUserState {
     NetClientState nc;
     CharDriverState *chr;
     VHostNetState *vhost_net;
+    /* features acked by the guest, restored when the backend reconnects */
+    uint64_t acked_features;
 } VhostUserState;
 
 typedef struct VhostUserChardevProps {
@@ -39,37 +41,78 @@ static int vhost_user_running(VhostUserState *s)
     return (s->vhost_net) ? 1 : 0;
 }
 
-static int vhost_user_start(VhostUserState *s)
+static void vhost_user_stop(int queues, NetClientState *ncs[])
 {
-    VhostNetOptions options;
+    VhostUserState *s;
+    int i;
 
-    if (vhost_user_running(s)) {
-        return 0;
+    for (i = 0; i < queues; i++) {
+        assert(ncs[i]->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
+
+        s = DO_UPCAST(VhostUserState, nc, ncs[i]);
+        if (vhost_user_running(s)) {
+            s->acked_features = vhost_net_get_acked_features(s->vhost_net);
+            vhost_net_cleanup(s->vhost_net);
+        }
+        s->vhost_net = 0;
     }
-
-    options.backend_type = VHOST_BACKEND_TYPE_USER;
-    options.net_backend = &s->nc;
-    options.opaque = s->chr;
-
-    s->vhost_net = vhost_net_init(&options);
-
-    return vhost_user_running(s) ? 0 : -1;
 }
 
-static void vhost_user_stop(VhostUserState *s)
+static int vhost_user_start(int queues, NetClientState *ncs[])
 {
-    if (vhost_user_running(s)) {
-        vhost_net_cleanup(s->vhost_net);
+    VhostNetOptions options;
+    VhostUserState *s;
+    uint64_t max_queues;
+    int i;
+
+    options.backend_type = VHOST_BACKEND_TYPE_USER;
+
+    for (i = 0; i < queues; i++) {
+        assert(ncs[i]->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
+
+        s = DO_UPCAST(VhostUserState, nc, ncs[i]);
+        if (vhost_user_running(s)) {
+            continue;
+        }
+
+        options.net_backend = ncs[i];
+        options.opaque = s->chr;
+        s->vhost_net = vhost_net_init(&options);
+        if (!s->vhost_net) {
+            error_report("failed to init vhost_net for queue %d", i);
+            goto err;
+        }
+
+        /* After a reconnect, resume with the features the guest acked */
+        if (s->acked_features) {
+            vhost_net_ack_features(s->vhost_net, s->acked_features);
+        }
+
+        if (i == 0) {
+            max_queues = vhost_net_get_max_queues(s->vhost_net);
+            if (queues > max_queues) {
+                error_report("vhost-user backend supports %" PRIu64
+                             " queue pairs, %d requested", max_queues, queues);
+                goto err;
+            }
+        }
     }
 
-    s->vhost_net = 0;
+    return 0;
+
+err:
+    vhost_user_stop(i + 1, ncs);
+    return -1;
 }
 
 static void vhost_user_cleanup(NetClientState *nc)
 {
     VhostUserState *s = DO_UPCAST(VhostUserState, nc, nc);
 
-    vhost_user_stop(s);
+    vhost_user_stop(1, &nc);
+    if (nc->queue_index == 0) {
+        qemu_chr_add_handlers(s->chr, NULL, NULL, NULL, NULL);
+    }
     qemu_purge_queued_packets(nc);
 }
 
@@ -95,37 +138,60 @@ static NetClientInfo net_vhost_user_info = {
         .has_ufo = vhost_user_has_ufo,
 };
 
-static void net_vhost_link_down(VhostUserState *s, bool link_down)
+static void net_vhost_link_down(int queues, NetClientState *ncs[],
+                                bool link_down)
 {
-    s->nc.link_down = link_down;
+    NetClientState *nc = ncs[0];
+    int i;
 
-    if (s->nc.peer) {
-        s->nc.peer->link_down = link_down;
+    for (i = 0; i < queues; i++) {
+        ncs[i]->link_down = link_down;
+
+        if (ncs[i]->peer) {
+            ncs[i]->peer->link_down = link_down;
+        }
     }
 
-    if (s->nc.info->link_status_changed) {
-        s->nc.info->link_status_changed(&s->nc);
+    /* The frontend tracks the link state of the first queue only */
+    if (nc->info->link_status_changed) {
+        nc->info->link_status_changed(nc);
     }
 
-    if (s->nc.peer && s->nc.peer->info->link_status_changed) {
-        s->nc.peer->info->link_status_changed(s->nc.peer);
+    if (nc->peer && nc->peer->info->link_status_changed) {
+        nc->peer->info->link_status_changed(nc->peer);
     }
 }
 
+/* All queue pairs share the chardev, so the handler is registered once
+ * for the first one and starts or stops all of them.  When the backend
+ * reconnects, the frontend sees the link come back up and restarts
+ * vhost, which sends the memory table and the vring state again.
+ */
 static void net_vhost_user_event(void *opaque, int event)
 {
     VhostUserState *s = opaque;
+    NetClientState *ncs[MAX_QUEUE_NUM];
+    int queues;
+
+    queues = qemu_find_net_clients_except(s->nc.name, ncs,
+                                          NET_CLIENT_OPTIONS_KIND_NIC,
+                                          MAX_QUEUE_NUM);
+    assert(queues > 0 && queues <= MAX_QUEUE_NUM);
 
     switch (event) {
     case CHR_EVENT_OPENED:
-        vhost_user_start(s);
-        net_vhost_link_down(s, false);
-        error_report("chardev \"%s\" went up", s->nc.info_str);
+        if (vhost_user_start(queues, ncs) < 0) {
+            error_report("chardev \"%s\" went up, but vhost-user could not "
+                         "be started", s->chr->label);
+            break;
+        }
+        net_vhost_link_down(queues, ncs, false);
+        error_report("chardev \"%s\" went up", s->chr->label);
         break;
     case CHR_EVENT_CLOSED:
-        net_vhost_link_down(s, true);
-        vhost_user_stop(s);
-        error_report("chardev \"%s\" went down", s->nc.info_str);
+        net_vhost_link_down(queues, ncs, true);
+        vhost_user_stop(queues, ncs);
+        error_report("chardev \"%s\" went down", s->chr->label);
         break;
     }
 }
@@ -134,7 +200,7 @@ static int net_vhost_user_init(NetClientState *peer, const char *device,
                                const char *name, CharDriverState *chr,
                                uint32_t queues)
 {
-    NetClientState *nc;
+    NetClientState *nc, *nc0 = NULL;
     VhostUserState *s;
     int i;
 
@@ -151,8 +217,13 @@ static int net_vhost_user_init(NetClientState *peer, const char *device,
         s->chr = chr;
         s->nc.queue_index = i;
 
-        qemu_chr_add_handlers(s->chr, NULL, NULL, net_vhost_user_event, s);
+        if (!nc0) {
+            nc0 = nc;
+        }
     }
+
+    s = DO_UPCAST(VhostUserState, nc, nc0);
+    qemu_chr_add_handlers(chr, NULL, NULL, net_vhost_user_event, s);
     return 0;
 }
 
@@ -168,6 +239,8 @@ static int net_vhost_chardev_opts(void *opaque,
         props->is_unix = true;
     } else if (strcmp(name, "server") == 0) {
         props->is_server = true;
+    } else if (strcmp(name, "reconnect") == 0) {
+        /* handled by the chardev; net_vhost_user_event restarts vhost */
     } else {
         error_setg(errp,
                    "vhost-user does not support a chardev with option %s=%s",
@@ -254,6 +327,11 @@ int net_init_vhost_user(const NetClientOptions *opts, const char *name,
     } else {
         queues = 1;
     }
+    if (queues < 1 || queues > MAX_QUEUE_NUM) {
+        error_setg(errp, "vhost-user number of queues must be in range "
+                   "[1, %d]", MAX_QUEUE_NUM);
+        return -1;
+    }
 
     return net_vhost_user_init(peer, "vhost_user", name, chr, queues);
 }
@@ -47,6 +47,7 @@ typedef struct img_cmd_t {
 enum {
     OPTION_OUTPUT = 256,
     OPTION_BACKING_CHAIN = 257,
+    OPTION_PATTERN = 258,
 };
 
 typedef enum OutputFormat {
@@ -129,6 +130,10 @@ static void QEMU_NORETURN help(void)
            "  '--output' takes the format in which the output must be done (human or json)\n"
            "  '-n' skips the target volume creation (useful if the volume is created\n"
            "       prior to running qemu-img)\n"
+           "  '-m' number of parallel coroutines for the conversion (1 to 16,\n"
+           "       defaults to 8)\n"
+           "  '-W' allow the target to be written out of order; reduces the time\n"
+           "       waiting for other coroutines, but may fragment the target image\n"
            "\n"
            "Parameters to check subcommand:\n"
            "  '-r' tries to repair any inconsistencies that are found during the check.\n"
@@ -146,7 +151,20 @@ static void QEMU_NORETURN help(void)
            "Parameters to compare subcommand:\n"
            "  '-f' first image format\n"
            "  '-F' second image format\n"
-           "  '-s' run in Strict mode - fail on different image size or sector allocation\n";
+           "  '-s' run in Strict mode - fail on different image size or sector allocation\n"
+           "\n"
+           "Parameters to bench subcommand:\n"
+           "  '-c' number of requests to send (defaults to 75000)\n"
+           "  '-d' number of requests in flight at the same time (defaults to 64)\n"
+           "  '-i' aio mode used to open the image (threads, native or io_uring)\n"
+           "  '-n' bypass the host page cache (same as '-t none')\n"
+           "  '-o' offset of the first request in bytes (defaults to 0)\n"
+           "  '--pattern' byte written by write requests (defaults to 0)\n"
+           "  '-r' issue requests at random offsets aligned to the buffer size\n"
+           "  '-s' size of each request in bytes (defaults to 4k)\n"
+           "  '-S' distance between the offsets of sequential requests (defaults\n"
+           "       to the buffer size)\n"
+           "  '-w' send write requests instead of read requests\n";
 
     printf("%s\nSupported formats:", help_msg);
     bdrv_iterate_format(format_print, NULL);
@@ -1221,6 +1239,8 @@ enum ImgConvertBlockStatus {
     BLK_BACKING_FILE,
 };
 
+#define MAX_COROUTINES 16
+
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
@@ -1228,24 +1248,36 @@ typedef struct ImgConvertState {
     int64_t src_cur_offset;
     int64_t total_sectors;
     int64_t allocated_sectors;
+    int64_t allocated_done;
+    int64_t sector_num;
+    int64_t wr_offs;
     enum ImgConvertBlockStatus status;
     int64_t sector_next_status;
     BlockBackend *target;
     bool has_zero_init;
     bool compressed;
     bool target_has_backing;
+    bool wr_in_order;
     int min_sparse;
     size_t cluster_sectors;
     size_t buf_sectors;
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+    CoMutex lock;
+    int ret;
 } ImgConvertState;
 
-static void convert_select_part(ImgConvertState *s, int64_t sector_num)
+static void convert_select_part(ImgConvertState *s, int64_t sector_num,
+                                int *src_cur, int64_t *src_cur_offset)
 {
-    assert(sector_num >= s->src_cur_offset);
-    while (sector_num - s->src_cur_offset >= s->src_sectors[s->src_cur]) {
-        s->src_cur_offset += s->src_sectors[s->src_cur];
-        s->src_cur++;
-        assert(s->src_cur < s->src_num);
+    *src_cur = 0;
+    *src_cur_offset = 0;
+    while (sector_num - *src_cur_offset >= s->src_sectors[*src_cur]) {
+        *src_cur_offset += s->src_sectors[*src_cur];
+        (*src_cur)++;
+        assert(*src_cur < s->src_num);
     }
 }
 
@@ -1254,7 +1286,7 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
     int64_t ret;
     int n;
 
-    convert_select_part(s, sector_num);
+    convert_select_part(s, sector_num, &s->src_cur, &s->src_cur_offset);
 
     assert(s->total_sectors > sector_num);
     n = MIN(s->total_sectors - sector_num, BDRV_REQUEST_MAX_SECTORS);
@@ -1305,30 +1337,33 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
     return n;
 }
 
-static int convert_read(ImgConvertState *s, int64_t sector_num, int nb_sectors,
-                        uint8_t *buf)
+static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
+                                        int nb_sectors, uint8_t *buf)
 {
     int n;
     int ret;
 
-    if (s->status == BLK_ZERO || s->status == BLK_BACKING_FILE) {
-        return 0;
-    }
-
     assert(nb_sectors <= s->buf_sectors);
     while (nb_sectors > 0) {
         BlockBackend *blk;
-        int64_t bs_sectors;
+        int src_cur;
+        int64_t bs_sectors, src_cur_offset;
+        QEMUIOVector qiov;
+        struct iovec iov;
 
         /* In the case of compression with multiple source files, we can get a
          * nb_sectors that spreads into the next part. So we must be able to
          * read across multiple BDSes for one convert_read() call. */
-        convert_select_part(s, sector_num);
-        blk = s->src[s->src_cur];
-        bs_sectors = s->src_sectors[s->src_cur];
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        blk = s->src[src_cur];
+        bs_sectors = s->src_sectors[src_cur];
+
+        n = MIN(nb_sectors, bs_sectors - (sector_num - src_cur_offset));
+        iov.iov_base = buf;
+        iov.iov_len = n * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&qiov, &iov, 1);
 
-        n = MIN(nb_sectors, bs_sectors - (sector_num - s->src_cur_offset));
-        ret = blk_read(blk, sector_num - s->src_cur_offset, buf, n);
+        ret = blk_co_readv(blk, sector_num - src_cur_offset, n, &qiov);
         if (ret < 0) {
             return ret;
         }
@@ -1341,15 +1376,19 @@ static int convert_read(ImgConvertState *s, int64_t sector_num, int nb_sectors,
     return 0;
 }
 
-static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
-                         const uint8_t *buf)
+static int coroutine_fn convert_co_write(ImgConvertState *s,
+                                         int64_t sector_num, int nb_sectors,
+                                         uint8_t *buf,
+                                         enum ImgConvertBlockStatus status)
 {
     int ret;
 
     while (nb_sectors > 0) {
         int n = nb_sectors;
+        QEMUIOVector qiov;
+        struct iovec iov;
 
-        switch (s->status) {
+        switch (status) {
         case BLK_BACKING_FILE:
             /* If we have a backing file, leave clusters unallocated that are
              * unallocated in the source image, so that the backing file is
@@ -1383,7 +1422,11 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
             if (!s->min_sparse ||
                 is_allocated_sectors_min(buf, n, &n, s->min_sparse))
             {
-                ret = blk_write(s->target, sector_num, buf, n);
+                iov.iov_base = buf;
+                iov.iov_len = n * BDRV_SECTOR_SIZE;
+                qemu_iovec_init_external(&qiov, &iov, 1);
+
+                ret = blk_co_writev(s->target, sector_num, n, &qiov);
                 if (ret < 0) {
                     return ret;
                 }
@@ -1395,7 +1438,7 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
             if (s->has_zero_init) {
                 break;
             }
-            ret = blk_write_zeroes(s->target, sector_num, n, 0);
+            ret = blk_co_write_zeroes(s->target, sector_num, n, 0);
             if (ret < 0) {
                 return ret;
             }
@@ -1410,11 +1453,109 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
     return 0;
 }
 
-static int convert_do_copy(ImgConvertState *s)
+/* Each coroutine repeatedly takes the next chunk of the source, reads it and
+ * writes it.  Reads always run in parallel; writes too unless the target must
+ * be written in order, in which case a coroutine waits until the chunk before
+ * its own has been written.
+ */
+static void coroutine_fn convert_co_do_copy(void *opaque)
 {
+    ImgConvertState *s = opaque;
     uint8_t *buf = NULL;
-    int64_t sector_num, allocated_done;
-    int ret;
+    int ret, i;
+    int index = -1;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    s->running_coroutines++;
+    buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    while (1) {
+        int n;
+        int64_t sector_num;
+        enum ImgConvertBlockStatus status;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        n = convert_iteration_sectors(s, s->sector_num);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            s->ret = n;
+            break;
+        }
+        /* Save the chunk and its status, and let the other coroutines go on
+         * with the next chunks */
+        sector_num = s->sector_num;
+        status = s->status;
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (status == BLK_DATA) {
+            s->allocated_done += n;
+            qemu_progress_print(100.0 * s->allocated_done /
+                                s->allocated_sectors, 0);
+
+            ret = convert_co_read(s, sector_num, n, buf);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                s->ret = ret;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* keep writes in order */
+            while (s->wr_offs != sector_num && s->ret == -EINPROGRESS) {
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[index] = -1;
+        }
+
+        if (s->ret == -EINPROGRESS) {
+            ret = convert_co_write(s, sector_num, n, buf, status);
+            if (ret < 0) {
+                error_report("error while writing sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                s->ret = ret;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* Wake up the coroutine that waits for this write, if any.  It
+             * cannot be the current one, whose wait_sector_num is -1.  */
+            s->wr_offs = sector_num + n;
+            for (i = 0; i < s->num_coroutines; i++) {
+                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+                    qemu_coroutine_enter(s->co[i], NULL);
+                    break;
+                }
+            }
+        }
+    }
+
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
+        /* the convert job finished successfully */
+        s->ret = 0;
+    }
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    int64_t sector_num;
+    int ret, i;
     int n;
 
     /* Check whether we have zero initialisation or can get it efficiently */
@@ -1436,12 +1577,10 @@ static int convert_do_copy(ImgConvertState *s)
     if (s->compressed) {
         if (s->cluster_sectors <= 0 || s->cluster_sectors > s->buf_sectors) {
             error_report("invalid cluster size");
-            ret = -EINVAL;
-            goto fail;
+            return -EINVAL;
         }
         s->buf_sectors = s->cluster_sectors;
     }
-    buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
 
     /* Calculate allocated sectors for progress */
     s->allocated_sectors = 0;
@@ -1449,8 +1588,7 @@ static int convert_do_copy(ImgConvertState *s)
     while (sector_num < s->total_sectors) {
         n = convert_iteration_sectors(s, sector_num);
         if (n < 0) {
-            ret = n;
-            goto fail;
+            return n;
         }
         if (s->status == BLK_DATA) {
             s->allocated_sectors += n;
@@ -1459,54 +1597,32 @@ static int convert_do_copy(ImgConvertState *s)
     }
 
     /* Do the copy */
-    s->src_cur = 0;
-    s->src_cur_offset = 0;
     s->sector_next_status = 0;
+    s->sector_num = 0;
+    s->allocated_done = 0;
+    s->wr_offs = 0;
+    s->ret = -EINPROGRESS;
 
-    sector_num = 0;
-    allocated_done = 0;
-
-    while (sector_num < s->total_sectors) {
-        n = convert_iteration_sectors(s, sector_num);
-        if (n < 0) {
-            ret = n;
-            goto fail;
-        }
-        if (s->status == BLK_DATA) {
-            allocated_done += n;
-            qemu_progress_print(100.0 * allocated_done / s->allocated_sectors,
-                                0);
-        }
-
-        ret = convert_read(s, sector_num, n, buf);
-        if (ret < 0) {
-            error_report("error while reading sector %" PRId64
-                         ": %s", sector_num, strerror(-ret));
-            goto fail;
-        }
-
-        ret = convert_write(s, sector_num, n, buf);
-        if (ret < 0) {
-            error_report("error while writing sector %" PRId64
-                         ": %s", sector_num, strerror(-ret));
-            goto fail;
-        }
+    qemu_co_mutex_init(&s->lock);
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+        s->wait_sector_num[i] = -1;
+        qemu_coroutine_enter(s->co[i], s);
+    }
 
-        sector_num += n;
+    while (s->running_coroutines) {
+        aio_poll(blk_get_aio_context(s->target), true);
     }
 
-    if (s->compressed) {
+    if (s->ret == 0 && s->compressed) {
         /* signal EOF to align */
         ret = blk_write_compressed(s->target, 0, NULL, 0);
         if (ret < 0) {
-            goto fail;
+            return ret;
         }
     }
 
-    ret = 0;
-fail:
-    qemu_vfree(buf);
-    return ret;
+    return s->ret;
 }
 
 static int img_convert(int argc, char **argv)
@@ -1532,6 +1648,9 @@ static int img_convert(int argc, char **argv)
     Error *local_err = NULL;
     QemuOpts *sn_opts = NULL;
     ImgConvertState state;
+    bool wr_in_order = true;
+    long num_coroutines = 8;
+    int64_t start_time = 0;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -1541,7 +1660,7 @@ static int img_convert(int argc, char **argv)
     compress = 0;
     skip_create = 0;
     for(;;) {
-        c = getopt(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qn");
+        c = getopt(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qnm:W");
         if (c == -1) {
             break;
         }
@@ -1632,6 +1751,23 @@ static int img_convert(int argc, char **argv)
         case 'n':
             skip_create = 1;
             break;
+        case 'm':
+        {
+            char *end;
+            errno = 0;
+            num_coroutines = strtol(optarg, &end, 10);
+            if (errno || *end || num_coroutines < 1 ||
+                num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d", MAX_COROUTINES);
+                ret = -1;
+                goto fail_getopt;
+            }
+            break;
+        }
+        case 'W':
+            wr_in_order = false;
+            break;
         }
     }
 
@@ -1876,7 +2012,10 @@ static int img_convert(int argc, char **argv)
         .min_sparse         = min_sparse,
         .cluster_sectors    = cluster_sectors,
         .buf_sectors        = bufsectors,
+        .wr_in_order        = wr_in_order,
+        .num_coroutines     = num_coroutines,
     };
+    start_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     ret = convert_do_copy(&state);
 
 out:
@@ -1884,6 +2023,15 @@ out:
         qemu_progress_print(100, 0);
     }
     qemu_progress_end();
+    if (!ret && progress && start_time) {
+        double secs = (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_time) /
+                      1e9;
+        double mib = (double)state.allocated_sectors * BDRV_SECTOR_SIZE /
+                     (1024 * 1024);
+
+        printf("Copied %.1f MiB in %.3f s (%.1f MiB/s)\n",
+               mib, secs, secs > 0 ? mib / secs : 0);
+    }
     qemu_opts_del(opts);
     qemu_opts_free(create_opts);
     qemu_opts_del(sn_opts);
@@ -3042,6 +3190,379 @@ out:
     return 0;
 }
 
+typedef struct BenchData BenchData;
+
+typedef struct BenchRequest {
+    BenchData *b;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int64_t start;
+} BenchRequest;
+
+struct BenchData {
+    BlockBackend *blk;
+    uint64_t image_size;
+    bool write;
+    bool random;
+    int bufsize;
+    int step;
+    int nrreq;
+    int count;
+    int n_issued;
+    int n_done;
+    uint64_t offset;
+    uint64_t start_offset;
+    uint8_t *buf;
+    BenchRequest *reqs;
+    int64_t *latency;
+    GRand *rand;
+};
+
+static uint64_t bench_next_offset(BenchData *b)
+{
+    uint64_t offset;
+
+    if (b->random) {
+        uint64_t blocks = (b->image_size - b->start_offset) / b->bufsize;
+        uint64_t r = ((uint64_t)g_rand_int(b->rand) << 32) |
+                     g_rand_int(b->rand);
+
+        return b->start_offset + (r % blocks) * b->bufsize;
+    }
+
+    offset = b->offset;
+    b->offset += b->step;
+    if (b->offset + b->bufsize > b->image_size) {
+        b->offset = b->start_offset;
+    }
+    return offset;
+}
+
+static void bench_cb(void *opaque, int ret);
+
+static void bench_submit(BenchRequest *req)
+{
+    BenchData *b = req->b;
+    int64_t sector_num = bench_next_offset(b) >> BDRV_SECTOR_BITS;
+    int nb_sectors = b->bufsize >> BDRV_SECTOR_BITS;
+    BlockAIOCB *acb;
+
+    b->n_issued++;
+    req->start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    if (b->write) {
+        acb = blk_aio_writev(b->blk, sector_num, &req->qiov, nb_sectors,
+                             bench_cb, req);
+    } else {
+        acb = blk_aio_readv(b->blk, sector_num, &req->qiov, nb_sectors,
+                            bench_cb, req);
+    }
+    if (!acb) {
+        error_report("Failed to issue request");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void bench_cb(void *opaque, int ret)
+{
+    BenchRequest *req = opaque;
+    BenchData *b = req->b;
+
+    if (ret < 0) {
+        error_report("Failed request: %s", strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+
+    b->latency[b->n_done++] = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                              req->start;
+    if (b->n_issued < b->count) {
+        bench_submit(req);
+    }
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Latency of the request at the given percentile, in microseconds */
+static double bench_percentile(BenchData *b, double percentile)
+{
+    int i = (int)(percentile / 100 * b->count);
+
+    return b->latency[MIN(i, b->count - 1)] / 1000.0;
+}
+
+static int img_bench(int argc, char **argv)
+{
+    int c, ret = 0;
+    const char *fmt = NULL, *filename;
+    bool quiet = false;
+    bool is_write = false;
+    bool random = false;
+    int count = 75000;
+    int depth = 64;
+    int64_t offset = 0;
+    size_t bufsize = 4096;
+    int pattern = 0;
+    size_t step = 0;
+    size_t buf_size;
+    int flags = 0;
+    bool seen_cache = false;
+    BlockBackend *blk = NULL;
+    BenchData data = {};
+    int64_t image_size, start, total = 0;
+    double duration;
+    int i;
+
+    for (;;) {
+        static const struct option long_options[] = {
+            {"help", no_argument, 0, 'h'},
+            {"pattern", required_argument, 0, OPTION_PATTERN},
+            {0, 0, 0, 0}
+        };
+        c = getopt_long(argc, argv, "hc:d:f:i:no:qrs:S:t:w", long_options,
+                        NULL);
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+        case 'h':
+        case '?':
+            help();
+            break;
+        case 'c':
+        {
+            unsigned long val;
+            char *end;
+            errno = 0;
+            val = strtoul(optarg, &end, 0);
+            if (errno || *end || val == 0 || val > INT_MAX) {
+                error_report("Invalid request count specified");
+                return 1;
+            }
+            count = val;
+            break;
+        }
+        case 'd':
+        {
+            unsigned long val;
+            char *end;
+            errno = 0;
+            val = strtoul(optarg, &end, 0);
+            if (errno || *end || val == 0 || val > INT_MAX) {
+                error_report("Invalid queue depth specified");
+                return 1;
+            }
+            depth = val;
+            break;
+        }
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'i':
+            if (bdrv_parse_aio(optarg, &flags) < 0) {
+                error_report("Invalid aio option: %s", optarg);
+                return 1;
+            }
+            break;
+        case 'n':
+            flags |= BDRV_O_NOCACHE;
+            break;
+        case 'o':
+        {
+            char *end;
+            offset = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (offset < 0 || *end) {
+                error_report("Invalid offset specified");
+                return 1;
+            }
+            break;
+        }
+        case 'q':
+            quiet = true;
+            break;
+        case 'r':
+            random = true;
+            break;
+        case 's':
+        {
+            int64_t sval;
+            char *end;
+
+            sval = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (sval <= 0 || sval > INT_MAX || *end) {
+                error_report("Invalid buffer size specified");
+                return 1;
+            }
+
+            bufsize = sval;
+            break;
+        }
+        case 'S':
+        {
+            int64_t sval;
+            char *end;
+
+            sval = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (sval <= 0 || sval > INT_MAX || *end) {
+                error_report("Invalid step size specified");
+                return 1;
+            }
+
+            step = sval;
+            break;
+        }
+        case 't':
+            if (bdrv_parse_cache_flags(optarg, &flags) < 0) {
+                error_report("Invalid cache mode");
+                return 1;
+            }
+            seen_cache = true;
+            break;
+        case 'w':
+            flags |= BDRV_O_RDWR;
+            is_write = true;
+            break;
+        case OPTION_PATTERN:
+        {
+            unsigned long val;
+            char *end;
+            errno = 0;
+            val = strtoul(optarg, &end, 0);
+            if (errno || *end || val > 0xff) {
+                error_report("Invalid pattern byte specified");
+                return 1;
+            }
+            pattern = val;
+            break;
+        }
+        }
+    }
+
+    if (optind != argc - 1) {
+        error_exit("Expecting one image file name");
+    }
+    filename = argv[argc - 1];
+
+    if (!seen_cache) {
+        flags |= BDRV_O_FLAGS;
+    }
+
+    if ((offset | bufsize | step) & (BDRV_SECTOR_SIZE - 1)) {
+        error_report("Offset, buffer size and step size must be multiples "
+                     "of %d", (int)BDRV_SECTOR_SIZE);
+        return 1;
+    }
+    if (random && step) {
+        error_report("A step size cannot be used with random offsets");
+        return 1;
+    }
+    if (MIN(depth, count) > SIZE_MAX / bufsize) {
+        error_report("Buffer size and queue depth are too large");
+        return 1;
+    }
+
+    blk = img_open("image", filename, fmt, flags, true, quiet);
+    if (!blk) {
+        ret = -1;
+        goto out;
+    }
+
+    image_size = blk_getlength(blk);
+    if (image_size < 0) {
+        ret = image_size;
+        goto out;
+    }
+    if (offset + bufsize > image_size) {
+        error_report("The image is too small for the requests");
+        ret = -1;
+        goto out;
+    }
+
+    data = (BenchData) {
+        .blk            = blk,
+        .image_size     = image_size,
+        .bufsize        = bufsize,
+        .step           = step ?: bufsize,
+        .nrreq          = MIN(depth, count),
+        .count          = count,
+        .offset         = offset,
+        .start_offset   = offset,
+        .write          = is_write,
+        .random         = random,
+    };
+    qprintf(quiet, "Sending %d %s requests, %d bytes each, %d in parallel "
+            "(starting at offset %" PRId64 ", %s)\n",
+            data.count, data.write ? "write" : "read",
+            data.bufsize, data.nrreq, offset,
+            data.random ? "random offsets" : "sequential");
+    if (!data.random) {
+        qprintf(quiet, "Step size: %d bytes\n", data.step);
+    }
+
+    buf_size = (size_t)data.nrreq * data.bufsize;
+    data.buf = qemu_try_blockalign(blk_bs(blk), buf_size);
+    if (!data.buf) {
+        error_report("Could not allocate %zu bytes for the buffers", buf_size);
+        ret = -1;
+        goto out;
+    }
+    memset(data.buf, pattern, buf_size);
+    data.reqs = g_new0(BenchRequest, data.nrreq);
+    data.latency = g_new(int64_t, data.count);
+    data.rand = g_rand_new_with_seed(0);
+
+    start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    for (i = 0; i < data.nrreq; i++) {
+        BenchRequest *req = &data.reqs[i];
+
+        req->b = &data;
+        req->iov.iov_base = data.buf + (size_t)i * data.bufsize;
+        req->iov.iov_len = data.bufsize;
+        qemu_iovec_init_external(&req->qiov, &req->iov, 1);
+        bench_submit(req);
+    }
+
+    while (data.n_done < data.count) {
+        aio_poll(blk_get_aio_context(blk), true);
+    }
+    duration = (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start) / 1e9;
+
+    qsort(data.latency, data.count, sizeof(data.latency[0]), compare_int64);
+    for (i = 0; i < data.count; i++) {
+        total += data.latency[i];
+    }
+
+    qprintf(quiet, "Run completed in %3.3f seconds.\n", duration);
+    qprintf(quiet, "IOPS: %.0f, bandwidth: %.2f MiB/s\n",
+            data.count / duration,
+            (double)data.count * data.bufsize / duration / (1024 * 1024));
+    qprintf(quiet, "Latency (us): min %.1f, avg %.1f, 50%% %.1f, 90%% %.1f, "
+            "99%% %.1f, 99.9%% %.1f, max %.1f\n",
+            data.latency[0] / 1000.0, (double)total / data.count / 1000.0,
+            bench_percentile(&data, 50), bench_percentile(&data, 90),
+            bench_percentile(&data, 99), bench_percentile(&data, 99.9),
+            data.latency[data.count - 1] / 1000.0);
+
+out:
+    if (data.rand) {
+        g_rand_free(data.rand);
+    }
+    g_free(data.latency);
+    g_free(data.reqs);
+    qemu_vfree(data.buf);
+    blk_unref(blk);
+
+    if (ret) {
+        return 1;
+    }
+    return 0;
+}
+
 static const img_cmd_t img_cmds[] = {
 #define DEF(option, callback, arg_string)        \
     { option, callback },
@@ -45,11 +45,13 @@
 #define QEMU_NBD_OPT_AIO           2
 #define QEMU_NBD_OPT_DISCARD       3
 #define QEMU_NBD_OPT_DETECT_ZEROES 4
+#define QEMU_NBD_OPT_QUEUE_DEPTH   5
 
 static NBDExport *exp;
 static int verbose;
 static char *srcpath;
 static char *sockpath;
+static const char *export_name;
 static int persistent = 0;
 static enum { RUNNING, TERMINATE, TERMINATING, TERMINATED } state;
 static int shared = 1;
@@ -70,9 +72,12 @@ static void usage(const char *name)
 "  -b, --bind=IFACE          interface to bind to (default `0.0.0.0')\n"
 "  -k, --socket=PATH         path to the unix socket\n"
 "                            (default '"SOCKET_PATH"')\n"
+"  -x, --export-name=NAME    expose the export by name (newstyle protocol)\n"
 "  -e, --shared=NUM          device can be shared by NUM clients (default '1')\n"
 "  -t, --persistent          don't exit on the last connection\n"
 "  -v, --verbose             display extra debugging information\n"
+"      --queue-depth=NUM     serve up to NUM requests per client in parallel\n"
+"                            (default '%d')\n"
 "\n"
 "Exposing part of the image:\n"
 "  -o, --offset=OFFSET       offset into the image\n"
@@ -98,14 +103,14 @@ static void usage(const char *name)
 "                            '[ID_OR_NAME]'\n"
 "  -n, --nocache             disable host cache\n"
 "      --cache=MODE          set cache mode (none, writeback, ...)\n"
-#ifdef CONFIG_LINUX_AIO
-"      --aio=MODE            set AIO mode (native or threads)\n"
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
+"      --aio=MODE            set AIO mode (native, io_uring or threads)\n"
 #endif
 "      --discard=MODE        set discard mode (ignore, unmap)\n"
 "      --detect-zeroes=MODE  set detect-zeroes mode (off, on, discard)\n"
 "\n"
 "Report bugs to <qemu-devel@nongnu.org>\n"
-    , name, NBD_DEFAULT_PORT, "DEVICE");
+    , name, NBD_DEFAULT_PORT, "DEVICE", NBD_DEFAULT_MAX_REQUESTS);
 }
 
 static void version(const char *name)
@@ -292,8 +297,8 @@ static void *nbd_client_thread(void *arg)
         goto out;
     }
 
-    ret = nbd_receive_negotiate(sock, NULL, &nbdflags,
-                                &size, &local_error);
+    ret = nbd_receive_negotiate(sock, export_name, &nbdflags,
+                                &size, NULL, &local_error);
     if (ret < 0) {
         if (local_error) {
             fprintf(stderr, "%s\n", error_get_pretty(local_error));
@@ -382,7 +387,8 @@ static void nbd_accept(void *opaque)
         return;
     }
 
-    if (nbd_client_new(exp, fd, nbd_client_closed)) {
+    /* Named exports are looked up during negotiation */
+    if (nbd_client_new(export_name ? NULL : exp, fd, nbd_client_closed)) {
         nb_fds++;
         nbd_update_server_fd_handler(server_fd);
     } else {
@@ -413,13 +419,14 @@ int main(int argc, char **argv)
     off_t fd_size;
     QemuOpts *sn_opts = NULL;
     const char *sn_id_or_name = NULL;
-    const char *sopt = "hVb:o:p:rsnP:c:dvk:e:f:tl:";
+    const char *sopt = "hVb:o:p:rsnP:c:dvk:e:f:tl:x:";
     struct option lopt[] = {
         { "help", 0, NULL, 'h' },
         { "version", 0, NULL, 'V' },
         { "bind", 1, NULL, 'b' },
         { "port", 1, NULL, 'p' },
         { "socket", 1, NULL, 'k' },
+        { "export-name", 1, NULL, 'x' },
         { "offset", 1, NULL, 'o' },
         { "read-only", 0, NULL, 'r' },
         { "partition", 1, NULL, 'P' },
@@ -429,7 +436,7 @@ int main(int argc, char **argv)
         { "load-snapshot", 1, NULL, 'l' },
         { "nocache", 0, NULL, 'n' },
         { "cache", 1, NULL, QEMU_NBD_OPT_CACHE },
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
         { "aio", 1, NULL, QEMU_NBD_OPT_AIO },
 #endif
         { "discard", 1, NULL, QEMU_NBD_OPT_DISCARD },
@@ -438,6 +445,7 @@ int main(int argc, char **argv)
         { "format", 1, NULL, 'f' },
         { "persistent", 0, NULL, 't' },
         { "verbose", 0, NULL, 'v' },
+        { "queue-depth", 1, NULL, QEMU_NBD_OPT_QUEUE_DEPTH },
         { NULL, 0, NULL, 0 }
     };
     int ch;
@@ -446,6 +454,7 @@ int main(int argc, char **argv)
     char *end;
     int flags = BDRV_O_RDWR;
     int partition = -1;
+    int queue_depth = NBD_DEFAULT_MAX_REQUESTS;
     int ret = 0;
     int fd;
     bool seen_cache = false;
@@ -485,18 +494,14 @@ int main(int argc, char **argv)
                 errx(EXIT_FAILURE, "Invalid cache mode `%s'", optarg);
             }
             break;
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
         case QEMU_NBD_OPT_AIO:
             if (seen_aio) {
                 errx(EXIT_FAILURE, "--aio can only be specified once");
             }
             seen_aio = true;
-            if (!strcmp(optarg, "native")) {
-                flags |= BDRV_O_NATIVE_AIO;
-            } else if (!strcmp(optarg, "threads")) {
-                /* this is the default */
-            } else {
-               errx(EXIT_FAILURE, "invalid aio mode `%s'", optarg);
+            if (bdrv_parse_aio(optarg, &flags) < 0) {
+                errx(EXIT_FAILURE, "invalid aio mode `%s'", optarg);
             }
             break;
 #endif
@@ -526,6 +531,16 @@ int main(int argc, char **argv)
                                    "without setting discard operation to unmap"); 
             }
             break;
+        case QEMU_NBD_OPT_QUEUE_DEPTH:
+            queue_depth = strtol(optarg, &end, 0);
+            if (*end) {
+                errx(EXIT_FAILURE, "Invalid queue depth `%s'", optarg);
+            }
+            if (queue_depth < 1 || queue_depth > NBD_MAX_REQUESTS_LIMIT) {
+                errx(EXIT_FAILURE, "Queue depth must be between 1 and %d",
+                     NBD_MAX_REQUESTS_LIMIT);
+            }
+            break;
         case 'b':
             bindto = optarg;
             break;
@@ -579,6 +594,9 @@ int main(int argc, char **argv)
                 errx(EXIT_FAILURE, "socket path must be absolute\n");
             }
             break;
+        case 'x':
+            export_name = optarg;
+            break;
         case 'd':
             disconnect = true;
             break;
@@ -747,11 +765,22 @@ int main(int argc, char **argv)
         }
     }
 
+    if (shared > 1) {
+        /* All clients share one BlockBackend, so a flush from any of them
+         * also covers the writes completed on the other connections.
+         */
+        nbdflags |= NBD_FLAG_CAN_MULTI_CONN;
+    }
+
     exp = nbd_export_new(blk, dev_offset, fd_size, nbdflags, nbd_export_closed,
                          &local_err);
     if (!exp) {
         errx(EXIT_FAILURE, "%s", error_get_pretty(local_err));
     }
+    nbd_export_set_max_requests(exp, queue_depth);
+    if (export_name) {
+        nbd_export_set_name(exp, export_name);
+    }
 
     if (sockpath) {
         fd = unix_socket_incoming(sockpath);
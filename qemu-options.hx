@@ -461,9 +461,14 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,rerror=ignore|stop|report]\n"
-    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native]\n"
+    "       [,werror=ignore|stop|report|enospc][,id=name]\n"
+    "       [,aio=threads|native|io_uring]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
+    "       [,copy-on-read-background=on|off][,copy-on-read-prefetch=n]\n"
     "       [,discard=ignore|unmap][,detect-zeroes=on|off|unmap]\n"
+    "       [,merge-requests=on|off][,merge-window=us]\n"
+    "       [,stats-account-invalid=on|off][,stats-account-failed=on|off]\n"
+    "       [,stats-intervals=n[:n...]]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]]\n"
     "       [[,iops=i]|[[,iops_rd=r][,iops_wr=w]]]\n"
     "       [[,bps_max=bm]|[[,bps_rd_max=rm][,bps_wr_max=wm]]]\n"
@@ -504,7 +509,7 @@ These options have the same definition as they have in @option{-hdachs}.
 @item cache=@var{cache}
 @var{cache} is "none", "writeback", "unsafe", "directsync" or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native" or "io_uring" and selects between pthread based disk I/O, native Linux AIO and Linux io_uring.
 @item discard=@var{discard}
 @var{discard} is one of "ignore" (or "off") or "unmap" (or "on") and controls whether @dfn{discard} (also known as @dfn{trim} or @dfn{unmap}) requests are ignored or passed to the filesystem.  Some machine types may not support discard requests.
 @item format=@var{format}
@@ -526,11 +531,43 @@ Open drive @option{file} as read-only. Guest write attempts will fail.
 @item copy-on-read=@var{copy-on-read}
 @var{copy-on-read} is "on" or "off" and enables whether to copy read backing
 file sectors into the image file.
+@item copy-on-read-background=@var{copy-on-read-background}
+@var{copy-on-read-background} is "on" or "off" (the default).  If "on", reads
+complete as soon as the data has been read from the backing file, and the
+data is written to the image file in the background.  This only has an
+effect with @option{copy-on-read=on}.
+@item copy-on-read-prefetch=@var{copy-on-read-prefetch}
+@var{copy-on-read-prefetch} is the number of clusters following a sequential
+read that are copied to the image file in the background, up to 256.  The
+default is 0.  This requires @option{copy-on-read-background=on}.
 @item detect-zeroes=@var{detect-zeroes}
 @var{detect-zeroes} is "off", "on" or "unmap" and enables the automatic
 conversion of plain zero writes by the OS to driver specific optimized
 zero write commands. You may even choose "unmap" if @var{discard} is set
 to "unmap" to allow a zero write to be converted to an UNMAP operation.
+@item merge-requests=@var{merge-requests}
+@var{merge-requests} is "on" or "off" (the default) and enables coalescing of
+adjacent read or write requests into a single request, independent of the
+device model.  Merged requests are counted in @code{query-blockstats}.
+@item merge-window=@var{merge-window}
+@var{merge-window} is the time, in microseconds, that a request waits for
+adjacent requests to merge with.  The default is 0, in which case only requests
+that are submitted before QEMU returns to its event loop are merged.
+@item stats-account-invalid=@var{stats-account-invalid}
+@var{stats-account-invalid} is "on" (the default) or "off" and selects whether
+requests rejected by the device model as invalid, for example because they are
+out of range, count as an access for the idle time reported by
+@code{query-blockstats}.  Invalid requests are always counted.
+@item stats-account-failed=@var{stats-account-failed}
+@var{stats-account-failed} is "on" (the default) or "off" and selects whether
+requests that failed are included in the latency statistics and histograms.
+Failed requests are always counted.
+@item stats-intervals=@var{stats-intervals}
+@var{stats-intervals} is a colon-separated list of interval lengths, in
+seconds, for example "1:60:3600".  For each interval, @code{query-blockstats}
+reports the minimum, maximum and average latency and the average queue depth
+of the requests that completed in roughly the last @var{n} seconds.  By
+default no interval is tracked.
 @end table
 
 By default, the @option{cache=writeback} mode is used. It will report data
@@ -1548,7 +1585,7 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                VALE port (created on the fly) called 'name' ('nmname' is name of the \n"
     "                netmap device, defaults to '/dev/netmap')\n"
 #endif
-    "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off]\n"
+    "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off][,queues=n]\n"
     "                configure a vhost-user network, backed by a chardev 'dev'\n"
     "-netdev hubport,id=str,hubid=n\n"
     "                configure a hub port on QEMU VLAN 'n'\n", QEMU_ARCH_ALL)
@@ -1970,7 +2007,13 @@ be a unix domain socket backed one. The vhost-user uses a specifically defined
 protocol to pass vhost ioctl replacement messages to an application on the other
 end of the socket. On non-MSIX guests, the feature can be forced with
 @var{vhostforce}. Use 'queues=@var{n}' to specify the number of queues to
-be created for multiqueue vhost-user.
+be created for multiqueue vhost-user; the application must support at least
+@var{n} queue pairs.
+
+If the application disconnects, the link goes down until it connects again,
+at which point the device state is sent to it again. With a client chardev,
+use the @option{reconnect} option of the chardev so that QEMU retries the
+connection.
 
 Example:
 @example
@@ -2348,6 +2391,14 @@ Example for Unix Domain Sockets
 qemu-system-i386 --drive file=nbd:unix:/tmp/nbd-socket
 @end example
 
+The @option{file.queue-depth} option sets how many requests can be in flight
+on a connection (default 16).  If the server allows it, the
+@option{file.connections} option spreads requests across several connections
+to the same export (default 1):
+@example
+qemu-system-i386 --drive file=nbd:unix:/tmp/nbd-socket,file.connections=4
+@end example
+
 @item SSH
 QEMU supports SSH (Secure Shell) access to remote disks.
 
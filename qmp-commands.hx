@@ -1309,7 +1309,7 @@ EQMP
 
     {
         .name       = "block-dirty-bitmap-add",
-        .args_type  = "node:B,name:s,granularity:i?",
+        .args_type  = "node:B,name:s,granularity:i?,persistent:b?",
         .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_add,
     },
 
@@ -1326,6 +1326,8 @@ Arguments:
 - "node": device/node on which to create dirty bitmap (json-string)
 - "name": name of the new dirty bitmap (json-string)
 - "granularity": granularity to track writes with (int, optional)
+- "persistent": bitmap will be saved to the image on close and loaded again
+                when the image is opened (json-bool, optional, default false)
 
 Example:
 
@@ -1503,7 +1505,7 @@ EQMP
         .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
                       "node-name:s?,replaces:s?,"
                       "on-source-error:s?,on-target-error:s?,"
-                      "granularity:i?,buf-size:i?",
+                      "granularity:i?,buf-size:i?,copy-mode:s?",
         .mhandler.cmd_new = qmp_marshal_input_drive_mirror,
     },
 
@@ -1542,6 +1544,9 @@ Arguments:
   (BlockdevOnError, default 'report')
 - "on-target-error": the action to take on an error on the target
   (BlockdevOnError, default 'report')
+- "copy-mode": when to copy data to the target; "write-blocking" also copies
+  guest writes synchronously, so that the job converges regardless of the
+  guest's write rate (MirrorCopyMode, default 'background')
 
 The default value of the granularity is the image cluster size clamped
 between 4096 and 65536, if the image format defines one.  If the format
@@ -2459,6 +2464,63 @@ Each json-object contain the following:
                    another request (json-int)
     - "wr_merged": number of write requests that have been merged into
                    another request (json-int)
+    - "idle_time_ns": time since the last I/O operation, in
+                      nanoseconds. If the field is absent it means
+                      that there haven't been any operations yet
+                      (json-int, optional)
+    - "failed_rd_operations": number of failed reads (json-int)
+    - "failed_wr_operations": number of failed writes (json-int)
+    - "failed_flush_operations": number of failed flushes (json-int)
+    - "invalid_rd_operations": number of invalid reads (json-int)
+    - "invalid_wr_operations": number of invalid writes (json-int)
+    - "invalid_flush_operations": number of invalid flushes (json-int)
+    - "account_invalid": whether invalid operations are included in
+                         the last access statistics (json-bool)
+    - "account_failed": whether failed operations are included in the
+                         latency and last access statistics
+                         (json-bool)
+    - "timed_stats": A json-array containing statistics collected in
+                     specific intervals, with the following members:
+        - "interval_length": interval used for calculating the
+                             statistics, in seconds (json-int)
+        - "min_rd_latency_ns": minimum latency of read operations in
+                               the defined interval, in nanoseconds
+                               (json-int)
+        - "min_wr_latency_ns": minimum latency of write operations in
+                               the defined interval, in nanoseconds
+                               (json-int)
+        - "min_flush_latency_ns": minimum latency of flush operations
+                                  in the defined interval, in
+                                  nanoseconds (json-int)
+        - "max_rd_latency_ns": maximum latency of read operations in
+                               the defined interval, in nanoseconds
+                               (json-int)
+        - "max_wr_latency_ns": maximum latency of write operations in
+                               the defined interval, in nanoseconds
+                               (json-int)
+        - "max_flush_latency_ns": maximum latency of flush operations
+                                  in the defined interval, in
+                                  nanoseconds (json-int)
+        - "avg_rd_latency_ns": average latency of read operations in
+                               the defined interval, in nanoseconds
+                               (json-int)
+        - "avg_wr_latency_ns": average latency of write operations in
+                               the defined interval, in nanoseconds
+                               (json-int)
+        - "avg_flush_latency_ns": average latency of flush operations
+                                  in the defined interval, in
+                                  nanoseconds (json-int)
+        - "avg_rd_queue_depth": average number of pending read
+                                operations in the defined interval
+                                (json-number)
+        - "avg_wr_queue_depth": average number of pending write
+                                operations in the defined interval
+                                (json-number).
+    - "rd_latency_histogram", "wr_latency_histogram",
+      "flush_latency_histogram": latency histograms set with
+                                 block-latency-histogram-set, with the
+                                 members "boundaries" and "bins"
+                                 (json-object, optional)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -2497,7 +2559,36 @@ Example:
                "rd_total_times_ns":3465673657
                "flush_total_times_ns":49653,
                "rd_merged":0,
-               "wr_merged":0
+               "wr_merged":0,
+               "idle_time_ns":2953431879,
+               "failed_rd_operations":0,
+               "failed_wr_operations":0,
+               "failed_flush_operations":0,
+               "invalid_rd_operations":0,
+               "invalid_wr_operations":0,
+               "invalid_flush_operations":0,
+               "account_invalid":true,
+               "account_failed":true,
+               "timed_stats":[
+                  {
+                     "interval_length":60,
+                     "min_rd_latency_ns":45872,
+                     "max_rd_latency_ns":3810523,
+                     "avg_rd_latency_ns":213502,
+                     "min_wr_latency_ns":61740,
+                     "max_wr_latency_ns":2031211,
+                     "avg_wr_latency_ns":452596,
+                     "min_flush_latency_ns":0,
+                     "max_flush_latency_ns":0,
+                     "avg_flush_latency_ns":0,
+                     "avg_rd_queue_depth":0.4,
+                     "avg_wr_queue_depth":0.1
+                  }
+               ],
+               "rd_latency_histogram":{
+                  "boundaries":[100000, 1000000],
+                  "bins":[31018, 5481, 105]
+               }
             }
          },
          {
@@ -2559,6 +2650,46 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_blockstats,
     },
 
+SQMP
+block-latency-histogram-set
+---------------------------
+
+Manage read, write and flush latency histograms for the device.
+
+Arguments:
+
+- "device": device name (json-string)
+- "boundaries": list of interval boundary values in nanoseconds, for all
+                I/O types (json-array of json-int, optional)
+- "boundaries-read": boundaries for the read latency histogram
+                     (json-array of json-int, optional)
+- "boundaries-write": boundaries for the write latency histogram
+                      (json-array of json-int, optional)
+- "boundaries-flush": boundaries for the flush latency histogram
+                      (json-array of json-int, optional)
+
+The boundaries must be greater than zero and in increasing order.  The list
+[10, 50, 100] produces the intervals [0, 10), [10, 50), [50, 100) and
+[100, +inf).  Setting a histogram resets its counters.  If only "device" is
+given, all the histograms of the device are removed.
+
+Example:
+
+-> { "execute": "block-latency-histogram-set",
+     "arguments": { "device": "drive0",
+                    "boundaries": [10000, 50000, 100000],
+                    "boundaries-flush": [1000000] } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-latency-histogram-set",
+        .args_type  = "device:B,boundaries:q?,boundaries-read:q?,"
+                      "boundaries-write:q?,boundaries-flush:q?",
+        .mhandler.cmd_new = qmp_marshal_input_block_latency_histogram_set,
+    },
+
 SQMP
 query-cpus
 ----------
@@ -2649,6 +2780,142 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_iothreads,
     },
 
+SQMP
+query-virtio-coalescing
+-----------------------
+
+Return the interrupt coalescing state of the virtqueues of a virtio device.
+
+Arguments:
+
+- "path": QOM path of the virtio device or of its transport, or device ID
+          (json-string)
+
+Return a json-array.  Each virtqueue is represented by a json-object, which
+contains:
+
+- "queue": index of the virtqueue (json-int)
+- "usecs": maximum interrupt delay in microseconds, 0 if disabled (json-int)
+- "frames": pending completions that force an interrupt, 0 for no limit
+            (json-int)
+- "adaptive": whether the delay follows the completion rate (json-bool)
+- "rate-low": completions/s below which interrupts are not delayed
+              (json-int)
+- "rate-high": completions/s above which interrupts are delayed by "usecs"
+               (json-int)
+- "current-usecs": delay currently applied (json-int)
+- "rate": completions/s measured in the last sample (json-int)
+- "completions": buffers returned to the guest (json-int)
+- "interrupts": interrupts sent to the guest (json-int)
+
+Example:
+
+-> { "execute": "query-virtio-coalescing", "arguments": { "path": "net0" } }
+<- {
+      "return":[
+         {
+            "queue":0, "usecs":50, "frames":64, "adaptive":true,
+            "rate-low":10000, "rate-high":100000, "current-usecs":23,
+            "rate":48711, "completions":1840311, "interrupts":412007
+         },
+         {
+            "queue":1, "usecs":50, "frames":64, "adaptive":true,
+            "rate-low":10000, "rate-high":100000, "current-usecs":0,
+            "rate":312, "completions":20183, "interrupts":20101
+         }
+      ]
+   }
+
+EQMP
+
+    {
+        .name       = "query-virtio-coalescing",
+        .args_type  = "path:s",
+        .mhandler.cmd_new = qmp_marshal_input_query_virtio_coalescing,
+    },
+
+SQMP
+virtio-set-coalescing
+---------------------
+
+Change the interrupt coalescing settings of a virtio device.
+
+Arguments:
+
+- "path": QOM path of the virtio device or of its transport, or device ID
+          (json-string)
+- "queue": index of the virtqueue to change, all by default
+           (json-int, optional)
+- "usecs": maximum interrupt delay in microseconds, 0 to disable
+           (json-int, optional)
+- "frames": pending completions that force an interrupt, 0 for no limit
+            (json-int, optional)
+- "adaptive": scale the delay with the completion rate (json-bool, optional)
+- "rate-low": completions/s below which interrupts are not delayed
+              (json-int, optional)
+- "rate-high": completions/s above which interrupts are delayed by "usecs"
+               (json-int, optional)
+
+Example:
+
+-> { "execute": "virtio-set-coalescing",
+     "arguments": { "path": "net0", "usecs": 50, "frames": 64,
+                    "adaptive": true } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "virtio-set-coalescing",
+        .args_type  = "path:s,queue:i?,usecs:i?,frames:i?,adaptive:b?,rate-low:i?,rate-high:i?",
+        .mhandler.cmd_new = qmp_marshal_input_virtio_set_coalescing,
+    },
+
+SQMP
+query-virtio-net-tx-stats
+-------------------------
+
+Show the transmit statistics of a virtio-net device.
+
+Arguments:
+
+- "path": QOM path of the virtio-net device or of its transport, or device
+          ID (json-string)
+
+Return a json-array with one json-object per queue pair.  Each json-object
+contains:
+
+- "queue": index of the queue pair (json-int)
+- "packets": packets sent to the backend (json-int)
+- "bytes": bytes sent to the backend (json-int)
+- "flushes": times the transmit virtqueue was processed (json-int)
+- "full-bursts": flushes that stopped at the burst limit (json-int)
+- "backend-busy": times transmission waited for the backend (json-int)
+- "burst": current burst limit (json-int)
+- "timeout": current transmit timer in nanoseconds, 0 if the queue does not
+             use a timer (json-int)
+
+Example:
+
+-> { "execute": "query-virtio-net-tx-stats", "arguments": { "path": "net0" } }
+<- {
+      "return":[
+         {
+            "queue":0, "packets":2210451, "bytes":3190312844,
+            "flushes":40113, "full-bursts":7021, "backend-busy":12,
+            "burst":256, "timeout":0
+         }
+      ]
+   }
+
+EQMP
+
+    {
+        .name       = "query-virtio-net-tx-stats",
+        .args_type  = "path:s",
+        .mhandler.cmd_new = qmp_marshal_input_query_virtio_net_tx_stats,
+    },
+
 SQMP
 query-pci
 ---------
@@ -3403,6 +3670,7 @@ Enable/Disable migration capabilities
 - "rdma-pin-all": pin all pages when using RDMA during migration
 - "auto-converge": throttle down guest to help convergence of migration
 - "zero-blocks": compress zero blocks during block migration
+- "dirty-bitmaps": migrate named dirty bitmaps of block devices
 
 Arguments:
 
@@ -3430,6 +3698,7 @@ Query current migration capabilities
          - "rdma-pin-all" : RDMA Pin Page state (json-bool)
          - "auto-converge" : Auto Converge state (json-bool)
          - "zero-blocks" : Zero Blocks state (json-bool)
+         - "dirty-bitmaps" : Dirty Bitmaps state (json-bool)
 
 Arguments:
 
@@ -0,0 +1,29 @@
+#include "qemu-common.h"
+#include "qapi/qmp/qerror.h"
+#include "qmp-commands.h"
+
+VirtioCoalescingInfoList *qmp_query_virtio_coalescing(const char *path,
+                                                      Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+void qmp_virtio_set_coalescing(const char *path,
+                               bool has_queue, int64_t queue,
+                               bool has_usecs, int64_t usecs,
+                               bool has_frames, int64_t frames,
+                               bool has_adaptive, bool adaptive,
+                               bool has_rate_low, int64_t rate_low,
+                               bool has_rate_high, int64_t rate_high,
+                               Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+}
+
+VirtioNetTxStatsList *qmp_query_virtio_net_tx_stats(const char *path,
+                                                    Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
@@ -29,6 +29,12 @@
 #           "after" - alias for -1
 #           default: before
 #
+# With --refuse-options, the server announces the fixed newstyle protocol and
+# answers every option other than NBD_OPT_EXPORT_NAME with NBD_REP_ERR_UNSUP,
+# like a server without any protocol extensions.  With
+# --refuse-options-and-close, it closes the connection after such a reply,
+# like QEMU up to 2.3 did.
+#
 # Currently the only error injection action is to terminate the server process.
 # This resets the TCP connection and thus forces the client to handle
 # unexpected connection termination.
@@ -61,6 +67,9 @@ NBD_PASSWD = 0x4e42444d41474943
 NBD_OPTS_MAGIC = 0x49484156454F5054
 NBD_CLIENT_MAGIC = 0x0000420281861253
 NBD_OPT_EXPORT_NAME = 1 << 0
+NBD_FLAG_FIXED_NEWSTYLE = 1 << 0
+NBD_REP_MAGIC = 0x3e889045565a9
+NBD_REP_ERR_UNSUP = (1 << 31) | 1
 
 # Protocol structs
 neg_classic_struct = struct.Struct('>QQQI124x')
@@ -68,6 +77,10 @@ neg1_struct = struct.Struct('>QQH')
 export_tuple = collections.namedtuple('Export', 'reserved magic opt len')
 export_struct = struct.Struct('>IQII')
 neg2_struct = struct.Struct('>QH124x')
+client_flags_struct = struct.Struct('>I')
+option_tuple = collections.namedtuple('Option', 'magic opt len')
+option_struct = struct.Struct('>QII')
+option_reply_struct = struct.Struct('>QIII')
 request_tuple = collections.namedtuple('Request', 'magic type handle from_ len')
 request_struct = struct.Struct('>IIQQI')
 reply_struct = struct.Struct('>IIQ')
@@ -151,12 +164,40 @@ def negotiate_export(conn):
     buf = neg2_struct.pack(FAKE_DISK_SIZE, 0)
     conn.send(buf, event='neg2')
 
-def negotiate(conn, use_export):
+def negotiate_options(conn, close_on_refuse):
+    '''Refuse all options until the client sends NBD_OPT_EXPORT_NAME.
+    Returns False if the connection is to be closed.'''
+    buf = neg1_struct.pack(NBD_PASSWD, NBD_OPTS_MAGIC, NBD_FLAG_FIXED_NEWSTYLE)
+    conn.send(buf, event='neg1')
+    conn.recv(client_flags_struct.size, event='export')
+
+    while True:
+        buf = conn.recv(option_struct.size, event='export')
+        option = option_tuple._make(option_struct.unpack(buf))
+        assert option.magic == NBD_OPTS_MAGIC
+        _ = conn.recv(option.len, event='export-name')
+        if option.opt == NBD_OPT_EXPORT_NAME:
+            break
+
+        buf = option_reply_struct.pack(NBD_REP_MAGIC, option.opt,
+                                       NBD_REP_ERR_UNSUP, 0)
+        conn.send(buf, event='export')
+        if close_on_refuse:
+            return False
+
+    buf = neg2_struct.pack(FAKE_DISK_SIZE, 0)
+    conn.send(buf, event='neg2')
+    return True
+
+def negotiate(conn, mode):
     '''Negotiate export with client'''
-    if use_export:
+    if mode == 'export':
         negotiate_export(conn)
-    else:
+    elif mode == 'classic':
         negotiate_classic(conn)
+    else:
+        return negotiate_options(conn, mode == 'refuse-and-close')
+    return True
 
 def read_request(conn):
     '''Parse NBD request from client'''
@@ -169,8 +210,10 @@ def write_reply(conn, error, handle):
     buf = reply_struct.pack(NBD_REPLY_MAGIC, error, handle)
     conn.send(buf, event='reply')
 
-def handle_connection(conn, use_export):
-    negotiate(conn, use_export)
+def handle_connection(conn, mode):
+    if not negotiate(conn, mode):
+        conn.close()
+        return
     while True:
         req = read_request(conn)
         if req.type == NBD_CMD_READ:
@@ -186,10 +229,10 @@ def handle_connection(conn, use_export):
             break
     conn.close()
 
-def run_server(sock, rules, use_export):
+def run_server(sock, rules, mode):
     while True:
         conn, _ = sock.accept()
-        handle_connection(FaultInjectionSocket(conn, rules), use_export)
+        handle_connection(FaultInjectionSocket(conn, rules), mode)
 
 def parse_inject_error(name, options):
     if 'event' not in options:
@@ -243,21 +286,25 @@ def open_socket(path):
     return sock
 
 def usage(args):
-    sys.stderr.write('usage: %s [--classic-negotiation] <tcp-port>|<unix-path> <config-file>\n' % args[0])
+    sys.stderr.write('usage: %s [--classic-negotiation|--refuse-options|--refuse-options-and-close] <tcp-port>|<unix-path> <config-file>\n' % args[0])
     sys.stderr.write('Run an fault injector NBD server with rules defined in a config file.\n')
     sys.exit(1)
 
 def main(args):
-    if len(args) != 3 and len(args) != 4:
-        usage(args)
-    use_export = True
-    if args[1] == '--classic-negotiation':
-        use_export = False
-    elif len(args) == 4:
+    modes = {'--classic-negotiation': 'classic',
+             '--refuse-options': 'refuse',
+             '--refuse-options-and-close': 'refuse-and-close'}
+    mode = 'export'
+    if len(args) == 4:
+        if args[1] not in modes:
+            usage(args)
+        mode = modes[args[1]]
+        args = args[:1] + args[2:]
+    elif len(args) != 3:
         usage(args)
-    sock = open_socket(args[1 if use_export else 2])
-    rules = load_rules(args[2 if use_export else 3])
-    run_server(sock, rules, use_export)
+    sock = open_socket(args[1])
+    rules = load_rules(args[2])
+    run_server(sock, rules, mode)
     return 0
 
 if __name__ == '__main__':
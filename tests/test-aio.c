@@ -351,6 +351,90 @@ static void test_wait_event_notifier(void)
     event_notifier_cleanup(&data.e);
 }
 
+static bool poll_work;
+
+static void event_poll_ready_cb(EventNotifier *e)
+{
+    EventNotifierTestData *data = container_of(e, EventNotifierTestData, e);
+
+    /* Not signaled: the callback runs because the poll callback found work */
+    g_assert(!event_notifier_test_and_clear(e));
+    poll_work = false;
+    data->n++;
+}
+
+static bool event_poll_cb(void *opaque)
+{
+    return poll_work;
+}
+
+static void test_poll_event_notifier(void)
+{
+    EventNotifierTestData data = { .n = 0 };
+
+    aio_context_set_poll_params(ctx, 1000000000, 0, 0, &error_abort);
+    event_notifier_init(&data.e, false);
+    aio_set_event_notifier(ctx, &data.e, event_poll_ready_cb);
+    aio_set_event_notifier_poll(ctx, &data.e, event_poll_cb);
+
+    /* A short wait makes aio_poll() start polling */
+    aio_notify(ctx);
+    g_assert(!aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 0);
+    g_assert_cmpint(ctx->poll_ns, >, 0);
+
+    /* Work found by polling is dispatched without a notification */
+    poll_work = true;
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 1);
+
+    aio_set_event_notifier(ctx, &data.e, NULL);
+    event_notifier_cleanup(&data.e);
+    aio_context_set_poll_params(ctx, 0, 0, 0, &error_abort);
+}
+
+/* Enough event notifiers to make aio_poll() switch to epoll on Linux */
+#define MANY_EVENT_NOTIFIERS 128
+
+static void test_many_event_notifiers(void)
+{
+    EventNotifierTestData *data = g_new0(EventNotifierTestData,
+                                         MANY_EVENT_NOTIFIERS);
+    int i;
+
+    for (i = 0; i < MANY_EVENT_NOTIFIERS; i++) {
+        data[i].active = 1;
+        event_notifier_init(&data[i].e, false);
+        aio_set_event_notifier(ctx, &data[i].e, event_ready_cb);
+    }
+    g_assert(!aio_poll(ctx, false));
+
+    event_notifier_set(&data[1].e);
+    event_notifier_set(&data[MANY_EVENT_NOTIFIERS - 1].e);
+    g_assert(aio_poll(ctx, false));
+    g_assert_cmpint(data[1].n, ==, 1);
+    g_assert_cmpint(data[MANY_EVENT_NOTIFIERS - 1].n, ==, 1);
+    g_assert(!aio_poll(ctx, false));
+
+    /* Remove a handler and check that it is not called anymore */
+    aio_set_event_notifier(ctx, &data[2].e, NULL);
+    event_notifier_set(&data[2].e);
+    event_notifier_set(&data[3].e);
+    wait_until_inactive(&data[3]);
+    g_assert_cmpint(data[2].n, ==, 0);
+    g_assert_cmpint(data[3].n, ==, 1);
+
+    for (i = 0; i < MANY_EVENT_NOTIFIERS; i++) {
+        aio_set_event_notifier(ctx, &data[i].e, NULL);
+        event_notifier_cleanup(&data[i].e);
+    }
+    g_assert(!aio_poll(ctx, false));
+    g_free(data);
+}
+
 static void test_flush_event_notifier(void)
 {
     EventNotifierTestData data = { .n = 0, .active = 10, .auto_set = true };
@@ -843,6 +927,8 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait",              test_wait_event_notifier);
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
+    g_test_add_func("/aio/event/poll",              test_poll_event_notifier);
+    g_test_add_func("/aio/event/many",              test_many_event_notifiers);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
 
     g_test_add_func("/aio-gsource/notify",                  test_source_notify);
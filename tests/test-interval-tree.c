@@ -0,0 +1,281 @@
+/*
+ * Interval tree unit-tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include "qemu/osdep.h"
+#include "qemu/queue.h"
+#include "qemu/interval-tree.h"
+
+typedef struct TestRange {
+    IntervalTreeNode node;
+    bool in_tree;
+    QLIST_ENTRY(TestRange) list;
+} TestRange;
+
+/* Check the tree invariants and return the height of @node */
+static int check_subtree(IntervalTreeNode *node, IntervalTreeNode *parent,
+                         int *count)
+{
+    int lh, rh;
+    uint64_t subtree_last;
+
+    if (!node) {
+        return 0;
+    }
+
+    g_assert(node->parent == parent);
+    g_assert(!node->left || node->left->start <= node->start);
+    g_assert(!node->right || node->right->start >= node->start);
+
+    lh = check_subtree(node->left, node, count);
+    rh = check_subtree(node->right, node, count);
+    g_assert_cmpint(ABS(lh - rh), <=, 1);
+    g_assert_cmpint(node->height, ==, MAX(lh, rh) + 1);
+
+    subtree_last = node->last;
+    if (node->left) {
+        subtree_last = MAX(subtree_last, node->left->subtree_last);
+    }
+    if (node->right) {
+        subtree_last = MAX(subtree_last, node->right->subtree_last);
+    }
+    g_assert_cmpuint(node->subtree_last, ==, subtree_last);
+
+    (*count)++;
+    return node->height;
+}
+
+static void check_tree(IntervalTreeRoot *root, int expected)
+{
+    int count = 0;
+
+    check_subtree(root->root, NULL, &count);
+    g_assert_cmpint(count, ==, expected);
+}
+
+static bool range_overlaps(TestRange *r, uint64_t start, uint64_t last)
+{
+    return r->node.start <= last && start <= r->node.last;
+}
+
+/* Compare the result of a lookup with a linear scan of @ranges */
+static void check_lookup(IntervalTreeRoot *root, TestRange *ranges, int n,
+                         uint64_t start, uint64_t last)
+{
+    IntervalTreeNode *node;
+    uint64_t prev_start = 0;
+    int expected = 0;
+    int found = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (ranges[i].in_tree && range_overlaps(&ranges[i], start, last)) {
+            expected++;
+        }
+    }
+
+    for (node = interval_tree_iter_first(root, start, last); node;
+         node = interval_tree_iter_next(node, start, last)) {
+        TestRange *r = container_of(node, TestRange, node);
+
+        g_assert(r->in_tree);
+        g_assert(range_overlaps(r, start, last));
+        g_assert_cmpuint(node->start, >=, prev_start);
+        prev_start = node->start;
+        found++;
+    }
+
+    g_assert_cmpint(found, ==, expected);
+}
+
+static void test_empty(void)
+{
+    IntervalTreeRoot root = { NULL };
+
+    g_assert(interval_tree_iter_first(&root, 0, UINT64_MAX) == NULL);
+}
+
+static void test_overlap(void)
+{
+    IntervalTreeRoot root = { NULL };
+    TestRange ranges[4];
+    IntervalTreeNode *node;
+    int i;
+
+    memset(ranges, 0, sizeof(ranges));
+    for (i = 0; i < ARRAY_SIZE(ranges); i++) {
+        ranges[i].node.start = i * 100;
+        ranges[i].node.last = i * 100 + 49;
+        interval_tree_insert(&ranges[i].node, &root);
+    }
+    check_tree(&root, 4);
+
+    /* Touching the first and last byte */
+    node = interval_tree_iter_first(&root, 149, 200);
+    g_assert(node == &ranges[1].node);
+    node = interval_tree_iter_next(node, 149, 200);
+    g_assert(node == &ranges[2].node);
+    g_assert(interval_tree_iter_next(node, 149, 200) == NULL);
+
+    /* In a hole */
+    g_assert(interval_tree_iter_first(&root, 50, 99) == NULL);
+    g_assert(interval_tree_iter_first(&root, 350, UINT64_MAX) == NULL);
+
+    interval_tree_remove(&ranges[1].node, &root);
+    check_tree(&root, 3);
+    node = interval_tree_iter_first(&root, 0, 399);
+    g_assert(node == &ranges[0].node);
+    node = interval_tree_iter_next(node, 0, 399);
+    g_assert(node == &ranges[2].node);
+    node = interval_tree_iter_next(node, 0, 399);
+    g_assert(node == &ranges[3].node);
+    g_assert(interval_tree_iter_next(node, 0, 399) == NULL);
+}
+
+static void test_random(void)
+{
+    IntervalTreeRoot root = { NULL };
+    TestRange *ranges;
+    int n = 512;
+    int in_tree = 0;
+    int i, j;
+
+    ranges = g_new0(TestRange, n);
+    for (i = 0; i < 20000; i++) {
+        TestRange *r = &ranges[g_test_rand_int_range(0, n)];
+        uint64_t start = g_test_rand_int_range(0, 65536);
+        uint64_t last = start + g_test_rand_int_range(0, 4096);
+
+        if (r->in_tree) {
+            interval_tree_remove(&r->node, &root);
+            r->in_tree = false;
+            in_tree--;
+        } else {
+            r->node.start = start;
+            r->node.last = last;
+            interval_tree_insert(&r->node, &root);
+            r->in_tree = true;
+            in_tree++;
+        }
+
+        if (i % 64 == 0) {
+            check_tree(&root, in_tree);
+            for (j = 0; j < 8; j++) {
+                start = g_test_rand_int_range(0, 70000);
+                last = start + g_test_rand_int_range(0, 8192);
+                check_lookup(&root, ranges, n, start, last);
+            }
+        }
+    }
+    g_free(ranges);
+}
+
+/* Emulate the way the block layer uses its tracked requests: every new
+ * request looks for overlapping ones, is added and later removed, while
+ * @depth requests are in flight.
+ */
+#define PERF_DEPTH      4096
+#define PERF_REQUESTS   (1 << 18)
+#define PERF_REQ_SIZE   4096
+
+static uint64_t perf_offset(uint32_t *seed)
+{
+    /* Scatter requests randomly over a 1 GiB disk (xorshift32) */
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return (uint64_t)(*seed & 0x3ffff) * PERF_REQ_SIZE;
+}
+
+static void perf_tree(void)
+{
+    IntervalTreeRoot root = { NULL };
+    TestRange *ranges = g_new0(TestRange, PERF_DEPTH);
+    unsigned long overlaps = 0;
+    uint32_t seed = 1;
+    double duration;
+    unsigned int i;
+
+    g_test_timer_start();
+    for (i = 0; i < PERF_REQUESTS; i++) {
+        TestRange *r = &ranges[i % PERF_DEPTH];
+        uint64_t start = perf_offset(&seed);
+        uint64_t last = start + PERF_REQ_SIZE - 1;
+        IntervalTreeNode *node;
+
+        if (r->in_tree) {
+            interval_tree_remove(&r->node, &root);
+        }
+        for (node = interval_tree_iter_first(&root, start, last); node;
+             node = interval_tree_iter_next(node, start, last)) {
+            overlaps++;
+        }
+        r->node.start = start;
+        r->node.last = last;
+        interval_tree_insert(&r->node, &root);
+        r->in_tree = true;
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("interval tree: %d requests in flight, %d requests, "
+                   "%lu overlaps, %f s, %lu ns per request",
+                   PERF_DEPTH, PERF_REQUESTS, overlaps, duration,
+                   (unsigned long)(1000000000.0 * duration / PERF_REQUESTS));
+    g_free(ranges);
+}
+
+static void perf_list(void)
+{
+    QLIST_HEAD(, TestRange) head = QLIST_HEAD_INITIALIZER(head);
+    TestRange *ranges = g_new0(TestRange, PERF_DEPTH);
+    unsigned long overlaps = 0;
+    uint32_t seed = 1;
+    double duration;
+    unsigned int i;
+
+    g_test_timer_start();
+    for (i = 0; i < PERF_REQUESTS; i++) {
+        TestRange *r = &ranges[i % PERF_DEPTH];
+        uint64_t start = perf_offset(&seed);
+        uint64_t last = start + PERF_REQ_SIZE - 1;
+        TestRange *other;
+
+        if (r->in_tree) {
+            QLIST_REMOVE(r, list);
+        }
+        QLIST_FOREACH(other, &head, list) {
+            if (range_overlaps(other, start, last)) {
+                overlaps++;
+            }
+        }
+        r->node.start = start;
+        r->node.last = last;
+        QLIST_INSERT_HEAD(&head, r, list);
+        r->in_tree = true;
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("linear list: %d requests in flight, %d requests, "
+                   "%lu overlaps, %f s, %lu ns per request",
+                   PERF_DEPTH, PERF_REQUESTS, overlaps, duration,
+                   (unsigned long)(1000000000.0 * duration / PERF_REQUESTS));
+    g_free(ranges);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/interval-tree/empty", test_empty);
+    g_test_add_func("/interval-tree/overlap", test_overlap);
+    g_test_add_func("/interval-tree/random", test_random);
+    if (g_test_perf()) {
+        g_test_add_func("/perf/tree", perf_tree);
+        g_test_add_func("/perf/list", perf_list);
+    }
+    return g_test_run();
+}
@@ -0,0 +1,193 @@
+/*
+ * Batched datagram transmission tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "net/dgram-batch.h"
+
+#define NUM_DGRAMS 5
+
+/* Stands in for a socket that accepts @space more datagrams */
+typedef struct {
+    unsigned int space;
+    int error;
+    unsigned int received;
+    GByteArray *dgrams[NET_DGRAM_BATCH_MAX];
+    struct sockaddr *dst;
+} FakeSocket;
+
+static int fake_send(void *opaque, struct mmsghdr *msgs, unsigned int vlen)
+{
+    FakeSocket *f = opaque;
+    struct iovec *iov;
+    unsigned int i, n;
+
+    if (f->error) {
+        return f->error;
+    }
+
+    n = MIN(vlen, f->space);
+    if (!n) {
+        return -EAGAIN;
+    }
+    for (i = 0; i < n; i++) {
+        g_assert(msgs[i].msg_hdr.msg_name == f->dst);
+        g_assert_cmpint(msgs[i].msg_hdr.msg_iovlen, ==, 1);
+        iov = msgs[i].msg_hdr.msg_iov;
+        f->dgrams[f->received++] = g_byte_array_append(g_byte_array_new(),
+                                                       iov->iov_base,
+                                                       iov->iov_len);
+    }
+    f->space -= n;
+    return n;
+}
+
+static void fake_socket_init(FakeSocket *f, struct sockaddr_in *dst,
+                             unsigned int space)
+{
+    memset(f, 0, sizeof(*f));
+    f->space = space;
+    f->dst = (struct sockaddr *)dst;
+}
+
+static void fake_socket_free(FakeSocket *f)
+{
+    unsigned int i;
+
+    for (i = 0; i < f->received; i++) {
+        g_byte_array_free(f->dgrams[i], true);
+    }
+}
+
+/* Datagram @i has a different size and content for each @i, so that the
+ * buffer has to grow and mixed up datagrams are noticed.
+ */
+static size_t make_dgram(uint8_t *buf, int i)
+{
+    size_t len = 100 * i + 1;
+
+    memset(buf, 'a' + i, len);
+    return len;
+}
+
+static void add_dgrams(NetDgramBatch *b, int n)
+{
+    uint8_t buf[1024];
+    int i;
+
+    for (i = 0; i < n; i++) {
+        g_assert(net_dgram_batch_add(b, buf, make_dgram(buf, i)));
+    }
+    g_assert_cmpint(b->count, ==, n);
+}
+
+static void check_dgrams(FakeSocket *f, int n)
+{
+    uint8_t buf[1024];
+    size_t len;
+    int i;
+
+    g_assert_cmpint(f->received, ==, n);
+    for (i = 0; i < n; i++) {
+        len = make_dgram(buf, i);
+        g_assert_cmpint(f->dgrams[i]->len, ==, len);
+        g_assert(memcmp(f->dgrams[i]->data, buf, len) == 0);
+    }
+}
+
+static void test_flush(void)
+{
+    NetDgramBatch b = {};
+    struct sockaddr_in dst = {};
+    FakeSocket f;
+
+    fake_socket_init(&f, &dst, NET_DGRAM_BATCH_MAX);
+    add_dgrams(&b, NUM_DGRAMS);
+
+    g_assert_cmpint(net_dgram_batch_flush(&b, fake_send, &f,
+                                          f.dst, sizeof(dst)), ==, 0);
+    g_assert_cmpint(b.count, ==, 0);
+    check_dgrams(&f, NUM_DGRAMS);
+
+    fake_socket_free(&f);
+    net_dgram_batch_cleanup(&b);
+}
+
+/* The datagrams that did not fit are kept and sent in order later */
+static void test_partial(void)
+{
+    NetDgramBatch b = {};
+    struct sockaddr_in dst = {};
+    FakeSocket f;
+
+    fake_socket_init(&f, &dst, 2);
+    add_dgrams(&b, NUM_DGRAMS);
+
+    g_assert_cmpint(net_dgram_batch_flush(&b, fake_send, &f,
+                                          f.dst, sizeof(dst)), ==, -EAGAIN);
+    g_assert_cmpint(f.received, ==, 2);
+    g_assert_cmpint(b.count, ==, NUM_DGRAMS);
+
+    /* still no space */
+    g_assert_cmpint(net_dgram_batch_flush(&b, fake_send, &f,
+                                          f.dst, sizeof(dst)), ==, -EAGAIN);
+    g_assert_cmpint(f.received, ==, 2);
+
+    f.space = NET_DGRAM_BATCH_MAX;
+    g_assert_cmpint(net_dgram_batch_flush(&b, fake_send, &f,
+                                          f.dst, sizeof(dst)), ==, 0);
+    g_assert_cmpint(b.count, ==, 0);
+    check_dgrams(&f, NUM_DGRAMS);
+
+    fake_socket_free(&f);
+    net_dgram_batch_cleanup(&b);
+}
+
+/* Other errors drop the batch */
+static void test_error(void)
+{
+    NetDgramBatch b = {};
+    struct sockaddr_in dst = {};
+    FakeSocket f;
+
+    fake_socket_init(&f, &dst, NET_DGRAM_BATCH_MAX);
+    f.error = -EIO;
+    add_dgrams(&b, NUM_DGRAMS);
+
+    g_assert_cmpint(net_dgram_batch_flush(&b, fake_send, &f,
+                                          f.dst, sizeof(dst)), ==, 0);
+    g_assert_cmpint(b.count, ==, 0);
+    g_assert_cmpint(f.received, ==, 0);
+
+    fake_socket_free(&f);
+    net_dgram_batch_cleanup(&b);
+}
+
+static void test_full(void)
+{
+    NetDgramBatch b = {};
+    uint8_t buf[1] = { 0 };
+    int i;
+
+    for (i = 0; i < NET_DGRAM_BATCH_MAX; i++) {
+        g_assert(net_dgram_batch_add(&b, buf, sizeof(buf)));
+    }
+    g_assert(!net_dgram_batch_add(&b, buf, sizeof(buf)));
+    g_assert_cmpint(b.count, ==, NET_DGRAM_BATCH_MAX);
+
+    net_dgram_batch_cleanup(&b);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/dgram-batch/flush", test_flush);
+    g_test_add_func("/net/dgram-batch/partial", test_partial);
+    g_test_add_func("/net/dgram-batch/error", test_error);
+    g_test_add_func("/net/dgram-batch/full", test_full);
+    return g_test_run();
+}
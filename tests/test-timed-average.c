@@ -0,0 +1,112 @@
+/*
+ * Timed average computation tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <unistd.h>
+
+#include "qemu/timed-average.h"
+
+#define SECOND 1000000000LL
+
+/* This is the clock for QEMU_CLOCK_VIRTUAL */
+static int64_t my_clock_value;
+
+int64_t cpu_get_clock(void)
+{
+    return my_clock_value;
+}
+
+static void account(TimedAverage *ta)
+{
+    timed_average_account(ta, 1);
+    timed_average_account(ta, 5);
+    timed_average_account(ta, 2);
+    timed_average_account(ta, 4);
+    timed_average_account(ta, 3);
+}
+
+static void test_average(void)
+{
+    TimedAverage ta;
+    uint64_t result;
+    int i;
+
+    /* we will compute some average on a period of 1 second */
+    timed_average_init(&ta, QEMU_CLOCK_VIRTUAL, SECOND);
+
+    result = timed_average_min(&ta);
+    g_assert_cmpint(result, ==, 0);
+    result = timed_average_avg(&ta);
+    g_assert_cmpint(result, ==, 0);
+    result = timed_average_max(&ta);
+    g_assert_cmpint(result, ==, 0);
+
+    for (i = 0; i < 100; i++) {
+        account(&ta);
+        result = timed_average_min(&ta);
+        g_assert_cmpint(result, ==, 1);
+        result = timed_average_avg(&ta);
+        g_assert_cmpint(result, ==, 3);
+        result = timed_average_max(&ta);
+        g_assert_cmpint(result, ==, 5);
+        my_clock_value += SECOND / 10;
+    }
+
+    my_clock_value += SECOND * 100;
+
+    result = timed_average_min(&ta);
+    g_assert_cmpint(result, ==, 0);
+    result = timed_average_avg(&ta);
+    g_assert_cmpint(result, ==, 0);
+    result = timed_average_max(&ta);
+    g_assert_cmpint(result, ==, 0);
+
+    for (i = 0; i < 100; i++) {
+        account(&ta);
+        result = timed_average_min(&ta);
+        g_assert_cmpint(result, ==, 1);
+        result = timed_average_avg(&ta);
+        g_assert_cmpint(result, ==, 3);
+        result = timed_average_max(&ta);
+        g_assert_cmpint(result, ==, 5);
+        my_clock_value += SECOND / 10;
+    }
+}
+
+static void test_window(void)
+{
+    TimedAverage ta;
+    uint64_t elapsed;
+
+    timed_average_init(&ta, QEMU_CLOCK_VIRTUAL, SECOND);
+
+    timed_average_account(&ta, 100);
+    my_clock_value += SECOND * 6 / 10;
+    timed_average_account(&ta, 10);
+    g_assert_cmpint(timed_average_max(&ta), ==, 100);
+    g_assert_cmpint(timed_average_sum(&ta, NULL), ==, 110);
+
+    /* The first value is more than a period old and has been forgotten */
+    my_clock_value += SECOND / 2;
+    g_assert_cmpint(timed_average_min(&ta), ==, 10);
+    g_assert_cmpint(timed_average_max(&ta), ==, 10);
+    g_assert_cmpint(timed_average_sum(&ta, &elapsed), ==, 10);
+    g_assert_cmpint(elapsed, >=, SECOND / 2);
+    g_assert_cmpint(elapsed, <=, SECOND);
+
+    my_clock_value += SECOND / 2;
+    g_assert_cmpint(timed_average_max(&ta), ==, 0);
+    g_assert_cmpint(timed_average_sum(&ta, NULL), ==, 0);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/timed-average/average", test_average);
+    g_test_add_func("/timed-average/window", test_window);
+    return g_test_run();
+}
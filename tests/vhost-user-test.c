@@ -39,9 +39,10 @@
 #define QEMU_CMD_ACCEL  " -machine accel=tcg"
 #define QEMU_CMD_MEM    " -m 512 -object memory-backend-file,id=mem,size=512M,"\
                         "mem-path=%s,share=on -numa node,memdev=mem"
-#define QEMU_CMD_CHR    " -chardev socket,id=chr0,path=%s"
-#define QEMU_CMD_NETDEV " -netdev vhost-user,id=net0,chardev=chr0,vhostforce"
-#define QEMU_CMD_NET    " -device virtio-net-pci,netdev=net0 "
+#define QEMU_CMD_CHR    " -chardev socket,id=chr0,path=%s,reconnect=1"
+#define QEMU_CMD_NETDEV " -netdev vhost-user,id=net0,chardev=chr0,vhostforce," \
+                        "queues=2"
+#define QEMU_CMD_NET    " -device virtio-net-pci,netdev=net0,mq=on,vectors=6 "
 #define QEMU_CMD_ROM    " -option-rom ../pc-bios/pxe-virtio.rom"
 
 #define QEMU_CMD        QEMU_CMD_ACCEL QEMU_CMD_MEM QEMU_CMD_CHR \
@@ -52,6 +53,8 @@
 /*********** FROM hw/virtio/vhost-user.c *************************************/
 
 #define VHOST_MEMORY_MAX_NREGIONS    8
+#define VHOST_USER_F_PROTOCOL_FEATURES 30
+#define VHOST_USER_PROTOCOL_F_MQ    0
 
 typedef enum VhostUserRequest {
     VHOST_USER_NONE = 0,
@@ -69,6 +72,10 @@ typedef enum VhostUserRequest {
     VHOST_USER_SET_VRING_KICK = 12,
     VHOST_USER_SET_VRING_CALL = 13,
     VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+    VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+    VHOST_USER_GET_QUEUE_NUM = 17,
+    VHOST_USER_SET_VRING_ENABLE = 18,
     VHOST_USER_MAX
 } VhostUserRequest;
 
@@ -111,10 +118,19 @@ static VhostUserMsg m __attribute__ ((unused));
 #define VHOST_USER_VERSION    (0x1)
 /*****************************************************************************/
 
+/* Number of queue pairs supported by the test backend */
+#define BACKEND_QUEUES 2
+
 int fds_num = 0, fds[VHOST_MEMORY_MAX_NREGIONS];
 static VhostUserMemory memory;
 static GMutex *data_mutex;
 static GCond *data_cond;
+static CharDriverState *backend_chr;
+static char *socket_path;
+static uint64_t protocol_features;
+static bool queue_num_queried;
+static int vring_enable_num;
+static int vring_base_num;
 
 static gint64 _get_time(void)
 {
@@ -293,11 +309,41 @@ static void chr_read(void *opaque, const uint8_t *buf, int size)
         /* send back features to qemu */
         msg.flags |= VHOST_USER_REPLY_MASK;
         msg.size = sizeof(m.u64);
-        msg.u64 = 0;
+        msg.u64 = 1ULL << VHOST_USER_F_PROTOCOL_FEATURES;
+        p = (uint8_t *) &msg;
+        qemu_chr_fe_write_all(chr, p, VHOST_USER_HDR_SIZE + msg.size);
+        break;
+
+    case VHOST_USER_GET_PROTOCOL_FEATURES:
+        msg.flags |= VHOST_USER_REPLY_MASK;
+        msg.size = sizeof(m.u64);
+        msg.u64 = 1ULL << VHOST_USER_PROTOCOL_F_MQ;
+        p = (uint8_t *) &msg;
+        qemu_chr_fe_write_all(chr, p, VHOST_USER_HDR_SIZE + msg.size);
+        break;
+
+    case VHOST_USER_SET_PROTOCOL_FEATURES:
+        protocol_features = msg.u64;
+        break;
+
+    case VHOST_USER_GET_QUEUE_NUM:
+        queue_num_queried = true;
+        msg.flags |= VHOST_USER_REPLY_MASK;
+        msg.size = sizeof(m.u64);
+        msg.u64 = BACKEND_QUEUES;
         p = (uint8_t *) &msg;
         qemu_chr_fe_write_all(chr, p, VHOST_USER_HDR_SIZE + msg.size);
         break;
 
+    case VHOST_USER_SET_VRING_ENABLE:
+        vring_enable_num++;
+        break;
+
+    case VHOST_USER_SET_VRING_BASE:
+        vring_base_num++;
+        g_cond_signal(data_cond);
+        break;
+
     case VHOST_USER_GET_VRING_BASE:
         /* send back vring base to qemu */
         msg.flags |= VHOST_USER_REPLY_MASK;
@@ -333,6 +379,60 @@ static void chr_read(void *opaque, const uint8_t *buf, int size)
     g_mutex_unlock(data_mutex);
 }
 
+static CharDriverState *backend_new(void)
+{
+    CharDriverState *chr;
+    char *chr_path;
+
+    chr_path = g_strdup_printf("unix:%s,server,nowait", socket_path);
+    chr = qemu_chr_new("chr0", chr_path, NULL);
+    g_free(chr_path);
+    qemu_chr_add_handlers(chr, chr_can_read, chr_read, NULL, chr);
+
+    return chr;
+}
+
+static void test_multiqueue(void)
+{
+    g_mutex_lock(data_mutex);
+    g_assert(protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_MQ));
+    g_assert(queue_num_queried);
+    g_assert_cmpint(vring_enable_num, >, 0);
+    g_mutex_unlock(data_mutex);
+}
+
+static void test_reconnect(void)
+{
+    gint64 end_time;
+    int i;
+
+    /* Restart the backend; QEMU reconnects and sets it up from scratch */
+    g_mutex_lock(data_mutex);
+    qemu_chr_delete(backend_chr);
+    for (i = 0; i < fds_num; i++) {
+        close(fds[i]);
+    }
+    fds_num = 0;
+    vring_base_num = 0;
+    backend_chr = backend_new();
+    g_mutex_unlock(data_mutex);
+
+    /* waits for the memory table to be sent again */
+    read_guest_mem();
+
+    /* the vring setup may come after the memory table */
+    g_mutex_lock(data_mutex);
+    end_time = _get_time() + 5 * G_TIME_SPAN_SECOND;
+    while (!vring_base_num) {
+        if (!_cond_wait_until(data_cond, data_mutex, end_time)) {
+            /* timeout has passed */
+            break;
+        }
+    }
+    g_assert_cmpint(vring_base_num, >, 0);
+    g_mutex_unlock(data_mutex);
+}
+
 static const char *init_hugepagefs(void)
 {
     const char *path;
@@ -369,11 +469,8 @@ static const char *init_hugepagefs(void)
 int main(int argc, char **argv)
 {
     QTestState *s = NULL;
-    CharDriverState *chr = NULL;
     const char *hugefs = 0;
-    char *socket_path = 0;
     char *qemu_cmd = 0;
-    char *chr_path = 0;
     int ret;
 
     g_test_init(&argc, &argv, NULL);
@@ -389,10 +486,7 @@ int main(int argc, char **argv)
 
     /* create char dev and add read handlers */
     qemu_add_opts(&qemu_chardev_opts);
-    chr_path = g_strdup_printf("unix:%s,server,nowait", socket_path);
-    chr = qemu_chr_new("chr0", chr_path, NULL);
-    g_free(chr_path);
-    qemu_chr_add_handlers(chr, chr_can_read, chr_read, NULL, chr);
+    backend_chr = backend_new();
 
     /* run the main loop thread so the chardev may operate */
     data_mutex = _mutex_new();
@@ -404,6 +498,8 @@ int main(int argc, char **argv)
     g_free(qemu_cmd);
 
     qtest_add_func("/vhost-user/read-guest-mem", read_guest_mem);
+    qtest_add_func("/vhost-user/multiqueue", test_multiqueue);
+    qtest_add_func("/vhost-user/reconnect", test_reconnect);
 
     ret = g_test_run();
 
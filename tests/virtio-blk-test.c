@@ -33,6 +33,7 @@
 #define QVIRTIO_BLK_F_WCE           0x00000200
 #define QVIRTIO_BLK_F_TOPOLOGY      0x00000400
 #define QVIRTIO_BLK_F_CONFIG_WCE    0x00000800
+#define QVIRTIO_BLK_F_MQ            0x00001000
 
 #define QVIRTIO_BLK_T_IN            0
 #define QVIRTIO_BLK_T_OUT           1
@@ -47,6 +48,10 @@
 #define PCI_SLOT_HP             0x06
 #define PCI_SLOT                0x04
 #define PCI_FN                  0x00
+#define MQ_NUM_QUEUES           4
+
+/* Offset of num_queues in struct virtio_blk_config */
+#define QVIRTIO_BLK_CONFIG_NUM_QUEUES   34
 
 #define MMIO_PAGE_SIZE          4096
 #define MMIO_DEV_BASE_ADDR      0x0A003E00
@@ -76,7 +81,7 @@ static char *drive_create(void)
     return tmp_path;
 }
 
-static QPCIBus *pci_test_start(void)
+static QPCIBus *pci_test_start_opts(const char *device_opts)
 {
     char *cmdline;
     char *tmp_path;
@@ -86,8 +91,8 @@ static QPCIBus *pci_test_start(void)
     cmdline = g_strdup_printf("-drive if=none,id=drive0,file=%s,format=raw "
                         "-drive if=none,id=drive1,file=/dev/null,format=raw "
                         "-device virtio-blk-pci,id=drv0,drive=drive0,"
-                        "addr=%x.%x",
-                        tmp_path, PCI_SLOT, PCI_FN);
+                        "addr=%x.%x%s",
+                        tmp_path, PCI_SLOT, PCI_FN, device_opts);
     qtest_start(cmdline);
     unlink(tmp_path);
     g_free(tmp_path);
@@ -96,6 +101,11 @@ static QPCIBus *pci_test_start(void)
     return qpci_init_pc();
 }
 
+static QPCIBus *pci_test_start(void)
+{
+    return pci_test_start_opts("");
+}
+
 static void arm_test_start(void)
 {
     char *cmdline;
@@ -724,6 +734,114 @@ static void pci_hotplug(void)
     test_end();
 }
 
+/* Write @data to @sector through @vq, or read it back and compare */
+static void virtio_blk_rw(const QVirtioBus *bus, QVirtioDevice *dev,
+                          QGuestAllocator *alloc, QVirtQueue *vq,
+                          bool write, uint64_t sector, const char *data)
+{
+    QVirtioBlkReq req;
+    uint64_t req_addr;
+    uint32_t free_head;
+    uint8_t status;
+    char *buf;
+
+    req.type = write ? QVIRTIO_BLK_T_OUT : QVIRTIO_BLK_T_IN;
+    req.ioprio = 1;
+    req.sector = sector;
+    req.data = g_malloc0(512);
+    if (write) {
+        strcpy(req.data, data);
+    }
+
+    req_addr = virtio_blk_request(alloc, &req, 512);
+
+    g_free(req.data);
+
+    free_head = qvirtqueue_add(vq, req_addr, 16, false, true);
+    qvirtqueue_add(vq, req_addr + 16, 512, !write, true);
+    qvirtqueue_add(vq, req_addr + 528, 1, true, false);
+
+    qvirtqueue_kick(bus, dev, vq, free_head);
+
+    qvirtio_wait_queue_isr(bus, dev, vq, QVIRTIO_BLK_TIMEOUT_US);
+    status = readb(req_addr + 528);
+    g_assert_cmpint(status, ==, 0);
+
+    if (!write) {
+        buf = g_malloc0(512);
+        memread(req_addr + 16, buf, 512);
+        g_assert_cmpstr(buf, ==, data);
+        g_free(buf);
+    }
+
+    guest_free(alloc, req_addr);
+}
+
+static void pci_mq(void)
+{
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    QVirtQueuePCI *vqpci[MQ_NUM_QUEUES];
+    QGuestAllocator *alloc;
+    uint32_t features;
+    uint16_t num_queues;
+    char *opts;
+    char *data;
+    void *addr;
+    int i;
+
+    opts = g_strdup_printf(",num-queues=%d", MQ_NUM_QUEUES);
+    bus = pci_test_start_opts(opts);
+    g_free(opts);
+    dev = virtio_blk_pci_init(bus, PCI_SLOT);
+
+    /* MSI-X is not enabled */
+    addr = dev->addr + QVIRTIO_PCI_DEVICE_SPECIFIC_NO_MSIX;
+
+    features = qvirtio_get_features(&qvirtio_pci, &dev->vdev);
+    g_assert(features & QVIRTIO_BLK_F_MQ);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                    QVIRTIO_F_RING_INDIRECT_DESC | QVIRTIO_F_RING_EVENT_IDX |
+                            QVIRTIO_BLK_F_SCSI);
+    qvirtio_set_features(&qvirtio_pci, &dev->vdev, features);
+
+    num_queues = qvirtio_config_readw(&qvirtio_pci, &dev->vdev,
+                    (uint64_t)(uintptr_t)addr + QVIRTIO_BLK_CONFIG_NUM_QUEUES);
+    g_assert_cmpint(num_queues, ==, MQ_NUM_QUEUES);
+
+    alloc = pc_alloc_init();
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        vqpci[i] = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                                     alloc, i);
+    }
+
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+
+    /* Each sector is written through one queue and read through the next */
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        data = g_strdup_printf("TEST%d", i);
+        virtio_blk_rw(&qvirtio_pci, &dev->vdev, alloc, &vqpci[i]->vq,
+                      true, i, data);
+        g_free(data);
+    }
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        data = g_strdup_printf("TEST%d", i);
+        virtio_blk_rw(&qvirtio_pci, &dev->vdev, alloc,
+                      &vqpci[(i + 1) % MQ_NUM_QUEUES]->vq, false, i, data);
+        g_free(data);
+    }
+
+    /* End test */
+    for (i = 0; i < MQ_NUM_QUEUES; i++) {
+        guest_free(alloc, vqpci[i]->vq.desc);
+    }
+    pc_alloc_uninit(alloc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qpci_free_pc(bus);
+    test_end();
+}
+
 static void mmio_basic(void)
 {
     QVirtioMMIODevice *dev;
@@ -779,6 +897,7 @@ int main(int argc, char **argv)
         qtest_add_func("/virtio/blk/pci/msix", pci_msix);
         qtest_add_func("/virtio/blk/pci/idx", pci_idx);
         qtest_add_func("/virtio/blk/pci/hotplug", pci_hotplug);
+        qtest_add_func("/virtio/blk/pci/mq", pci_mq);
     } else if (strcmp(arch, "arm") == 0) {
         qtest_add_func("/virtio/blk/mmio/basic", mmio_basic);
     }
@@ -9,11 +9,59 @@
 
 #include <glib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
 #include "libqtest.h"
 #include "qemu/osdep.h"
+#include "qapi/qmp/types.h"
 #include "libqos/pci.h"
+#include "libqos/virtio.h"
+#include "libqos/virtio-pci.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc.h"
+#include "libqos/malloc-pc.h"
+
+#define QVIRTIO_NET_F_MRG_RXBUF     0x00008000
 
 #define PCI_SLOT_HP             0x06
+#define PCI_SLOT                0x04
+#define PCI_FN                  0x00
+
+#define QVIRTIO_NET_TIMEOUT_US  (30 * 1000 * 1000)
+#define VNET_HDR_SIZE           10
+
+/* The test's end of the socket pair that backs the tap netdev */
+static int test_sock;
+
+static QVirtioPCIDevice *virtio_net_pci_init(QPCIBus *bus, int slot)
+{
+    QVirtioPCIDevice *dev;
+
+    dev = qvirtio_pci_device_find(bus, QVIRTIO_NET_DEVICE_ID);
+    g_assert(dev != NULL);
+    g_assert_cmphex(dev->vdev.device_type, ==, QVIRTIO_NET_DEVICE_ID);
+    g_assert_cmphex(dev->pdev->devfn, ==, ((slot << 3) | PCI_FN));
+
+    qvirtio_pci_device_enable(dev);
+    qvirtio_reset(&qvirtio_pci, &dev->vdev);
+    qvirtio_set_acknowledge(&qvirtio_pci, &dev->vdev);
+    qvirtio_set_driver(&qvirtio_pci, &dev->vdev);
+
+    return dev;
+}
+
+static void virtio_net_set_features(QVirtioPCIDevice *dev)
+{
+    uint32_t features;
+
+    /* Without mergeable buffers the guest header is 10 bytes */
+    features = qvirtio_get_features(&qvirtio_pci, &dev->vdev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                            QVIRTIO_F_RING_INDIRECT_DESC |
+                            QVIRTIO_F_RING_EVENT_IDX |
+                            QVIRTIO_NET_F_MRG_RXBUF);
+    qvirtio_set_features(&qvirtio_pci, &dev->vdev, features);
+}
 
 /* Tests only initialization so far. TODO: Replace with functional tests */
 static void pci_nop(void)
@@ -26,18 +74,243 @@ static void hotplug(void)
     qpci_unplug_acpi_device_test("net1", PCI_SLOT_HP);
 }
 
+/* A packet from the tap backend is read straight into the guest buffer */
+static void rx(void)
+{
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    QVirtQueuePCI *vqpci;
+    QGuestAllocator *alloc;
+    char test[] = "TEST";
+    char pkt[60], buf[sizeof(pkt)];
+    uint64_t req_addr;
+    uint32_t free_head;
+    ssize_t ret;
+
+    bus = qpci_init_pc();
+    dev = virtio_net_pci_init(bus, PCI_SLOT);
+
+    alloc = pc_alloc_init();
+    vqpci = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                              alloc, 0);
+
+    virtio_net_set_features(dev);
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+
+    req_addr = guest_alloc(alloc, 128);
+    free_head = qvirtqueue_add(&vqpci->vq, req_addr, 128, true, false);
+    qvirtqueue_kick(&qvirtio_pci, &dev->vdev, &vqpci->vq, free_head);
+
+    memset(pkt, 0, sizeof(pkt));
+    memcpy(pkt, test, sizeof(test));
+    ret = send(test_sock, pkt, sizeof(pkt), 0);
+    g_assert_cmpint(ret, ==, sizeof(pkt));
+
+    qvirtio_wait_queue_isr(&qvirtio_pci, &dev->vdev, &vqpci->vq,
+                           QVIRTIO_NET_TIMEOUT_US);
+    memread(req_addr + VNET_HDR_SIZE, buf, sizeof(buf));
+    g_assert_cmpstr(buf, ==, test);
+
+    /* End test */
+    guest_free(alloc, req_addr);
+    guest_free(alloc, vqpci->vq.desc);
+    pc_alloc_uninit(alloc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qpci_free_pc(bus);
+}
+
+/* A packet sent by the guest reaches the backend and is counted */
+static void tx_stats(void)
+{
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    QVirtQueuePCI *vqpci;
+    QGuestAllocator *alloc;
+    QDict *response, *stats;
+    QList *list;
+    char test[] = "TEST";
+    char pkt[VNET_HDR_SIZE + 60], buf[sizeof(pkt)];
+    uint64_t req_addr;
+    uint32_t free_head;
+    ssize_t ret;
+
+    bus = qpci_init_pc();
+    dev = virtio_net_pci_init(bus, PCI_SLOT);
+
+    alloc = pc_alloc_init();
+    vqpci = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                              alloc, 1);
+
+    virtio_net_set_features(dev);
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+
+    memset(pkt, 0, sizeof(pkt));
+    memcpy(pkt + VNET_HDR_SIZE, test, sizeof(test));
+    req_addr = guest_alloc(alloc, sizeof(pkt));
+    memwrite(req_addr, pkt, sizeof(pkt));
+    free_head = qvirtqueue_add(&vqpci->vq, req_addr, sizeof(pkt),
+                               false, false);
+    qvirtqueue_kick(&qvirtio_pci, &dev->vdev, &vqpci->vq, free_head);
+
+    qvirtio_wait_queue_isr(&qvirtio_pci, &dev->vdev, &vqpci->vq,
+                           QVIRTIO_NET_TIMEOUT_US);
+
+    /* The backend gets the packet without the header */
+    ret = recv(test_sock, buf, sizeof(buf), 0);
+    g_assert_cmpint(ret, ==, sizeof(pkt) - VNET_HDR_SIZE);
+    g_assert_cmpstr(buf, ==, test);
+
+    response = qmp("{ 'execute': 'query-virtio-net-tx-stats',"
+                   "  'arguments': { 'path': 'net0' } }");
+    g_assert(response);
+    list = qdict_get_qlist(response, "return");
+    g_assert(list);
+    g_assert_cmpint(qlist_size(list), ==, 1);
+    stats = qobject_to_qdict(qlist_entry_obj(qlist_first(list)));
+    g_assert(stats);
+    g_assert_cmpint(qdict_get_int(stats, "queue"), ==, 0);
+    g_assert_cmpint(qdict_get_int(stats, "packets"), ==, 1);
+    g_assert_cmpint(qdict_get_int(stats, "bytes"), ==,
+                    sizeof(pkt) - VNET_HDR_SIZE);
+    g_assert_cmpint(qdict_get_int(stats, "flushes"), >=, 1);
+    g_assert_cmpint(qdict_get_int(stats, "backend-busy"), ==, 0);
+    g_assert_cmpint(qdict_get_int(stats, "burst"), >, 0);
+    QDECREF(response);
+
+    response = qmp("{ 'execute': 'query-virtio-net-tx-stats',"
+                   "  'arguments': { 'path': 'nonexistent' } }");
+    g_assert(response);
+    g_assert(qdict_haskey(response, "error"));
+    QDECREF(response);
+
+    /* End test */
+    guest_free(alloc, req_addr);
+    guest_free(alloc, vqpci->vq.desc);
+    pc_alloc_uninit(alloc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qpci_free_pc(bus);
+}
+
+static void set_coalescing_fails(const char *args)
+{
+    QDict *response;
+    char *cmd;
+
+    cmd = g_strdup_printf("{ 'execute': 'virtio-set-coalescing',"
+                          "  'arguments': { 'path': 'net0', %s } }", args);
+    response = qmp(cmd);
+    g_assert(response);
+    g_assert(qdict_haskey(response, "error"));
+    QDECREF(response);
+    g_free(cmd);
+}
+
+static void check_coalescing(int64_t usecs, int64_t queue1_usecs,
+                             int64_t frames)
+{
+    QDict *response, *info;
+    QList *list;
+    const QListEntry *p;
+    int64_t queue;
+    int n = 0;
+
+    response = qmp("{ 'execute': 'query-virtio-coalescing',"
+                   "  'arguments': { 'path': 'net0' } }");
+    g_assert(response);
+    list = qdict_get_qlist(response, "return");
+    g_assert(list);
+
+    for (p = qlist_first(list); p; p = qlist_next(p)) {
+        info = qobject_to_qdict(qlist_entry_obj(p));
+        g_assert(info);
+        queue = qdict_get_int(info, "queue");
+        g_assert_cmpint(qdict_get_int(info, "usecs"), ==,
+                        queue == 1 ? queue1_usecs : usecs);
+        g_assert_cmpint(qdict_get_int(info, "frames"), ==, frames);
+        g_assert(!qdict_get_bool(info, "adaptive"));
+        n++;
+    }
+    /* receive, transmit and control queue */
+    g_assert_cmpint(n, ==, 3);
+    QDECREF(response);
+}
+
+static void coalescing(void)
+{
+    QDict *response;
+
+    check_coalescing(0, 0, 0);
+
+    response = qmp("{ 'execute': 'virtio-set-coalescing',"
+                   "  'arguments': { 'path': 'net0', 'usecs': 50,"
+                   "                 'frames': 8 } }");
+    g_assert(response);
+    g_assert(!qdict_haskey(response, "error"));
+    QDECREF(response);
+    check_coalescing(50, 50, 8);
+
+    response = qmp("{ 'execute': 'virtio-set-coalescing',"
+                   "  'arguments': { 'path': 'net0', 'queue': 1,"
+                   "                 'usecs': 0 } }");
+    g_assert(response);
+    g_assert(!qdict_haskey(response, "error"));
+    QDECREF(response);
+    check_coalescing(50, 0, 8);
+
+    /* Bad values are rejected and leave the settings alone */
+    set_coalescing_fails("'usecs': 100001");
+    set_coalescing_fails("'frames': -1");
+    set_coalescing_fails("'queue': 64");
+    set_coalescing_fails("'adaptive': true, 'rate-low': 2000,"
+                         " 'rate-high': 1000");
+    check_coalescing(50, 0, 8);
+
+    response = qmp("{ 'execute': 'virtio-set-coalescing',"
+                   "  'arguments': { 'path': 'net0', 'usecs': 0,"
+                   "                 'frames': 0 } }");
+    g_assert(response);
+    g_assert(!qdict_haskey(response, "error"));
+    QDECREF(response);
+    check_coalescing(0, 0, 0);
+
+    response = qmp("{ 'execute': 'virtio-set-coalescing',"
+                   "  'arguments': { 'path': 'nonexistent', 'usecs': 10 } }");
+    g_assert(response);
+    g_assert(qdict_haskey(response, "error"));
+    QDECREF(response);
+}
+
 int main(int argc, char **argv)
 {
-    int ret;
+    int ret, sv[2];
+    char *args;
 
     g_test_init(&argc, &argv, NULL);
     qtest_add_func("/virtio/net/pci/nop", pci_nop);
     qtest_add_func("/virtio/net/pci/hotplug", hotplug);
+    qtest_add_func("/virtio/net/pci/rx", rx);
+    qtest_add_func("/virtio/net/pci/tx-stats", tx_stats);
+    qtest_add_func("/virtio/net/pci/coalescing", coalescing);
+
+    /* The tap backend takes any file descriptor; a datagram socket keeps
+     * the packet boundaries.
+     */
+    ret = socketpair(PF_UNIX, SOCK_DGRAM, 0, sv);
+    g_assert_cmpint(ret, !=, -1);
+    test_sock = sv[0];
 
-    qtest_start("-device virtio-net-pci");
+    args = g_strdup_printf("-netdev tap,id=hs0,fd=%d "
+                           "-device virtio-net-pci,id=net0,netdev=hs0,"
+                           "addr=%x.%x", sv[1], PCI_SLOT, PCI_FN);
+    qtest_start(args);
+    g_free(args);
     ret = g_test_run();
 
     qtest_end();
+    close(sv[0]);
+    close(sv[1]);
 
     return ret;
 }
@@ -10,6 +10,8 @@
 
 #include <glib.h>
 #include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include "libqtest.h"
 #include "qemu/osdep.h"
 #include <stdio.h>
@@ -19,14 +21,20 @@
 #include "libqos/malloc.h"
 #include "libqos/malloc-pc.h"
 #include "libqos/malloc-generic.h"
+#include "block/scsi.h"
 
 #define PCI_SLOT                0x02
 #define PCI_FN                  0x00
 #define QVIRTIO_SCSI_TIMEOUT_US (1 * 1000 * 1000)
 #define CDB_SIZE 32
+#define TEST_IMAGE_SIZE         (1 * 1024 * 1024)
 
 #define MAX_NUM_QUEUES 64
 
+#define QVIRTIO_SCSI_T_TMF                     0
+#define QVIRTIO_SCSI_T_TMF_I_T_NEXUS_RESET     4
+#define QVIRTIO_SCSI_T_TMF_LOGICAL_UNIT_RESET  5
+
 typedef struct {
     QVirtioDevice *dev;
     QGuestAllocator *alloc;
@@ -53,6 +61,17 @@ typedef struct {
     uint8_t sense[96];
 } QEMU_PACKED QVirtIOSCSICmdResp;
 
+typedef struct {
+    uint32_t type;
+    uint32_t subtype;
+    uint8_t lun[8];
+    uint64_t tag;
+} QEMU_PACKED QVirtIOSCSICtrlTMFReq;
+
+typedef struct {
+    uint8_t response;
+} QEMU_PACKED QVirtIOSCSICtrlTMFResp;
+
 static void qvirtio_scsi_start(const char *extra_opts)
 {
     char *cmdline;
@@ -131,10 +150,25 @@ static uint64_t qvirtio_scsi_alloc(QVirtIOSCSI *vs, size_t alloc_size,
     return addr;
 }
 
-static uint8_t virtio_scsi_do_command(QVirtIOSCSI *vs, const uint8_t *cdb,
-                                      const uint8_t *data_in,
-                                      size_t data_in_len,
-                                      uint8_t *data_out, size_t data_out_len)
+static void virtio_scsi_set_lun(uint8_t *lun, uint8_t target, uint16_t id)
+{
+    lun[0] = 1; /* Select LUN */
+    lun[1] = target;
+    lun[2] = (id >> 8) | 0x40;
+    lun[3] = id & 0xff;
+}
+
+/* Send @cdb to LUN @lun of target 1 through request queue @queue.  The
+ * data read by the command is copied back to @data_in and, if @resp_out is
+ * not NULL, the response header to @resp_out.
+ */
+static uint8_t virtio_scsi_do_lun_command(QVirtIOSCSI *vs, int queue,
+                                          uint16_t lun, const uint8_t *cdb,
+                                          uint8_t *data_in,
+                                          size_t data_in_len,
+                                          uint8_t *data_out,
+                                          size_t data_out_len,
+                                          QVirtIOSCSICmdResp *resp_out)
 {
     QVirtQueue *vq;
     QVirtIOSCSICmdReq req = { { 0 } };
@@ -143,10 +177,10 @@ static uint8_t virtio_scsi_do_command(QVirtIOSCSI *vs, const uint8_t *cdb,
     uint8_t response;
     uint32_t free_head;
 
-    vq = vs->vq[2];
+    g_assert_cmpint(queue, <, vs->num_queues);
+    vq = vs->vq[2 + queue];
 
-    req.lun[0] = 1; /* Select LUN */
-    req.lun[1] = 1; /* Select target 1 */
+    virtio_scsi_set_lun(req.lun, 1, lun);
     memcpy(req.cdb, cdb, CDB_SIZE);
 
     /* XXX: Fix endian if any multi-byte field in req/resp is used */
@@ -173,6 +207,12 @@ static uint8_t virtio_scsi_do_command(QVirtIOSCSI *vs, const uint8_t *cdb,
     qvirtio_wait_queue_isr(&qvirtio_pci, vs->dev, vq, QVIRTIO_SCSI_TIMEOUT_US);
 
     response = readb(resp_addr + offsetof(QVirtIOSCSICmdResp, response));
+    if (resp_out) {
+        memread(resp_addr, resp_out, sizeof(*resp_out));
+    }
+    if (data_in_len) {
+        memread(data_in_addr, data_in, data_in_len);
+    }
 
     guest_free(vs->alloc, req_addr);
     guest_free(vs->alloc, resp_addr);
@@ -181,6 +221,51 @@ static uint8_t virtio_scsi_do_command(QVirtIOSCSI *vs, const uint8_t *cdb,
     return response;
 }
 
+static uint8_t virtio_scsi_do_command(QVirtIOSCSI *vs, const uint8_t *cdb,
+                                      uint8_t *data_in,
+                                      size_t data_in_len,
+                                      uint8_t *data_out, size_t data_out_len)
+{
+    return virtio_scsi_do_lun_command(vs, 0, 0, cdb, data_in, data_in_len,
+                                      data_out, data_out_len, NULL);
+}
+
+/* Send a task management function for LUN @lun of target 1 through the
+ * control queue
+ */
+static uint8_t virtio_scsi_do_tmf(QVirtIOSCSI *vs, uint32_t subtype,
+                                  uint16_t lun)
+{
+    QVirtQueue *vq;
+    QVirtIOSCSICtrlTMFReq req = { .type = QVIRTIO_SCSI_T_TMF,
+                                  .subtype = subtype };
+    QVirtIOSCSICtrlTMFResp resp = { .response = 0xff };
+    uint64_t req_addr, resp_addr;
+    uint8_t response;
+    uint32_t free_head;
+
+    vq = vs->vq[0];
+
+    virtio_scsi_set_lun(req.lun, 1, lun);
+
+    /* XXX: Fix endian if any multi-byte field in req/resp is used */
+
+    req_addr = qvirtio_scsi_alloc(vs, sizeof(req), &req);
+    free_head = qvirtqueue_add(vq, req_addr, sizeof(req), false, true);
+
+    resp_addr = qvirtio_scsi_alloc(vs, sizeof(resp), &resp);
+    qvirtqueue_add(vq, resp_addr, sizeof(resp), true, false);
+
+    qvirtqueue_kick(&qvirtio_pci, vs->dev, vq, free_head);
+    qvirtio_wait_queue_isr(&qvirtio_pci, vs->dev, vq, QVIRTIO_SCSI_TIMEOUT_US);
+
+    response = readb(resp_addr + offsetof(QVirtIOSCSICtrlTMFResp, response));
+
+    guest_free(vs->alloc, req_addr);
+    guest_free(vs->alloc, resp_addr);
+    return response;
+}
+
 /* Tests only initialization so far. TODO: Replace with functional tests */
 static void pci_nop(void)
 {
@@ -237,6 +322,171 @@ static void test_unaligned_write_same(void)
     qvirtio_scsi_stop();
 }
 
+static char *drive_create(void)
+{
+    int fd, ret;
+    char *tmp_path = g_strdup("/tmp/qtest.XXXXXX");
+
+    /* Create a temporary raw image */
+    fd = mkstemp(tmp_path);
+    g_assert_cmpint(fd, >=, 0);
+    ret = ftruncate(fd, TEST_IMAGE_SIZE);
+    g_assert_cmpint(ret, ==, 0);
+    close(fd);
+
+    return tmp_path;
+}
+
+static void qvirtio_scsi_start_iothreads(void)
+{
+    char *tmp_path[2];
+    char *cmdline;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        tmp_path[i] = drive_create();
+    }
+
+    cmdline = g_strdup_printf("-object iothread,id=io0 -object iothread,id=io1 "
+                              "-drive file=%s,if=none,id=dr1,format=raw "
+                              "-drive file=%s,if=none,id=dr2,format=raw "
+                              "-device virtio-scsi-pci,id=vs0,num_queues=2,"
+                              "iothread=io0,len-iothreads=1,iothreads[0]=io1 "
+                              "-device scsi-hd,bus=vs0.0,drive=dr1,lun=0,"
+                              "scsi-id=1 "
+                              "-device scsi-hd,bus=vs0.0,drive=dr2,lun=1,"
+                              "scsi-id=1",
+                              tmp_path[0], tmp_path[1]);
+    qtest_start(cmdline);
+
+    for (i = 0; i < 2; i++) {
+        unlink(tmp_path[i]);
+        g_free(tmp_path[i]);
+    }
+    g_free(cmdline);
+}
+
+/* Send TEST UNIT READY to @lun until the UNIT ATTENTION conditions left by
+ * power on or by a reset have been reported.
+ */
+static void virtio_scsi_clear_unit_attention(QVirtIOSCSI *vs, uint16_t lun)
+{
+    const uint8_t test_unit_ready_cdb[CDB_SIZE] = { TEST_UNIT_READY };
+    QVirtIOSCSICmdResp resp;
+    int i;
+
+    for (i = 0; i < 5; i++) {
+        g_assert_cmphex(0, ==,
+            virtio_scsi_do_lun_command(vs, 0, lun, test_unit_ready_cdb,
+                                       NULL, 0, NULL, 0, &resp));
+        if (resp.status == GOOD) {
+            return;
+        }
+        g_assert_cmphex(resp.status, ==, CHECK_CONDITION);
+        g_assert_cmphex(resp.sense[2] & 0xf, ==, UNIT_ATTENTION);
+    }
+    g_assert_not_reached();
+}
+
+/* WRITE(10) and READ(10) of LBA 1, checking the SCSI status as well */
+static void virtio_scsi_write_lba(QVirtIOSCSI *vs, int queue, uint16_t lun,
+                                  uint8_t *buf)
+{
+    const uint8_t write_cdb[CDB_SIZE] = { 0x2a, 0x00, 0x00, 0x00, 0x00,
+                                          0x01, 0x00, 0x00, 0x01, 0x00 };
+    QVirtIOSCSICmdResp resp;
+
+    g_assert_cmphex(0, ==,
+        virtio_scsi_do_lun_command(vs, queue, lun, write_cdb,
+                                   NULL, 0, buf, 512, &resp));
+    g_assert_cmphex(resp.status, ==, GOOD);
+}
+
+static void virtio_scsi_read_lba(QVirtIOSCSI *vs, int queue, uint16_t lun,
+                                 uint8_t *buf)
+{
+    const uint8_t read_cdb[CDB_SIZE] = { 0x28, 0x00, 0x00, 0x00, 0x00,
+                                         0x01, 0x00, 0x00, 0x01, 0x00 };
+    QVirtIOSCSICmdResp resp;
+
+    memset(buf, 0, 512);
+    g_assert_cmphex(0, ==,
+        virtio_scsi_do_lun_command(vs, queue, lun, read_cdb,
+                                   buf, 512, NULL, 0, &resp));
+    g_assert_cmphex(resp.status, ==, GOOD);
+}
+
+/* READ(10)/WRITE(10) with the queues and LUNs spread over two IOThreads */
+static void test_iothreads_rw(void)
+{
+    QVirtIOSCSI *vs;
+    int queue, lun;
+    uint8_t wbuf[512], rbuf[512];
+
+    qvirtio_scsi_start_iothreads();
+    vs = qvirtio_scsi_pci_init(PCI_SLOT);
+
+    for (lun = 0; lun < 2; lun++) {
+        virtio_scsi_clear_unit_attention(vs, lun);
+    }
+
+    /* Each queue talks to both LUNs, whichever thread owns them */
+    for (queue = 0; queue < 2; queue++) {
+        for (lun = 0; lun < 2; lun++) {
+            memset(wbuf, 'a' + queue * 2 + lun, sizeof(wbuf));
+            virtio_scsi_write_lba(vs, queue, lun, wbuf);
+            virtio_scsi_read_lba(vs, queue, lun, rbuf);
+            g_assert(memcmp(rbuf, wbuf, sizeof(wbuf)) == 0);
+        }
+    }
+
+    /* The LUNs have their own data, written last through queue 1 */
+    for (lun = 0; lun < 2; lun++) {
+        memset(wbuf, 'a' + 2 + lun, sizeof(wbuf));
+        virtio_scsi_read_lba(vs, 0, lun, rbuf);
+        g_assert(memcmp(rbuf, wbuf, sizeof(wbuf)) == 0);
+    }
+
+    qvirtio_scsi_pci_free(vs);
+    qvirtio_scsi_stop();
+}
+
+/* LUN and I_T nexus resets for LUNs owned by different IOThreads */
+static void test_iothreads_reset(void)
+{
+    QVirtIOSCSI *vs;
+    uint8_t wbuf[512], rbuf[512];
+    int lun;
+
+    qvirtio_scsi_start_iothreads();
+    vs = qvirtio_scsi_pci_init(PCI_SLOT);
+
+    for (lun = 0; lun < 2; lun++) {
+        virtio_scsi_clear_unit_attention(vs, lun);
+        memset(wbuf, 'a' + lun, sizeof(wbuf));
+        virtio_scsi_write_lba(vs, lun, lun, wbuf);
+    }
+
+    for (lun = 0; lun < 2; lun++) {
+        g_assert_cmphex(0, ==,
+            virtio_scsi_do_tmf(vs, QVIRTIO_SCSI_T_TMF_LOGICAL_UNIT_RESET,
+                               lun));
+    }
+    g_assert_cmphex(0, ==,
+        virtio_scsi_do_tmf(vs, QVIRTIO_SCSI_T_TMF_I_T_NEXUS_RESET, 0));
+
+    /* Both LUNs still work after the resets and kept their data */
+    for (lun = 0; lun < 2; lun++) {
+        virtio_scsi_clear_unit_attention(vs, lun);
+        memset(wbuf, 'a' + lun, sizeof(wbuf));
+        virtio_scsi_read_lba(vs, lun, lun, rbuf);
+        g_assert(memcmp(rbuf, wbuf, sizeof(wbuf)) == 0);
+    }
+
+    qvirtio_scsi_pci_free(vs);
+    qvirtio_scsi_stop();
+}
+
 int main(int argc, char **argv)
 {
     int ret;
@@ -246,6 +496,8 @@ int main(int argc, char **argv)
     qtest_add_func("/virtio/scsi/pci/hotplug", hotplug);
     qtest_add_func("/virtio/scsi/pci/scsi-disk/unaligned-write-same",
                    test_unaligned_write_same);
+    qtest_add_func("/virtio/scsi/pci/iothreads/rw", test_iothreads_rw);
+    qtest_add_func("/virtio/scsi/pci/iothreads/reset", test_iothreads_reset);
 
     ret = g_test_run();
 
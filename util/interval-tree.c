@@ -0,0 +1,247 @@
+/*
+ * Interval tree
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+#include "qemu/osdep.h"
+#include "qemu/interval-tree.h"
+
+/* The tree is an AVL tree with parent pointers.  Each node caches the
+ * maximum "last" of its subtree, which must be recomputed whenever the
+ * children of a node change: after a rotation and on the path from a modified
+ * node to the root.  Rebalancing always walks up to the root so that it can
+ * refresh this value along the way; with AVL trees this path is O(log n).
+ */
+
+static inline int node_height(IntervalTreeNode *node)
+{
+    return node ? node->height : 0;
+}
+
+static void node_update(IntervalTreeNode *node)
+{
+    node->height = 1 + MAX(node_height(node->left),
+                           node_height(node->right));
+
+    node->subtree_last = node->last;
+    if (node->left && node->left->subtree_last > node->subtree_last) {
+        node->subtree_last = node->left->subtree_last;
+    }
+    if (node->right && node->right->subtree_last > node->subtree_last) {
+        node->subtree_last = node->right->subtree_last;
+    }
+}
+
+static void replace_child(IntervalTreeRoot *root, IntervalTreeNode *parent,
+                          IntervalTreeNode *old, IntervalTreeNode *new)
+{
+    if (!parent) {
+        root->root = new;
+    } else if (parent->left == old) {
+        parent->left = new;
+    } else {
+        parent->right = new;
+    }
+}
+
+/* Rotate the subtree rooted at @node and return its new root */
+static IntervalTreeNode *rotate_left(IntervalTreeRoot *root,
+                                     IntervalTreeNode *node)
+{
+    IntervalTreeNode *pivot = node->right;
+
+    node->right = pivot->left;
+    if (pivot->left) {
+        pivot->left->parent = node;
+    }
+    pivot->parent = node->parent;
+    replace_child(root, node->parent, node, pivot);
+    pivot->left = node;
+    node->parent = pivot;
+
+    node_update(node);
+    node_update(pivot);
+    return pivot;
+}
+
+static IntervalTreeNode *rotate_right(IntervalTreeRoot *root,
+                                      IntervalTreeNode *node)
+{
+    IntervalTreeNode *pivot = node->left;
+
+    node->left = pivot->right;
+    if (pivot->right) {
+        pivot->right->parent = node;
+    }
+    pivot->parent = node->parent;
+    replace_child(root, node->parent, node, pivot);
+    pivot->right = node;
+    node->parent = pivot;
+
+    node_update(node);
+    node_update(pivot);
+    return pivot;
+}
+
+static void rebalance(IntervalTreeRoot *root, IntervalTreeNode *node)
+{
+    while (node) {
+        int balance;
+
+        node_update(node);
+        balance = node_height(node->left) - node_height(node->right);
+        if (balance > 1) {
+            if (node_height(node->left->left) <
+                node_height(node->left->right)) {
+                rotate_left(root, node->left);
+            }
+            node = rotate_right(root, node);
+        } else if (balance < -1) {
+            if (node_height(node->right->right) <
+                node_height(node->right->left)) {
+                rotate_right(root, node->right);
+            }
+            node = rotate_left(root, node);
+        }
+        node = node->parent;
+    }
+}
+
+void interval_tree_insert(IntervalTreeNode *node, IntervalTreeRoot *root)
+{
+    IntervalTreeNode *parent = NULL;
+    IntervalTreeNode **link = &root->root;
+
+    assert(node->start <= node->last);
+
+    while (*link) {
+        parent = *link;
+        if (node->start < parent->start) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+        }
+    }
+
+    node->left = NULL;
+    node->right = NULL;
+    node->parent = parent;
+    *link = node;
+    rebalance(root, node);
+}
+
+void interval_tree_remove(IntervalTreeNode *node, IntervalTreeRoot *root)
+{
+    IntervalTreeNode *parent = node->parent;
+    IntervalTreeNode *fixup;
+
+    if (node->left && node->right) {
+        /* Replace @node with its successor, which has no left child */
+        IntervalTreeNode *succ = node->right;
+
+        while (succ->left) {
+            succ = succ->left;
+        }
+
+        if (succ->parent == node) {
+            fixup = succ;
+        } else {
+            fixup = succ->parent;
+            fixup->left = succ->right;
+            if (succ->right) {
+                succ->right->parent = fixup;
+            }
+            succ->right = node->right;
+            node->right->parent = succ;
+        }
+
+        succ->left = node->left;
+        node->left->parent = succ;
+        succ->parent = parent;
+        replace_child(root, parent, node, succ);
+    } else {
+        IntervalTreeNode *child = node->left ? node->left : node->right;
+
+        if (child) {
+            child->parent = parent;
+        }
+        replace_child(root, parent, node, child);
+        fixup = parent;
+    }
+
+    node->left = node->right = node->parent = NULL;
+    rebalance(root, fixup);
+}
+
+/* Return the leftmost node in the subtree rooted at @node that overlaps
+ * [@start, @last].  The caller guarantees start <= node->subtree_last.
+ */
+static IntervalTreeNode *subtree_search(IntervalTreeNode *node,
+                                        uint64_t start, uint64_t last)
+{
+    for (;;) {
+        /* If some interval in the left subtree ends after @start, then
+         * either one of them overlaps, or all of them (and thus @node and
+         * the right subtree too) begin after @last.
+         */
+        if (node->left && start <= node->left->subtree_last) {
+            node = node->left;
+            continue;
+        }
+        if (node->start > last) {
+            return NULL;
+        }
+        if (start <= node->last) {
+            return node;
+        }
+        node = node->right;
+        if (!node || start > node->subtree_last) {
+            return NULL;
+        }
+    }
+}
+
+IntervalTreeNode *interval_tree_iter_first(IntervalTreeRoot *root,
+                                           uint64_t start, uint64_t last)
+{
+    IntervalTreeNode *node = root->root;
+
+    if (!node || start > node->subtree_last) {
+        return NULL;
+    }
+    return subtree_search(node, start, last);
+}
+
+IntervalTreeNode *interval_tree_iter_next(IntervalTreeNode *node,
+                                          uint64_t start, uint64_t last)
+{
+    IntervalTreeNode *right = node->right;
+    IntervalTreeNode *prev;
+
+    for (;;) {
+        /* Everything left of @node has been visited; try its right subtree */
+        if (right && start <= right->subtree_last) {
+            return subtree_search(right, start, last);
+        }
+
+        /* Move up until we come from a left child */
+        do {
+            prev = node;
+            node = node->parent;
+            if (!node) {
+                return NULL;
+            }
+            right = node->right;
+        } while (prev == right);
+
+        if (node->start > last) {
+            return NULL;
+        }
+        if (start <= node->last) {
+            return node;
+        }
+    }
+}
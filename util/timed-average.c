@@ -0,0 +1,125 @@
+/*
+ * Timed average computation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include "qemu/osdep.h"
+
+#include "qemu/timed-average.h"
+
+static void window_reset(TimedAverageWindow *w)
+{
+    w->min = UINT64_MAX;
+    w->max = 0;
+    w->sum = 0;
+    w->count = 0;
+}
+
+/* Expire the windows that ended before @now and return the older one, which
+ * is the one that covers the longest period of time.
+ */
+static TimedAverageWindow *update_expiration(TimedAverage *ta, int64_t now)
+{
+    TimedAverageWindow *w = &ta->windows[ta->current];
+    int64_t elapsed;
+    int i;
+
+    if (now < w->expiration) {
+        return w;
+    }
+
+    /* Both windows expire every period, half a period apart; move them
+     * forward by a whole number of periods.
+     */
+    for (i = 0; i < ARRAY_SIZE(ta->windows); i++) {
+        TimedAverageWindow *cur = &ta->windows[i];
+
+        if (cur->expiration <= now) {
+            elapsed = now - cur->expiration;
+            cur->expiration += (elapsed / ta->period + 1) * ta->period;
+            window_reset(cur);
+        }
+    }
+
+    /* The older window is the one that expires first */
+    ta->current = ta->windows[0].expiration < ta->windows[1].expiration ? 0 : 1;
+    return &ta->windows[ta->current];
+}
+
+void timed_average_init(TimedAverage *ta, QEMUClockType clock_type,
+                        uint64_t period)
+{
+    int64_t now = qemu_clock_get_ns(clock_type);
+
+    assert(period > 0);
+
+    memset(ta, 0, sizeof(*ta));
+    ta->period = period;
+    ta->clock_type = clock_type;
+
+    window_reset(&ta->windows[0]);
+    window_reset(&ta->windows[1]);
+    ta->windows[0].expiration = now + period / 2;
+    ta->windows[1].expiration = now + period;
+    ta->current = 0;
+}
+
+void timed_average_account(TimedAverage *ta, uint64_t value)
+{
+    int64_t now = qemu_clock_get_ns(ta->clock_type);
+    int i;
+
+    update_expiration(ta, now);
+    for (i = 0; i < ARRAY_SIZE(ta->windows); i++) {
+        TimedAverageWindow *w = &ta->windows[i];
+
+        w->sum += value;
+        w->count++;
+        if (value < w->min) {
+            w->min = value;
+        }
+        if (value > w->max) {
+            w->max = value;
+        }
+    }
+}
+
+uint64_t timed_average_min(TimedAverage *ta)
+{
+    TimedAverageWindow *w;
+
+    w = update_expiration(ta, qemu_clock_get_ns(ta->clock_type));
+    return w->count ? w->min : 0;
+}
+
+uint64_t timed_average_max(TimedAverage *ta)
+{
+    TimedAverageWindow *w;
+
+    w = update_expiration(ta, qemu_clock_get_ns(ta->clock_type));
+    return w->max;
+}
+
+uint64_t timed_average_avg(TimedAverage *ta)
+{
+    TimedAverageWindow *w;
+
+    w = update_expiration(ta, qemu_clock_get_ns(ta->clock_type));
+    return w->count ? w->sum / w->count : 0;
+}
+
+uint64_t timed_average_sum(TimedAverage *ta, uint64_t *elapsed)
+{
+    int64_t now = qemu_clock_get_ns(ta->clock_type);
+    TimedAverageWindow *w;
+
+    w = update_expiration(ta, now);
+    if (elapsed) {
+        *elapsed = ta->period - (w->expiration - now);
+    }
+    return w->sum;
+}
@@ -4407,6 +4407,7 @@ int main(int argc, char **argv, char **envp)
     }
 
     blk_mig_init();
+    dirty_bitmap_mig_init();
     ram_mig_init();
 
     /* If the currently selected machine wishes to override the units-per-bus